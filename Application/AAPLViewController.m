@@ -141,7 +141,16 @@ NS_OPTIONS(uint8_t, keyCode)
 - (void)rightMouseUp:(NSEvent *)event        { _aDapter.mouseButtonMask &= (~2); }
 - (void)mouseDown:(NSEvent *)event           { _aDapter.mouseButtonMask |= 1; }
 - (void)mouseUp:(NSEvent *)event             { _aDapter.mouseButtonMask &= (~1); }
-- (void)mouseMoved:(NSEvent *)event          { _aDapter.cursorPosition = (simd_float2){ event.locationInWindow.x,                                                                                                    _view.drawableSize.height - event.locationInWindow.y};}
+- (void)mouseMoved:(NSEvent *)event
+{
+    /// Window points to drawable pixels with the origin top left, the drawable does not follow
+    /// the view size, so the scale is taken from both instead of the backing scale factor alone
+    const NSPoint location = [_view convertPoint:event.locationInWindow fromView:nil];
+    const NSSize  bounds   = _view.bounds.size;
+    const CGSize  drawable = _view.drawableSize;
+    _aDapter.cursorPosition = (simd_float2){ (float)( location.x * drawable.width / bounds.width ),
+                                             (float)( ( bounds.height - location.y ) * drawable.height / bounds.height ) };
+}
 
 - (void)mouseDragged:(NSEvent *)event        { _mouseDrag = (simd_float2){ (float)event.deltaX, (float)event.deltaY };
     float rotation_speed = 0.1f;
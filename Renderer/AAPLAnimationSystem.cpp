@@ -0,0 +1,208 @@
+///
+///  AAPLAnimationSystem.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 18.04.24.
+///
+
+#include "AAPLAnimationSystem.h"
+#include "AAPLMathUtilities.h"
+#include "AAPLParallel.h"
+#include "AAPLUtilities.h"
+
+#include <algorithm>
+#include <cmath>
+
+AnimationSystem::AnimationSystem()
+{
+}
+
+void AnimationSystem::clear()
+{
+    _keyTimes.clear();
+    _keyValues.clear();
+    _tracks.clear();
+    _values.clear();
+    _linearTracks.clear();
+    _rotationTracks.clear();
+    _transformBindings.clear();
+    _boundLocals.clear();
+    _floatBindings.clear();
+}
+
+AnimationSystem::Track AnimationSystem::addTrack( const float* pTimes, const simd::float4* pValues, size_t keyCount,
+                                                  TrackType type, Wrap wrap )
+{
+    AAPL_ASSERT( keyCount > 0, "AnimationSystem: a track needs at least one key" );
+    AAPL_ASSERT( std::is_sorted( pTimes, pTimes + keyCount ), "AnimationSystem: key times have to ascend" );
+
+    const Track track = Track( _tracks.size() );
+    _tracks.push_back( { uint32_t( _keyTimes.size() ), uint32_t( keyCount ), type, wrap } );
+    _keyTimes.insert( _keyTimes.end(), pTimes, pTimes + keyCount );
+    _keyValues.insert( _keyValues.end(), pValues, pValues + keyCount );
+    _values.push_back( pValues[0] );
+
+    if ( type == TrackQuaternion )
+        _rotationTracks.push_back( track );
+    else
+        _linearTracks.push_back( track );
+    return track;
+}
+
+AnimationSystem::Track AnimationSystem::addFloatTrack( const float* pTimes, const float* pValues, size_t keyCount, Wrap wrap )
+{
+    std::vector<simd::float4> values( keyCount );
+    for ( size_t key = 0; key < keyCount; ++key )
+        values[key] = (simd::float4){ pValues[key], 0.f, 0.f, 0.f };
+    return addTrack( pTimes, values.data(), keyCount, TrackFloat, wrap );
+}
+
+AnimationSystem::Track AnimationSystem::addFloat3Track( const float* pTimes, const simd::float3* pValues, size_t keyCount, Wrap wrap )
+{
+    std::vector<simd::float4> values( keyCount );
+    for ( size_t key = 0; key < keyCount; ++key )
+        values[key] = (simd::float4){ pValues[key].x, pValues[key].y, pValues[key].z, 0.f };
+    return addTrack( pTimes, values.data(), keyCount, TrackFloat3, wrap );
+}
+
+AnimationSystem::Track AnimationSystem::addQuaternionTrack( const float* pTimes, const simd::float4* pRotations, size_t keyCount, Wrap wrap )
+{
+    /// Neighbouring keys in the same hemisphere, so every segment takes the short way
+    std::vector<simd::float4> values( pRotations, pRotations + keyCount );
+    for ( size_t key = 0; key < keyCount; ++key )
+    {
+        values[key] = quaternion_normalize( values[key] );
+        if ( key > 0 && simd_dot( values[key - 1], values[key] ) < 0.f )
+            values[key] = -values[key];
+    }
+    return addTrack( pTimes, values.data(), keyCount, TrackQuaternion, wrap == WrapExtrapolate ? WrapClamp : wrap );
+}
+
+void AnimationSystem::bindTransform( TransformHierarchy::Node node, Track translation, Track rotation, Track scale,
+                                     const simd::float3& baseTranslation, const simd::float4& baseRotation,
+                                     const simd::float3& baseScale )
+{
+    AAPL_ASSERT( translation == kNoTrack || _tracks[translation].type == TrackFloat3, "AnimationSystem: translation needs a float3 track" );
+    AAPL_ASSERT( rotation == kNoTrack || _tracks[rotation].type == TrackQuaternion, "AnimationSystem: rotation needs a quaternion track" );
+    AAPL_ASSERT( scale == kNoTrack || _tracks[scale].type == TrackFloat3, "AnimationSystem: scale needs a float3 track" );
+
+    _transformBindings.push_back( { node, translation, rotation, scale, baseTranslation, baseRotation, baseScale } );
+    _boundLocals.resize( _transformBindings.size() );
+}
+
+void AnimationSystem::bindFloat( Track track, float* pTarget )
+{
+    AAPL_ASSERT( _tracks[track].type == TrackFloat, "AnimationSystem: float binding needs a float track" );
+    _floatBindings.push_back( { track, pTarget } );
+}
+
+void AnimationSystem::locate( const TrackRange& track, float time, uint32_t& key, float& fraction ) const
+{
+    const float* pTimes = &_keyTimes[track.firstKey];
+    const uint32_t last = track.keyCount - 1;
+
+    key = track.firstKey;
+    fraction = 0.f;
+    if ( last == 0 )
+        return;
+
+    const float start = pTimes[0];
+    const float end   = pTimes[last];
+    if ( track.wrap == WrapLoop && end > start )
+    {
+        const float length = end - start;
+        time = start + ( time - start ) - std::floor( ( time - start ) / length ) * length;
+    }
+
+    uint32_t segment;
+    if ( time <= start )
+        segment = 0;
+    else if ( time >= end )
+        segment = last - 1;
+    else
+        segment = uint32_t( std::upper_bound( pTimes, pTimes + last, time ) - pTimes ) - 1;
+
+    const float duration = pTimes[segment + 1] - pTimes[segment];
+    fraction = duration > 0.f ? ( time - pTimes[segment] ) / duration : 1.f;
+    if ( track.wrap != WrapExtrapolate )
+        fraction = std::clamp( fraction, 0.f, 1.f );
+
+    key = track.firstKey + segment;
+}
+
+simd::float4 AnimationSystem::sampleLinear( const TrackRange& track, float time ) const
+{
+    uint32_t key;
+    float fraction;
+    locate( track, time, key, fraction );
+    if ( track.keyCount == 1 )
+        return _keyValues[key];
+
+    const simd::float4 from = _keyValues[key];
+    const simd::float4 to   = _keyValues[key + 1];
+    return from + ( to - from ) * fraction;
+}
+
+simd::float4 AnimationSystem::sampleRotation( const TrackRange& track, float time ) const
+{
+    uint32_t key;
+    float fraction;
+    locate( track, time, key, fraction );
+    if ( track.keyCount == 1 )
+        return _keyValues[key];
+
+    return quaternion_normalize( quaternion_slerp( _keyValues[key], _keyValues[key + 1], fraction ) );
+}
+
+void AnimationSystem::evaluate( float time )
+{
+    parallelFor( _linearTracks.size(), kTrackGrain, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+        {
+            const Track track = _linearTracks[i];
+            _values[track] = sampleLinear( _tracks[track], time );
+        }
+    });
+
+    parallelFor( _rotationTracks.size(), kTrackGrain, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+        {
+            const Track track = _rotationTracks[i];
+            _values[track] = sampleRotation( _tracks[track], time );
+        }
+    });
+}
+
+void AnimationSystem::apply( TransformHierarchy& hierarchy )
+{
+    /// Compose the local matrices in parallel, the hierarchy is written from one thread
+    parallelFor( _transformBindings.size(), kTrackGrain, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+        {
+            const TransformBinding& binding = _transformBindings[i];
+            const simd::float3 translation = binding.translation == kNoTrack ? binding.baseTranslation : _values[binding.translation].xyz;
+            const simd::float4 rotation    = binding.rotation    == kNoTrack ? binding.baseRotation    : _values[binding.rotation];
+            const simd::float3 scale       = binding.scale       == kNoTrack ? binding.baseScale       : _values[binding.scale].xyz;
+
+            simd::float4x4 local = matrix4x4_from_quaternion( rotation );
+            local.columns[0] *= scale.x;
+            local.columns[1] *= scale.y;
+            local.columns[2] *= scale.z;
+            local.columns[3] = (simd::float4){ translation.x, translation.y, translation.z, 1.f };
+            _boundLocals[i] = local;
+        }
+    });
+
+    for ( size_t i = 0; i < _transformBindings.size(); ++i )
+    {
+        hierarchy.setLocal( _transformBindings[i].node, _boundLocals[i] );
+    }
+
+    for ( const FloatBinding& binding : _floatBindings )
+    {
+        *binding.pTarget = _values[binding.track].x;
+    }
+}
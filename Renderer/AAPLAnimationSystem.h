@@ -0,0 +1,133 @@
+///
+///  AAPLAnimationSystem.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 18.04.24.
+///
+/// Abstract:
+/// Keyframe animation with typed tracks. Float, float3 and quaternion tracks share one flat
+/// array of key times and one of float4 key values, every track is a contiguous key range.
+/// evaluate() samples all tracks in one pass per frame, float and float3 tracks interpolate
+/// linearly as float4, quaternion tracks with quaternion_slerp, each kind in its own batch
+/// spread over worker threads. Bindings route the results to transform hierarchy nodes and
+/// plain float parameters, so adding an animated object only adds tracks and a binding.
+
+#pragma once
+#ifndef AAPLAnimationSystem_h
+#define AAPLAnimationSystem_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "AAPLTransformHierarchy.h"
+
+class AnimationSystem
+{
+public:
+    using Track = uint32_t;
+    static constexpr Track kNoTrack = UINT32_MAX;
+
+    enum TrackType : uint8_t
+    {
+        TrackFloat,
+        TrackFloat3,
+        TrackQuaternion
+    };
+
+    /// Behaviour outside the key range. Extrapolate continues the slope of the first or last
+    /// segment, quaternion tracks clamp instead.
+    enum Wrap : uint8_t
+    {
+        WrapClamp,
+        WrapLoop,
+        WrapExtrapolate
+    };
+
+    AnimationSystem();
+
+    /// Removes all tracks and bindings.
+    void clear();
+
+    /// Key times have to ascend, a track with a single key is constant.
+    Track addFloatTrack( const float* pTimes, const float* pValues, size_t keyCount, Wrap wrap );
+    Track addFloat3Track( const float* pTimes, const simd::float3* pValues, size_t keyCount, Wrap wrap );
+    Track addQuaternionTrack( const float* pTimes, const simd::float4* pRotations, size_t keyCount, Wrap wrap );
+
+    /// Drives the local transform of a node as translation * rotation * scale. Channels without
+    /// a track keep the base value.
+    void bindTransform( TransformHierarchy::Node node, Track translation, Track rotation, Track scale,
+                        const simd::float3& baseTranslation, const simd::float4& baseRotation,
+                        const simd::float3& baseScale );
+
+    /// Writes the value of a float track to pTarget on apply().
+    void bindFloat( Track track, float* pTarget );
+
+    /// Samples every track at time.
+    void evaluate( float time );
+
+    /// Pushes the evaluated values to the bound nodes and parameters.
+    void apply( TransformHierarchy& hierarchy );
+
+    /// Value of the last evaluate(), floats in x, float3 in xyz, quaternions as xyzw.
+    const simd::float4& value( Track track ) const { return _values[track]; }
+
+    size_t trackCount() const { return _tracks.size(); }
+    size_t keyCount() const { return _keyTimes.size(); }
+
+private:
+    /// Tracks per parallel task
+    static constexpr size_t kTrackGrain = 256;
+
+    struct TrackRange
+    {
+        uint32_t  firstKey;
+        uint32_t  keyCount;
+        TrackType type;
+        Wrap      wrap;
+    };
+
+    struct TransformBinding
+    {
+        TransformHierarchy::Node node;
+        Track        translation;
+        Track        rotation;
+        Track        scale;
+        simd::float3 baseTranslation;
+        simd::float4 baseRotation;
+        simd::float3 baseScale;
+    };
+
+    struct FloatBinding
+    {
+        Track  track;
+        float* pTarget;
+    };
+
+    Track addTrack( const float* pTimes, const simd::float4* pValues, size_t keyCount, TrackType type, Wrap wrap );
+
+    /// First key of the segment around time and the position inside it, below 0 or above 1
+    /// only when extrapolating.
+    void locate( const TrackRange& track, float time, uint32_t& key, float& fraction ) const;
+    simd::float4 sampleLinear( const TrackRange& track, float time ) const;
+    simd::float4 sampleRotation( const TrackRange& track, float time ) const;
+
+    /// Flat key storage of all tracks
+    std::vector<float>        _keyTimes;
+    std::vector<simd::float4> _keyValues;
+
+    std::vector<TrackRange>   _tracks;
+    std::vector<simd::float4> _values;
+
+    /// Float and float3 tracks, quaternion tracks
+    std::vector<Track> _linearTracks;
+    std::vector<Track> _rotationTracks;
+
+    std::vector<TransformBinding> _transformBindings;
+    std::vector<simd::float4x4>   _boundLocals;
+    std::vector<FloatBinding>     _floatBindings;
+};
+
+#endif /* AAPLAnimationSystem_h */
@@ -0,0 +1,93 @@
+///
+///  AAPLAssetCatalog.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 24.04.24.
+///
+
+#include "AAPLAssetCatalog.h"
+
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace AssetCatalog
+{
+    bool resolveBaseImage( const fs::path& set, const std::string& filename, fs::path& image )
+    {
+        const fs::path entry = set / filename;
+        if ( entry.extension() != ".mipmapset" )
+        {
+            image = entry;
+            return true;
+        }
+
+        std::string contents;
+        if ( !readText( entry / "Contents.json", contents ) )
+            return false;
+        for ( const std::string& object : innerObjects( contents ) )
+        {
+            if ( stringValue( object, "mipmap-level" ) == "base" && !stringValue( object, "filename" ).empty() )
+            {
+                image = entry / stringValue( object, "filename" );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void writeInfo( std::ostream& out )
+    {
+        out << "  \"info\" : {\n"
+               "    \"author\" : \"xcode\",\n"
+               "    \"version\" : 1\n"
+               "  },\n";
+    }
+
+    void writeSetHeader( std::ostream& out )
+    {
+        out << "{\n";
+        writeInfo( out );
+        out << "  \"properties\" : {\n"
+               "    \"origin\" : \"bottom-left\"\n"
+               "  },\n"
+               "  \"textures\" : [\n";
+    }
+
+    bool writeMipmapContents( const fs::path& folder, const std::vector<std::string>& filenames, std::string& error )
+    {
+        std::ostringstream json;
+        json << "{\n";
+        writeInfo( json );
+        json << "  \"levels\" : [\n";
+        for ( size_t level = 0; level < filenames.size(); ++level )
+        {
+            json << "    {\n"
+                 << "      \"filename\" : \"" << filenames[level] << "\",\n"
+                 << "      \"mipmap-level\" : \"" << ( level == 0 ? std::string( "base" ) : "mipmap-level-" + std::to_string( level ) ) << "\"\n"
+                 << "    }" << ( level + 1 < filenames.size() ? "," : "" ) << "\n";
+        }
+        json << "  ],\n"
+             << "  \"properties\" : {\n"
+             << "    \"level-mode\" : \"" << ( filenames.size() > 1 ? "fixed" : "none" ) << "\"\n"
+             << "  }\n"
+             << "}\n";
+        return writeText( folder / "Contents.json", json.str(), error );
+    }
+
+    bool writeMipmapSet( const fs::path& folder, const std::vector<const Image*>& levels,
+                         const std::vector<std::string>& filenames, bool flipRows, uint32_t bitDepth, bool sRGB,
+                         std::string& error )
+    {
+        fs::create_directories( folder );
+        for ( size_t level = 0; level < levels.size(); ++level )
+        {
+            Image image = *levels[level];
+            if ( flipRows )
+                image.flipRows();
+            if ( !savePNG( ( folder / filenames[level] ).string(), image, bitDepth, sRGB, error ) )
+                return false;
+        }
+        return writeMipmapContents( folder, filenames, error );
+    }
+}
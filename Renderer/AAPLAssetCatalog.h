@@ -0,0 +1,45 @@
+///
+///  AAPLAssetCatalog.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 24.04.24.
+///
+/// Abstract:
+/// Helpers the asset tools share to read and write the sets of an .xcassets folder. Reading
+/// goes through the plain JSON helpers of AAPLCatalogJSON.h. The writing side emits the same
+/// layout and key order Xcode uses, the files diff cleanly against its own.
+
+#pragma once
+#ifndef AAPLAssetCatalog_h
+#define AAPLAssetCatalog_h
+
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "AAPLCatalogJSON.h"
+#include "AAPLImage.h"
+
+namespace AssetCatalog
+{
+    /// Base level image of a texture entry, either a mipmapset folder or a plain image.
+    bool resolveBaseImage( const std::filesystem::path& set, const std::string& filename, std::filesystem::path& image );
+
+    /// The "info" block every Contents.json starts with.
+    void writeInfo( std::ostream& out );
+
+    /// Opening of a texture or cube texture set with a bottom left origin, up to its texture array.
+    void writeSetHeader( std::ostream& out );
+
+    /// Contents.json of a mipmapset listing the files of its levels, level 0 is the base.
+    bool writeMipmapContents( const std::filesystem::path& folder, const std::vector<std::string>& filenames, std::string& error );
+
+    /// One mipmapset with the given images per level, level 0 is the base. The bottom left origin
+    /// of the sets only flips 2D textures, cube faces are stored top down in the Metal orientation.
+    bool writeMipmapSet( const std::filesystem::path& folder, const std::vector<const Image*>& levels,
+                         const std::vector<std::string>& filenames, bool flipRows, uint32_t bitDepth, bool sRGB,
+                         std::string& error );
+}
+
+#endif /* AAPLAssetCatalog_h */
@@ -0,0 +1,444 @@
+///
+///  AAPLAssetPack.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 27.04.24.
+///
+
+#include "AAPLAssetPack.h"
+
+#include <zlib.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    uint64_t alignUp( uint64_t value, uint64_t alignment )
+    {
+        return ( value + alignment - 1 ) / alignment * alignment;
+    }
+
+    uint32_t checksum( const void* pData, uint64_t size )
+    {
+        /// crc32 takes the length as uInt, large blobs go in pieces
+        uLong crc = crc32( 0L, Z_NULL, 0 );
+        const Bytef* pBytes = static_cast<const Bytef*>( pData );
+        while ( size > 0 )
+        {
+            const uInt piece = uInt( std::min<uint64_t>( size, 1u << 30 ) );
+            crc = crc32( crc, pBytes, piece );
+            pBytes += piece;
+            size -= piece;
+        }
+        return uint32_t( crc );
+    }
+
+    bool isCompressed( const AssetPackEntry& entry )
+    {
+        return entry.format == AssetPackEntry::FormatBC7 || entry.format == AssetPackEntry::FormatBC7_sRGB;
+    }
+
+    bool isTextureFormat( AssetPackEntry::Format format )
+    {
+        return format <= AssetPackEntry::FormatRGBA8_sRGB;
+    }
+
+    uint32_t indexSize( const AssetPackEntry& entry )
+    {
+        return entry.format == AssetPackEntry::FormatUInt16 ? 2 : 4;
+    }
+
+    std::string entryName( const AssetPackEntry& entry )
+    {
+        return std::string( entry.name, strnlen( entry.name, AssetPackEntry::kNameLength ) );
+    }
+}
+
+AssetPack::~AssetPack()
+{
+    close();
+}
+
+bool AssetPack::open( const std::string& path, std::string& error )
+{
+    close();
+
+    const int file = ::open( path.c_str(), O_RDONLY );
+    if ( file < 0 )
+    {
+        error = "can not open " + path;
+        return false;
+    }
+
+    struct stat status;
+    if ( fstat( file, &status ) != 0 || uint64_t( status.st_size ) < sizeof( AssetPackHeader ) )
+    {
+        ::close( file );
+        error = path + " is not an asset pack";
+        return false;
+    }
+
+    /// Private and writable so Metal can wrap the pages, nothing writes them and they stay file backed
+    void* pMapping = mmap( nullptr, size_t( status.st_size ), PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0 );
+    ::close( file );
+    if ( pMapping == MAP_FAILED )
+    {
+        error = "can not map " + path;
+        return false;
+    }
+    _pBase = static_cast<uint8_t*>( pMapping );
+    _size  = uint64_t( status.st_size );
+
+    const AssetPackHeader& header = *reinterpret_cast<const AssetPackHeader*>( _pBase );
+    const uint64_t tocEnd = sizeof( AssetPackHeader ) + uint64_t( header.entryCount ) * sizeof( AssetPackEntry );
+    if ( std::memcmp( header.magic, AssetPackHeader::kMagic, sizeof( header.magic ) ) != 0 || header.version != AssetPackHeader::kVersion
+      || header.fileSize != _size || tocEnd > _size )
+    {
+        close();
+        error = path + " is not an asset pack of version " + std::to_string( AssetPackHeader::kVersion );
+        return false;
+    }
+    if ( header.vertexStride != sizeof( AssetPackVertex ) )
+    {
+        close();
+        error = path + " was written with a different vertex layout";
+        return false;
+    }
+
+    _pEntries   = reinterpret_cast<const AssetPackEntry*>( _pBase + sizeof( AssetPackHeader ) );
+    _entryCount = header.entryCount;
+    if ( checksum( _pEntries, tocEnd - sizeof( AssetPackHeader ) ) != header.tocChecksum )
+    {
+        close();
+        error = "table of contents of " + path + " is damaged";
+        return false;
+    }
+
+    /// Blobs follow the table in the order of their entries, each on pages of its own
+    uint64_t blobsEnd = tocEnd;
+    for ( uint32_t i = 0; i < _entryCount; ++i )
+    {
+        const AssetPackEntry& entry = _pEntries[i];
+        if ( entry.offset % kAssetPackPageSize != 0 || entry.offset < blobsEnd || entry.offset > _size || entry.size > _size
+          || pageLength( entry ) > _size - entry.offset )
+        {
+            const std::string name = entryName( entry );
+            close();
+            error = "entry " + name + " lies outside of " + path + " or overlaps the one before";
+            return false;
+        }
+        blobsEnd = entry.offset + pageLength( entry );
+
+        if ( !checkLayout( i, error ) )
+        {
+            close();
+            error += " in " + path;
+            return false;
+        }
+    }
+    return true;
+}
+
+void AssetPack::close()
+{
+    if ( _pBase )
+        munmap( _pBase, size_t( _size ) );
+    _pBase = nullptr;
+    _size  = 0;
+    _pEntries = nullptr;
+    _entryCount = 0;
+}
+
+bool AssetPack::checkLayout( uint32_t index, std::string& error ) const
+{
+    const AssetPackEntry& entry = _pEntries[index];
+    const std::string name = entryName( entry );
+    if ( entry.type == AssetPackEntry::TypeTexture )
+    {
+        if ( !isTextureFormat( entry.format ) || entry.width == 0 || entry.height == 0 || entry.levelCount == 0 || entry.levelCount > 16
+          || levelOffset( entry, entry.levelCount - 1 ) + levelSize( entry, entry.levelCount - 1 ) != entry.size )
+        {
+            error = "texture " + name + " has the wrong size for its levels";
+            return false;
+        }
+    }
+    else if ( entry.type == AssetPackEntry::TypeMesh )
+    {
+        if ( ( entry.format != AssetPackEntry::FormatUInt16 && entry.format != AssetPackEntry::FormatUInt32 )
+          || entry.indexOffset != alignUp( uint64_t( entry.vertexCount ) * sizeof( AssetPackVertex ), kAssetPackLevelAlignment )
+          || entry.submeshOffset != alignUp( entry.indexOffset + uint64_t( entry.indexCount ) * indexSize( entry ), sizeof( AssetPackSubmesh ) )
+          || entry.submeshOffset + uint64_t( entry.submeshCount ) * sizeof( AssetPackSubmesh ) != entry.size )
+        {
+            error = "mesh " + name + " has the wrong size for its counts";
+            return false;
+        }
+
+        /// The submesh table is the tail of the blob, this touches its last page only
+        const AssetPackSubmesh* pSubmeshes = submeshes( entry );
+        for ( uint32_t submesh = 0; submesh < entry.submeshCount; ++submesh )
+        {
+            const AssetPackSubmesh& range = pSubmeshes[submesh];
+            if ( range.primitive > AssetPackSubmesh::PrimitiveTriangleStrip
+              || uint64_t( range.indexStart ) + range.indexCount > entry.indexCount
+              || ( range.indexStart * indexSize( entry ) ) % 4 != 0 )
+            {
+                error = "submesh " + std::to_string( submesh ) + " of " + name + " is out of range or misaligned";
+                return false;
+            }
+        }
+    }
+    else
+    {
+        error = "entry " + name + " has an unknown type";
+        return false;
+    }
+
+    for ( uint32_t other = 0; other < index; ++other )
+    {
+        if ( entryName( _pEntries[other] ) == name )
+        {
+            error = "entry " + name + " is in the pack twice";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AssetPack::validate( std::string& error ) const
+{
+    for ( uint32_t i = 0; i < _entryCount; ++i )
+    {
+        const AssetPackEntry& entry = _pEntries[i];
+        const std::string name = entryName( entry );
+        if ( checksum( data( entry ), entry.size ) != entry.checksum )
+        {
+            error = "checksum of " + name + " does not match";
+            return false;
+        }
+        if ( !checkLayout( i, error ) )
+            return false;
+
+        if ( entry.type == AssetPackEntry::TypeMesh )
+        {
+            const uint8_t* pIndices = data( entry ) + entry.indexOffset;
+            for ( uint32_t index = 0; index < entry.indexCount; ++index )
+            {
+                uint32_t value;
+                if ( entry.format == AssetPackEntry::FormatUInt16 )
+                    value = reinterpret_cast<const uint16_t*>( pIndices )[index];
+                else
+                    value = reinterpret_cast<const uint32_t*>( pIndices )[index];
+                if ( value >= entry.vertexCount )
+                {
+                    error = "mesh " + name + " indexes a vertex it does not have";
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+const AssetPackEntry* AssetPack::find( const std::string& name ) const
+{
+    for ( uint32_t i = 0; i < _entryCount; ++i )
+    {
+        if ( entryName( _pEntries[i] ) == name )
+            return &_pEntries[i];
+    }
+    return nullptr;
+}
+
+uint64_t AssetPack::pageLength( const AssetPackEntry& entry ) const
+{
+    /// The writer pads the last blob as well, every blob owns whole pages
+    return alignUp( entry.size, kAssetPackPageSize );
+}
+
+void AssetPack::prefetch( const AssetPackEntry& entry ) const
+{
+    madvise( _pBase + entry.offset, size_t( pageLength( entry ) ), MADV_WILLNEED );
+}
+
+const AssetPackSubmesh* AssetPack::submeshes( const AssetPackEntry& entry ) const
+{
+    return reinterpret_cast<const AssetPackSubmesh*>( data( entry ) + entry.submeshOffset );
+}
+
+uint32_t AssetPack::levelWidth( const AssetPackEntry& entry, uint32_t level )
+{
+    return std::max( entry.width >> level, 1u );
+}
+
+uint32_t AssetPack::levelHeight( const AssetPackEntry& entry, uint32_t level )
+{
+    return std::max( entry.height >> level, 1u );
+}
+
+uint64_t AssetPack::bytesPerRow( const AssetPackEntry& entry, uint32_t level )
+{
+    return isCompressed( entry ) ? uint64_t( ( levelWidth( entry, level ) + 3 ) / 4 ) * 16 : uint64_t( levelWidth( entry, level ) ) * 4;
+}
+
+uint64_t AssetPack::levelSize( const AssetPackEntry& entry, uint32_t level )
+{
+    const uint64_t rows = isCompressed( entry ) ? ( levelHeight( entry, level ) + 3 ) / 4 : levelHeight( entry, level );
+    return bytesPerRow( entry, level ) * rows;
+}
+
+uint64_t AssetPack::levelOffset( const AssetPackEntry& entry, uint32_t level )
+{
+    uint64_t offset = 0;
+    for ( uint32_t i = 0; i < level; ++i )
+        offset = alignUp( offset + levelSize( entry, i ), kAssetPackLevelAlignment );
+    return offset;
+}
+
+bool AssetPackWriter::addEntry( AssetPackEntry& entry, const std::string& name, std::string& error )
+{
+    if ( name.empty() || name.size() >= AssetPackEntry::kNameLength )
+    {
+        error = "asset name \"" + name + "\" is empty or longer than " + std::to_string( AssetPackEntry::kNameLength - 1 );
+        return false;
+    }
+    for ( const AssetPackEntry& other : _entries )
+    {
+        if ( name == other.name )
+        {
+            error = "asset " + name + " is added twice";
+            return false;
+        }
+    }
+    std::memcpy( entry.name, name.data(), name.size() );
+    entry.checksum = checksum( _blobs.back().data(), _blobs.back().size() );
+    entry.size = _blobs.back().size();
+    _entries.push_back( entry );
+    return true;
+}
+
+bool AssetPackWriter::addTexture( const std::string& name, AssetPackEntry::Format format, uint32_t width, uint32_t height,
+                                  const std::vector< std::vector<uint8_t> >& levels, std::string& error )
+{
+    AssetPackEntry entry = {};
+    entry.type       = AssetPackEntry::TypeTexture;
+    entry.format     = format;
+    entry.width      = width;
+    entry.height     = height;
+    entry.levelCount = uint32_t( levels.size() );
+    if ( !isTextureFormat( format ) || width == 0 || height == 0 || levels.empty() || levels.size() > 16 )
+    {
+        error = "texture " + name + " has no levels or no texture format";
+        return false;
+    }
+
+    std::vector<uint8_t> blob( AssetPack::levelOffset( entry, entry.levelCount - 1 ) + AssetPack::levelSize( entry, entry.levelCount - 1 ), 0 );
+    for ( uint32_t level = 0; level < entry.levelCount; ++level )
+    {
+        if ( levels[level].size() != AssetPack::levelSize( entry, level ) )
+        {
+            error = "level " + std::to_string( level ) + " of " + name + " has the wrong size";
+            return false;
+        }
+        std::memcpy( blob.data() + AssetPack::levelOffset( entry, level ), levels[level].data(), levels[level].size() );
+    }
+    _blobs.push_back( std::move( blob ) );
+    if ( addEntry( entry, name, error ) )
+        return true;
+    _blobs.pop_back();
+    return false;
+}
+
+bool AssetPackWriter::addMesh( const std::string& name, const std::vector<AssetPackVertex>& vertices, const std::vector<uint32_t>& indices,
+                               const std::vector<AssetPackSubmesh>& submeshes, std::string& error )
+{
+    AssetPackEntry entry = {};
+    entry.type         = AssetPackEntry::TypeMesh;
+    entry.format       = vertices.size() <= 0x10000 ? AssetPackEntry::FormatUInt16 : AssetPackEntry::FormatUInt32;
+    for ( const AssetPackSubmesh& submesh : submeshes )
+    {
+        /// Metal wants index buffer offsets on 4 bytes, a submesh starting on an odd 16 bit index can not be drawn
+        if ( submesh.indexStart % 2 != 0 )
+            entry.format = AssetPackEntry::FormatUInt32;
+    }
+    entry.vertexCount  = uint32_t( vertices.size() );
+    entry.indexCount   = uint32_t( indices.size() );
+    entry.submeshCount = uint32_t( submeshes.size() );
+    entry.indexOffset  = uint32_t( alignUp( vertices.size() * sizeof( AssetPackVertex ), kAssetPackLevelAlignment ) );
+    entry.submeshOffset = uint32_t( alignUp( entry.indexOffset + uint64_t( indices.size() ) * indexSize( entry ), sizeof( AssetPackSubmesh ) ) );
+
+    std::vector<uint8_t> blob( entry.submeshOffset + submeshes.size() * sizeof( AssetPackSubmesh ), 0 );
+    std::memcpy( blob.data(), vertices.data(), vertices.size() * sizeof( AssetPackVertex ) );
+    for ( size_t i = 0; i < indices.size(); ++i )
+    {
+        if ( indices[i] >= vertices.size() )
+        {
+            error = "mesh " + name + " indexes a vertex it does not have";
+            return false;
+        }
+        if ( entry.format == AssetPackEntry::FormatUInt16 )
+            reinterpret_cast<uint16_t*>( blob.data() + entry.indexOffset )[i] = uint16_t( indices[i] );
+        else
+            reinterpret_cast<uint32_t*>( blob.data() + entry.indexOffset )[i] = indices[i];
+    }
+    std::memcpy( blob.data() + entry.submeshOffset, submeshes.data(), submeshes.size() * sizeof( AssetPackSubmesh ) );
+
+    _blobs.push_back( std::move( blob ) );
+    if ( addEntry( entry, name, error ) )
+        return true;
+    _blobs.pop_back();
+    return false;
+}
+
+bool AssetPackWriter::write( const std::string& path, std::string& error ) const
+{
+    std::vector<AssetPackEntry> entries = _entries;
+    uint64_t offset = alignUp( sizeof( AssetPackHeader ) + entries.size() * sizeof( AssetPackEntry ), kAssetPackPageSize );
+    for ( AssetPackEntry& entry : entries )
+    {
+        entry.offset = offset;
+        offset = alignUp( offset + entry.size, kAssetPackPageSize );
+    }
+
+    AssetPackHeader header = {};
+    std::memcpy( header.magic, AssetPackHeader::kMagic, sizeof( header.magic ) );
+    header.version      = AssetPackHeader::kVersion;
+    header.entryCount   = uint32_t( entries.size() );
+    header.fileSize     = offset;
+    header.vertexStride = sizeof( AssetPackVertex );
+    header.tocChecksum  = checksum( entries.data(), entries.size() * sizeof( AssetPackEntry ) );
+
+    FILE* pFile = std::fopen( path.c_str(), "wb" );
+    if ( !pFile )
+    {
+        error = "can not write " + path;
+        return false;
+    }
+
+    /// Padding is written out as zeros, the pages of every blob exist in the file
+    const std::vector<uint8_t> zeros( kAssetPackPageSize, 0 );
+    auto pad = [&]( uint64_t written )
+    {
+        const uint64_t padding = alignUp( written, kAssetPackPageSize ) - written;
+        return std::fwrite( zeros.data(), 1, size_t( padding ), pFile ) == padding;
+    };
+
+    bool written = std::fwrite( &header, sizeof( header ), 1, pFile ) == 1
+                && ( entries.empty() || std::fwrite( entries.data(), sizeof( AssetPackEntry ), entries.size(), pFile ) == entries.size() )
+                && pad( sizeof( header ) + entries.size() * sizeof( AssetPackEntry ) );
+    for ( size_t i = 0; written && i < entries.size(); ++i )
+    {
+        written = std::fwrite( _blobs[i].data(), 1, _blobs[i].size(), pFile ) == _blobs[i].size()
+               && pad( _blobs[i].size() );
+    }
+    written = std::fclose( pFile ) == 0 && written;
+    if ( !written )
+        error = "can not write " + path;
+    return written;
+}
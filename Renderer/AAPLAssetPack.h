@@ -0,0 +1,186 @@
+///
+///  AAPLAssetPack.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 27.04.24.
+///
+/// Abstract:
+/// Cooked asset container the renderer maps instead of parsing. A header and a table of
+/// contents are followed by one blob per asset, each starting on its own page: meshes with
+/// their vertices already in the VertexData layout, their indices and submesh ranges, and
+/// textures with every mip level in the pixel format the GPU samples. Opening only maps the
+/// file and checks the table and the layout of every entry, a blob is read from disk when its
+/// pages are first touched and is handed to Metal as a no copy buffer. The checksums of the
+/// blobs are verified by the AssetPacker tool, not at start up. Plain C++ on top of POSIX, it
+/// builds on Linux as well.
+
+#pragma once
+#ifndef AAPLAssetPack_h
+#define AAPLAssetPack_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Blobs start on a multiple of the largest VM page of the Macs, 16 KB on Apple silicon.
+static constexpr uint64_t kAssetPackPageSize = 16384;
+
+/// Mip levels inside a texture blob start on this alignment, enough for any blit source offset.
+static constexpr uint64_t kAssetPackLevelAlignment = 256;
+
+struct AssetPackHeader
+{
+    static constexpr char     kMagic[8] = { 'M', 'C', 'C', 'P', 'P', 'A', 'C', 'K' };
+    static constexpr uint32_t kVersion  = 1;
+
+    char     magic[8];
+    uint32_t version;
+    uint32_t entryCount;
+    uint64_t fileSize;
+    uint32_t vertexStride;      /// bytes per vertex the meshes were written with
+    uint32_t tocChecksum;       /// CRC-32 of the entries
+};
+
+struct AssetPackEntry
+{
+    static constexpr size_t kNameLength = 64;
+
+    enum Type : uint32_t
+    {
+        TypeTexture,
+        TypeMesh
+    };
+
+    enum Format : uint32_t
+    {
+        FormatBC7,              /// textures
+        FormatBC7_sRGB,
+        FormatRGBA8,
+        FormatRGBA8_sRGB,
+        FormatUInt16,           /// index type of meshes
+        FormatUInt32
+    };
+
+    char     name[kNameLength]; /// zero terminated
+    Type     type;
+    Format   format;
+    uint64_t offset;            /// from the start of the file, a multiple of kAssetPackPageSize
+    uint64_t size;              /// bytes of the blob without the padding to the next page
+    uint32_t checksum;          /// CRC-32 of the blob
+
+    /// Textures use width, height and levelCount, meshes the counts and the offsets into the
+    /// blob, vertices first, then the indices and the submesh table
+    uint32_t width;
+    uint32_t height;
+    uint32_t levelCount;
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    uint32_t submeshCount;
+    uint32_t indexOffset;
+    uint32_t submeshOffset;
+    uint32_t reserved;
+};
+
+/// Index range of a mesh drawn with one primitive type.
+struct AssetPackSubmesh
+{
+    enum Primitive : uint32_t
+    {
+        PrimitiveTriangle,
+        PrimitiveTriangleStrip
+    };
+
+    Primitive primitive;
+    uint32_t  indexStart;       /// first index, in indices
+    uint32_t  indexCount;
+    uint32_t  reserved;
+};
+
+/// VertexData of AAPLShaderTypes.h as it lies in memory, every simd float3 takes 16 bytes.
+struct AssetPackVertex
+{
+    float position[4];
+    float texCoord[2];
+    float padding[2];
+    float normal[4];
+};
+
+static_assert( sizeof( AssetPackHeader ) == 32, "AssetPackHeader layout changed" );
+static_assert( sizeof( AssetPackEntry ) == 128, "AssetPackEntry layout changed" );
+static_assert( sizeof( AssetPackVertex ) == 48, "AssetPackVertex has to match VertexData" );
+
+/// Read only view of a mapped pack.
+class AssetPack
+{
+public:
+    AssetPack() = default;
+    ~AssetPack();
+
+    AssetPack( const AssetPack& ) = delete;
+    AssetPack& operator=( const AssetPack& ) = delete;
+
+    /// Maps the file and checks the header, the table of contents and the layout every entry
+    /// claims for its blob, without reading the blobs beyond the submesh tables.
+    bool open( const std::string& path, std::string& error );
+    void close();
+    bool isOpen() const { return _pBase != nullptr; }
+
+    /// Checks the checksum of every blob and the indices of the meshes, this reads the whole file.
+    bool validate( std::string& error ) const;
+
+    const AssetPackEntry* find( const std::string& name ) const;
+    const AssetPackEntry* entries() const { return _pEntries; }
+    uint32_t entryCount() const { return _entryCount; }
+    uint64_t fileSize() const { return _size; }
+
+    const uint8_t* data( const AssetPackEntry& entry ) const { return _pBase + entry.offset; }
+
+    /// Blob rounded up to whole pages, the range a no copy buffer takes.
+    uint64_t pageLength( const AssetPackEntry& entry ) const;
+
+    /// Asks the kernel to read the pages of the blob ahead.
+    void prefetch( const AssetPackEntry& entry ) const;
+
+    const AssetPackSubmesh* submeshes( const AssetPackEntry& entry ) const;
+
+    /// Layout of the mip levels of a texture entry.
+    static uint64_t bytesPerRow( const AssetPackEntry& entry, uint32_t level );
+    static uint64_t levelSize( const AssetPackEntry& entry, uint32_t level );
+    static uint64_t levelOffset( const AssetPackEntry& entry, uint32_t level );
+    static uint32_t levelWidth( const AssetPackEntry& entry, uint32_t level );
+    static uint32_t levelHeight( const AssetPackEntry& entry, uint32_t level );
+
+private:
+    /// Sizes and offsets of an entry against its type and format, its submesh ranges and its name.
+    bool checkLayout( uint32_t index, std::string& error ) const;
+
+    uint8_t* _pBase = nullptr;
+    uint64_t _size  = 0;
+    const AssetPackEntry* _pEntries = nullptr;
+    uint32_t _entryCount = 0;
+};
+
+/// Collects assets and writes them as a pack.
+class AssetPackWriter
+{
+public:
+    /// Levels in the layout of AssetPack::levelSize, level 0 first.
+    bool addTexture( const std::string& name, AssetPackEntry::Format format, uint32_t width, uint32_t height,
+                     const std::vector< std::vector<uint8_t> >& levels, std::string& error );
+
+    /// Indices are stored as 16 bit when every vertex can be addressed that way and every
+    /// submesh starts on an even index.
+    bool addMesh( const std::string& name, const std::vector<AssetPackVertex>& vertices, const std::vector<uint32_t>& indices,
+                  const std::vector<AssetPackSubmesh>& submeshes, std::string& error );
+
+    bool write( const std::string& path, std::string& error ) const;
+
+private:
+    bool addEntry( AssetPackEntry& entry, const std::string& name, std::string& error );
+
+    std::vector<AssetPackEntry> _entries;
+    std::vector< std::vector<uint8_t> > _blobs;
+};
+
+#endif /* AAPLAssetPack_h */
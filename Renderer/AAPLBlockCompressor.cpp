@@ -0,0 +1,571 @@
+///
+///  AAPLBlockCompressor.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.04.24.
+///
+
+#include "AAPLBlockCompressor.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    const int kWeights2[4]  = { 0, 21, 43, 64 };
+    const int kWeights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    int interpolate( int e0, int e1, int weight )
+    {
+        return ( ( 64 - weight ) * e0 + weight * e1 + 32 ) >> 6;
+    }
+
+    /// Bits are packed from the least significant bit of byte 0 upwards
+    struct BitWriter
+    {
+        uint8_t* pBytes;
+        uint32_t bit = 0;
+
+        void write( uint32_t value, uint32_t count )
+        {
+            for ( uint32_t i = 0; i < count; ++i, ++bit )
+            {
+                if ( ( value >> i ) & 1 )
+                    pBytes[bit >> 3] |= uint8_t( 1u << ( bit & 7 ) );
+            }
+        }
+    };
+
+    struct BitReader
+    {
+        const uint8_t* pBytes;
+        uint32_t bit = 0;
+
+        uint32_t read( uint32_t count )
+        {
+            uint32_t value = 0;
+            for ( uint32_t i = 0; i < count; ++i, ++bit )
+                value |= uint32_t( ( pBytes[bit >> 3] >> ( bit & 7 ) ) & 1 ) << i;
+            return value;
+        }
+    };
+
+    /// Principal axis of the texels around their mean by power iteration, zero for a flat block
+    simd::float4 principalAxis( const simd::float4* pTexels, uint32_t count, simd::float4 mean )
+    {
+        simd::float4 covariance[4] = { 0.f, 0.f, 0.f, 0.f };
+        simd::float4 low = pTexels[0], high = pTexels[0];
+        for ( uint32_t i = 0; i < count; ++i )
+        {
+            const simd::float4 d = pTexels[i] - mean;
+            covariance[0] += d * d.x;
+            covariance[1] += d * d.y;
+            covariance[2] += d * d.z;
+            covariance[3] += d * d.w;
+            low  = simd_min( low, pTexels[i] );
+            high = simd_max( high, pTexels[i] );
+        }
+
+        simd::float4 axis = high - low;
+        if ( simd_dot( axis, axis ) < 1e-6f )
+            return simd::float4( 0.f );
+        for ( int iteration = 0; iteration < 8; ++iteration )
+        {
+            const simd::float4 next = covariance[0] * axis.x + covariance[1] * axis.y + covariance[2] * axis.z + covariance[3] * axis.w;
+            const float length = std::sqrt( simd_dot( next, next ) );
+            if ( length < 1e-6f )
+                break;
+            axis = next / length;
+        }
+        return axis;
+    }
+
+    /// Ends of the projection of the texels on the axis through their mean
+    void boundingEndpoints( const simd::float4* pTexels, uint32_t count, simd::float4& e0, simd::float4& e1 )
+    {
+        simd::float4 mean = 0.f;
+        for ( uint32_t i = 0; i < count; ++i )
+            mean += pTexels[i];
+        mean /= float( count );
+
+        const simd::float4 axis = principalAxis( pTexels, count, mean );
+        float low = 0.f, high = 0.f;
+        for ( uint32_t i = 0; i < count; ++i )
+        {
+            const float t = simd_dot( pTexels[i] - mean, axis );
+            low  = std::min( low, t );
+            high = std::max( high, t );
+        }
+        e0 = simd_clamp( mean + axis * low, simd::float4( 0.f ), simd::float4( 255.f ) );
+        e1 = simd_clamp( mean + axis * high, simd::float4( 0.f ), simd::float4( 255.f ) );
+    }
+
+    /// Endpoints that minimize the squared error for fixed interpolation weights, false if degenerate
+    bool leastSquaresEndpoints( const simd::float4* pTexels, const int* pWeights, uint32_t count, simd::float4& e0, simd::float4& e1 )
+    {
+        float a = 0.f, b = 0.f, c = 0.f;
+        simd::float4 x0 = 0.f, x1 = 0.f;
+        for ( uint32_t i = 0; i < count; ++i )
+        {
+            const float w = pWeights[i] / 64.f;
+            a  += ( 1.f - w ) * ( 1.f - w );
+            b  += ( 1.f - w ) * w;
+            c  += w * w;
+            x0 += ( 1.f - w ) * pTexels[i];
+            x1 += w * pTexels[i];
+        }
+        const float determinant = a * c - b * b;
+        if ( std::fabs( determinant ) < 1e-6f )
+            return false;
+        e0 = simd_clamp( ( c * x0 - b * x1 ) / determinant, simd::float4( 0.f ), simd::float4( 255.f ) );
+        e1 = simd_clamp( ( a * x1 - b * x0 ) / determinant, simd::float4( 0.f ), simd::float4( 255.f ) );
+        return true;
+    }
+
+    /// Index of the weight closest to the position t in [0, 1] along the endpoints
+    template< int Count >
+    int nearestIndex( float t, const int ( &weights )[Count] )
+    {
+        const float scaled = std::clamp( t, 0.f, 1.f ) * 64.f;
+        int best = 0;
+        for ( int i = 1; i < Count; ++i )
+        {
+            if ( std::fabs( weights[i] - scaled ) < std::fabs( weights[best] - scaled ) )
+                best = i;
+        }
+        return best;
+    }
+}
+
+/// Texels of one block as floats in [0, 255] and as the bytes they stand for
+struct BC7Encoder::Block
+{
+    simd::float4 texels[16];
+    int          bytes[16][4];
+};
+
+struct BC7Encoder::Candidate
+{
+    uint32_t error = std::numeric_limits<uint32_t>::max();
+    uint8_t  bits[kBlockBytes] = {};
+};
+
+BC7Encoder::BC7Encoder( Quality quality )
+: _quality( quality )
+, _refinements( quality == QualityFast ? 0 : 2 )
+{
+}
+
+size_t BC7Encoder::encodedSize( uint32_t width, uint32_t height )
+{
+    return size_t( ( width + 3 ) / 4 ) * ( ( height + 3 ) / 4 ) * kBlockBytes;
+}
+
+BC7Encoder::Candidate BC7Encoder::encodeMode6( const Block& block ) const
+{
+    struct Fit
+    {
+        uint32_t error = std::numeric_limits<uint32_t>::max();
+        int quantized[2][4];
+        int pbits[2];
+        int indices[16];
+    } best;
+
+    /// Quantizes both endpoints with every p bit pair and keeps the pair with the least error
+    auto evaluate = [&]( simd::float4 e0, simd::float4 e1, bool exhaustive )
+    {
+        for ( int pair = 0; pair < 4; ++pair )
+        {
+            Fit fit;
+            fit.pbits[0] = pair & 1;
+            fit.pbits[1] = pair >> 1;
+            int endpoints[2][4];
+            for ( int c = 0; c < 4; ++c )
+            {
+                fit.quantized[0][c] = std::clamp( int( std::lround( ( e0[c] - fit.pbits[0] ) / 2.f ) ), 0, 127 );
+                fit.quantized[1][c] = std::clamp( int( std::lround( ( e1[c] - fit.pbits[1] ) / 2.f ) ), 0, 127 );
+                endpoints[0][c] = fit.quantized[0][c] * 2 + fit.pbits[0];
+                endpoints[1][c] = fit.quantized[1][c] * 2 + fit.pbits[1];
+            }
+
+            const simd::float4 v0 = { float( endpoints[0][0] ), float( endpoints[0][1] ), float( endpoints[0][2] ), float( endpoints[0][3] ) };
+            const simd::float4 v1 = { float( endpoints[1][0] ), float( endpoints[1][1] ), float( endpoints[1][2] ), float( endpoints[1][3] ) };
+            const simd::float4 direction = v1 - v0;
+            const float lengthSquared = simd_dot( direction, direction );
+
+            fit.error = 0;
+            for ( int i = 0; i < 16; ++i )
+            {
+                /// Projection is close to optimal for one subset, the last passes check all sixteen weights
+                int first = 0, last = 15;
+                if ( !exhaustive )
+                {
+                    first = last = lengthSquared > 0.f ? nearestIndex( simd_dot( block.texels[i] - v0, direction ) / lengthSquared, kWeights4 ) : 0;
+                }
+
+                uint32_t bestError = std::numeric_limits<uint32_t>::max();
+                for ( int index = first; index <= last; ++index )
+                {
+                    uint32_t error = 0;
+                    for ( int c = 0; c < 4; ++c )
+                    {
+                        const int d = interpolate( endpoints[0][c], endpoints[1][c], kWeights4[index] ) - block.bytes[i][c];
+                        error += uint32_t( d * d );
+                    }
+                    if ( error < bestError )
+                    {
+                        bestError = error;
+                        fit.indices[i] = index;
+                    }
+                }
+                fit.error += bestError;
+            }
+            if ( fit.error < best.error )
+                best = fit;
+        }
+    };
+
+    /// Each quality level runs the passes of the one below first, so it never ends up worse
+    simd::float4 e0, e1;
+    boundingEndpoints( block.texels, 16, e0, e1 );
+    evaluate( e0, e1, false );
+    const uint32_t passes = _refinements + ( _quality == QualityHigh ? kExhaustivePasses : 0 );
+    for ( uint32_t pass = 0; pass < passes && best.error > 0; ++pass )
+    {
+        int weights[16];
+        for ( int i = 0; i < 16; ++i )
+            weights[i] = kWeights4[best.indices[i]];
+        if ( !leastSquaresEndpoints( block.texels, weights, 16, e0, e1 ) )
+            break;
+        evaluate( e0, e1, pass >= _refinements );
+    }
+
+    /// The anchor texel must have the high index bit clear, swap the ends otherwise
+    if ( best.indices[0] & 8 )
+    {
+        std::swap( best.quantized[0], best.quantized[1] );
+        std::swap( best.pbits[0], best.pbits[1] );
+        for ( int& index : best.indices )
+            index = 15 - index;
+    }
+
+    Candidate candidate;
+    candidate.error = best.error;
+    BitWriter writer { candidate.bits };
+    writer.write( 1u << 6, 7 );
+    for ( int c = 0; c < 4; ++c )
+    {
+        writer.write( uint32_t( best.quantized[0][c] ), 7 );
+        writer.write( uint32_t( best.quantized[1][c] ), 7 );
+    }
+    writer.write( uint32_t( best.pbits[0] ), 1 );
+    writer.write( uint32_t( best.pbits[1] ), 1 );
+    writer.write( uint32_t( best.indices[0] ), 3 );
+    for ( int i = 1; i < 16; ++i )
+        writer.write( uint32_t( best.indices[i] ), 4 );
+    return candidate;
+}
+
+BC7Encoder::Candidate BC7Encoder::encodeMode5( const Block& block, uint32_t rotation ) const
+{
+    /// The rotation swaps one color channel into alpha, where it is interpolated on its own
+    simd::float4 color[16];
+    float scalar[16];
+    int bytes[16][4];
+    for ( int i = 0; i < 16; ++i )
+    {
+        simd::float4 texel = block.texels[i];
+        std::memcpy( bytes[i], block.bytes[i], sizeof( bytes[i] ) );
+        if ( rotation > 0 )
+        {
+            const float channel = texel[rotation - 1];
+            texel[rotation - 1] = texel.w;
+            texel.w = channel;
+            std::swap( bytes[i][rotation - 1], bytes[i][3] );
+        }
+        scalar[i] = texel.w;
+        color[i] = (simd::float4){ texel.x, texel.y, texel.z, 0.f };
+    }
+
+    /// Color ends in 7 bits, alpha ends in 8 bits, both with two bit indices
+    int colorEnds[2][3] = {}, colorIndices[16] = {};
+    uint32_t colorError = std::numeric_limits<uint32_t>::max();
+    auto evaluateColor = [&]( simd::float4 e0, simd::float4 e1 )
+    {
+        int quantized[2][3], endpoints[2][3], indices[16];
+        for ( int c = 0; c < 3; ++c )
+        {
+            quantized[0][c] = std::clamp( int( std::lround( e0[c] * 127.f / 255.f ) ), 0, 127 );
+            quantized[1][c] = std::clamp( int( std::lround( e1[c] * 127.f / 255.f ) ), 0, 127 );
+            endpoints[0][c] = ( quantized[0][c] << 1 ) | ( quantized[0][c] >> 6 );
+            endpoints[1][c] = ( quantized[1][c] << 1 ) | ( quantized[1][c] >> 6 );
+        }
+
+        /// Four weights only, every texel tries all of them
+        uint32_t total = 0;
+        for ( int i = 0; i < 16; ++i )
+        {
+            uint32_t bestError = std::numeric_limits<uint32_t>::max();
+            for ( int index = 0; index < 4; ++index )
+            {
+                uint32_t error = 0;
+                for ( int c = 0; c < 3; ++c )
+                {
+                    const int d = interpolate( endpoints[0][c], endpoints[1][c], kWeights2[index] ) - bytes[i][c];
+                    error += uint32_t( d * d );
+                }
+                if ( error < bestError )
+                {
+                    bestError = error;
+                    indices[i] = index;
+                }
+            }
+            total += bestError;
+        }
+        if ( total < colorError )
+        {
+            colorError = total;
+            std::memcpy( colorEnds, quantized, sizeof( colorEnds ) );
+            std::memcpy( colorIndices, indices, sizeof( colorIndices ) );
+        }
+    };
+
+    int alphaEnds[2] = {}, alphaIndices[16] = {};
+    uint32_t alphaError = std::numeric_limits<uint32_t>::max();
+    auto evaluateAlpha = [&]( float a0, float a1 )
+    {
+        const int ends[2] = { std::clamp( int( std::lround( a0 ) ), 0, 255 ), std::clamp( int( std::lround( a1 ) ), 0, 255 ) };
+        int indices[16];
+        uint32_t total = 0;
+        for ( int i = 0; i < 16; ++i )
+        {
+            uint32_t bestError = std::numeric_limits<uint32_t>::max();
+            for ( int index = 0; index < 4; ++index )
+            {
+                const int d = interpolate( ends[0], ends[1], kWeights2[index] ) - bytes[i][3];
+                if ( uint32_t( d * d ) < bestError )
+                {
+                    bestError = uint32_t( d * d );
+                    indices[i] = index;
+                }
+            }
+            total += bestError;
+        }
+        if ( total < alphaError )
+        {
+            alphaError = total;
+            alphaEnds[0] = ends[0];
+            alphaEnds[1] = ends[1];
+            std::memcpy( alphaIndices, indices, sizeof( alphaIndices ) );
+        }
+    };
+
+    simd::float4 e0, e1;
+    boundingEndpoints( color, 16, e0, e1 );
+    evaluateColor( e0, e1 );
+    const float alphaLow = *std::min_element( scalar, scalar + 16 );
+    const float alphaHigh = *std::max_element( scalar, scalar + 16 );
+    evaluateAlpha( alphaLow, alphaHigh );
+
+    for ( uint32_t pass = 0; pass < _refinements; ++pass )
+    {
+        int weights[16];
+        for ( int i = 0; i < 16; ++i )
+            weights[i] = kWeights2[colorIndices[i]];
+        if ( colorError > 0 && leastSquaresEndpoints( color, weights, 16, e0, e1 ) )
+            evaluateColor( e0, e1 );
+
+        simd::float4 alpha[16];
+        for ( int i = 0; i < 16; ++i )
+        {
+            alpha[i] = simd::float4( scalar[i] );
+            weights[i] = kWeights2[alphaIndices[i]];
+        }
+        if ( alphaError > 0 && leastSquaresEndpoints( alpha, weights, 16, e0, e1 ) )
+            evaluateAlpha( e0.x, e1.x );
+    }
+
+    if ( colorIndices[0] & 2 )
+    {
+        std::swap( colorEnds[0], colorEnds[1] );
+        for ( int& index : colorIndices )
+            index = 3 - index;
+    }
+    if ( alphaIndices[0] & 2 )
+    {
+        std::swap( alphaEnds[0], alphaEnds[1] );
+        for ( int& index : alphaIndices )
+            index = 3 - index;
+    }
+
+    Candidate candidate;
+    candidate.error = colorError + alphaError;
+    BitWriter writer { candidate.bits };
+    writer.write( 1u << 5, 6 );
+    writer.write( rotation, 2 );
+    for ( int c = 0; c < 3; ++c )
+    {
+        writer.write( uint32_t( colorEnds[0][c] ), 7 );
+        writer.write( uint32_t( colorEnds[1][c] ), 7 );
+    }
+    writer.write( uint32_t( alphaEnds[0] ), 8 );
+    writer.write( uint32_t( alphaEnds[1] ), 8 );
+    writer.write( uint32_t( colorIndices[0] ), 1 );
+    for ( int i = 1; i < 16; ++i )
+        writer.write( uint32_t( colorIndices[i] ), 2 );
+    writer.write( uint32_t( alphaIndices[0] ), 1 );
+    for ( int i = 1; i < 16; ++i )
+        writer.write( uint32_t( alphaIndices[i] ), 2 );
+    return candidate;
+}
+
+void BC7Encoder::encodeBlock( const Block& block, uint8_t* pOut ) const
+{
+    Candidate best = encodeMode6( block );
+    if ( _quality == QualityHigh )
+    {
+        for ( uint32_t rotation = 0; rotation < 4 && best.error > 0; ++rotation )
+        {
+            const Candidate candidate = encodeMode5( block, rotation );
+            if ( candidate.error < best.error )
+                best = candidate;
+        }
+    }
+    std::memcpy( pOut, best.bits, kBlockBytes );
+}
+
+std::vector<uint8_t> BC7Encoder::encode( const Image& image, Statistics* pStatistics ) const
+{
+    const auto start = std::chrono::steady_clock::now();
+    const uint32_t blocksWide = ( image.width + 3 ) / 4;
+    const uint32_t blocksHigh = ( image.height + 3 ) / 4;
+    std::vector<uint8_t> encoded( encodedSize( image.width, image.height ), 0 );
+
+    /// Squared error and mode 5 count per block row, summed in order afterwards
+    std::vector<double> rowErrors( blocksHigh, 0.0 );
+    std::vector<size_t> rowMode5( blocksHigh, 0 );
+
+    parallelFor( blocksHigh, 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t by = begin; by < end; ++by )
+        {
+            for ( uint32_t bx = 0; bx < blocksWide; ++bx )
+            {
+                Block block;
+                for ( uint32_t i = 0; i < 16; ++i )
+                {
+                    const uint32_t x = std::min( bx * 4 + ( i & 3 ), image.width - 1 );
+                    const uint32_t y = std::min( uint32_t( by ) * 4 + ( i >> 2 ), image.height - 1 );
+                    const simd::float4 texel = simd_clamp( image.at( x, y ), simd::float4( 0.f ), simd::float4( 1.f ) );
+                    for ( int c = 0; c < 4; ++c )
+                    {
+                        block.bytes[i][c] = int( std::lround( texel[c] * 255.f ) );
+                        block.texels[i][c] = float( block.bytes[i][c] );
+                    }
+                }
+
+                uint8_t* pOut = &encoded[( by * blocksWide + bx ) * kBlockBytes];
+                encodeBlock( block, pOut );
+
+                uint8_t decoded[16][4];
+                decodeBlock( pOut, decoded );
+                for ( uint32_t i = 0; i < 16; ++i )
+                {
+                    /// Only texels inside the image count
+                    if ( bx * 4 + ( i & 3 ) >= image.width || by * 4 + ( i >> 2 ) >= image.height )
+                        continue;
+                    for ( int c = 0; c < 4; ++c )
+                    {
+                        const double d = double( decoded[i][c] ) - block.bytes[i][c];
+                        rowErrors[by] += d * d;
+                    }
+                }
+                rowMode5[by] += ( pOut[0] & 0x7f ) == 0x20;
+            }
+        }
+    });
+
+    if ( pStatistics )
+    {
+        double squaredError = 0.0;
+        size_t mode5 = 0;
+        for ( uint32_t by = 0; by < blocksHigh; ++by )
+        {
+            squaredError += rowErrors[by];
+            mode5 += rowMode5[by];
+        }
+        const double meanSquaredError = squaredError / ( double( image.width ) * image.height * 4.0 );
+        pStatistics->blockCount   = size_t( blocksWide ) * blocksHigh;
+        pStatistics->mode5Blocks  = mode5;
+        pStatistics->psnr         = meanSquaredError > 0.0 ? 10.0 * std::log10( 255.0 * 255.0 / meanSquaredError )
+                                                           : std::numeric_limits<double>::infinity();
+        pStatistics->milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+    return encoded;
+}
+
+void BC7Encoder::decodeBlock( const uint8_t* pBlock, uint8_t texels[16][4] )
+{
+    std::memset( texels, 0, 16 * 4 );
+    BitReader reader { pBlock };
+
+    uint32_t mode = 0;
+    while ( mode < 8 && reader.read( 1 ) == 0 )
+        ++mode;
+
+    if ( mode == 6 )
+    {
+        int quantized[2][4], endpoints[2][4];
+        for ( int c = 0; c < 4; ++c )
+        {
+            quantized[0][c] = int( reader.read( 7 ) );
+            quantized[1][c] = int( reader.read( 7 ) );
+        }
+        const int pbits[2] = { int( reader.read( 1 ) ), int( reader.read( 1 ) ) };
+        for ( int c = 0; c < 4; ++c )
+        {
+            endpoints[0][c] = ( quantized[0][c] << 1 ) | pbits[0];
+            endpoints[1][c] = ( quantized[1][c] << 1 ) | pbits[1];
+        }
+        for ( int i = 0; i < 16; ++i )
+        {
+            const int index = int( reader.read( i == 0 ? 3 : 4 ) );
+            for ( int c = 0; c < 4; ++c )
+                texels[i][c] = uint8_t( interpolate( endpoints[0][c], endpoints[1][c], kWeights4[index] ) );
+        }
+    }
+    else if ( mode == 5 )
+    {
+        const uint32_t rotation = reader.read( 2 );
+        int endpoints[2][4];
+        for ( int c = 0; c < 3; ++c )
+        {
+            for ( int e = 0; e < 2; ++e )
+            {
+                const int quantized = int( reader.read( 7 ) );
+                endpoints[e][c] = ( quantized << 1 ) | ( quantized >> 6 );
+            }
+        }
+        endpoints[0][3] = int( reader.read( 8 ) );
+        endpoints[1][3] = int( reader.read( 8 ) );
+
+        int colorIndices[16], alphaIndices[16];
+        for ( int i = 0; i < 16; ++i )
+            colorIndices[i] = int( reader.read( i == 0 ? 1 : 2 ) );
+        for ( int i = 0; i < 16; ++i )
+            alphaIndices[i] = int( reader.read( i == 0 ? 1 : 2 ) );
+
+        for ( int i = 0; i < 16; ++i )
+        {
+            for ( int c = 0; c < 3; ++c )
+                texels[i][c] = uint8_t( interpolate( endpoints[0][c], endpoints[1][c], kWeights2[colorIndices[i]] ) );
+            texels[i][3] = uint8_t( interpolate( endpoints[0][3], endpoints[1][3], kWeights2[alphaIndices[i]] ) );
+            if ( rotation > 0 )
+                std::swap( texels[i][rotation - 1], texels[i][3] );
+        }
+    }
+}
@@ -0,0 +1,75 @@
+///
+///  AAPLBlockCompressor.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.04.24.
+///
+/// Abstract:
+/// BC7 encoder for the asset pipeline, one byte per texel against the eight of the half float
+/// textures the asset catalog builds. Blocks are encoded with the single subset modes, mode 6
+/// for RGBA with per endpoint p bits and mode 5 with a separately interpolated channel, which
+/// covers textures whose alpha or one channel varies on its own. The quality knob trades the
+/// number of endpoint refinement passes and the modes tried for time. Block rows run on all
+/// cores and every block only depends on its own texels, the thread count never changes the output.
+
+#pragma once
+#ifndef AAPLBlockCompressor_h
+#define AAPLBlockCompressor_h
+
+#include <simd/simd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "AAPLImage.h"
+
+class BC7Encoder
+{
+public:
+    enum Quality
+    {
+        QualityFast,            /// mode 6, endpoints from the principal axis only
+        QualityNormal,          /// mode 6 with least squares refinement and p bit search
+        QualityHigh             /// exhaustive index search on top, mode 5 in all four rotations as well
+    };
+
+    /// Fit of the last encode against the 8 bit source.
+    struct Statistics
+    {
+        size_t blockCount;
+        size_t mode5Blocks;
+        double psnr;            /// over all four channels, infinite for an exact fit
+        double milliseconds;
+    };
+
+    static constexpr size_t kBlockBytes = 16;
+
+    explicit BC7Encoder( Quality quality );
+
+    /// Encodes values in [0, 1] as stored, no transfer function is applied. Blocks are row major
+    /// from the top left, edge blocks repeat the last row and column.
+    std::vector<uint8_t> encode( const Image& image, Statistics* pStatistics = nullptr ) const;
+
+    /// Bytes of a texture of width by height texels.
+    static size_t encodedSize( uint32_t width, uint32_t height );
+
+    /// Decodes a block of mode 5 or 6 into RGBA, rows of four texels. Other modes decode to zero.
+    static void decodeBlock( const uint8_t* pBlock, uint8_t texels[16][4] );
+
+private:
+    struct Block;
+    struct Candidate;
+
+    void encodeBlock( const Block& block, uint8_t* pOut ) const;
+    Candidate encodeMode6( const Block& block ) const;
+    Candidate encodeMode5( const Block& block, uint32_t rotation ) const;
+
+    /// Least squares passes of the high quality that pick every index from all sixteen weights
+    static constexpr uint32_t kExhaustivePasses = 2;
+
+    Quality  _quality;
+    uint32_t _refinements;      /// least squares passes with indices by projection
+};
+
+#endif /* AAPLBlockCompressor_h */
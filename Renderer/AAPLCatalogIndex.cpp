@@ -0,0 +1,513 @@
+///
+///  AAPLCatalogIndex.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 30.04.24.
+///
+
+#include "AAPLCatalogIndex.h"
+#include "AAPLCatalogJSON.h"
+#include "AAPLDecoderPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <unordered_map>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    constexpr char     kMagic[8] = { 'M', 'C', 'C', 'P', 'C', 'I', 'D', 'X' };
+    constexpr uint32_t kVersion  = 2;
+
+    struct Header
+    {
+        char     magic[8];
+        uint32_t version;
+        uint32_t entryCount;
+        uint32_t imageCount;
+        uint32_t stringBytes;
+        uint64_t hash;              /// of the Contents.json files the index was built from
+    };
+    static_assert( sizeof( Header ) == 32, "Catalog index header layout" );
+    static_assert( sizeof( CatalogIndex::Entry ) == 16, "Catalog index entry layout" );
+
+    /// A set as read from its Contents.json files, paths relative to the catalog.
+    struct ParsedSet
+    {
+        std::string name;
+        std::string pixelFormat;
+        uint8_t     type  = CatalogIndex::Entry::TypeTexture;
+        uint8_t     flags = 0;
+        std::vector< std::vector<std::string> > faces;
+        uint32_t    missingImageCount = 0;
+        std::string error;
+    };
+
+    uint64_t fnv1a( uint64_t hash, const void* pData, size_t size )
+    {
+        const uint8_t* pBytes = static_cast<const uint8_t*>( pData );
+        for ( size_t i = 0; i < size; ++i )
+            hash = ( hash ^ pBytes[i] ) * 1099511628211ull;
+        return hash;
+    }
+
+    uint64_t fnv1a( uint64_t hash, const std::string& text )
+    {
+        /// The terminator keeps "ab" + "c" apart from "a" + "bc"
+        return fnv1a( hash, text.c_str(), text.size() + 1 );
+    }
+
+    /// Slice of a cube face in Metal order, -1 for an unknown face.
+    int cubeSlice( const std::string& face )
+    {
+        static const char* faces[6] = { "x+", "x-", "y+", "y-", "z+", "z-" };
+        for ( int slice = 0; slice < 6; ++slice )
+        {
+            if ( face == faces[slice] )
+                return slice;
+        }
+        return -1;
+    }
+
+    /// 0 for "base", N for "mipmap-level-N", -1 otherwise.
+    int mipLevel( const std::string& level )
+    {
+        static const std::string prefix = "mipmap-level-";
+        if ( level == "base" )
+            return 0;
+        if ( level.compare( 0, prefix.size(), prefix ) != 0 || level.size() == prefix.size() )
+            return -1;
+        int value = 0;
+        for ( size_t i = prefix.size(); i < level.size(); ++i )
+        {
+            if ( level[i] < '0' || level[i] > '9' || value > 255 )
+                return -1;
+            value = value * 10 + ( level[i] - '0' );
+        }
+        return value;
+    }
+
+    const std::string* findContents( const std::vector< std::pair<std::string, std::string> >& contents, const std::string& path )
+    {
+        for ( const auto& file : contents )
+        {
+            if ( file.first == path )
+                return &file.second;
+        }
+        return nullptr;
+    }
+}
+
+void CatalogIndex::reset()
+{
+    _entries.clear();
+    _images.clear();
+    _strings.assign( 1, '\0' );
+    _hash = 0;
+    _statistics = { 0, 0, 0, false, 0.0 };
+}
+
+bool CatalogIndex::scan( const fs::path& catalog, std::vector<SetSource>& sources, uint64_t& hash,
+                         std::string& error, DecoderPool& pool )
+{
+    std::error_code code;
+    if ( !fs::is_directory( catalog, code ) )
+    {
+        error = "no asset catalog at " + catalog.string();
+        return false;
+    }
+
+    /// Folders without an extension are groups, other sets like colors and icons are skipped
+    sources.clear();
+    for ( auto it = fs::recursive_directory_iterator( catalog, code ); !code && it != fs::recursive_directory_iterator(); it.increment( code ) )
+    {
+        std::error_code entryCode;
+        if ( !it->is_directory( entryCode ) )
+            continue;
+        const fs::path path = it->path();
+        const std::string extension = path.extension().string();
+        if ( extension.empty() )
+            continue;
+        it.disable_recursion_pending();
+        if ( extension == ".textureset" || extension == ".cubetextureset" )
+            sources.push_back( SetSource{ path.stem().string(), fs::relative( path, catalog ).generic_string(),
+                                          extension == ".cubetextureset", {}, {} } );
+    }
+    if ( code )
+    {
+        error = "can not list " + catalog.string() + ": " + code.message();
+        return false;
+    }
+    std::sort( sources.begin(), sources.end(), []( const SetSource& a, const SetSource& b ) { return a.folder < b.folder; } );
+
+    /// One job per set reads its own and its mipmapsets' Contents.json
+    std::vector< std::future<void> > jobs;
+    jobs.reserve( sources.size() );
+    for ( SetSource& source : sources )
+    {
+        SetSource* pSource = &source;
+        jobs.push_back( pool.enqueue( [pSource, catalog]()
+        {
+            const fs::path folder = catalog / pSource->folder;
+            std::string text;
+            if ( !AssetCatalog::readText( folder / "Contents.json", text ) )
+            {
+                pSource->error = "no Contents.json in " + pSource->folder;
+                return;
+            }
+            pSource->contents.emplace_back( pSource->folder + "/Contents.json", std::move( text ) );
+
+            std::vector<std::string> mipmapSets;
+            std::error_code code;
+            for ( const fs::directory_entry& entry : fs::directory_iterator( folder, code ) )
+            {
+                if ( entry.is_directory( code ) && entry.path().extension() == ".mipmapset" )
+                    mipmapSets.push_back( entry.path().filename().string() );
+            }
+            std::sort( mipmapSets.begin(), mipmapSets.end() );
+            for ( const std::string& mipmapSet : mipmapSets )
+            {
+                if ( AssetCatalog::readText( folder / mipmapSet / "Contents.json", text ) )
+                    pSource->contents.emplace_back( pSource->folder + "/" + mipmapSet + "/Contents.json", std::move( text ) );
+            }
+        }));
+    }
+    for ( std::future<void>& job : jobs )
+        job.wait();
+
+    hash = fnv1a( 14695981039346656037ull, &kVersion, sizeof( kVersion ) );
+    for ( const SetSource& source : sources )
+    {
+        if ( !source.error.empty() )
+        {
+            error = source.error;
+            return false;
+        }
+        for ( const auto& file : source.contents )
+            hash = fnv1a( fnv1a( hash, file.first ), file.second );
+    }
+    return true;
+}
+
+bool CatalogIndex::assemble( const std::vector<SetSource>& sources, uint64_t hash, std::string& error, DecoderPool& pool )
+{
+    const fs::path catalog = _catalog;
+    std::vector<ParsedSet> sets( sources.size() );
+    {
+        std::vector< std::future<void> > jobs;
+        jobs.reserve( sources.size() );
+        for ( size_t i = 0; i < sources.size(); ++i )
+        {
+            const SetSource* pSource = &sources[i];
+            ParsedSet* pSet = &sets[i];
+            jobs.push_back( pool.enqueue( [pSource, pSet, catalog]()
+            {
+                const SetSource& source = *pSource;
+                ParsedSet& set = *pSet;
+                set.name  = source.name;
+                set.type  = source.cube ? Entry::TypeCubeTexture : Entry::TypeTexture;
+                set.faces.resize( source.cube ? 6 : 1 );
+
+                /// The first universal texture of a face wins, the set file is first in contents
+                for ( const std::string& object : AssetCatalog::innerObjects( source.contents.front().second ) )
+                {
+                    if ( AssetCatalog::stringValue( object, "origin" ) == "bottom-left" )
+                        set.flags |= Entry::FlagBottomLeftOrigin;
+                    if ( AssetCatalog::stringValue( object, "interpretation" ) == "data" )
+                        set.flags |= Entry::FlagData;
+
+                    const std::string filename = AssetCatalog::stringValue( object, "filename" );
+                    const std::string idiom    = AssetCatalog::stringValue( object, "idiom" );
+                    if ( filename.empty() || ( !idiom.empty() && idiom != "universal" ) )
+                        continue;
+
+                    const int face = source.cube ? cubeSlice( AssetCatalog::stringValue( object, "cube-face" ) ) : 0;
+                    if ( face < 0 )
+                    {
+                        set.error = "unknown cube face in " + source.folder;
+                        return;
+                    }
+                    std::vector<std::string>& levels = set.faces[face];
+                    if ( !levels.empty() )
+                        continue;
+                    if ( set.pixelFormat.empty() )
+                        set.pixelFormat = AssetCatalog::stringValue( object, "pixel-format" );
+
+                    const std::string entry = source.folder + "/" + filename;
+                    if ( fs::path( filename ).extension() != ".mipmapset" )
+                    {
+                        levels.push_back( entry );
+                        continue;
+                    }
+
+                    const std::string* pContents = findContents( source.contents, entry + "/Contents.json" );
+                    if ( !pContents )
+                    {
+                        set.error = "no Contents.json in " + entry;
+                        return;
+                    }
+                    for ( const std::string& level : AssetCatalog::innerObjects( *pContents ) )
+                    {
+                        const std::string file = AssetCatalog::stringValue( level, "filename" );
+                        const int index = mipLevel( AssetCatalog::stringValue( level, "mipmap-level" ) );
+                        if ( file.empty() || index < 0 )
+                            continue;
+                        if ( levels.size() <= size_t( index ) )
+                            levels.resize( index + 1 );
+                        levels[index] = entry + "/" + file;
+                    }
+                    if ( levels.empty() || levels[0].empty() )
+                    {
+                        set.error = "no base level in " + entry;
+                        return;
+                    }
+                }
+
+                size_t levelCount = 0;
+                for ( const std::vector<std::string>& levels : set.faces )
+                {
+                    if ( levels.empty() )
+                    {
+                        set.error = ( source.cube ? "missing cube face in " : "no texture in " ) + source.folder;
+                        return;
+                    }
+                    levelCount = std::max( levelCount, levels.size() );
+                }
+                if ( levelCount > 255 )
+                {
+                    set.error = "too many levels in " + source.folder;
+                    return;
+                }
+
+                std::error_code code;
+                for ( std::vector<std::string>& levels : set.faces )
+                {
+                    levels.resize( levelCount );
+                    for ( const std::string& path : levels )
+                    {
+                        if ( !path.empty() && !fs::exists( catalog / path, code ) )
+                            ++set.missingImageCount;
+                    }
+                }
+            }));
+        }
+        for ( std::future<void>& job : jobs )
+            job.wait();
+    }
+
+    std::sort( sets.begin(), sets.end(), []( const ParsedSet& a, const ParsedSet& b ) { return a.name < b.name; } );
+    for ( size_t i = 0; i < sets.size(); ++i )
+    {
+        if ( !sets[i].error.empty() )
+        {
+            error = sets[i].error;
+            return false;
+        }
+        if ( i > 0 && sets[i].name == sets[i - 1].name )
+        {
+            error = "two sets named " + sets[i].name;
+            return false;
+        }
+    }
+
+    /// Pixel formats repeat across sets and are stored once
+    reset();
+    std::unordered_map<std::string, uint32_t> formats;
+    auto addString = [this]( const std::string& text )
+    {
+        if ( text.empty() )
+            return uint32_t( 0 );
+        const uint32_t offset = uint32_t( _strings.size() );
+        _strings.insert( _strings.end(), text.c_str(), text.c_str() + text.size() + 1 );
+        return offset;
+    };
+
+    for ( const ParsedSet& set : sets )
+    {
+        auto format = formats.find( set.pixelFormat );
+        if ( format == formats.end() )
+            format = formats.emplace( set.pixelFormat, addString( set.pixelFormat ) ).first;
+
+        Entry entry = {};
+        entry.name        = addString( set.name );
+        entry.pixelFormat = format->second;
+        entry.firstImage  = uint32_t( _images.size() );
+        entry.type        = set.type;
+        entry.faceCount   = uint8_t( set.faces.size() );
+        entry.levelCount  = uint8_t( set.faces.front().size() );
+        entry.flags       = set.flags;
+        for ( const std::vector<std::string>& levels : set.faces )
+        {
+            for ( const std::string& path : levels )
+                _images.push_back( addString( path ) );
+        }
+        _entries.push_back( entry );
+        _statistics.missingImageCount += set.missingImageCount;
+    }
+
+    _hash = hash;
+    _statistics.setCount   = uint32_t( _entries.size() );
+    _statistics.imageCount = uint32_t( _images.size() );
+    return true;
+}
+
+bool CatalogIndex::build( const fs::path& catalog, std::string& error, uint32_t threadCount )
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<SetSource> sources;
+    uint64_t hash = 0;
+    DecoderPool pool( threadCount );
+    _catalog = catalog;
+    if ( !scan( catalog, sources, hash, error, pool ) || !assemble( sources, hash, error, pool ) )
+        return false;
+
+    _statistics.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    return true;
+}
+
+bool CatalogIndex::open( const fs::path& catalog, const fs::path& indexPath, std::string& error, uint32_t threadCount )
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<SetSource> sources;
+    uint64_t hash = 0;
+    DecoderPool pool( threadCount );
+    if ( !scan( catalog, sources, hash, error, pool ) )
+        return false;
+
+    /// A stale or broken index file is simply built again
+    std::string loadError;
+    std::error_code code;
+    if ( !indexPath.empty() && fs::exists( indexPath, code ) && load( catalog, indexPath, loadError ) && _hash == hash )
+    {
+        _statistics.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        return true;
+    }
+
+    _catalog = catalog;
+    if ( !assemble( sources, hash, error, pool ) )
+        return false;
+    if ( !indexPath.empty() && !save( indexPath, error ) )
+        return false;
+
+    _statistics.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    return true;
+}
+
+bool CatalogIndex::save( const fs::path& indexPath, std::string& error ) const
+{
+    Header header = {};
+    std::memcpy( header.magic, kMagic, sizeof( kMagic ) );
+    header.version     = kVersion;
+    header.entryCount  = uint32_t( _entries.size() );
+    header.imageCount  = uint32_t( _images.size() );
+    header.stringBytes = uint32_t( _strings.size() );
+    header.hash        = _hash;
+
+    std::ofstream file( indexPath, std::ios::binary | std::ios::trunc );
+    file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+    file.write( reinterpret_cast<const char*>( _entries.data() ), std::streamsize( _entries.size() * sizeof( Entry ) ) );
+    file.write( reinterpret_cast<const char*>( _images.data() ), std::streamsize( _images.size() * sizeof( uint32_t ) ) );
+    file.write( _strings.data(), std::streamsize( _strings.size() ) );
+    if ( !file )
+    {
+        error = "can not write " + indexPath.string();
+        return false;
+    }
+    return true;
+}
+
+bool CatalogIndex::load( const fs::path& catalog, const fs::path& indexPath, std::string& error )
+{
+    const auto start = std::chrono::steady_clock::now();
+    std::ifstream file( indexPath, std::ios::binary | std::ios::ate );
+    if ( !file )
+    {
+        error = "can not open " + indexPath.string();
+        return false;
+    }
+    const uint64_t fileSize = uint64_t( file.tellg() );
+    file.seekg( 0 );
+
+    Header header = {};
+    if ( fileSize < sizeof( header ) || !file.read( reinterpret_cast<char*>( &header ), sizeof( header ) )
+        || std::memcmp( header.magic, kMagic, sizeof( kMagic ) ) != 0 || header.version != kVersion )
+    {
+        error = indexPath.string() + " is not a catalog index of this version";
+        return false;
+    }
+    if ( fileSize != sizeof( header ) + uint64_t( header.entryCount ) * sizeof( Entry )
+                   + uint64_t( header.imageCount ) * sizeof( uint32_t ) + header.stringBytes || header.stringBytes == 0 )
+    {
+        error = indexPath.string() + " is truncated";
+        return false;
+    }
+
+    std::vector<Entry>    entries( header.entryCount );
+    std::vector<uint32_t> images( header.imageCount );
+    std::vector<char>     strings( header.stringBytes );
+    file.read( reinterpret_cast<char*>( entries.data() ), std::streamsize( entries.size() * sizeof( Entry ) ) );
+    file.read( reinterpret_cast<char*>( images.data() ), std::streamsize( images.size() * sizeof( uint32_t ) ) );
+    file.read( strings.data(), std::streamsize( strings.size() ) );
+    if ( !file )
+    {
+        error = "can not read " + indexPath.string();
+        return false;
+    }
+
+    /// Offsets stay within the file and names are sorted, so find and the accessors can trust them
+    bool valid = strings.front() == '\0' && strings.back() == '\0';
+    for ( uint32_t image : images )
+        valid = valid && image < strings.size();
+    for ( size_t i = 0; valid && i < entries.size(); ++i )
+    {
+        const Entry& entry = entries[i];
+        valid = entry.name < strings.size() && entry.pixelFormat < strings.size()
+             && entry.type <= Entry::TypeCubeTexture && entry.faceCount == ( entry.type == Entry::TypeCubeTexture ? 6 : 1 )
+             && entry.levelCount > 0
+             && uint64_t( entry.firstImage ) + uint64_t( entry.faceCount ) * entry.levelCount <= images.size()
+             && ( i == 0 || std::strcmp( strings.data() + entries[i - 1].name, strings.data() + entry.name ) < 0 );
+    }
+    if ( !valid )
+    {
+        error = indexPath.string() + " is corrupt";
+        return false;
+    }
+
+    reset();
+    _catalog = catalog;
+    _entries = std::move( entries );
+    _images  = std::move( images );
+    _strings = std::move( strings );
+    _hash    = header.hash;
+    _statistics.setCount   = uint32_t( _entries.size() );
+    _statistics.imageCount = uint32_t( _images.size() );
+    _statistics.cached     = true;
+    _statistics.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    return true;
+}
+
+const CatalogIndex::Entry* CatalogIndex::find( std::string_view name ) const
+{
+    const auto found = std::lower_bound( _entries.begin(), _entries.end(), name, [this]( const Entry& entry, std::string_view key )
+    {
+        return std::string_view( this->name( entry ) ) < key;
+    });
+    return found != _entries.end() && std::string_view( this->name( *found ) ) == name ? &*found : nullptr;
+}
+
+const char* CatalogIndex::relativePath( const Entry& entry, uint32_t face, uint32_t level ) const
+{
+    if ( face >= entry.faceCount || level >= entry.levelCount )
+        return _strings.data();
+    return _strings.data() + _images[entry.firstImage + face * entry.levelCount + level];
+}
+
+fs::path CatalogIndex::imagePath( const Entry& entry, uint32_t face, uint32_t level ) const
+{
+    const char* pPath = relativePath( entry, face, level );
+    return *pPath ? _catalog / pPath : fs::path();
+}
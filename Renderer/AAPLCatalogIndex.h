@@ -0,0 +1,120 @@
+///
+///  AAPLCatalogIndex.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 30.04.24.
+///
+/// Abstract:
+/// Index of the texture sets of an .xcassets folder, so names like "BaseColorMap" or
+/// "GardenMap" resolve to their image files without MTKTextureLoader and the app bundle.
+/// Texture sets, cube texture sets and their mipmapsets are read from their Contents.json
+/// files, one job per set on a decoder pool, into entries sorted by name that find searches
+/// by bisection. Every entry knows its type, catalog pixel format, origin, interpretation
+/// and the file of each face and mip level. The index is written to a small binary file together with a hash
+/// of every Contents.json it came from. open reuses that file as long as the hash matches and
+/// rebuilds it otherwise, load takes it as it is for callers whose catalog does not change.
+/// Plain C++, it runs wherever the tools do.
+
+#pragma once
+#ifndef AAPLCatalogIndex_h
+#define AAPLCatalogIndex_h
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class DecoderPool;
+
+class CatalogIndex
+{
+public:
+    /// One texture set, 16 bytes as stored in the index file.
+    struct Entry
+    {
+        enum Type : uint8_t
+        {
+            TypeTexture     = 0,
+            TypeCubeTexture = 1,
+        };
+
+        enum Flags : uint8_t
+        {
+            FlagBottomLeftOrigin = 1,       /// 2D images are stored bottom row first
+            FlagData             = 2,       /// interpretation "data", the images are not sRGB
+        };
+
+        uint32_t name;              /// offset into the strings
+        uint32_t pixelFormat;       /// offset into the strings, empty when the images decide
+        uint32_t firstImage;        /// face major, level minor
+        uint8_t  type;
+        uint8_t  faceCount;         /// 6 for cubes in Metal slice order +X -X +Y -Y +Z -Z
+        uint8_t  levelCount;
+        uint8_t  flags;
+    };
+
+    struct Statistics
+    {
+        uint32_t setCount;
+        uint32_t imageCount;
+        uint32_t missingImageCount;     /// listed in a Contents.json but not on disk, after a build
+        bool     cached;                /// the last open or load came from the index file
+        double   milliseconds;
+    };
+
+    /// Index file of the catalog if its hash is still the one of the catalog, else builds the
+    /// index and writes the file. An empty indexPath always builds and writes nothing.
+    bool open( const std::filesystem::path& catalog, const std::filesystem::path& indexPath,
+               std::string& error, uint32_t threadCount = 0 );
+
+    /// Reads every set of the catalog, threadCount workers, 0 takes one per hardware thread.
+    bool build( const std::filesystem::path& catalog, std::string& error, uint32_t threadCount = 0 );
+
+    bool save( const std::filesystem::path& indexPath, std::string& error ) const;
+
+    /// Takes the index file without looking at the catalog, paths resolve against catalog.
+    bool load( const std::filesystem::path& catalog, const std::filesystem::path& indexPath, std::string& error );
+
+    /// Entry of the set with that name, nullptr if the catalog has none.
+    const Entry* find( std::string_view name ) const;
+
+    const char* name( const Entry& entry ) const { return _strings.data() + entry.name; }
+    const char* pixelFormat( const Entry& entry ) const { return _strings.data() + entry.pixelFormat; }
+
+    /// Path of the image of a face and level relative to the catalog, empty when the set skips the level.
+    const char* relativePath( const Entry& entry, uint32_t face, uint32_t level ) const;
+
+    /// The same joined to the catalog folder.
+    std::filesystem::path imagePath( const Entry& entry, uint32_t face, uint32_t level ) const;
+
+    const std::vector<Entry>& entries() const { return _entries; }
+    const std::filesystem::path& catalog() const { return _catalog; }
+    uint64_t hash() const { return _hash; }
+    const Statistics& statistics() const { return _statistics; }
+
+private:
+    /// Contents.json files of one set, relative path and text, the set file first.
+    struct SetSource
+    {
+        std::string name;
+        std::string folder;         /// relative to the catalog
+        bool        cube;
+        std::vector< std::pair<std::string, std::string> > contents;
+        std::string error;
+    };
+
+    bool scan( const std::filesystem::path& catalog, std::vector<SetSource>& sources, uint64_t& hash,
+               std::string& error, DecoderPool& pool );
+    bool assemble( const std::vector<SetSource>& sources, uint64_t hash, std::string& error, DecoderPool& pool );
+    void reset();
+
+    std::filesystem::path _catalog;
+    std::vector<Entry>    _entries;
+    std::vector<uint32_t> _images;          /// offsets into the strings
+    std::vector<char>     _strings = std::vector<char>( 1, '\0' );   /// zero terminated, offset 0 is the empty string
+    uint64_t   _hash = 0;
+    Statistics _statistics = { 0, 0, 0, false, 0.0 };
+};
+
+#endif /* AAPLCatalogIndex_h */
@@ -0,0 +1,69 @@
+///
+///  AAPLCatalogJSON.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+
+#include "AAPLCatalogJSON.h"
+
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+namespace AssetCatalog
+{
+    bool readText( const fs::path& path, std::string& text )
+    {
+        std::ifstream file( path );
+        if ( !file )
+            return false;
+        std::stringstream stream;
+        stream << file.rdbuf();
+        text = stream.str();
+        return true;
+    }
+
+    bool writeText( const fs::path& path, const std::string& text, std::string& error )
+    {
+        std::ofstream file( path );
+        file << text;
+        if ( !file )
+        {
+            error = "can not write " + path.string();
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<std::string> innerObjects( const std::string& json )
+    {
+        std::vector<std::string> objects;
+        size_t open = std::string::npos;
+        for ( size_t i = 0; i < json.size(); ++i )
+        {
+            if ( json[i] == '{' )
+                open = i;
+            else if ( json[i] == '}' && open != std::string::npos )
+            {
+                objects.push_back( json.substr( open, i - open + 1 ) );
+                open = std::string::npos;
+            }
+        }
+        return objects;
+    }
+
+    std::string stringValue( const std::string& object, const std::string& key )
+    {
+        const size_t keyPosition = object.find( "\"" + key + "\"" );
+        if ( keyPosition == std::string::npos )
+            return {};
+        const size_t colon = object.find( ':', keyPosition + key.size() + 2 );
+        const size_t first = object.find( '"', colon );
+        const size_t last  = first == std::string::npos ? first : object.find( '"', first + 1 );
+        if ( colon == std::string::npos || last == std::string::npos )
+            return {};
+        return object.substr( first + 1, last - first - 1 );
+    }
+}
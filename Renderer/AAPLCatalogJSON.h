@@ -0,0 +1,33 @@
+///
+///  AAPLCatalogJSON.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Text level access to the Contents.json files of an .xcassets folder. The files Xcode
+/// writes nest their objects only one level deep inside arrays, so the innermost objects and
+/// their string values are all the reading side needs. Plain C++ without the image types,
+/// for code that only looks at the catalog and never touches its pixels.
+
+#pragma once
+#ifndef AAPLCatalogJSON_h
+#define AAPLCatalogJSON_h
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace AssetCatalog
+{
+    bool readText( const std::filesystem::path& path, std::string& text );
+    bool writeText( const std::filesystem::path& path, const std::string& text, std::string& error );
+
+    /// The innermost { } objects of a Contents.json.
+    std::vector<std::string> innerObjects( const std::string& json );
+
+    /// String value of "key" : "value" in a flat object, empty if missing.
+    std::string stringValue( const std::string& object, const std::string& key );
+}
+
+#endif /* AAPLCatalogJSON_h */
@@ -0,0 +1,100 @@
+///
+///  AAPLChannelPacker.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 26.04.24.
+///
+
+#include "AAPLChannelPacker.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    /// Rows per job of parallel work.
+    const size_t kRowGrain = 16;
+
+    float component( const simd::float4& texel, ChannelPacker::Channel channel )
+    {
+        return texel[channel];
+    }
+
+    /// Texel centers line up at every size, the edges clamp
+    float sampleBilinear( const Image& image, ChannelPacker::Channel channel, float u, float v )
+    {
+        const float x = std::clamp( u * float( image.width ) - 0.5f, 0.f, float( image.width - 1 ) );
+        const float y = std::clamp( v * float( image.height ) - 0.5f, 0.f, float( image.height - 1 ) );
+        const uint32_t x0 = uint32_t( x ), y0 = uint32_t( y );
+        const uint32_t x1 = std::min( x0 + 1, image.width - 1 ), y1 = std::min( y0 + 1, image.height - 1 );
+        const float fx = x - float( x0 ), fy = y - float( y0 );
+
+        const float top    = component( image.at( x0, y0 ), channel ) * ( 1.f - fx ) + component( image.at( x1, y0 ), channel ) * fx;
+        const float bottom = component( image.at( x0, y1 ), channel ) * ( 1.f - fx ) + component( image.at( x1, y1 ), channel ) * fx;
+        return top * ( 1.f - fy ) + bottom * fy;
+    }
+}
+
+namespace ChannelPacker
+{
+    bool pack( const Source ( &sources )[ChannelCount], Image& packed, std::string& error )
+    {
+        uint32_t width = 0, height = 0;
+        for ( const Source& source : sources )
+        {
+            if ( source.pImage && size_t( source.pImage->width ) * source.pImage->height > size_t( width ) * height )
+            {
+                width  = source.pImage->width;
+                height = source.pImage->height;
+            }
+        }
+        if ( width == 0 || height == 0 )
+        {
+            error = "no source image to pack";
+            return false;
+        }
+        for ( const Source& source : sources )
+        {
+            if ( source.pImage && uint64_t( source.pImage->width ) * height != uint64_t( source.pImage->height ) * width )
+            {
+                error = "packed images differ in aspect ratio";
+                return false;
+            }
+        }
+
+        packed = Image( width, height );
+        parallelFor( height, kRowGrain, [&]( size_t begin, size_t end )
+        {
+            for ( size_t y = begin; y < end; ++y )
+            {
+                const float v = ( float( y ) + 0.5f ) / float( height );
+                for ( uint32_t x = 0; x < width; ++x )
+                {
+                    const float u = ( float( x ) + 0.5f ) / float( width );
+                    simd::float4& texel = packed.at( x, uint32_t( y ) );
+                    for ( uint32_t channel = 0; channel < ChannelCount; ++channel )
+                    {
+                        const Source& source = sources[channel];
+                        float value = source.constant;
+                        if ( source.pImage )
+                        {
+                            const Image& image = *source.pImage;
+                            value = image.width == width ? component( image.at( x, uint32_t( y ) ), source.channel )
+                                                         : sampleBilinear( image, source.channel, u, v );
+                            value = source.low + value * ( source.high - source.low );
+                        }
+                        texel[channel] = std::clamp( value, 0.f, 1.f );
+                    }
+                }
+            }
+        });
+        return true;
+    }
+
+    const char* channelName( Channel channel )
+    {
+        static const char* kNames[ChannelCount] = { "r", "g", "b", "a" };
+        return kNames[channel];
+    }
+}
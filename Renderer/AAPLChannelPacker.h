@@ -0,0 +1,52 @@
+///
+///  AAPLChannelPacker.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 26.04.24.
+///
+/// Abstract:
+/// Packs single channel maps into the channels of one texture for the asset pipeline, so a
+/// shader fetches occlusion, roughness and metallic with one sample instead of three. Each
+/// output channel takes one channel of a source image, or a constant, and remaps it to a
+/// range. Sources of different sizes are resampled bilinearly to the size of the largest.
+
+#pragma once
+#ifndef AAPLChannelPacker_h
+#define AAPLChannelPacker_h
+
+#include <simd/simd.h>
+
+#include <cstdint>
+#include <string>
+
+#include "AAPLImage.h"
+
+namespace ChannelPacker
+{
+    enum Channel : uint32_t
+    {
+        ChannelRed,
+        ChannelGreen,
+        ChannelBlue,
+        ChannelAlpha,
+        ChannelCount
+    };
+
+    struct Source
+    {
+        const Image* pImage  = nullptr;     /// without an image the channel is filled with constant as it is
+        Channel  channel     = ChannelRed;  /// channel of the image that is read
+        float    constant    = 0.f;
+        float    low         = 0.f;         /// value v is stored as low + v * ( high - low ),
+        float    high        = 1.f;         /// high below low inverts, glossiness becomes roughness
+    };
+
+    /// Packs the four sources into RGBA, every value clamped to [0, 1]. Returns false and fills
+    /// error without a source image or when the images differ in aspect ratio.
+    bool pack( const Source ( &sources )[ChannelCount], Image& packed, std::string& error );
+
+    /// "r", "g", "b" or "a".
+    const char* channelName( Channel channel );
+}
+
+#endif /* AAPLChannelPacker_h */
@@ -0,0 +1,135 @@
+///
+///  AAPLCompressedTexture.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.04.24.
+///
+
+#include "AAPLCompressedTexture.h"
+
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+    const uint8_t kIdentifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+    const uint32_t kEndianness = 0x04030201;
+
+    /// OpenGL names of the formats
+    const uint32_t kGLRGBA = 0x1908;
+    const uint32_t kGLCompressedRGBABPTC = 0x8E8C;
+    const uint32_t kGLCompressedSRGBAlphaBPTC = 0x8E8D;
+
+    /// Header fields after the identifier, in file order
+    struct Header
+    {
+        uint32_t endianness;
+        uint32_t glType;
+        uint32_t glTypeSize;
+        uint32_t glFormat;
+        uint32_t glInternalFormat;
+        uint32_t glBaseInternalFormat;
+        uint32_t pixelWidth;
+        uint32_t pixelHeight;
+        uint32_t pixelDepth;
+        uint32_t numberOfArrayElements;
+        uint32_t numberOfFaces;
+        uint32_t numberOfMipmapLevels;
+        uint32_t bytesOfKeyValueData;
+    };
+
+    size_t levelSize( const CompressedTexture& texture, uint32_t level )
+    {
+        return texture.bytesPerRow( level ) * ( ( texture.levelHeight( level ) + 3 ) / 4 );
+    }
+}
+
+bool saveKTX( const std::string& path, const CompressedTexture& texture, std::string& error )
+{
+    for ( uint32_t level = 0; level < texture.levels.size(); ++level )
+    {
+        if ( texture.levels[level].size() != levelSize( texture, level ) )
+        {
+            error = "level " + std::to_string( level ) + " of " + path + " has the wrong size";
+            return false;
+        }
+    }
+
+    FILE* pFile = std::fopen( path.c_str(), "wb" );
+    if ( !pFile )
+    {
+        error = "can not write " + path;
+        return false;
+    }
+
+    const Header header =
+    {
+        kEndianness, 0, 1, 0,
+        texture.format == CompressedTexture::FormatBC7_sRGB ? kGLCompressedSRGBAlphaBPTC : kGLCompressedRGBABPTC,
+        kGLRGBA, texture.width, texture.height, 0, 0, 1, uint32_t( texture.levels.size() ), 0
+    };
+    bool written = std::fwrite( kIdentifier, sizeof( kIdentifier ), 1, pFile ) == 1
+                && std::fwrite( &header, sizeof( header ), 1, pFile ) == 1;
+
+    /// Blocks are 16 bytes, every level already ends on the 4 byte alignment KTX asks for
+    for ( const std::vector<uint8_t>& level : texture.levels )
+    {
+        const uint32_t imageSize = uint32_t( level.size() );
+        written = written && std::fwrite( &imageSize, sizeof( imageSize ), 1, pFile ) == 1
+                          && std::fwrite( level.data(), 1, level.size(), pFile ) == level.size();
+    }
+    written = std::fclose( pFile ) == 0 && written;
+    if ( !written )
+        error = "can not write " + path;
+    return written;
+}
+
+bool loadKTX( const std::string& path, CompressedTexture& texture, std::string& error )
+{
+    FILE* pFile = std::fopen( path.c_str(), "rb" );
+    if ( !pFile )
+    {
+        error = "can not open " + path;
+        return false;
+    }
+
+    uint8_t identifier[12];
+    Header header;
+    if ( std::fread( identifier, sizeof( identifier ), 1, pFile ) != 1 || std::memcmp( identifier, kIdentifier, sizeof( identifier ) ) != 0
+      || std::fread( &header, sizeof( header ), 1, pFile ) != 1 || header.endianness != kEndianness )
+    {
+        std::fclose( pFile );
+        error = path + " is not a KTX file";
+        return false;
+    }
+
+    if ( ( header.glInternalFormat != kGLCompressedRGBABPTC && header.glInternalFormat != kGLCompressedSRGBAlphaBPTC )
+      || header.pixelWidth == 0 || header.pixelHeight == 0 || header.pixelDepth > 1 || header.numberOfArrayElements > 1
+      || header.numberOfFaces != 1 || header.numberOfMipmapLevels == 0 || header.numberOfMipmapLevels > 16 )
+    {
+        std::fclose( pFile );
+        error = path + " is not a BC7 2D texture";
+        return false;
+    }
+
+    texture.format = header.glInternalFormat == kGLCompressedSRGBAlphaBPTC ? CompressedTexture::FormatBC7_sRGB : CompressedTexture::FormatBC7;
+    texture.width  = header.pixelWidth;
+    texture.height = header.pixelHeight;
+    texture.levels.assign( header.numberOfMipmapLevels, {} );
+
+    bool valid = std::fseek( pFile, long( header.bytesOfKeyValueData ), SEEK_CUR ) == 0;
+    for ( uint32_t level = 0; valid && level < header.numberOfMipmapLevels; ++level )
+    {
+        uint32_t imageSize = 0;
+        valid = std::fread( &imageSize, sizeof( imageSize ), 1, pFile ) == 1 && imageSize == levelSize( texture, level );
+        if ( valid )
+        {
+            texture.levels[level].resize( imageSize );
+            valid = std::fread( texture.levels[level].data(), 1, imageSize, pFile ) == imageSize;
+        }
+    }
+    std::fclose( pFile );
+    if ( !valid )
+        error = path + " is truncated or its levels have the wrong size";
+    return valid;
+}
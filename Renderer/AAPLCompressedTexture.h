@@ -0,0 +1,47 @@
+///
+///  AAPLCompressedTexture.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.04.24.
+///
+/// Abstract:
+/// Block compressed 2D texture with its mip chain, and its KTX 1 file. The levels are kept in
+/// the layout Metal takes them, rows of blocks top down, so a loader hands them to the texture
+/// without touching a byte. The files open in the usual KTX viewers as well.
+
+#pragma once
+#ifndef AAPLCompressedTexture_h
+#define AAPLCompressedTexture_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct CompressedTexture
+{
+    enum Format : uint32_t
+    {
+        FormatBC7,
+        FormatBC7_sRGB
+    };
+
+    Format   format = FormatBC7;
+    uint32_t width  = 0;
+    uint32_t height = 0;
+    std::vector< std::vector<uint8_t> > levels;
+
+    uint32_t levelWidth( uint32_t level ) const  { return width > ( 1u << level ) ? width >> level : 1u; }
+    uint32_t levelHeight( uint32_t level ) const { return height > ( 1u << level ) ? height >> level : 1u; }
+
+    /// Bytes of one row of 4x4 blocks of a level.
+    size_t bytesPerRow( uint32_t level ) const { return size_t( ( levelWidth( level ) + 3 ) / 4 ) * 16; }
+};
+
+/// Writes the texture as KTX 1 with the BPTC internal formats of OpenGL.
+bool saveKTX( const std::string& path, const CompressedTexture& texture, std::string& error );
+
+/// Reads a KTX 1 file with a single BC7 2D texture and checks the size of every level.
+bool loadKTX( const std::string& path, CompressedTexture& texture, std::string& error );
+
+#endif /* AAPLCompressedTexture_h */
@@ -0,0 +1,116 @@
+///
+///  AAPLDecoderPool.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 23.04.24.
+///
+
+#include "AAPLDecoderPool.h"
+
+#include <algorithm>
+#include <chrono>
+
+DecoderPool::DecoderPool( uint32_t threadCount )
+{
+    if ( threadCount == 0 )
+        threadCount = std::max( 1u, std::thread::hardware_concurrency() );
+
+    _workers.reserve( threadCount );
+    for ( uint32_t i = 0; i < threadCount; ++i )
+        _workers.emplace_back( [this]() { run(); } );
+}
+
+DecoderPool::~DecoderPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _stopping = true;
+    }
+    _wake.notify_all();
+    for ( std::thread& worker : _workers )
+        worker.join();
+}
+
+void DecoderPool::run()
+{
+    for ( ;; )
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock( _mutex );
+            _wake.wait( lock, [this]() { return _stopping || !_jobs.empty(); } );
+            if ( _jobs.empty() )
+                return;
+            job = std::move( _jobs.front() );
+            _jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void DecoderPool::push( std::vector< std::function<void()> >& jobs )
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        for ( std::function<void()>& job : jobs )
+            _jobs.push_back( std::move( job ) );
+    }
+    if ( jobs.size() == 1 )
+        _wake.notify_one();
+    else
+        _wake.notify_all();
+}
+
+DecodedImage DecoderPool::decodeFile( const std::string& path )
+{
+    const auto start = std::chrono::steady_clock::now();
+    DecodedImage decoded;
+    decoded.path = path;
+    if ( !loadPNG( path, decoded.image, decoded.error ) && decoded.error.empty() )
+        decoded.error = "can not decode " + path;
+    decoded.microseconds = std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+    return decoded;
+}
+
+std::future<DecodedImage> DecoderPool::decode( const std::string& path )
+{
+    return enqueue( [path]() { return decodeFile( path ); } );
+}
+
+std::vector< std::future<DecodedImage> > DecoderPool::decode( const std::vector<std::string>& paths )
+{
+    std::vector< std::future<DecodedImage> > futures;
+    std::vector< std::function<void()> > jobs;
+    futures.reserve( paths.size() );
+    jobs.reserve( paths.size() );
+    for ( const std::string& path : paths )
+    {
+        auto pTask = std::make_shared< std::packaged_task< DecodedImage() > >( [path]() { return decodeFile( path ); } );
+        futures.push_back( pTask->get_future() );
+        jobs.push_back( [pTask]() { ( *pTask )(); } );
+    }
+    push( jobs );
+    return futures;
+}
+
+DecoderPool::Timings DecoderPool::benchmark( const std::vector<std::string>& paths, uint32_t threadCount )
+{
+    using Clock = std::chrono::steady_clock;
+    Timings timings = { paths.size(), 0, 0.0, 0.0, 0 };
+
+    auto start = Clock::now();
+    for ( const std::string& path : paths )
+        timings.byteCount += decodeFile( path ).image.pixels.size();
+    timings.serialMilliseconds = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+
+    /// Thread start up counts, it is part of what a loader pays at launch
+    start = Clock::now();
+    {
+        DecoderPool pool( threadCount );
+        timings.threadCount = pool.threadCount();
+        for ( std::future<DecodedImage>& future : pool.decode( paths ) )
+            future.wait();
+    }
+    timings.pooledMilliseconds = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    return timings;
+}
@@ -0,0 +1,106 @@
+///
+///  AAPLDecoderPool.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 23.04.24.
+///
+/// Abstract:
+/// Fixed set of worker threads that decode image files off the calling thread. Jobs are
+/// taken in the order they were queued, a batch is queued under one lock and wakes all
+/// workers at once. Every job hands back a future, so a caller can issue all of its loads
+/// up front and wait once. Plain C++ on top of the PNG reader, it runs wherever the tools do.
+
+#pragma once
+#ifndef AAPLDecoderPool_h
+#define AAPLDecoderPool_h
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "AAPLPNG.h"
+
+/// Result of decoding one file, error is set when the file could not be read.
+struct DecodedImage
+{
+    std::string path;
+    Image8      image;
+    std::string error;
+    double      microseconds = 0.0;
+
+    bool valid() const { return error.empty(); }
+};
+
+class DecoderPool
+{
+public:
+    /// Serial and pooled decode time of the same files.
+    struct Timings
+    {
+        size_t fileCount;
+        size_t byteCount;               /// decoded RGBA bytes of all files
+        double serialMilliseconds;
+        double pooledMilliseconds;
+        uint32_t threadCount;
+    };
+
+    /// Starts threadCount workers, 0 takes one per hardware thread.
+    explicit DecoderPool( uint32_t threadCount = 0 );
+
+    /// Finishes the queued jobs and joins the workers.
+    ~DecoderPool();
+
+    DecoderPool( const DecoderPool& ) = delete;
+    DecoderPool& operator=( const DecoderPool& ) = delete;
+
+    /// Queues the decode of one PNG file.
+    std::future<DecodedImage> decode( const std::string& path );
+
+    /// Queues the decodes of all files at once, the futures are in the order of the paths.
+    std::vector< std::future<DecodedImage> > decode( const std::vector<std::string>& paths );
+
+    /// Queues any job, for work that has to follow the decode on the same worker.
+    template< typename Job >
+    std::future< std::invoke_result_t<Job> > enqueue( Job job );
+
+    uint32_t threadCount() const { return uint32_t( _workers.size() ); }
+
+    /// Decodes a file on the calling thread.
+    static DecodedImage decodeFile( const std::string& path );
+
+    /// Decodes the files one after the other on the calling thread, then again through a pool.
+    static Timings benchmark( const std::vector<std::string>& paths, uint32_t threadCount = 0 );
+
+private:
+    void run();
+    void push( std::vector< std::function<void()> >& jobs );
+
+    std::vector<std::thread>            _workers;
+    std::deque< std::function<void()> > _jobs;
+    std::mutex                          _mutex;
+    std::condition_variable             _wake;
+    bool                                _stopping = false;
+};
+
+template< typename Job >
+std::future< std::invoke_result_t<Job> > DecoderPool::enqueue( Job job )
+{
+    using Result = std::invoke_result_t<Job>;
+
+    /// std::function needs a copyable target, the task is shared with the queued wrapper
+    auto pTask = std::make_shared< std::packaged_task< Result() > >( std::move( job ) );
+    std::future<Result> future = pTask->get_future();
+    std::vector< std::function<void()> > jobs( 1, [pTask]() { ( *pTask )(); } );
+    push( jobs );
+    return future;
+}
+
+#endif /* AAPLDecoderPool_h */
@@ -10,13 +10,6 @@ using namespace metal;
 #include "AAPLShaderTypes.h"
 #include "AAPLShaderCommon.h"
 
-struct QuadInOut
-{
-    float4 position [[position]];
-    float3 eye_position;
-};
-
-
 vertex QuadInOut lighting_vertex(constant SimpleVertex * vertices  [[ buffer(BufferIndexQuadVertexData) ]],
                                  constant FrameData    & frameData [[ buffer(BufferIndexFrameData) ]],
                                    uint                    vid     [[ vertex_id ]])
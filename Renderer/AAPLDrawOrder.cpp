@@ -0,0 +1,112 @@
+///
+///  AAPLDrawOrder.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 28.03.24.
+///
+
+#include "AAPLDrawOrder.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+uint64_t DrawOrder::makeKey( uint8_t pipeline, uint8_t material, uint8_t layer, float depth01, bool backToFront )
+{
+    const float clamped = std::min( std::max( depth01, 0.f ), 1.f );
+    uint32_t depth = uint32_t( double( clamped ) * double( UINT32_MAX ) );
+    if ( backToFront )
+        depth = UINT32_MAX - depth;
+
+    return ( uint64_t( pipeline ) << 48 )
+         | ( uint64_t( material ) << 40 )
+         | ( uint64_t( layer )    << 32 )
+         |   uint64_t( depth );
+}
+
+void DrawOrder::sort( std::vector<uint64_t>& keys, std::vector<uint32_t>& values )
+{
+    const size_t count = keys.size();
+    if ( count < 2 )
+        return;
+
+    _keyScratch.resize( count );
+    _valueScratch.resize( count );
+
+    const size_t chunkCount  = std::min( kMaxChunks, ( count + kMinChunkLength - 1 ) / kMinChunkLength );
+    const size_t chunkLength = ( count + chunkCount - 1 ) / chunkCount;
+    _histograms.resize( chunkCount * kRadixSize );
+
+    uint64_t* pSrcKeys   = keys.data();
+    uint32_t* pSrcValues = values.data();
+    uint64_t* pDstKeys   = _keyScratch.data();
+    uint32_t* pDstValues = _valueScratch.data();
+    bool resultInScratch = false;
+
+    for ( size_t shift = 0; shift < 64; shift += kRadixBits )
+    {
+        /// Digit histogram per chunk
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end )
+        {
+            for ( size_t chunk = begin; chunk < end; ++chunk )
+            {
+                size_t* pHistogram = &_histograms[ chunk * kRadixSize ];
+                std::fill( pHistogram, pHistogram + kRadixSize, 0 );
+
+                const size_t last = std::min( ( chunk + 1 ) * chunkLength, count );
+                for ( size_t i = chunk * chunkLength; i < last; ++i )
+                    ++pHistogram[ ( pSrcKeys[i] >> shift ) & ( kRadixSize - 1 ) ];
+            }
+        });
+
+        /// Most key bytes are shared by all keys (pipeline, material), those passes are skipped
+        bool singleDigit = false;
+        for ( size_t digit = 0; digit < kRadixSize && !singleDigit; ++digit )
+        {
+            size_t digitCount = 0;
+            for ( size_t chunk = 0; chunk < chunkCount; ++chunk )
+                digitCount += _histograms[ chunk * kRadixSize + digit ];
+            singleDigit = digitCount == count;
+        }
+        if ( singleDigit )
+            continue;
+
+        /// Exclusive prefix sum, digit major and chunk minor keeps the scatter stable
+        size_t offset = 0;
+        for ( size_t digit = 0; digit < kRadixSize; ++digit )
+        {
+            for ( size_t chunk = 0; chunk < chunkCount; ++chunk )
+            {
+                size_t& bucket = _histograms[ chunk * kRadixSize + digit ];
+                const size_t digitCount = bucket;
+                bucket = offset;
+                offset += digitCount;
+            }
+        }
+
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end )
+        {
+            for ( size_t chunk = begin; chunk < end; ++chunk )
+            {
+                size_t* pOffsets = &_histograms[ chunk * kRadixSize ];
+                const size_t last = std::min( ( chunk + 1 ) * chunkLength, count );
+                for ( size_t i = chunk * chunkLength; i < last; ++i )
+                {
+                    const size_t position = pOffsets[ ( pSrcKeys[i] >> shift ) & ( kRadixSize - 1 ) ]++;
+                    pDstKeys[position]   = pSrcKeys[i];
+                    pDstValues[position] = pSrcValues[i];
+                }
+            }
+        });
+
+        std::swap( pSrcKeys, pDstKeys );
+        std::swap( pSrcValues, pDstValues );
+        resultInScratch = !resultInScratch;
+    }
+
+    if ( resultInScratch )
+    {
+        keys.swap( _keyScratch );
+        values.swap( _valueScratch );
+    }
+}
@@ -0,0 +1,48 @@
+///
+///  AAPLDrawOrder.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 28.03.24.
+///
+/// Abstract:
+/// Draw ordering with 64 bit sort keys and a parallel LSD radix sort. Opaque passes sort
+/// front to back so early depth testing rejects hidden fragments, transparent passes can
+/// use the same keys with the depth inverted to sort back to front.
+///
+/// Key layout, most significant first:
+///
+///     63..56  pass / reserved
+///     55..48  pipeline
+///     47..40  material
+///     39..32  layer, the LOD level for instanced draws so buckets stay contiguous
+///     31..0   quantized view depth
+
+#pragma once
+#ifndef AAPLDrawOrder_h
+#define AAPLDrawOrder_h
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class DrawOrder
+{
+public:
+    /// depth01 is the view depth normalized to [0, 1] between near and far plane.
+    static uint64_t makeKey( uint8_t pipeline, uint8_t material, uint8_t layer, float depth01, bool backToFront = false );
+
+    /// Sorts keys ascending and applies the same permutation to values. Stable.
+    void sort( std::vector<uint64_t>& keys, std::vector<uint32_t>& values );
+
+private:
+    static constexpr size_t kRadixBits   = 8;
+    static constexpr size_t kRadixSize   = 1 << kRadixBits;
+    static constexpr size_t kMaxChunks   = 64;
+    static constexpr size_t kMinChunkLength = 8192;
+
+    std::vector<uint64_t> _keyScratch;
+    std::vector<uint32_t> _valueScratch;
+    std::vector<size_t>   _histograms;
+};
+
+#endif /* AAPLDrawOrder_h */
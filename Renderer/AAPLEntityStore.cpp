@@ -0,0 +1,270 @@
+///
+///  AAPLEntityStore.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.03.24.
+///
+
+#include "AAPLEntityStore.h"
+#include "AAPLParallel.h"
+#include "AAPLUtilities.h"
+
+namespace
+{
+    constexpr size_t kComponentSizes[ComponentTypeCount] =
+    {
+        sizeof( TransformComponent ),
+        sizeof( BoundsComponent ),
+        sizeof( RotationComponent ),
+        sizeof( AppearanceComponent ),
+        sizeof( RenderPassComponent ),
+    };
+
+    static_assert( std::is_trivially_copyable< TransformComponent >::value &&
+                   std::is_trivially_copyable< BoundsComponent >::value &&
+                   std::is_trivially_copyable< RotationComponent >::value &&
+                   std::is_trivially_copyable< AppearanceComponent >::value &&
+                   std::is_trivially_copyable< RenderPassComponent >::value,
+                   "components are moved with memcpy" );
+
+    /// Rows per parallel task
+    constexpr size_t kSystemGrain = 4096;
+}
+
+//----------------------------------------------------------------------------------------
+
+Archetype::Archetype( ComponentMask mask )
+: _mask(mask)
+{
+    for ( size_t type = 0; type < ComponentTypeCount; ++type )
+    {
+        if ( mask & ( ComponentMask( 1 ) << type ) )
+            _columns[type].elementSize = kComponentSizes[type];
+    }
+}
+
+uint32_t Archetype::appendRow( Entity entity )
+{
+    const uint32_t row = uint32_t( _entities.size() );
+    _entities.push_back( entity );
+
+    /// New rows start zeroed
+    for ( Column& column : _columns )
+    {
+        if ( column.elementSize )
+            column.data.resize( column.data.size() + column.elementSize, 0 );
+    }
+    return row;
+}
+
+Entity Archetype::removeRow( uint32_t row )
+{
+    const uint32_t last = uint32_t( _entities.size() - 1 );
+    for ( Column& column : _columns )
+    {
+        if ( !column.elementSize )
+            continue;
+
+        if ( row != last )
+            memcpy( column.data.data() + row * column.elementSize,
+                    column.data.data() + last * column.elementSize,
+                    column.elementSize );
+        column.data.resize( last * column.elementSize );
+    }
+
+    const Entity moved = _entities[last];
+    _entities[row] = moved;
+    _entities.pop_back();
+    return moved;
+}
+
+//----------------------------------------------------------------------------------------
+
+EntityStore::EntityStore()
+: _liveCount(0)
+{
+}
+
+uint32_t EntityStore::archetypeFor( ComponentMask mask )
+{
+    for ( uint32_t i = 0; i < _archetypes.size(); ++i )
+    {
+        if ( _archetypes[i]->mask() == mask )
+            return i;
+    }
+    _archetypes.emplace_back( new Archetype( mask ) );
+    return uint32_t( _archetypes.size() - 1 );
+}
+
+Entity EntityStore::allocateEntity()
+{
+    if ( !_freeIndices.empty() )
+    {
+        const uint32_t index = _freeIndices.back();
+        _freeIndices.pop_back();
+        return { index, _records[index].generation };
+    }
+
+    _records.push_back( { 0, 0, 0, false } );
+    return { uint32_t( _records.size() - 1 ), 0 };
+}
+
+Entity EntityStore::create( ComponentMask mask )
+{
+    const uint32_t archetype = archetypeFor( mask );
+    const Entity entity = allocateEntity();
+
+    Record& record = _records[entity.index];
+    record.archetype = archetype;
+    record.row = _archetypes[archetype]->appendRow( entity );
+    record.alive = true;
+    ++_liveCount;
+    return entity;
+}
+
+void EntityStore::create( ComponentMask mask, size_t count, std::vector<Entity>& outEntities )
+{
+    Archetype& archetype = *_archetypes[ archetypeFor( mask ) ];
+    archetype._entities.reserve( archetype.size() + count );
+    for ( Archetype::Column& column : archetype._columns )
+        column.data.reserve( column.data.size() + count * column.elementSize );
+
+    outEntities.reserve( outEntities.size() + count );
+    for ( size_t i = 0; i < count; ++i )
+        outEntities.push_back( create( mask ) );
+}
+
+void EntityStore::destroy( Entity entity )
+{
+    AAPL_ASSERT( alive( entity ), "EntityStore: destroying a dead entity" );
+
+    Record& record = _records[entity.index];
+    const Entity moved = _archetypes[record.archetype]->removeRow( record.row );
+    if ( !( moved == entity ) )
+        _records[moved.index].row = record.row;
+
+    record.alive = false;
+    ++record.generation;
+    _freeIndices.push_back( entity.index );
+    --_liveCount;
+}
+
+bool EntityStore::alive( Entity entity ) const
+{
+    return entity.index < _records.size()
+        && _records[entity.index].alive
+        && _records[entity.index].generation == entity.generation;
+}
+
+const EntityStore::Record& EntityStore::liveRecord( Entity entity, ComponentMask mask ) const
+{
+    AAPL_ASSERT( alive( entity ), "EntityStore: component of a dead or stale entity" );
+
+    const Record& record = _records[entity.index];
+    AAPL_ASSERT( _archetypes[record.archetype]->contains( mask ), "EntityStore: the entity has no such component" );
+    return record;
+}
+
+//----------------------------------------------------------------------------------------
+
+void updateRotationSystem( EntityStore& store, float deltaTime )
+{
+    store.forEachArchetype( componentMask< TransformComponent, RotationComponent >(), [deltaTime]( Archetype& archetype )
+    {
+        TransformComponent* pTransforms = archetype.components< TransformComponent >();
+        RotationComponent*  pRotations  = archetype.components< RotationComponent >();
+        BoundsComponent*    pBounds     = archetype.contains( componentMask< BoundsComponent >() )
+                                        ? archetype.components< BoundsComponent >() : nullptr;
+
+        parallelFor( archetype.size(), kSystemGrain, [=]( size_t begin, size_t end )
+        {
+            for ( size_t i = begin; i < end; ++i )
+            {
+                RotationComponent& rotation = pRotations[i];
+                rotation.rotationAmount += rotation.rotationSpeed * deltaTime;
+
+                pTransforms[i].modelMatrix = matrix_multiply( matrix4x4_translation( rotation.rotationPoint ),
+                                             matrix_multiply( matrix4x4_rotation( rotation.rotationAmount, rotation.rotationAxis ),
+                                                              matrix4x4_translation( rotation.translation ) ) );
+                if ( pBounds )
+                {
+                    const simd::float4 center = matrix_multiply( pTransforms[i].modelMatrix,
+                                                                 (simd::float4){ pBounds[i].localSphere.x,
+                                                                                 pBounds[i].localSphere.y,
+                                                                                 pBounds[i].localSphere.z, 1.f } );
+                    pBounds[i].worldSphere = (simd::float4){ center.x, center.y, center.z, pBounds[i].localSphere.w };
+                }
+            }
+        });
+    });
+}
+
+void cullSystem( EntityStore& store, const FrustumCuller& frustum )
+{
+    store.forEachArchetype( componentMask< BoundsComponent, RenderPassComponent >(), [&frustum]( Archetype& archetype )
+    {
+        const BoundsComponent* pBounds = archetype.components< BoundsComponent >();
+        RenderPassComponent*   pPasses = archetype.components< RenderPassComponent >();
+
+        parallelFor( archetype.size(), kSystemGrain, [&]( size_t begin, size_t end )
+        {
+            for ( size_t i = begin; i < end; ++i )
+            {
+                pPasses[i].visibleInFinal = ( pPasses[i].passFlags & Final ) && frustum.IntersectsPlanes( pBounds[i].worldSphere );
+            }
+        });
+    });
+}
+
+void gatherPassSystem( EntityStore& store, EPassFlags pass, std::vector<Entity>& outEntities )
+{
+    outEntities.clear();
+
+    store.forEachArchetype( componentMask< RenderPassComponent >(), [&]( Archetype& archetype )
+    {
+        const RenderPassComponent* pPasses = archetype.components< RenderPassComponent >();
+        const Entity* pEntities = archetype.entities();
+        const size_t count = archetype.size();
+
+        auto accepted = [pPasses, pass]( size_t i )
+        {
+            return ( pPasses[i].passFlags & pass ) && ( pass != Final || pPasses[i].visibleInFinal );
+        };
+
+        /// Count per chunk, then every chunk writes its entities behind the prefix sum of the counts
+        const size_t chunkCount = ( count + kSystemGrain - 1 ) / kSystemGrain;
+        std::vector<size_t> chunkOffsets( chunkCount + 1, 0 );
+
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end )
+        {
+            for ( size_t chunk = begin; chunk < end; ++chunk )
+            {
+                const size_t last = std::min( ( chunk + 1 ) * kSystemGrain, count );
+                size_t accepts = 0;
+                for ( size_t i = chunk * kSystemGrain; i < last; ++i )
+                    accepts += accepted( i );
+                chunkOffsets[chunk + 1] = accepts;
+            }
+        });
+
+        const size_t base = outEntities.size();
+        chunkOffsets[0] = base;
+        for ( size_t chunk = 0; chunk < chunkCount; ++chunk )
+            chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+        outEntities.resize( chunkOffsets[chunkCount] );
+
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end )
+        {
+            for ( size_t chunk = begin; chunk < end; ++chunk )
+            {
+                const size_t last = std::min( ( chunk + 1 ) * kSystemGrain, count );
+                size_t write = chunkOffsets[chunk];
+                for ( size_t i = chunk * kSystemGrain; i < last; ++i )
+                {
+                    if ( accepted( i ) )
+                        outEntities[write++] = pEntities[i];
+                }
+            }
+        });
+    });
+}
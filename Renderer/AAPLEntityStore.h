@@ -0,0 +1,198 @@
+///
+///  AAPLEntityStore.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 25.03.24.
+///
+/// Abstract:
+/// Archetype based entity / component storage. Entities with the same set of components
+/// share an archetype, which keeps one tightly packed array per component. Systems iterate
+/// the archetypes that contain the components they need and process the rows in parallel,
+/// replacing the former per actor AAPLActorData objects.
+
+#pragma once
+#ifndef AAPLEntityStore_h
+#define AAPLEntityStore_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "AAPLRendererUtils.hpp"
+
+//----------------------------------------------------------------------------------------
+// Components. Plain data only, they are moved around with memcpy.
+
+enum ComponentType : uint8_t
+{
+    ComponentTypeTransform = 0,
+    ComponentTypeBounds,
+    ComponentTypeRotation,
+    ComponentTypeAppearance,
+    ComponentTypeRenderPass,
+    ComponentTypeCount
+};
+
+using ComponentMask = uint32_t;
+
+/// Model matrix of the entity
+struct TransformComponent
+{
+    static constexpr ComponentType kType = ComponentTypeTransform;
+    simd::float4x4 modelMatrix;
+};
+
+/// Bounding sphere, local center in xyz and radius in w, plus the world space sphere
+struct BoundsComponent
+{
+    static constexpr ComponentType kType = ComponentTypeBounds;
+    simd::float4 localSphere;
+    simd::float4 worldSphere;
+};
+
+/// Rotation of the entity around rotationPoint, after being moved away from it by translation
+struct RotationComponent
+{
+    static constexpr ComponentType kType = ComponentTypeRotation;
+    simd::float3 translation;
+    simd::float3 rotationPoint;
+    simd::float3 rotationAxis;
+    float        rotationAmount;
+    float        rotationSpeed;
+};
+
+/// Multiplier used in shading to color entities sharing the same mesh differently
+struct AppearanceComponent
+{
+    static constexpr ComponentType kType = ComponentTypeAppearance;
+    simd::float3 diffuseMultiplier;
+};
+
+/// Passes the entity is rendered to and its visibility in them
+struct RenderPassComponent
+{
+    static constexpr ComponentType kType = ComponentTypeRenderPass;
+    EPassFlags passFlags;
+    uint8_t    instanceCountInReflection;
+    bool       visibleInFinal;
+};
+
+template< typename... Components >
+constexpr ComponentMask componentMask()
+{
+    return ( ComponentMask( 0 ) | ... | ( ComponentMask( 1 ) << Components::kType ) );
+}
+
+//----------------------------------------------------------------------------------------
+
+struct Entity
+{
+    uint32_t index;
+    uint32_t generation;
+
+    bool operator==( const Entity& rhs ) const { return index == rhs.index && generation == rhs.generation; }
+};
+
+/// All entities with exactly the same component mask, one packed column per component.
+class Archetype
+{
+public:
+    explicit Archetype( ComponentMask mask );
+
+    ComponentMask mask() const { return _mask; }
+    bool contains( ComponentMask mask ) const { return ( _mask & mask ) == mask; }
+    size_t size() const { return _entities.size(); }
+    const Entity* entities() const { return _entities.data(); }
+
+    template< typename Component >
+    Component* components()
+    {
+        return reinterpret_cast< Component* >( _columns[Component::kType].data.data() );
+    }
+
+private:
+    friend class EntityStore;
+
+    struct Column
+    {
+        size_t elementSize = 0;
+        std::vector<uint8_t> data;
+    };
+
+    uint32_t appendRow( Entity entity );
+    /// Moves the last row into row, returns the entity that moved
+    Entity removeRow( uint32_t row );
+
+    ComponentMask _mask;
+    std::vector<Entity> _entities;
+    Column _columns[ComponentTypeCount];
+};
+
+class EntityStore
+{
+public:
+    EntityStore();
+
+    Entity create( ComponentMask mask );
+    void create( ComponentMask mask, size_t count, std::vector<Entity>& outEntities );
+    void destroy( Entity entity );
+    bool alive( Entity entity ) const;
+    size_t entityCount() const { return _liveCount; }
+
+    /// Component of a live entity, traps on a destroyed or stale handle and on an entity
+    /// whose archetype lacks the component.
+    template< typename Component >
+    Component& get( Entity entity )
+    {
+        const Record& record = liveRecord( entity, componentMask< Component >() );
+        return _archetypes[record.archetype]->components< Component >()[record.row];
+    }
+
+    /// Calls fn( archetype ) for every non empty archetype containing all of mask.
+    template< typename Fn >
+    void forEachArchetype( ComponentMask mask, const Fn& fn )
+    {
+        for ( auto& pArchetype : _archetypes )
+        {
+            if ( pArchetype->contains( mask ) && pArchetype->size() > 0 )
+                fn( *pArchetype );
+        }
+    }
+
+private:
+    struct Record
+    {
+        uint32_t archetype;
+        uint32_t row;
+        uint32_t generation;
+        bool     alive;
+    };
+
+    const Record& liveRecord( Entity entity, ComponentMask mask ) const;
+    uint32_t archetypeFor( ComponentMask mask );
+    Entity allocateEntity();
+
+    std::vector< std::unique_ptr< Archetype > > _archetypes;
+    std::vector<Record>   _records;
+    std::vector<uint32_t> _freeIndices;
+    size_t _liveCount;
+};
+
+//----------------------------------------------------------------------------------------
+// Systems, each runs over the packed component arrays in parallel.
+
+/// Advances rotationAmount and rebuilds the model matrix, and the world bounds if present.
+void updateRotationSystem( EntityStore& store, float deltaTime );
+
+/// Tests the world bounds of every entity rendered in the final pass against the frustum
+/// planes (see FrustumCuller::Reset_ViewProjection) and stores the result in visibleInFinal.
+void cullSystem( EntityStore& store, const FrustumCuller& frustum );
+
+/// Collects the entities subscribed to pass. For the final pass only visible entities are returned.
+void gatherPassSystem( EntityStore& store, EPassFlags pass, std::vector<Entity>& outEntities );
+
+#endif /* AAPLEntityStore_h */
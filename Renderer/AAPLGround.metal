@@ -11,28 +11,22 @@ using namespace metal;
 #include "AAPLShaderTypes.h"
 #include "AAPLShaderCommon.h"
 
-struct QuadInOut
+struct GroundInOut
 {
     float4 position [[position]];
     float3 normal;
     float3 worldPos;
-    float2 shadow_uv;
-    half shadow_depth;
+    float  view_depth;
 };
 
-constexpr sampler shadowSampler(coord::normalized,
-                                mip_filter::none,
-                                address::clamp_to_edge,
-                                compare_func:: less);
-
 constant half3 kRec709Luma = half3(0.2126, 0.7152, 0.0722);
 
-vertex QuadInOut ground_vertex(constant GroundVertex * vertices  [[ buffer(BufferIndexGroundVertexData)]],
+vertex GroundInOut ground_vertex(constant GroundVertex * vertices  [[ buffer(BufferIndexGroundVertexData)]],
                                uint vid [[ vertex_id ]],
                                constant FrameData  & frameData    [[ buffer(BufferIndexFrameData) ]])
 
 {
-    QuadInOut out;
+    GroundInOut out;
     constant GroundVertex & gv = vertices[vid];
     
     float4 groundPosition = float4(gv.position.x, 0.f, gv.position.y, 1.f) ;
@@ -44,34 +38,21 @@ vertex QuadInOut ground_vertex(constant GroundVertex * vertices  [[ buffer(Buffe
     float3 normal = float3(gv.normal.x, 0.f, gv.normal.y);
     out.normal = normalize(frameData.normalPlaneModelViewMatrix * normal);
     
-    float4 shadow_coord = frameData.shadow_xform_matrix * frameData.shadow_projections_matrix * frameData.shadow_view_matrix * groundPosition;
-    
-    out.shadow_uv = shadow_coord.xy;
-    out.shadow_depth = half(shadow_coord.z);
+    out.view_depth = -(frameData.viewMatrix * groundPosition).z;
     
     return out;
 }
 
-fragment GBufferData ground_fragment (QuadInOut      in                  [[ stage_in ]],
+fragment GBufferData ground_fragment (GroundInOut    in                  [[ stage_in ]],
                                       constant FrameData  & frameData    [[ buffer(BufferIndexFrameData) ]],
-                                      depth2d<float>     shadowMap       [[ texture(TextureIndexShadowMap) ]])
+                                      depth2d_array<float> shadowMap     [[ texture(TextureIndexShadowMap) ]])
 {
     GBufferData gBuffer;
     
     half3 eye_normal = half3(in.normal);
-    const int neighborWidth = 3;
-    const float neighbors = (neighborWidth * 2.0 + 1.0) *
-                            (neighborWidth * 2.0 + 1.0);
-    float mapSize = 2048;
-    float texelSize = 1.0 / mapSize;
-    float total = 0.f;
-    for (int x = -neighborWidth; x <= neighborWidth; x++) {
-      for (int y = -neighborWidth; y <= neighborWidth; y++) {
-          total += shadowMap.sample_compare(shadowSampler, in.shadow_uv + float2(x,y) * texelSize, in.shadow_depth);
-        }
-      }
-    total /= neighbors;
-    half shadow_sample = (half)total;
+    uint cascade = shadow_cascade_index(frameData.shadow_cascade_splits, in.view_depth);
+    float3 shadow_coord = (frameData.shadow_xform_matrix * frameData.shadow_cascade_matrix[min(cascade, uint(ShadowCascadeCount - 1))] * float4(in.worldPos, 1)).xyz;
+    half shadow_sample = shadow_cascade_pcf(shadowMap, shadow_coord, cascade);
     
     float onEdge;
     float2 onEdge2d = fract(float2(in.worldPos.xz));
@@ -0,0 +1,38 @@
+///
+///  AAPLImage.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.04.24.
+///
+
+#include "AAPLImage.h"
+
+#include <algorithm>
+#include <cstring>
+
+void Image::flipRows()
+{
+    for ( uint32_t y = 0; y < height / 2; ++y )
+    {
+        std::swap_ranges( &at( 0, y ), &at( 0, y ) + width, &at( 0, height - 1 - y ) );
+    }
+}
+
+bool loadPNG( const std::string& path, Image& image, std::string& error )
+{
+    uint32_t width, height;
+    std::vector<float> rgba;
+    if ( !loadPNG( path, width, height, rgba, error ) )
+        return false;
+
+    image = Image( width, height );
+    for ( size_t i = 0; i < image.pixels.size(); ++i )
+        image.pixels[i] = (simd::float4){ rgba[4 * i], rgba[4 * i + 1], rgba[4 * i + 2], rgba[4 * i + 3] };
+    return true;
+}
+
+bool savePNG( const std::string& path, const Image& image, uint32_t bitDepth, bool sRGB, std::string& error )
+{
+    static_assert( sizeof( simd::float4 ) == 4 * sizeof( float ), "pixels are handed on as packed float RGBA" );
+    return savePNG( path, image.width, image.height, reinterpret_cast<const float*>( image.pixels.data() ), bitDepth, sRGB, error );
+}
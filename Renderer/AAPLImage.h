@@ -0,0 +1,48 @@
+///
+///  AAPLImage.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.04.24.
+///
+/// Abstract:
+/// Float RGBA image for the tools that filter, bake and compress the images of the asset
+/// catalog. Pixels are simd float4 in [0, 1], rows top down as they are stored in the file.
+/// Reading and writing go through the PNG codec of AAPLPNG.h, which also provides the 8 bit
+/// Image8 for images that only go to the GPU.
+
+#pragma once
+#ifndef AAPLImage_h
+#define AAPLImage_h
+
+#include <simd/simd.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "AAPLPNG.h"
+
+struct Image
+{
+    uint32_t width  = 0;
+    uint32_t height = 0;
+    std::vector<simd::float4> pixels;
+
+    Image() = default;
+    Image( uint32_t w, uint32_t h ) : width( w ), height( h ), pixels( size_t( w ) * h, (simd::float4){ 0.f, 0.f, 0.f, 1.f } ) {}
+
+    simd::float4&       at( uint32_t x, uint32_t y )       { return pixels[size_t( y ) * width + x]; }
+    const simd::float4& at( uint32_t x, uint32_t y ) const { return pixels[size_t( y ) * width + x]; }
+
+    /// Swaps the rows, converts between top left and bottom left origins.
+    void flipRows();
+};
+
+/// Decodes a PNG file. Returns false and fills error if the file can not be read.
+bool loadPNG( const std::string& path, Image& image, std::string& error );
+
+/// Encodes the image as RGBA with 8 or 16 bits per channel, values are clamped to [0, 1].
+/// With sRGB the linear values are encoded with the sRGB transfer function.
+bool savePNG( const std::string& path, const Image& image, uint32_t bitDepth, bool sRGB, std::string& error );
+
+#endif /* AAPLImage_h */
@@ -0,0 +1,426 @@
+///
+///  AAPLInstanceBVH.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 02.04.24.
+///
+
+#include "AAPLInstanceBVH.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+    inline simd::float3 loadFloat3( const float* p ) { return (simd::float3){ p[0], p[1], p[2] }; }
+
+    inline float halfArea( simd::float3 extent )
+    {
+        extent = simd_max( extent, (simd::float3){ 0.f, 0.f, 0.f } );
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+
+    struct Bin
+    {
+        simd::float3 boundsMin = FLT_MAX;
+        simd::float3 boundsMax = -FLT_MAX;
+        uint32_t count = 0;
+    };
+
+    /// Entry distance of the ray into the box, FLT_MAX if it misses or lies behind tMax
+    inline float slabEntry( const float* pMin, const float* pMax,
+                            simd::float3 origin, simd::float3 inverseDirection, float tMax )
+    {
+        const simd::float3 t0 = ( loadFloat3( pMin ) - origin ) * inverseDirection;
+        const simd::float3 t1 = ( loadFloat3( pMax ) - origin ) * inverseDirection;
+        const simd::float3 tNear = simd_min( t0, t1 );
+        const simd::float3 tFar  = simd_max( t0, t1 );
+        const float entry = std::max( std::max( tNear.x, tNear.y ), std::max( tNear.z, 0.f ) );
+        const float exit  = std::min( std::min( tFar.x, tFar.y ), std::min( tFar.z, tMax ) );
+        return entry <= exit ? entry : FLT_MAX;
+    }
+}
+
+void InstanceBVH::setNodeBounds( Node& node, simd::float3 boundsMin, simd::float3 boundsMax )
+{
+    node.boundsMin[0] = boundsMin.x; node.boundsMin[1] = boundsMin.y; node.boundsMin[2] = boundsMin.z;
+    node.boundsMax[0] = boundsMax.x; node.boundsMax[1] = boundsMax.y; node.boundsMax[2] = boundsMax.z;
+}
+
+void InstanceBVH::computeLeafBounds( Node& node ) const
+{
+    simd::float3 boundsMin = FLT_MAX;
+    simd::float3 boundsMax = -FLT_MAX;
+    for ( uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i )
+    {
+        const simd::float4 sphere = _spheres[ _primitives[i] ];
+        boundsMin = simd_min( boundsMin, sphere.xyz - sphere.w );
+        boundsMax = simd_max( boundsMax, sphere.xyz + sphere.w );
+    }
+    setNodeBounds( node, boundsMin, boundsMax );
+}
+
+void InstanceBVH::build( const simd::float4* pSpheres, size_t count )
+{
+    _spheres.assign( pSpheres, pSpheres + count );
+    _centroids.resize( count );
+    _primitives.resize( count );
+    _leafOfPrimitive.assign( count, kInvalid );
+    _nodes.clear();
+    _nodes.reserve( count ? 2 * count - 1 : 0 );
+
+    if ( count == 0 )
+    {
+        _builtCost = 0.f;
+        return;
+    }
+
+    for ( uint32_t i = 0; i < count; ++i )
+    {
+        _primitives[i] = i;
+        _centroids[i]  = _spheres[i].xyz;
+    }
+
+    Node root;
+    root.leftFirst = 0;
+    root.count = uint32_t( count );
+    computeLeafBounds( root );
+    _nodes.push_back( root );
+
+    /// Children are always appended behind their parent, refit relies on that order
+    std::vector<uint32_t> stack = { 0 };
+    while ( !stack.empty() )
+    {
+        const uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+        subdivide( nodeIndex, stack );
+    }
+
+    _nodeDirty.assign( _nodes.size(), 0 );
+    _builtCost = treeCost();
+}
+
+void InstanceBVH::subdivide( uint32_t nodeIndex, std::vector<uint32_t>& stack )
+{
+    const uint32_t first = _nodes[nodeIndex].leftFirst;
+    const uint32_t count = _nodes[nodeIndex].count;
+
+    auto makeLeaf = [&]()
+    {
+        for ( uint32_t i = first; i < first + count; ++i )
+            _leafOfPrimitive[ _primitives[i] ] = nodeIndex;
+    };
+
+    if ( count <= kMaxLeafSize )
+        return makeLeaf();
+
+    /// Bin along the axis with the largest centroid extent
+    simd::float3 centroidMin = FLT_MAX;
+    simd::float3 centroidMax = -FLT_MAX;
+    for ( uint32_t i = first; i < first + count; ++i )
+    {
+        centroidMin = simd_min( centroidMin, _centroids[ _primitives[i] ] );
+        centroidMax = simd_max( centroidMax, _centroids[ _primitives[i] ] );
+    }
+    const simd::float3 extent = centroidMax - centroidMin;
+    const int axis = extent.x > extent.y ? ( extent.x > extent.z ? 0 : 2 ) : ( extent.y > extent.z ? 1 : 2 );
+    if ( extent[axis] <= 0.f )
+        return makeLeaf();
+
+    const float binScale = float( kBinCount ) / extent[axis];
+    auto binOf = [&]( uint32_t primitive )
+    {
+        return std::min( kBinCount - 1, uint32_t( ( _centroids[primitive][axis] - centroidMin[axis] ) * binScale ) );
+    };
+
+    Bin bins[kBinCount];
+    for ( uint32_t i = first; i < first + count; ++i )
+    {
+        const simd::float4 sphere = _spheres[ _primitives[i] ];
+        Bin& bin = bins[ binOf( _primitives[i] ) ];
+        bin.boundsMin = simd_min( bin.boundsMin, sphere.xyz - sphere.w );
+        bin.boundsMax = simd_max( bin.boundsMax, sphere.xyz + sphere.w );
+        ++bin.count;
+    }
+
+    /// Sweep from both sides, cost of split s is area(left) * count(left) + area(right) * count(right)
+    float    leftCost[kBinCount - 1];
+    uint32_t leftCount[kBinCount - 1];
+    {
+        simd::float3 boundsMin = FLT_MAX, boundsMax = -FLT_MAX;
+        uint32_t sum = 0;
+        for ( uint32_t s = 0; s < kBinCount - 1; ++s )
+        {
+            boundsMin = simd_min( boundsMin, bins[s].boundsMin );
+            boundsMax = simd_max( boundsMax, bins[s].boundsMax );
+            sum += bins[s].count;
+            leftCount[s] = sum;
+            leftCost[s]  = halfArea( boundsMax - boundsMin ) * sum;
+        }
+    }
+
+    float bestCost = FLT_MAX;
+    uint32_t bestSplit = 0;
+    {
+        simd::float3 boundsMin = FLT_MAX, boundsMax = -FLT_MAX;
+        uint32_t sum = 0;
+        for ( uint32_t s = kBinCount - 1; s > 0; --s )
+        {
+            boundsMin = simd_min( boundsMin, bins[s].boundsMin );
+            boundsMax = simd_max( boundsMax, bins[s].boundsMax );
+            sum += bins[s].count;
+            if ( !sum || !leftCount[s - 1] )
+                continue;
+
+            const float cost = leftCost[s - 1] + halfArea( boundsMax - boundsMin ) * sum;
+            if ( cost < bestCost )
+            {
+                bestCost  = cost;
+                bestSplit = s;
+            }
+        }
+    }
+
+    const Node& node = _nodes[nodeIndex];
+    const float leafCost = halfArea( loadFloat3( node.boundsMax ) - loadFloat3( node.boundsMin ) ) * count;
+    if ( bestSplit == 0 || ( bestCost >= leafCost && count <= 4 * kMaxLeafSize ) )
+        return makeLeaf();
+
+    uint32_t* pMiddle = std::partition( &_primitives[first], &_primitives[first] + count,
+                                        [&]( uint32_t primitive ) { return binOf( primitive ) < bestSplit; } );
+    const uint32_t splitCount = uint32_t( pMiddle - &_primitives[first] );
+
+    Node left, right;
+    left.leftFirst  = first;
+    left.count      = splitCount;
+    right.leftFirst = first + splitCount;
+    right.count     = count - splitCount;
+    computeLeafBounds( left );
+    computeLeafBounds( right );
+
+    const uint32_t leftIndex = uint32_t( _nodes.size() );
+    _nodes.push_back( left );
+    _nodes.push_back( right );
+    _nodes[nodeIndex].leftFirst = leftIndex;
+    _nodes[nodeIndex].count     = 0;
+
+    stack.push_back( leftIndex + 1 );
+    stack.push_back( leftIndex );
+}
+
+float InstanceBVH::treeCost() const
+{
+    /// SAH cost relative to the root, inner nodes weighted with one traversal step
+    float cost = 0.f;
+    for ( const Node& node : _nodes )
+    {
+        const float area = halfArea( loadFloat3( node.boundsMax ) - loadFloat3( node.boundsMin ) );
+        cost += area * ( node.isLeaf() ? float( node.count ) : 1.f );
+    }
+    const float rootArea = halfArea( loadFloat3( _nodes[0].boundsMax ) - loadFloat3( _nodes[0].boundsMin ) );
+    return rootArea > 0.f ? cost / rootArea : 0.f;
+}
+
+bool InstanceBVH::refit( const simd::float4* pSpheres, const uint8_t* pChanged )
+{
+    if ( _nodes.empty() )
+        return true;
+
+    const size_t count = _spheres.size();
+    if ( pChanged )
+    {
+        std::fill( _nodeDirty.begin(), _nodeDirty.end(), 0 );
+        for ( size_t i = 0; i < count; ++i )
+        {
+            if ( pChanged[i] )
+            {
+                _spheres[i] = pSpheres[i];
+                _nodeDirty[ _leafOfPrimitive[i] ] = 1;
+            }
+        }
+    }
+    else
+    {
+        _spheres.assign( pSpheres, pSpheres + count );
+        std::fill( _nodeDirty.begin(), _nodeDirty.end(), 1 );
+    }
+
+    /// Children follow their parents, so one reverse sweep sees every child before its parent
+    for ( size_t nodeIndex = _nodes.size(); nodeIndex-- > 0; )
+    {
+        Node& node = _nodes[nodeIndex];
+        if ( node.isLeaf() )
+        {
+            if ( _nodeDirty[nodeIndex] )
+                computeLeafBounds( node );
+            continue;
+        }
+
+        const uint32_t left = node.leftFirst;
+        if ( !_nodeDirty[left] && !_nodeDirty[left + 1] )
+            continue;
+
+        const Node& a = _nodes[left];
+        const Node& b = _nodes[left + 1];
+        setNodeBounds( node,
+                       simd_min( loadFloat3( a.boundsMin ), loadFloat3( b.boundsMin ) ),
+                       simd_max( loadFloat3( a.boundsMax ), loadFloat3( b.boundsMax ) ) );
+        _nodeDirty[nodeIndex] = 1;
+    }
+
+    return treeCost() <= kRebuildRatio * _builtCost;
+}
+
+uint32_t InstanceBVH::raycast( simd::float3 origin, simd::float3 direction, float& outDistance ) const
+{
+    uint32_t hit = kInvalid;
+    outDistance = FLT_MAX;
+    if ( _nodes.empty() || simd_length_squared( direction ) <= 0.f )
+        return hit;
+
+    direction = simd_normalize( direction );
+    const simd::float3 inverseDirection = 1.f / direction;
+
+    /// Near first traversal defers one node per level, the fixed stack covers the depth of any
+    /// reasonable tree, a degenerate deeper one spills to the heap instead of skipping subtrees
+    uint32_t stack[kRayStackSize];
+    uint32_t stackSize = 0;
+    std::vector<uint32_t> spill;
+
+    uint32_t nodeIndex = 0;
+    if ( slabEntry( _nodes[0].boundsMin, _nodes[0].boundsMax, origin, inverseDirection, outDistance ) == FLT_MAX )
+        return hit;
+
+    for ( ;; )
+    {
+        const Node& node = _nodes[nodeIndex];
+        if ( node.isLeaf() )
+        {
+            for ( uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i )
+            {
+                const simd::float4 sphere = _spheres[ _primitives[i] ];
+                const simd::float3 toOrigin = origin - sphere.xyz;
+                const float b = simd_dot( toOrigin, direction );
+                const float c = simd_dot( toOrigin, toOrigin ) - sphere.w * sphere.w;
+                const float discriminant = b * b - c;
+                if ( discriminant < 0.f )
+                    continue;
+
+                /// Rays starting inside a sphere hit its far side
+                const float root = std::sqrt( discriminant );
+                const float t = ( -b - root >= 0.f ) ? -b - root : -b + root;
+                if ( t >= 0.f && t < outDistance )
+                {
+                    outDistance = t;
+                    hit = _primitives[i];
+                }
+            }
+        }
+        else
+        {
+            uint32_t nearChild = node.leftFirst;
+            uint32_t farChild  = node.leftFirst + 1;
+            float nearEntry = slabEntry( _nodes[nearChild].boundsMin, _nodes[nearChild].boundsMax, origin, inverseDirection, outDistance );
+            float farEntry  = slabEntry( _nodes[farChild].boundsMin,  _nodes[farChild].boundsMax,  origin, inverseDirection, outDistance );
+            if ( farEntry < nearEntry )
+            {
+                std::swap( nearChild, farChild );
+                std::swap( nearEntry, farEntry );
+            }
+
+            if ( nearEntry != FLT_MAX )
+            {
+                if ( farEntry != FLT_MAX )
+                {
+                    if ( stackSize < kRayStackSize )
+                        stack[stackSize++] = farChild;
+                    else
+                        spill.push_back( farChild );
+                }
+                nodeIndex = nearChild;
+                continue;
+            }
+        }
+
+        if ( !spill.empty() )
+        {
+            nodeIndex = spill.back();
+            spill.pop_back();
+            continue;
+        }
+        if ( !stackSize )
+            break;
+        nodeIndex = stack[--stackSize];
+    }
+
+    if ( hit == kInvalid )
+        outDistance = FLT_MAX;
+    return hit;
+}
+
+void InstanceBVH::collect( uint32_t nodeIndex, std::vector<uint32_t>& outPrimitives ) const
+{
+    const Node& node = _nodes[nodeIndex];
+    if ( node.isLeaf() )
+    {
+        outPrimitives.insert( outPrimitives.end(), &_primitives[node.leftFirst], &_primitives[node.leftFirst] + node.count );
+        return;
+    }
+    collect( node.leftFirst, outPrimitives );
+    collect( node.leftFirst + 1, outPrimitives );
+}
+
+void InstanceBVH::query( const FrustumCuller& frustum, std::vector<uint32_t>& outPrimitives ) const
+{
+    if ( _nodes.empty() )
+        return;
+
+    std::vector<uint32_t> stack = { 0 };
+    while ( !stack.empty() )
+    {
+        const uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+
+        const Node& node = _nodes[nodeIndex];
+        const simd::float3 boundsMin = loadFloat3( node.boundsMin );
+        const simd::float3 boundsMax = loadFloat3( node.boundsMax );
+
+        /// Farthest corner along the plane normal decides outside, nearest corner fully inside
+        bool outside = false;
+        bool inside  = true;
+        for ( const vector_float4& plane : frustum.planes )
+        {
+            const simd::float3 positive = simd_select( boundsMin, boundsMax, plane.xyz >= 0.f );
+            const simd::float3 negative = simd_select( boundsMax, boundsMin, plane.xyz >= 0.f );
+            if ( simd_dot( plane.xyz, positive ) + plane.w < 0.f )
+            {
+                outside = true;
+                break;
+            }
+            inside = inside && simd_dot( plane.xyz, negative ) + plane.w >= 0.f;
+        }
+
+        if ( outside )
+            continue;
+
+        if ( inside )
+        {
+            collect( nodeIndex, outPrimitives );
+            continue;
+        }
+
+        if ( node.isLeaf() )
+        {
+            for ( uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i )
+            {
+                if ( frustum.IntersectsPlanes( _spheres[ _primitives[i] ] ) )
+                    outPrimitives.push_back( _primitives[i] );
+            }
+            continue;
+        }
+
+        stack.push_back( node.leftFirst + 1 );
+        stack.push_back( node.leftFirst );
+    }
+}
@@ -0,0 +1,77 @@
+///
+///  AAPLInstanceBVH.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 02.04.24.
+///
+/// Abstract:
+/// Bounding volume hierarchy over instance bounding spheres. Built top down with a binned
+/// surface area heuristic, refit bottom up when the instances move, and rebuilt once the
+/// refit tree got too loose. Serves ray casts for picking and frustum range queries.
+
+#pragma once
+#ifndef AAPLInstanceBVH_h
+#define AAPLInstanceBVH_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+
+#include "AAPLRendererUtils.hpp"
+
+class InstanceBVH
+{
+public:
+    static constexpr uint32_t kInvalid = UINT32_MAX;
+
+    /// Builds the tree over count spheres, center in xyz and radius in w.
+    void build( const simd::float4* pSpheres, size_t count );
+
+    /// Updates the node bounds for moved spheres. With pChanged only primitives flagged
+    /// non zero and their ancestors are touched, without it everything is refit.
+    /// Returns false if the refit tree became much worse than the built one and should be rebuilt.
+    bool refit( const simd::float4* pSpheres, const uint8_t* pChanged = nullptr );
+
+    size_t primitiveCount() const { return _spheres.size(); }
+
+    /// Closest sphere hit along the ray, kInvalid if nothing is hit.
+    uint32_t raycast( simd::float3 origin, simd::float3 direction, float& outDistance ) const;
+
+    /// Appends all primitives intersecting the frustum planes (see FrustumCuller::Reset_ViewProjection).
+    void query( const FrustumCuller& frustum, std::vector<uint32_t>& outPrimitives ) const;
+
+private:
+    static constexpr uint32_t kBinCount    = 16;
+    static constexpr uint32_t kMaxLeafSize = 4;
+    static constexpr float    kRebuildRatio = 1.6f;
+    static constexpr uint32_t kRayStackSize = 64;
+
+    /// 32 byte node, leaves have count > 0 and leftFirst indexes _primitives,
+    /// inner nodes have their two children at leftFirst and leftFirst + 1.
+    struct Node
+    {
+        float    boundsMin[3];
+        uint32_t leftFirst;
+        float    boundsMax[3];
+        uint32_t count;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    static void setNodeBounds( Node& node, simd::float3 boundsMin, simd::float3 boundsMax );
+    void computeLeafBounds( Node& node ) const;
+    void subdivide( uint32_t nodeIndex, std::vector<uint32_t>& stack );
+    float treeCost() const;
+    void collect( uint32_t nodeIndex, std::vector<uint32_t>& outPrimitives ) const;
+
+    std::vector<Node>         _nodes;
+    std::vector<uint32_t>     _primitives;
+    std::vector<uint32_t>     _leafOfPrimitive;
+    std::vector<simd::float4> _spheres;
+    std::vector<simd::float3> _centroids;
+    std::vector<uint8_t>      _nodeDirty;
+    float _builtCost = 0.f;
+};
+
+#endif /* AAPLInstanceBVH_h */
@@ -0,0 +1,127 @@
+///
+///  AAPLInstanceCuller.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 14.03.24.
+///
+
+#include "AAPLInstanceCuller.h"
+
+#include <algorithm>
+#include <cfloat>
+
+InstanceCuller::InstanceCuller()
+: _instanceCount(0)
+{
+    for ( FrustumCuller & frustum : _frustum )
+    {
+        frustum.Reset_ViewProjection( matrix_identity_float4x4 );
+    }
+}
+
+void InstanceCuller::resize( size_t instanceCount )
+{
+    if ( instanceCount == _instanceCount )
+        return;
+
+    _instanceCount = instanceCount;
+    const size_t blockCount = ( instanceCount + kLaneCount - 1 ) / kLaneCount;
+
+    /// Padding lanes get a radius of -FLT_MAX, the plane test "distance >= -radius" can never pass for them.
+    _centerX.assign( blockCount, simd::float8( 0.f ) );
+    _centerY.assign( blockCount, simd::float8( 0.f ) );
+    _centerZ.assign( blockCount, simd::float8( 0.f ) );
+    _radius.assign(  blockCount, simd::float8( -FLT_MAX ) );
+
+    for ( std::vector<uint32_t> & visible : _visible )
+    {
+        visible.clear();
+        visible.reserve( instanceCount );
+    }
+}
+
+void InstanceCuller::setBounds( size_t index, const simd::float3& center, float radius )
+{
+    const size_t block = index / kLaneCount;
+    const size_t lane  = index % kLaneCount;
+
+    _centerX[block][lane] = center.x;
+    _centerY[block][lane] = center.y;
+    _centerZ[block][lane] = center.z;
+    _radius[block][lane]  = radius;
+}
+
+simd::float4 InstanceCuller::bounds( size_t index ) const
+{
+    const size_t block = index / kLaneCount;
+    const size_t lane  = index % kLaneCount;
+
+    return (simd::float4){ _centerX[block][lane], _centerY[block][lane], _centerZ[block][lane], _radius[block][lane] };
+}
+
+void InstanceCuller::setViewProjection( View view, const simd::float4x4& viewProjectionMatrix )
+{
+    _frustum[view].Reset_ViewProjection( viewProjectionMatrix );
+}
+
+void InstanceCuller::setPlanes( View view, const simd::float4* pPlanes )
+{
+    for ( size_t p = 0; p < 6; ++p )
+    {
+        _frustum[view].planes[p] = pPlanes[p];
+    }
+}
+
+void InstanceCuller::filterVisible( View view, const std::vector<uint8_t>& flags, uint8_t keep )
+{
+    std::vector<uint32_t>& visible = _visible[view];
+    visible.erase( std::remove_if( visible.begin(), visible.end(), [&]( uint32_t index )
+    {
+        return flags[index] != keep;
+    }), visible.end() );
+}
+
+size_t InstanceCuller::cull( View view )
+{
+    const FrustumCuller& frustum = _frustum[view];
+    std::vector<uint32_t>& visible = _visible[view];
+    visible.clear();
+
+    /// Broadcast the plane components once, every block then costs 6 * 4 vector ops.
+    simd::float8 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for ( size_t p = 0; p < 6; ++p )
+    {
+        planeX[p] = frustum.planes[p].x;
+        planeY[p] = frustum.planes[p].y;
+        planeZ[p] = frustum.planes[p].z;
+        planeW[p] = frustum.planes[p].w;
+    }
+
+    const size_t blockCount = _radius.size();
+    for ( size_t block = 0; block < blockCount; ++block )
+    {
+        const simd::float8 cx = _centerX[block];
+        const simd::float8 cy = _centerY[block];
+        const simd::float8 cz = _centerZ[block];
+        const simd::float8 negRadius = -_radius[block];
+
+        simd::int8 inside = -1;
+        for ( size_t p = 0; p < 6; ++p )
+        {
+            const simd::float8 distance = planeX[p] * cx + planeY[p] * cy + planeZ[p] * cz + planeW[p];
+            inside &= ( distance >= negRadius );
+        }
+
+        if ( !simd_any( inside ) )
+            continue;
+
+        const uint32_t base = uint32_t( block * kLaneCount );
+        for ( uint32_t lane = 0; lane < kLaneCount; ++lane )
+        {
+            if ( inside[lane] )
+                visible.push_back( base + lane );
+        }
+    }
+
+    return visible.size();
+}
@@ -0,0 +1,83 @@
+///
+///  AAPLInstanceCuller.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 14.03.24.
+///
+/// Abstract:
+/// Batched frustum culling of instance bounding spheres. The spheres are kept in
+/// structure of arrays form and tested eight at a time against the six planes of a
+/// FrustumCuller. Every view produces a compacted list of visible instance indices,
+/// which drives the instance upload and the instance count of the draw call.
+
+#pragma once
+#ifndef AAPLInstanceCuller_h
+#define AAPLInstanceCuller_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+
+#include "AAPLRendererUtils.hpp"
+#include "AAPLShaderTypes.h"
+
+class InstanceCuller
+{
+public:
+    /// Views the instances are culled against every frame. Per cascade c the dynamic casters
+    /// are View( ViewShadow + c ), the casters of the cached static layer are ViewShadowStatic.
+    enum View : uint8_t
+    {
+        ViewMain         = 0,
+        ViewShadow       = 1,
+        ViewShadowStatic = ViewShadow + ShadowCascadeCount,
+        ViewCount        = ViewShadowStatic + 1
+    };
+
+    static constexpr size_t kLaneCount = 8;
+
+    InstanceCuller();
+
+    /// Resizes the bounds storage. Padding lanes are set up so they never pass the test.
+    void resize( size_t instanceCount );
+    size_t instanceCount() const { return _instanceCount; }
+
+    /// Sets the world space bounding sphere of one instance.
+    void setBounds( size_t index, const simd::float3& center, float radius );
+
+    /// Bounding sphere of one instance, center in xyz and radius in w.
+    simd::float4 bounds( size_t index ) const;
+
+    /// Updates the clip planes of a view from its projection * view matrix.
+    void setViewProjection( View view, const simd::float4x4& viewProjectionMatrix );
+    const FrustumCuller& frustum( View view ) const { return _frustum[view]; }
+
+    /// Replaces the clip planes of a view with six inward facing world space planes,
+    /// for culling volumes that are not the frustum of a projection.
+    void setPlanes( View view, const simd::float4* pPlanes );
+
+    /// Tests all instances against the planes of the view and rebuilds its visible list.
+    /// Returns the number of visible instances.
+    size_t cull( View view );
+
+    /// Drops the visible instances of a view whose flag differs from keep.
+    void filterVisible( View view, const std::vector<uint8_t>& flags, uint8_t keep );
+
+    /// Compacted, ascending list of visible instance indices of the last cull.
+    const std::vector<uint32_t>& visibleInstances( View view ) const { return _visible[view]; }
+
+private:
+    size_t _instanceCount;
+
+    /// SoA bounding spheres, one lane per instance.
+    std::vector<simd::float8> _centerX;
+    std::vector<simd::float8> _centerY;
+    std::vector<simd::float8> _centerZ;
+    std::vector<simd::float8> _radius;
+
+    FrustumCuller _frustum[ViewCount];
+    std::vector<uint32_t> _visible[ViewCount];
+};
+
+#endif /* AAPLInstanceCuller_h */
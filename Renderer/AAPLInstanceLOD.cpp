@@ -0,0 +1,167 @@
+///
+///  AAPLInstanceLOD.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 18.03.24.
+///
+
+#include "AAPLInstanceLOD.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+
+namespace
+{
+    /// Sphere segments per level, level 0 is the original 70 x 70 vertex sphere.
+    constexpr uint16_t kLevelSegments[InstanceLOD::kLevelCount] = { 69, 34, 16, 8 };
+
+    /// Smallest projected radius in pixels a level is used for.
+    constexpr float kLevelMinPixelRadius[InstanceLOD::kLevelCount] = { 80.f, 28.f, 10.f, 0.f };
+
+    /// Relative width of the hysteresis band around every threshold.
+    constexpr float kHysteresis = 0.15f;
+
+    constexpr uint8_t kUnselected = 0xFF;
+}
+
+InstanceLOD::InstanceLOD()
+{
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        _levels[level] = { kLevelSegments[level], 0, 0 };
+    }
+    for ( auto& buckets : _buckets )
+    {
+        for ( Bucket& bucket : buckets )
+        {
+            bucket = { 0, 0 };
+        }
+    }
+}
+
+void InstanceLOD::buildSphereLevels( std::vector<VertexData>& vertices, std::vector<uint16_t>& indices )
+{
+    for ( Level& level : _levels )
+    {
+        const uint16_t segments = level.segments;
+        const uint16_t baseVertex = uint16_t( vertices.size() );
+
+        for ( uint16_t x = 0; x <= segments; ++x )
+        {
+            for ( uint16_t y = 0; y <= segments; ++y )
+            {
+                float xSegment = (float)x / (float)segments;
+                float ySegment = (float)y / (float)segments;
+                float xPos = std::cos(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
+                float yPos = std::cos(ySegment * PI);
+                float zPos = std::sin(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
+
+                vertices.push_back( { simd::float3 { xPos, yPos, zPos },
+                                      simd::float2 { xSegment, ySegment },
+                                      simd::float3 { xPos, yPos, zPos } } );
+            }
+        }
+
+        /// Metal wants index buffer offsets 4 byte aligned, pad odd ranges with one unused index.
+        if ( indices.size() % 2 )
+            indices.push_back( baseVertex );
+
+        level.indexOffset = indices.size() * sizeof( uint16_t );
+
+        bool oddRow = false;
+        for ( int y = 0; y < segments; ++y )
+        {
+            if ( !oddRow )
+            {
+                for ( int x = 0; x <= segments; ++x )
+                {
+                    indices.push_back( baseVertex + y * (segments + 1) + x );
+                    indices.push_back( baseVertex + (y + 1) * (segments + 1) + x );
+                }
+            }
+            else
+            {
+                for ( int x = segments; x >= 0; --x )
+                {
+                    indices.push_back( baseVertex + (y + 1) * (segments + 1) + x );
+                    indices.push_back( baseVertex + y * (segments + 1) + x );
+                }
+            }
+            oddRow = !oddRow;
+        }
+
+        level.indexCount = indices.size() - level.indexOffset / sizeof( uint16_t );
+    }
+}
+
+void InstanceLOD::resize( size_t instanceCount )
+{
+    for ( std::vector<uint8_t>& selected : _selected )
+    {
+        if ( selected.size() != instanceCount )
+            selected.assign( instanceCount, kUnselected );
+    }
+}
+
+uint8_t InstanceLOD::levelForRadius( float pixelRadius )
+{
+    uint8_t level = 0;
+    while ( level < kLevelCount - 1 && pixelRadius < kLevelMinPixelRadius[level] )
+        ++level;
+    return level;
+}
+
+void InstanceLOD::select( InstanceCuller::View view,
+                          const InstanceCuller& culler,
+                          const simd::float4x4& viewProjectionMatrix,
+                          float pixelScale )
+{
+    const std::vector<uint32_t>& visible = culler.visibleInstances( view );
+    std::vector<uint8_t>& selected = _selected[view];
+    std::vector<uint32_t>& ordered = _ordered[view];
+
+    /// Clip w of a world position is the dot product with the last matrix row,
+    /// this covers left and right handed perspective as well as orthographic projections.
+    const simd::float4 rowW = { viewProjectionMatrix.columns[0].w,
+                                viewProjectionMatrix.columns[1].w,
+                                viewProjectionMatrix.columns[2].w,
+                                viewProjectionMatrix.columns[3].w };
+
+    NS::UInteger counts[kLevelCount] = { 0 };
+
+    for ( uint32_t index : visible )
+    {
+        const simd::float4 bounds = culler.bounds( index );
+        const float w = simd_dot( rowW, (simd::float4){ bounds.x, bounds.y, bounds.z, 1.f } );
+        const float pixelRadius = bounds.w * pixelScale / std::max( w, FLT_EPSILON );
+
+        /// Keep the current level as long as it is valid somewhere inside the hysteresis band.
+        uint8_t level = selected[index];
+        const uint8_t finest   = levelForRadius( pixelRadius * ( 1.f + kHysteresis ) );
+        const uint8_t coarsest = levelForRadius( pixelRadius * ( 1.f - kHysteresis ) );
+        if ( level == kUnselected || level < finest || level > coarsest )
+            level = levelForRadius( pixelRadius );
+
+        selected[index] = level;
+        ++counts[level];
+    }
+
+    NS::UInteger first = 0;
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        _buckets[view][level] = { first, counts[level] };
+        first += counts[level];
+    }
+
+    /// Counting sort of the visible list by level, stable so each bucket stays in index order.
+    NS::UInteger cursor[kLevelCount];
+    for ( size_t level = 0; level < kLevelCount; ++level )
+        cursor[level] = _buckets[view][level].firstInstance;
+
+    ordered.resize( visible.size() );
+    for ( uint32_t index : visible )
+    {
+        ordered[ cursor[ selected[index] ]++ ] = index;
+    }
+}
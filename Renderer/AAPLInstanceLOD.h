@@ -0,0 +1,81 @@
+///
+///  AAPLInstanceLOD.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 18.03.24.
+///
+/// Abstract:
+/// Level of detail selection for the instanced spheres. Several sphere tessellations
+/// share one vertex and one index buffer. A level is picked per instance and view from
+/// the projected radius, with a hysteresis band so instances near a threshold do not
+/// flip every frame. The visible instances of a view are grouped into per level buckets,
+/// so every level is drawn with a single instanced draw call.
+
+#pragma once
+#ifndef AAPLInstanceLOD_h
+#define AAPLInstanceLOD_h
+
+#include <simd/simd.h>
+#include <Metal/Metal.hpp>
+
+#include <vector>
+#include <cstdint>
+
+#include "AAPLShaderTypes.h"
+#include "AAPLInstanceCuller.h"
+
+class InstanceLOD
+{
+public:
+    static constexpr size_t kLevelCount = 4;
+
+    /// Index range of one tessellation inside the shared index buffer.
+    struct Level
+    {
+        uint16_t     segments;
+        NS::UInteger indexOffset;   /// in bytes
+        NS::UInteger indexCount;
+    };
+
+    /// Instance range of one level inside the compacted instance data of a view.
+    struct Bucket
+    {
+        NS::UInteger firstInstance;
+        NS::UInteger instanceCount;
+    };
+
+    InstanceLOD();
+
+    /// Appends all sphere tessellations as triangle strips, finest level first.
+    void buildSphereLevels( std::vector<VertexData>& vertices, std::vector<uint16_t>& indices );
+    const Level& level( size_t level ) const { return _levels[level]; }
+
+    /// Resets the per instance hysteresis state.
+    void resize( size_t instanceCount );
+
+    /// Selects a level for every visible instance of the view and regroups them per level.
+    /// pixelScale converts a radius at clip w = 1 into pixels, (projection[1][1] * viewport height / 2).
+    void select( InstanceCuller::View view,
+                 const InstanceCuller& culler,
+                 const simd::float4x4& viewProjectionMatrix,
+                 float pixelScale );
+
+    /// Visible instance indices of the view, ordered by level.
+    const std::vector<uint32_t>& orderedInstances( InstanceCuller::View view ) const { return _ordered[view]; }
+    const Bucket& bucket( InstanceCuller::View view, size_t level ) const { return _buckets[view][level]; }
+
+    /// Level picked for a visible instance by the last select() of the view.
+    uint8_t selectedLevel( InstanceCuller::View view, uint32_t instance ) const { return _selected[view][instance]; }
+
+private:
+    static uint8_t levelForRadius( float pixelRadius );
+
+    Level _levels[kLevelCount];
+
+    /// Last selected level per view and instance, kUnselected before the first selection.
+    std::vector<uint8_t> _selected[InstanceCuller::ViewCount];
+    std::vector<uint32_t> _ordered[InstanceCuller::ViewCount];
+    Bucket _buckets[InstanceCuller::ViewCount][kLevelCount];
+};
+
+#endif /* AAPLInstanceLOD_h */
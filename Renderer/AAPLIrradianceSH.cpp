@@ -0,0 +1,317 @@
+///
+///  AAPLIrradianceSH.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 22.04.24.
+///
+
+#include "AAPLIrradianceSH.h"
+#include "AAPLParallel.h"
+#include "AAPLUtilities.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+    /// Real spherical harmonic basis constants of bands 0 to 2
+    const float kY0 = 0.282095f;
+    const float kY1 = 0.488603f;
+    const float kY2 = 1.092548f;
+    const float kY3 = 0.315392f;
+    const float kY4 = 0.546274f;
+
+    /// Clamped cosine convolution per band over pi, Ramamoorthi and Hanrahan
+    const float kBandScale[3] = { 1.f, 2.f / 3.f, 1.f / 4.f };
+
+    float areaElement( float x, float y )
+    {
+        return std::atan2( x * y, std::sqrt( x * x + y * y + 1.f ) );
+    }
+
+    float texelSolidAngle( uint32_t x, uint32_t y, uint32_t size )
+    {
+        const float scale = 2.f / float( size );
+        const float u0 = float( x ) * scale - 1.f, u1 = u0 + scale;
+        const float v0 = float( y ) * scale - 1.f, v1 = v0 + scale;
+        return areaElement( u0, v0 ) - areaElement( u0, v1 ) - areaElement( u1, v0 ) + areaElement( u1, v1 );
+    }
+
+    float horizontalSum( simd::float4 value )
+    {
+        return ( value.x + value.y ) + ( value.z + value.w );
+    }
+
+    uint32_t band( uint32_t coefficient )
+    {
+        return coefficient == 0 ? 0 : ( coefficient < 4 ? 1 : 2 );
+    }
+}
+
+IrradianceSH::IrradianceSH()
+{
+    std::fill( _coefficients, _coefficients + kCoefficientCount, (simd::float4){ 0.f, 0.f, 0.f, 0.f } );
+}
+
+simd::float3 IrradianceSH::faceDirection( uint32_t face, float u, float v )
+{
+    simd::float3 direction;
+    switch ( face )
+    {
+        case 0:  direction = (simd::float3){  1.f,  -v,  -u }; break;
+        case 1:  direction = (simd::float3){ -1.f,  -v,   u }; break;
+        case 2:  direction = (simd::float3){    u, 1.f,   v }; break;
+        case 3:  direction = (simd::float3){    u,-1.f,  -v }; break;
+        case 4:  direction = (simd::float3){    u,  -v, 1.f }; break;
+        default: direction = (simd::float3){   -u,  -v,-1.f }; break;
+    }
+    return simd_normalize( direction );
+}
+
+void IrradianceSH::buildTexelPackets()
+{
+    /// All faces share the texel layout, only the signs and the order of the components differ
+    _packetsPerRow = ( _size + 3 ) / 4;
+    _packets.resize( size_t( _packetsPerRow ) * _size );
+    const float scale = 2.f / float( _size );
+    for ( uint32_t y = 0; y < _size; ++y )
+    {
+        for ( uint32_t packet = 0; packet < _packetsPerRow; ++packet )
+        {
+            TexelPacket& texels = _packets[y * _packetsPerRow + packet];
+            for ( uint32_t lane = 0; lane < 4; ++lane )
+            {
+                const uint32_t x = packet * 4 + lane;
+                if ( x >= _size )
+                {
+                    texels.u[lane] = 0.f;
+                    texels.v[lane] = 0.f;
+                    texels.w[lane] = 1.f;
+                    texels.weight[lane] = 0.f;
+                    continue;
+                }
+                const float u = ( float( x ) + 0.5f ) * scale - 1.f;
+                const float v = ( float( y ) + 0.5f ) * scale - 1.f;
+                const float inverseLength = 1.f / std::sqrt( 1.f + u * u + v * v );
+                texels.u[lane] = u * inverseLength;
+                texels.v[lane] = v * inverseLength;
+                texels.w[lane] = inverseLength;
+                texels.weight[lane] = texelSolidAngle( x, y, _size );
+            }
+        }
+    }
+}
+
+void IrradianceSH::beginProjection( const simd::float4* pTexels, uint32_t size, Source source )
+{
+    AAPL_ASSERT( size > 0, "IrradianceSH: empty cubemap" );
+
+    _texels.assign( pTexels, pTexels + size_t( 6 ) * size * size );
+    _source   = source;
+    _rowCount = 6 * size;
+    _nextRow  = 0;
+    _projectionMicroseconds = 0.0;
+    _rowSums.assign( _rowCount, RowSum{} );
+
+    if ( size != _size || _packets.empty() )
+    {
+        _size = size;
+        buildTexelPackets();
+    }
+}
+
+void IrradianceSH::projectRow( uint32_t row, RowSum& sum ) const
+{
+    const uint32_t face = row / _size;
+    const uint32_t y    = row % _size;
+    const simd::float4* pRow = &_texels[size_t( row ) * _size];
+
+    simd::float4 r[kCoefficientCount], g[kCoefficientCount], b[kCoefficientCount];
+    for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+    {
+        r[k] = 0.f;
+        g[k] = 0.f;
+        b[k] = 0.f;
+    }
+
+    for ( uint32_t packet = 0; packet < _packetsPerRow; ++packet )
+    {
+        const TexelPacket& texels = _packets[y * _packetsPerRow + packet];
+
+        simd::float4 dx, dy, dz;
+        switch ( face )
+        {
+            case 0:  dx =  texels.w; dy = -texels.v; dz = -texels.u; break;
+            case 1:  dx = -texels.w; dy = -texels.v; dz =  texels.u; break;
+            case 2:  dx =  texels.u; dy =  texels.w; dz =  texels.v; break;
+            case 3:  dx =  texels.u; dy = -texels.w; dz = -texels.v; break;
+            case 4:  dx =  texels.u; dy = -texels.v; dz =  texels.w; break;
+            default: dx = -texels.u; dy = -texels.v; dz = -texels.w; break;
+        }
+
+        /// Transpose four texels into channel lanes, the padding lanes carry no weight
+        simd::float4 red = 0.f, green = 0.f, blue = 0.f;
+        for ( uint32_t lane = 0; lane < 4 && packet * 4 + lane < _size; ++lane )
+        {
+            const simd::float4 texel = pRow[packet * 4 + lane];
+            red[lane]   = texel.x;
+            green[lane] = texel.y;
+            blue[lane]  = texel.z;
+        }
+        red   *= texels.weight;
+        green *= texels.weight;
+        blue  *= texels.weight;
+
+        const simd::float4 basis[kCoefficientCount] =
+        {
+            simd::float4( kY0 ),
+            kY1 * dy,
+            kY1 * dz,
+            kY1 * dx,
+            kY2 * dx * dy,
+            kY2 * dy * dz,
+            kY3 * ( 3.f * dz * dz - 1.f ),
+            kY2 * dx * dz,
+            kY4 * ( dx * dx - dy * dy )
+        };
+        for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+        {
+            r[k] += basis[k] * red;
+            g[k] += basis[k] * green;
+            b[k] += basis[k] * blue;
+        }
+    }
+
+    for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+    {
+        sum.r[k] = horizontalSum( r[k] );
+        sum.g[k] = horizontalSum( g[k] );
+        sum.b[k] = horizontalSum( b[k] );
+    }
+}
+
+bool IrradianceSH::step( uint32_t rowBudget )
+{
+    if ( !projecting() )
+        return false;
+
+    const auto start = std::chrono::steady_clock::now();
+    const uint32_t first = _nextRow;
+    const uint32_t count = std::min( rowBudget, _rowCount - _nextRow );
+    parallelFor( count, kRowGrain, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+            projectRow( first + uint32_t( i ), _rowSums[first + i] );
+    });
+    _nextRow += count;
+    _projectionMicroseconds += std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+
+    if ( projecting() )
+        return false;
+
+    publish();
+    return true;
+}
+
+void IrradianceSH::project( const simd::float4* pTexels, uint32_t size, Source source )
+{
+    beginProjection( pTexels, size, source );
+    step( _rowCount );
+}
+
+void IrradianceSH::publish()
+{
+    /// Rows are summed in order, the result does not depend on how the steps were split
+    double r[kCoefficientCount] = {}, g[kCoefficientCount] = {}, b[kCoefficientCount] = {};
+    for ( const RowSum& sum : _rowSums )
+    {
+        for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+        {
+            r[k] += sum.r[k];
+            g[k] += sum.g[k];
+            b[k] += sum.b[k];
+        }
+    }
+
+    for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+    {
+        const double scale = _source == SourceRadiance ? kBandScale[band( k )] : 1.0;
+        _coefficients[k] = (simd::float4){ float( r[k] * scale ), float( g[k] * scale ), float( b[k] * scale ), 0.f };
+    }
+    _valid = true;
+
+    _error = _source == SourceIrradiance ? compare( _texels.data(), _size ) : Error{};
+    _error.microseconds = _projectionMicroseconds;
+
+    std::vector<simd::float4>().swap( _texels );
+    std::vector<RowSum>().swap( _rowSums );
+}
+
+simd::float3 IrradianceSH::evaluate( simd::float3 n ) const
+{
+    const float basis[kCoefficientCount] =
+    {
+        kY0,
+        kY1 * n.y,
+        kY1 * n.z,
+        kY1 * n.x,
+        kY2 * n.x * n.y,
+        kY2 * n.y * n.z,
+        kY3 * ( 3.f * n.z * n.z - 1.f ),
+        kY2 * n.x * n.z,
+        kY4 * ( n.x * n.x - n.y * n.y )
+    };
+
+    simd::float3 result = { 0.f, 0.f, 0.f };
+    for ( uint32_t k = 0; k < kCoefficientCount; ++k )
+        result += _coefficients[k].xyz * basis[k];
+    return result;
+}
+
+IrradianceSH::Error IrradianceSH::compare( const simd::float4* pTexels, uint32_t size ) const
+{
+    struct RowError
+    {
+        double error;
+        double reference;
+        double maxAbsolute;
+    };
+
+    const uint32_t rowCount = 6 * size;
+    std::vector<RowError> rows( rowCount );
+    parallelFor( rowCount, kRowGrain, [&]( size_t begin, size_t end )
+    {
+        const float scale = 2.f / float( size );
+        for ( size_t row = begin; row < end; ++row )
+        {
+            const uint32_t face = uint32_t( row ) / size;
+            const uint32_t y    = uint32_t( row ) % size;
+            RowError rowError = { 0.0, 0.0, 0.0 };
+            for ( uint32_t x = 0; x < size; ++x )
+            {
+                const simd::float3 direction = faceDirection( face, ( float( x ) + 0.5f ) * scale - 1.f, ( float( y ) + 0.5f ) * scale - 1.f );
+                const simd::float3 reference = pTexels[row * size + x].xyz;
+                const simd::float3 difference = evaluate( direction ) - reference;
+                const double weight = texelSolidAngle( x, y, size );
+
+                rowError.error     += weight * simd_dot( difference, difference );
+                rowError.reference += weight * simd_dot( reference, reference );
+                rowError.maxAbsolute = std::max( { rowError.maxAbsolute, double( std::fabs( difference.x ) ),
+                                                   double( std::fabs( difference.y ) ), double( std::fabs( difference.z ) ) } );
+            }
+            rows[row] = rowError;
+        }
+    });
+
+    Error error = { size_t( rowCount ) * size, 0.0, 0.0, 0.0 };
+    double squaredError = 0.0, squaredReference = 0.0;
+    for ( const RowError& row : rows )
+    {
+        squaredError     += row.error;
+        squaredReference += row.reference;
+        error.maxAbsolute = std::max( error.maxAbsolute, row.maxAbsolute );
+    }
+    error.relativeRMS = squaredReference > 0.0 ? std::sqrt( squaredError / squaredReference ) : 0.0;
+    return error;
+}
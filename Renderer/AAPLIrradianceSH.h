@@ -0,0 +1,125 @@
+///
+///  AAPLIrradianceSH.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 22.04.24.
+///
+/// Abstract:
+/// Diffuse image based lighting as nine spherical harmonic coefficients per color channel.
+/// A cubemap is projected on the CPU, every texel weighted by its solid angle, four texels
+/// per lane and rows spread over the cores. A radiance environment is convolved with the
+/// clamped cosine afterwards, an irradiance map is taken as it is. The projection can run a
+/// few rows per frame, the previous coefficients stay in use until the new set is complete.
+/// The result is irradiance over pi, the value the irradiance map stores, and once done it is
+/// compared against the texels of an irradiance map to report the error of the fit.
+
+#pragma once
+#ifndef AAPLIrradianceSH_h
+#define AAPLIrradianceSH_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "AAPLShaderTypes.h"
+
+class IrradianceSH
+{
+public:
+    /// What the projected cubemap holds.
+    enum Source
+    {
+        SourceRadiance,
+        SourceIrradiance
+    };
+
+    /// Fit of the coefficients against the texels of an irradiance map, weighted by solid angle.
+    struct Error
+    {
+        size_t texelCount;
+        double relativeRMS;         /// RMS error over the RMS irradiance
+        double maxAbsolute;         /// largest error of a channel
+        double microseconds;        /// projection time summed over all steps
+    };
+
+    IrradianceSH();
+
+    /// Starts projecting a cubemap of size^2 texels per face, the faces in the Metal order
+    /// +X, -X, +Y, -Y, +Z, -Z one after the other, rows top down. The texels are copied.
+    void beginProjection( const simd::float4* pTexels, uint32_t size, Source source );
+
+    /// Projects up to rowBudget more rows. Returns true when this call completed the
+    /// projection and published new coefficients.
+    bool step( uint32_t rowBudget );
+
+    /// Runs a whole projection at once.
+    void project( const simd::float4* pTexels, uint32_t size, Source source );
+
+    bool valid() const { return _valid; }
+
+    /// Valid coefficients whose fit against the irradiance map stays within maxRelativeRMS.
+    /// A radiance source has no map to be compared with and passes on valid() alone.
+    bool accepted( double maxRelativeRMS ) const
+    {
+        return _valid && ( _error.texelCount == 0 || _error.relativeRMS <= maxRelativeRMS );
+    }
+    bool projecting() const { return _nextRow < _rowCount; }
+    float progress() const { return _rowCount ? float( _nextRow ) / float( _rowCount ) : 1.f; }
+
+    /// Irradiance over pi, rgb in xyz, in the layout of FrameData::irradianceSH.
+    const simd::float4* coefficients() const { return _coefficients; }
+
+    /// Irradiance over pi in direction n, what the shaders evaluate.
+    simd::float3 evaluate( simd::float3 n ) const;
+
+    /// Compares the coefficients against an irradiance cubemap in the layout of beginProjection.
+    Error compare( const simd::float4* pTexels, uint32_t size ) const;
+
+    /// Comparison against the projected texels, filled after an irradiance source completed,
+    /// without texels after a radiance source.
+    const Error& error() const { return _error; }
+
+    /// Direction through the face at u, v in [-1, 1], v pointing down the rows.
+    static simd::float3 faceDirection( uint32_t face, float u, float v );
+
+private:
+    static constexpr uint32_t kCoefficientCount = IrradianceSHCoefficientCount;
+    static constexpr uint32_t kRowGrain = 4;
+
+    /// Per row sum of the nine coefficients of each channel
+    struct RowSum
+    {
+        float r[kCoefficientCount];
+        float g[kCoefficientCount];
+        float b[kCoefficientCount];
+    };
+
+    /// Four texels of a face row, the face independent direction parts and the solid angle
+    struct TexelPacket
+    {
+        simd::float4 u, v, w;
+        simd::float4 weight;
+    };
+
+    void buildTexelPackets();
+    void projectRow( uint32_t row, RowSum& sum ) const;
+    void publish();
+
+    std::vector<simd::float4> _texels;
+    std::vector<TexelPacket>  _packets;
+    std::vector<RowSum>       _rowSums;
+    uint32_t _size = 0;
+    uint32_t _packetsPerRow = 0;
+    uint32_t _rowCount = 0;
+    uint32_t _nextRow = 0;
+    Source   _source = SourceIrradiance;
+    double   _projectionMicroseconds = 0.0;
+
+    simd::float4 _coefficients[kCoefficientCount];
+    bool  _valid = false;
+    Error _error {};
+};
+
+#endif /* AAPLIrradianceSH_h */
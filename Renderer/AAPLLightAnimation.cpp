@@ -0,0 +1,88 @@
+///
+///  AAPLLightAnimation.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 09.04.24.
+///
+
+#include "AAPLLightAnimation.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+
+LightAnimation::LightAnimation()
+: _lightCount(0)
+{
+}
+
+void LightAnimation::clear()
+{
+    _lightCount = 0;
+    _positionX.clear();
+    _positionY.clear();
+    _positionZ.clear();
+    _angularSpeed.clear();
+    _radius.clear();
+}
+
+uint32_t LightAnimation::addLight( simd::float3 position, float angularSpeed, float radius )
+{
+    const size_t lane = _lightCount % 8;
+    if ( lane == 0 )
+    {
+        _positionX.push_back( simd::float8( 0.f ) );
+        _positionY.push_back( simd::float8( 0.f ) );
+        _positionZ.push_back( simd::float8( 0.f ) );
+        _angularSpeed.push_back( simd::float8( 0.f ) );
+        _radius.push_back( simd::float8( 0.f ) );
+    }
+
+    _positionX.back()[lane]    = position.x;
+    _positionY.back()[lane]    = position.y;
+    _positionZ.back()[lane]    = position.z;
+    _angularSpeed.back()[lane] = angularSpeed;
+    _radius.back()[lane]       = radius;
+    return uint32_t( _lightCount++ );
+}
+
+void LightAnimation::update( float time, const simd::float4x4& viewFromGroup,
+                             simd::float4* pViewPositions, simd::float4* pViewSpheres ) const
+{
+    const simd::float4 c0 = viewFromGroup.columns[0];
+    const simd::float4 c1 = viewFromGroup.columns[1];
+    const simd::float4 c2 = viewFromGroup.columns[2];
+    const simd::float4 c3 = viewFromGroup.columns[3];
+
+    parallelFor( _positionX.size(), kBlockGrain, [&]( size_t begin, size_t end )
+    {
+        for ( size_t block = begin; block < end; ++block )
+        {
+            /// Rotation around y, x' = cos * x + sin * z, z' = cos * z - sin * x
+            const simd::float8 angle = _angularSpeed[block] * time;
+            const simd::float8 sine   = simd::sin( angle );
+            const simd::float8 cosine = simd::cos( angle );
+
+            const simd::float8 x = cosine * _positionX[block] + sine * _positionZ[block];
+            const simd::float8 y = _positionY[block];
+            const simd::float8 z = cosine * _positionZ[block] - sine * _positionX[block];
+
+            const simd::float8 viewX = c0.x * x + c1.x * y + c2.x * z + c3.x;
+            const simd::float8 viewY = c0.y * x + c1.y * y + c2.y * z + c3.y;
+            const simd::float8 viewZ = c0.z * x + c1.z * y + c2.z * z + c3.z;
+
+            const size_t first = block * 8;
+            const size_t lanes = std::min< size_t >( 8, _lightCount - first );
+            for ( size_t lane = 0; lane < lanes; ++lane )
+            {
+                pViewPositions[first + lane] = (simd::float4){ viewX[lane], viewY[lane], viewZ[lane], 1.f };
+            }
+            if ( pViewSpheres )
+            {
+                for ( size_t lane = 0; lane < lanes; ++lane )
+                {
+                    pViewSpheres[first + lane] = (simd::float4){ viewX[lane], viewY[lane], viewZ[lane], _radius[block][lane] };
+                }
+            }
+        }
+    });
+}
@@ -0,0 +1,52 @@
+///
+///  AAPLLightAnimation.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 09.04.24.
+///
+/// Abstract:
+/// Point light animation in SoA form. Every light circles the y axis of the object group
+/// with its own angular speed. The rotation is evaluated directly from sin and cos of eight
+/// lights at a time, followed by one shared group to view transform, spread over worker
+/// threads. Replaces a full rotation matrix and two matrix products per light.
+
+#pragma once
+#ifndef AAPLLightAnimation_h
+#define AAPLLightAnimation_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class LightAnimation
+{
+public:
+    LightAnimation();
+
+    void clear();
+
+    /// Adds a light at its unrotated position relative to the group, returns its index.
+    uint32_t addLight( simd::float3 position, float angularSpeed, float radius );
+    size_t lightCount() const { return _lightCount; }
+
+    /// Rotates every light by angularSpeed * time around the y axis and transforms it with the
+    /// affine viewFromGroup matrix. Writes view space positions with w = 1 and, if given,
+    /// view space spheres with the light radius in w.
+    void update( float time, const simd::float4x4& viewFromGroup,
+                 simd::float4* pViewPositions, simd::float4* pViewSpheres = nullptr ) const;
+
+private:
+    /// Blocks of eight lights per parallel task
+    static constexpr size_t kBlockGrain = 512;
+
+    size_t _lightCount;
+    std::vector<simd::float8> _positionX;
+    std::vector<simd::float8> _positionY;
+    std::vector<simd::float8> _positionZ;
+    std::vector<simd::float8> _angularSpeed;
+    std::vector<simd::float8> _radius;
+};
+
+#endif /* AAPLLightAnimation_h */
@@ -0,0 +1,509 @@
+///
+///  AAPLLightBVH.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 19.04.24.
+///
+
+#include "AAPLLightBVH.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+    constexpr float kPi = 3.14159265358979323846f;
+
+    /// Rec. 709 luminance of the light color
+    const simd::float3 kLuminance = { 0.2126f, 0.7152f, 0.0722f };
+
+    /// Point lights have no emission axis, the full sphere makes it irrelevant
+    const simd::float3 kPointAxis = { 0.f, 0.f, 1.f };
+
+    inline simd::float3 loadFloat3( const float* p ) { return (simd::float3){ p[0], p[1], p[2] }; }
+
+    inline void storeFloat3( float* p, simd::float3 v ) { p[0] = v.x; p[1] = v.y; p[2] = v.z; }
+
+    inline float halfArea( simd::float3 extent )
+    {
+        extent = simd_max( extent, (simd::float3){ 0.f, 0.f, 0.f } );
+        return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+    }
+}
+
+LightBVH::LightBVH()
+{
+}
+
+LightBVH::Cone LightBVH::mergeCones( const Cone& a, const Cone& b )
+{
+    /// Wider cone first, the result is the narrowest cone around both
+    if ( b.thetaO > a.thetaO )
+        return mergeCones( b, a );
+
+    const float thetaE = std::max( a.thetaE, b.thetaE );
+    const float thetaD = std::acos( std::clamp( simd_dot( a.axis, b.axis ), -1.f, 1.f ) );
+    if ( std::min( thetaD + b.thetaO, kPi ) <= a.thetaO )
+        return Cone{ a.axis, a.thetaO, thetaE };
+
+    const float thetaO = 0.5f * ( a.thetaO + thetaD + b.thetaO );
+    if ( thetaO >= kPi )
+        return Cone{ a.axis, kPi, thetaE };
+
+    /// Rotate the axis of a towards b, thetaD > 0 here
+    const simd::float3 ortho = b.axis - a.axis * simd_dot( a.axis, b.axis );
+    const float orthoLength = simd_length( ortho );
+    if ( orthoLength <= 1e-6f )
+        return Cone{ a.axis, kPi, thetaE };
+
+    const float thetaR = thetaO - a.thetaO;
+    const simd::float3 axis = a.axis * std::cos( thetaR ) + ortho * ( std::sin( thetaR ) / orthoLength );
+    return Cone{ simd_normalize( axis ), thetaO, thetaE };
+}
+
+float LightBVH::orientationMeasure( const Cone& cone )
+{
+    const float thetaW = std::min( cone.thetaO + cone.thetaE, kPi );
+    const float sinO = std::sin( cone.thetaO );
+    const float cosO = std::cos( cone.thetaO );
+    return 2.f * kPi * ( 1.f - cosO )
+         + 0.5f * kPi * ( 2.f * thetaW * sinO - std::cos( cone.thetaO - 2.f * thetaW ) - 2.f * cone.thetaO * sinO + cosO );
+}
+
+void LightBVH::merge( Bounds& bounds, const Bounds& other )
+{
+    bounds.boundsMin    = simd_min( bounds.boundsMin, other.boundsMin );
+    bounds.boundsMax    = simd_max( bounds.boundsMax, other.boundsMax );
+    bounds.cone         = mergeCones( bounds.cone, other.cone );
+    bounds.power       += other.power;
+    bounds.maxIntensity = std::max( bounds.maxIntensity, other.maxIntensity );
+    bounds.maxRadius    = std::max( bounds.maxRadius, other.maxRadius );
+}
+
+float LightBVH::importance( simd::float3 point, simd::float3 normal, simd::float3 boundsMin, simd::float3 boundsMax,
+                            const simd::float3& axis, float thetaO, float thetaE, float maxRadius, float power )
+{
+    /// Windowed falloff of the nearest possible light with the largest radius
+    const simd::float3 closest = simd_min( simd_max( point, boundsMin ), boundsMax );
+    const float distance = simd_length( closest - point );
+    if ( power <= 0.f || distance >= maxRadius )
+        return 0.f;
+
+    float falloff = 1.f - distance / maxRadius;
+    falloff *= falloff;
+
+    /// Inside the bounding sphere of the box any direction is possible
+    const simd::float3 toCenter = 0.5f * ( boundsMin + boundsMax ) - point;
+    const float centerDistance = simd_length( toCenter );
+    const float boxRadius = 0.5f * simd_length( boundsMax - boundsMin );
+    if ( centerDistance <= boxRadius )
+        return power * falloff;
+
+    const simd::float3 direction = toCenter / centerDistance;
+    const float sinB = boxRadius / centerDistance;
+    const float cosB = std::sqrt( std::max( 0.f, 1.f - sinB * sinB ) );
+
+    /// Emitters facing away, only for cones narrower than the full sphere
+    if ( thetaO + thetaE < kPi )
+    {
+        const float theta = std::acos( std::clamp( -simd_dot( axis, direction ), -1.f, 1.f ) );
+        if ( theta - thetaO - std::asin( sinB ) >= thetaE )
+            return 0.f;
+    }
+
+    /// Smallest angle between the normal and a direction into the box, cos( max( theta - thetaB, 0 ) )
+    const float cosN = simd_dot( normal, direction );
+    const float sinN = std::sqrt( std::max( 0.f, 1.f - cosN * cosN ) );
+    const float cosR = cosN >= cosB ? 1.f : cosN * cosB + sinN * sinB;
+    if ( cosR <= 0.f )
+        return 0.f;
+
+    return power * falloff * cosR;
+}
+
+float LightBVH::nodeImportance( const Node& node, simd::float3 point, simd::float3 normal, bool upperBound ) const
+{
+    return importance( point, normal, loadFloat3( node.boundsMin ), loadFloat3( node.boundsMax ),
+                       loadFloat3( node.axis ), node.thetaO, node.thetaE, node.maxRadius,
+                       upperBound ? node.maxIntensity : node.power );
+}
+
+float LightBVH::lightImportance( uint32_t light, simd::float3 point, simd::float3 normal ) const
+{
+    const simd::float4 sphere = _spheres[light];
+    return importance( point, normal, sphere.xyz, sphere.xyz, kPointAxis, kPi, 0.5f * kPi, sphere.w, _intensity[light] );
+}
+
+LightBVH::Bounds LightBVH::primitiveBounds( uint32_t light ) const
+{
+    const simd::float4 sphere = _spheres[light];
+    return Bounds{ sphere.xyz, sphere.xyz, Cone{ kPointAxis, kPi, 0.5f * kPi },
+                   _intensity[light], _intensity[light], sphere.w };
+}
+
+LightBVH::Bounds LightBVH::rangeBounds( uint32_t first, uint32_t count ) const
+{
+    Bounds bounds = primitiveBounds( _primitives[first] );
+    for ( uint32_t i = first + 1; i < first + count; ++i )
+        merge( bounds, primitiveBounds( _primitives[i] ) );
+    return bounds;
+}
+
+void LightBVH::setNode( Node& node, const Bounds& bounds )
+{
+    storeFloat3( node.boundsMin, bounds.boundsMin );
+    storeFloat3( node.boundsMax, bounds.boundsMax );
+    storeFloat3( node.axis, bounds.cone.axis );
+    node.thetaO       = bounds.cone.thetaO;
+    node.thetaE       = bounds.cone.thetaE;
+    node.power        = bounds.power;
+    node.maxIntensity = bounds.maxIntensity;
+    node.maxRadius    = bounds.maxRadius;
+}
+
+LightBVH::Bounds LightBVH::nodeBounds( const Node& node )
+{
+    return Bounds{ loadFloat3( node.boundsMin ), loadFloat3( node.boundsMax ),
+                   Cone{ loadFloat3( node.axis ), node.thetaO, node.thetaE },
+                   node.power, node.maxIntensity, node.maxRadius };
+}
+
+void LightBVH::setLights( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    _spheres.assign( pSpheres, pSpheres + count );
+    _intensity.resize( count );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        _intensity[i] = std::max( 0.f, simd_dot( pLights[i].pointLightColor, kLuminance ) );
+    }
+}
+
+void LightBVH::build( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    setLights( pLights, pSpheres, count );
+    _primitives.resize( count );
+    _nodes.clear();
+    _nodes.reserve( count ? 2 * count - 1 : 0 );
+
+    if ( count == 0 )
+    {
+        _builtCost = 0.f;
+        return;
+    }
+
+    for ( uint32_t i = 0; i < count; ++i )
+        _primitives[i] = i;
+
+    Node root;
+    root.leftFirst = 0;
+    root.count = uint32_t( count );
+    setNode( root, rangeBounds( 0, root.count ) );
+    _nodes.push_back( root );
+
+    /// Children are always appended behind their parent, refit relies on that order
+    std::vector<uint32_t> stack = { 0 };
+    while ( !stack.empty() )
+    {
+        const uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+        subdivide( nodeIndex, stack );
+    }
+
+    _builtCost = treeCost();
+}
+
+void LightBVH::subdivide( uint32_t nodeIndex, std::vector<uint32_t>& stack )
+{
+    const uint32_t first = _nodes[nodeIndex].leftFirst;
+    const uint32_t count = _nodes[nodeIndex].count;
+    if ( count <= kMaxLeafSize )
+        return;
+
+    /// Bin along the axis with the largest extent of the light positions
+    const simd::float3 boundsMin = loadFloat3( _nodes[nodeIndex].boundsMin );
+    const simd::float3 extent = loadFloat3( _nodes[nodeIndex].boundsMax ) - boundsMin;
+    const int axis = extent.x > extent.y ? ( extent.x > extent.z ? 0 : 2 ) : ( extent.y > extent.z ? 1 : 2 );
+    if ( extent[axis] <= 0.f )
+        return;
+
+    const float binScale = float( kBinCount ) / extent[axis];
+    auto binOf = [&]( uint32_t light )
+    {
+        return std::min( kBinCount - 1, uint32_t( ( _spheres[light][axis] - boundsMin[axis] ) * binScale ) );
+    };
+
+    Bounds   bins[kBinCount];
+    uint32_t binCount[kBinCount] = {};
+    for ( uint32_t i = first; i < first + count; ++i )
+    {
+        const uint32_t bin = binOf( _primitives[i] );
+        if ( binCount[bin]++ )
+            merge( bins[bin], primitiveBounds( _primitives[i] ) );
+        else
+            bins[bin] = primitiveBounds( _primitives[i] );
+    }
+
+    /// Power times the area of the light influence box times the orientation measure,
+    /// summed over both sides of split s
+    auto cost = [&]( const Bounds& bounds )
+    {
+        const simd::float3 influence = bounds.boundsMax - bounds.boundsMin + 2.f * bounds.maxRadius;
+        return bounds.power * halfArea( influence ) * orientationMeasure( bounds.cone );
+    };
+
+    float    leftCost[kBinCount - 1];
+    uint32_t leftCount[kBinCount - 1];
+    {
+        Bounds bounds;
+        uint32_t sum = 0;
+        for ( uint32_t s = 0; s < kBinCount - 1; ++s )
+        {
+            if ( binCount[s] )
+            {
+                if ( sum )
+                    merge( bounds, bins[s] );
+                else
+                    bounds = bins[s];
+            }
+            sum += binCount[s];
+            leftCount[s] = sum;
+            leftCost[s]  = sum ? cost( bounds ) : 0.f;
+        }
+    }
+
+    float bestCost = FLT_MAX;
+    uint32_t bestSplit = 0;
+    {
+        Bounds bounds;
+        uint32_t sum = 0;
+        for ( uint32_t s = kBinCount - 1; s > 0; --s )
+        {
+            if ( binCount[s] )
+            {
+                if ( sum )
+                    merge( bounds, bins[s] );
+                else
+                    bounds = bins[s];
+            }
+            sum += binCount[s];
+            if ( !sum || !leftCount[s - 1] )
+                continue;
+
+            const float splitCost = leftCost[s - 1] + cost( bounds );
+            if ( splitCost < bestCost )
+            {
+                bestCost  = splitCost;
+                bestSplit = s;
+            }
+        }
+    }
+
+    if ( bestSplit == 0 )
+        return;
+
+    uint32_t* pMiddle = std::partition( &_primitives[first], &_primitives[first] + count,
+                                        [&]( uint32_t light ) { return binOf( light ) < bestSplit; } );
+    const uint32_t splitCount = uint32_t( pMiddle - &_primitives[first] );
+
+    Node left, right;
+    left.leftFirst  = first;
+    left.count      = splitCount;
+    right.leftFirst = first + splitCount;
+    right.count     = count - splitCount;
+    setNode( left,  rangeBounds( left.leftFirst,  left.count ) );
+    setNode( right, rangeBounds( right.leftFirst, right.count ) );
+
+    const uint32_t leftIndex = uint32_t( _nodes.size() );
+    _nodes.push_back( left );
+    _nodes.push_back( right );
+    _nodes[nodeIndex].leftFirst = leftIndex;
+    _nodes[nodeIndex].count     = 0;
+
+    stack.push_back( leftIndex + 1 );
+    stack.push_back( leftIndex );
+}
+
+float LightBVH::treeCost() const
+{
+    /// SAOH cost relative to the root, inner nodes weighted with one traversal step
+    auto nodeCost = [&]( const Node& node )
+    {
+        const simd::float3 influence = loadFloat3( node.boundsMax ) - loadFloat3( node.boundsMin ) + 2.f * node.maxRadius;
+        return node.power * halfArea( influence ) * orientationMeasure( Cone{ loadFloat3( node.axis ), node.thetaO, node.thetaE } );
+    };
+
+    float cost = 0.f;
+    for ( const Node& node : _nodes )
+    {
+        cost += nodeCost( node ) * ( node.isLeaf() ? float( node.count ) : 1.f );
+    }
+    const float rootCost = nodeCost( _nodes[0] );
+    return rootCost > 0.f ? cost / rootCost : 0.f;
+}
+
+bool LightBVH::refit( const PointLightData* pLights, const simd::float4* pSpheres )
+{
+    if ( _nodes.empty() )
+        return true;
+
+    setLights( pLights, pSpheres, _spheres.size() );
+
+    /// Children follow their parents, so one reverse sweep sees every child before its parent
+    for ( size_t nodeIndex = _nodes.size(); nodeIndex-- > 0; )
+    {
+        Node& node = _nodes[nodeIndex];
+        if ( node.isLeaf() )
+        {
+            setNode( node, rangeBounds( node.leftFirst, node.count ) );
+            continue;
+        }
+
+        Bounds bounds = nodeBounds( _nodes[node.leftFirst] );
+        merge( bounds, nodeBounds( _nodes[node.leftFirst + 1] ) );
+        setNode( node, bounds );
+    }
+
+    return treeCost() <= kRebuildRatio * _builtCost;
+}
+
+bool LightBVH::update( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    if ( count != _spheres.size() || ( count && _nodes.empty() ) || !refit( pLights, pSpheres ) )
+    {
+        build( pLights, pSpheres, count );
+        return true;
+    }
+    return false;
+}
+
+LightBVH::Sample LightBVH::sample( simd::float3 point, simd::float3 normal, float u ) const
+{
+    const Sample none = { kInvalid, 0.f };
+    if ( _nodes.empty() || nodeImportance( _nodes[0], point, normal, false ) <= 0.f )
+        return none;
+
+    /// Descend by the importance of both children, u is rescaled to stay uniform
+    float pdf = 1.f;
+    uint32_t nodeIndex = 0;
+    while ( !_nodes[nodeIndex].isLeaf() )
+    {
+        const uint32_t left = _nodes[nodeIndex].leftFirst;
+        const float leftImportance  = nodeImportance( _nodes[left],     point, normal, false );
+        const float rightImportance = nodeImportance( _nodes[left + 1], point, normal, false );
+        const float total = leftImportance + rightImportance;
+        if ( total <= 0.f )
+            return none;
+
+        const float leftProbability = leftImportance / total;
+        if ( u < leftProbability )
+        {
+            u /= leftProbability;
+            pdf *= leftProbability;
+            nodeIndex = left;
+        }
+        else
+        {
+            u = ( u - leftProbability ) / ( 1.f - leftProbability );
+            pdf *= 1.f - leftProbability;
+            nodeIndex = left + 1;
+        }
+        u = std::min( u, 0x1.fffffep-1f );
+    }
+
+    /// Inside the leaf by the exact contribution
+    const Node& leaf = _nodes[nodeIndex];
+    float total = 0.f;
+    for ( uint32_t i = leaf.leftFirst; i < leaf.leftFirst + leaf.count; ++i )
+        total += lightImportance( _primitives[i], point, normal );
+    if ( total <= 0.f )
+        return none;
+
+    /// The last light with importance also takes the threshold that rounding left over
+    float threshold = u * total;
+    Sample picked = none;
+    for ( uint32_t i = leaf.leftFirst; i < leaf.leftFirst + leaf.count; ++i )
+    {
+        const float value = lightImportance( _primitives[i], point, normal );
+        if ( value <= 0.f )
+            continue;
+        picked = Sample{ _primitives[i], pdf * value / total };
+        if ( threshold < value )
+            break;
+        threshold -= value;
+    }
+    return picked;
+}
+
+size_t LightBVH::selectTopK( simd::float3 point, simd::float3 normal, size_t k,
+                             uint32_t* pLights, float* pImportance, size_t* pNodesVisited ) const
+{
+    if ( pNodesVisited )
+        *pNodesVisited = 0;
+    if ( _nodes.empty() || k == 0 )
+        return 0;
+
+    using Entry = std::pair<float, uint32_t>;
+    auto greater = []( const Entry& a, const Entry& b ) { return a.first > b.first; };
+
+    /// Best first over the bound of the strongest light below a node, the selected lights
+    /// are kept in a min heap so the weakest one is replaced first
+    std::vector<Entry> open;
+    std::vector<Entry> best;
+    best.reserve( k + 1 );
+
+    const float rootBound = nodeImportance( _nodes[0], point, normal, true );
+    if ( rootBound > 0.f )
+        open.push_back( { rootBound, 0 } );
+
+    size_t visited = 0;
+    while ( !open.empty() )
+    {
+        std::pop_heap( open.begin(), open.end() );
+        const Entry top = open.back();
+        open.pop_back();
+        if ( best.size() == k && top.first <= best.front().first )
+            break;
+
+        ++visited;
+        const Node& node = _nodes[top.second];
+        if ( node.isLeaf() )
+        {
+            for ( uint32_t i = node.leftFirst; i < node.leftFirst + node.count; ++i )
+            {
+                const float value = lightImportance( _primitives[i], point, normal );
+                if ( value <= 0.f || ( best.size() == k && value <= best.front().first ) )
+                    continue;
+
+                best.push_back( { value, _primitives[i] } );
+                std::push_heap( best.begin(), best.end(), greater );
+                if ( best.size() > k )
+                {
+                    std::pop_heap( best.begin(), best.end(), greater );
+                    best.pop_back();
+                }
+            }
+            continue;
+        }
+
+        for ( uint32_t child = node.leftFirst; child < node.leftFirst + 2; ++child )
+        {
+            const float bound = nodeImportance( _nodes[child], point, normal, true );
+            if ( bound <= 0.f || ( best.size() == k && bound <= best.front().first ) )
+                continue;
+            open.push_back( { bound, child } );
+            std::push_heap( open.begin(), open.end() );
+        }
+    }
+
+    std::sort( best.begin(), best.end(), greater );
+    for ( size_t i = 0; i < best.size(); ++i )
+    {
+        pLights[i] = best[i].second;
+        if ( pImportance )
+            pImportance[i] = best[i].first;
+    }
+    if ( pNodesVisited )
+        *pNodesVisited = visited;
+    return best.size();
+}
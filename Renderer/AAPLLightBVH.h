@@ -0,0 +1,132 @@
+///
+///  AAPLLightBVH.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 19.04.24.
+///
+/// Abstract:
+/// Light bounding volume hierarchy for importance based light selection. Every node keeps
+/// the box of its light positions, the largest light radius, an emission cone and the
+/// summed and the largest intensity of its lights. Built top down with a binned surface
+/// area orientation heuristic weighted by power, refit every frame after the lights moved
+/// and rebuilt once the refit tree got too loose. A shading point either draws lights
+/// stochastically, descending by the importance estimate of both children, or collects the
+/// k most important lights with a best first traversal bounded by the largest intensity.
+/// Tools/LightBench compares both against a brute force reference over all lights.
+
+#pragma once
+#ifndef AAPLLightBVH_h
+#define AAPLLightBVH_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "AAPLShaderTypes.h"
+
+class LightBVH
+{
+public:
+    static constexpr uint32_t kInvalid = UINT32_MAX;
+
+    /// Light drawn by sample() and the probability it was drawn with.
+    struct Sample
+    {
+        uint32_t light;
+        float    pdf;
+    };
+
+    LightBVH();
+
+    /// Builds the tree over count lights, positions in xyz and the light radius in w.
+    void build( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+
+    /// Refits the tree to the new positions and intensities of the same lights.
+    /// Returns false if the refit tree became much worse than the built one and should be rebuilt.
+    bool refit( const PointLightData* pLights, const simd::float4* pSpheres );
+
+    /// Refits, or rebuilds for a new light count or a loose tree. Returns true after a rebuild.
+    bool update( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+
+    size_t lightCount() const { return _spheres.size(); }
+    size_t nodeCount() const { return _nodes.size(); }
+
+    /// Diffuse contribution of one light at a point with normal n, the falloff of the
+    /// point light shaders and the luminance of the light color.
+    float lightImportance( uint32_t light, simd::float3 point, simd::float3 normal ) const;
+
+    /// Draws one light with u in [0, 1), light is kInvalid when no light reaches the point.
+    Sample sample( simd::float3 point, simd::float3 normal, float u ) const;
+
+    /// Writes up to k lights ordered by importance and their importance, returns the count.
+    size_t selectTopK( simd::float3 point, simd::float3 normal, size_t k,
+                       uint32_t* pLights, float* pImportance, size_t* pNodesVisited = nullptr ) const;
+
+private:
+    static constexpr uint32_t kBinCount     = 12;
+    static constexpr uint32_t kMaxLeafSize  = 4;
+    static constexpr float    kRebuildRatio = 1.6f;
+
+    /// 64 byte node, leaves have count > 0 and leftFirst indexes _primitives,
+    /// inner nodes have their two children at leftFirst and leftFirst + 1.
+    struct Node
+    {
+        float    boundsMin[3];
+        uint32_t leftFirst;
+        float    boundsMax[3];
+        uint32_t count;
+        float    axis[3];
+        float    thetaO;        /// half angle of the emission axes
+        float    thetaE;        /// emission spread around them, pi / 2 for point lights
+        float    power;         /// summed intensity
+        float    maxIntensity;
+        float    maxRadius;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    /// Emission cone, point lights emit into the full sphere
+    struct Cone
+    {
+        simd::float3 axis;
+        float thetaO;
+        float thetaE;
+    };
+
+    struct Bounds
+    {
+        simd::float3 boundsMin;
+        simd::float3 boundsMax;
+        Cone  cone;
+        float power;
+        float maxIntensity;
+        float maxRadius;
+    };
+
+    static Cone mergeCones( const Cone& a, const Cone& b );
+    static float orientationMeasure( const Cone& cone );
+    static void merge( Bounds& bounds, const Bounds& other );
+
+    /// Upper bound of the contribution of any light inside the box, scaled by power.
+    static float importance( simd::float3 point, simd::float3 normal, simd::float3 boundsMin, simd::float3 boundsMax,
+                             const simd::float3& axis, float thetaO, float thetaE, float maxRadius, float power );
+    float nodeImportance( const Node& node, simd::float3 point, simd::float3 normal, bool upperBound ) const;
+
+    Bounds primitiveBounds( uint32_t light ) const;
+    Bounds rangeBounds( uint32_t first, uint32_t count ) const;
+    static void setNode( Node& node, const Bounds& bounds );
+    static Bounds nodeBounds( const Node& node );
+    void subdivide( uint32_t nodeIndex, std::vector<uint32_t>& stack );
+    void setLights( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+    float treeCost() const;
+
+    std::vector<Node>         _nodes;
+    std::vector<uint32_t>     _primitives;
+    std::vector<simd::float4> _spheres;
+    std::vector<float>        _intensity;
+    float _builtCost = 0.f;
+};
+
+#endif /* AAPLLightBVH_h */
@@ -0,0 +1,180 @@
+///
+///  AAPLLightClusters.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 06.04.24.
+///
+
+#include "AAPLLightClusters.h"
+#include "AAPLParallel.h"
+#include "AAPLUtilities.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+LightClusters::LightClusters()
+: _projectionMatrix{}
+, _near(0.f)
+, _far(0.f)
+, _sliceDepth{}
+, _grid{ kTilesX, kTilesY, kSlices, 0.f, 0.f }
+, _clusterBounds( kClusterCount )
+, _clusters( kClusterCount, LightCluster{ 0, 0 } )
+, _slices( kSlices )
+{
+}
+
+void LightClusters::setProjection( const simd::float4x4& projectionMatrix, float near, float far )
+{
+    if ( near == _near && far == _far && simd_equal( projectionMatrix, _projectionMatrix ) )
+    {
+        return;
+    }
+
+    AAPL_ASSERT( 0.f < near && near < far, "LightClusters: invalid depth range" );
+
+    _projectionMatrix = projectionMatrix;
+    _near = near;
+    _far  = far;
+
+    /// Slice k starts at near * (far / near)^(k / slices), so every slice has about the same depth ratio
+    const float logRatio = std::log( far / near );
+    for ( uint32_t slice = 0; slice <= kSlices; ++slice )
+    {
+        _sliceDepth[slice] = near * std::exp( logRatio * slice / kSlices );
+    }
+    _grid.sliceScale = kSlices / logRatio;
+    _grid.sliceBias  = -float( kSlices ) * std::log( near ) / logRatio;
+
+    /// A view space point at depth d projects to ndc = xy / (d * tan(fov / 2)), the view looks down -z
+    const float tanHalfX = 1.f / projectionMatrix.columns[0][0];
+    const float tanHalfY = 1.f / projectionMatrix.columns[1][1];
+
+    for ( uint32_t slice = 0; slice < kSlices; ++slice )
+    {
+        const float d0 = _sliceDepth[slice];
+        const float d1 = _sliceDepth[slice + 1];
+
+        for ( uint32_t tileY = 0; tileY < kTilesY; ++tileY )
+        {
+            const float ndcY1 = 1.f - 2.f * tileY / kTilesY;
+            const float ndcY0 = ndcY1 - 2.f / kTilesY;
+
+            for ( uint32_t tileX = 0; tileX < kTilesX; ++tileX )
+            {
+                const float ndcX0 = -1.f + 2.f * tileX / kTilesX;
+                const float ndcX1 = ndcX0 + 2.f / kTilesX;
+
+                Bounds& bounds = _clusterBounds[ clusterIndex( tileX, tileY, slice ) ];
+                bounds.boundsMin = (simd::float3){ std::min( ndcX0 * d0, ndcX0 * d1 ) * tanHalfX,
+                                                   std::min( ndcY0 * d0, ndcY0 * d1 ) * tanHalfY,
+                                                   -d1 };
+                bounds.boundsMax = (simd::float3){ std::max( ndcX1 * d0, ndcX1 * d1 ) * tanHalfX,
+                                                   std::max( ndcY1 * d0, ndcY1 * d1 ) * tanHalfY,
+                                                   -d0 };
+            }
+        }
+    }
+}
+
+void LightClusters::buildSlice( uint32_t sliceIndex, const simd::float4* pLightSpheres, size_t lightCount )
+{
+    Slice& slice = _slices[sliceIndex];
+    const float d0 = _sliceDepth[sliceIndex];
+    const float d1 = _sliceDepth[sliceIndex + 1];
+
+    slice.candidates.clear();
+    for ( uint32_t light = 0; light < lightCount; ++light )
+    {
+        const float depth  = -pLightSpheres[light].z;
+        const float radius = pLightSpheres[light].w;
+        if ( depth + radius >= d0 && depth - radius <= d1 )
+            slice.candidates.push_back( light );
+    }
+
+    /// Padding lanes sit at infinity and never pass the distance test
+    const size_t laneBlocks = ( slice.candidates.size() + 7 ) / 8;
+    slice.centerX.assign( laneBlocks, simd::float8( FLT_MAX ) );
+    slice.centerY.assign( laneBlocks, simd::float8( FLT_MAX ) );
+    slice.centerZ.assign( laneBlocks, simd::float8( FLT_MAX ) );
+    slice.radius.assign( laneBlocks, simd::float8( 0.f ) );
+    for ( size_t i = 0; i < slice.candidates.size(); ++i )
+    {
+        const simd::float4 sphere = pLightSpheres[ slice.candidates[i] ];
+        slice.centerX[i / 8][i % 8] = sphere.x;
+        slice.centerY[i / 8][i % 8] = sphere.y;
+        slice.centerZ[i / 8][i % 8] = sphere.z;
+        slice.radius[i / 8][i % 8]  = sphere.w;
+    }
+
+    const simd::float8 zero = 0.f;
+    slice.indices.clear();
+    for ( uint32_t tileY = 0; tileY < kTilesY; ++tileY )
+    {
+        for ( uint32_t tileX = 0; tileX < kTilesX; ++tileX )
+        {
+            const uint32_t cluster = clusterIndex( tileX, tileY, sliceIndex );
+            const Bounds& bounds = _clusterBounds[cluster];
+            const uint32_t first = uint32_t( slice.indices.size() );
+
+            /// Squared distance from the sphere center to the box against the squared radius
+            for ( size_t block = 0; block < laneBlocks; ++block )
+            {
+                const simd::float8 dx = simd_max( simd_max( bounds.boundsMin.x - slice.centerX[block],
+                                                            slice.centerX[block] - bounds.boundsMax.x ), zero );
+                const simd::float8 dy = simd_max( simd_max( bounds.boundsMin.y - slice.centerY[block],
+                                                            slice.centerY[block] - bounds.boundsMax.y ), zero );
+                const simd::float8 dz = simd_max( simd_max( bounds.boundsMin.z - slice.centerZ[block],
+                                                            slice.centerZ[block] - bounds.boundsMax.z ), zero );
+                const simd::int8 inside = ( dx * dx + dy * dy + dz * dz ) <= slice.radius[block] * slice.radius[block];
+                if ( !simd_any( inside ) )
+                    continue;
+
+                for ( uint32_t lane = 0; lane < 8; ++lane )
+                {
+                    if ( inside[lane] )
+                        slice.indices.push_back( slice.candidates[ block * 8 + lane ] );
+                }
+            }
+
+            /// Offsets are relative to the slice until build() concatenates the slices
+            _clusters[cluster] = LightCluster{ first, uint32_t( slice.indices.size() ) - first };
+        }
+    }
+}
+
+void LightClusters::build( const simd::float4* pLightSpheres, size_t lightCount )
+{
+    parallelFor( kSlices, 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t slice = begin; slice < end; ++slice )
+            buildSlice( uint32_t( slice ), pLightSpheres, lightCount );
+    });
+
+    uint32_t sliceOffset[kSlices];
+    uint32_t total = 0;
+    for ( uint32_t slice = 0; slice < kSlices; ++slice )
+    {
+        sliceOffset[slice] = total;
+        total += uint32_t( _slices[slice].indices.size() );
+    }
+    _lightIndices.resize( total );
+
+    parallelFor( kSlices, 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t slice = begin; slice < end; ++slice )
+        {
+            const std::vector<uint32_t>& indices = _slices[slice].indices;
+            if ( !indices.empty() )
+                memcpy( _lightIndices.data() + sliceOffset[slice], indices.data(), indices.size() * sizeof( uint32_t ) );
+
+            for ( uint32_t cluster = clusterIndex( 0, 0, uint32_t( slice ) );
+                 cluster < clusterIndex( 0, 0, uint32_t( slice ) + 1 ); ++cluster )
+            {
+                _clusters[cluster].offset += sliceOffset[slice];
+            }
+        }
+    });
+}
@@ -0,0 +1,83 @@
+///
+///  AAPLLightClusters.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 06.04.24.
+///
+/// Abstract:
+/// Clustered light assignment on the CPU. The view frustum is split into screen tiles and
+/// exponential depth slices, every point light sphere is tested against the view space
+/// bounds of the clusters it may touch, and the result is a compact light index list with
+/// one range per cluster. Slices are processed in parallel, the sphere tests of a cluster
+/// run eight lights at a time.
+
+#pragma once
+#ifndef AAPLLightClusters_h
+#define AAPLLightClusters_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+
+#include "AAPLShaderTypes.h"
+
+class LightClusters
+{
+public:
+    static constexpr uint32_t kTilesX = 16;
+    static constexpr uint32_t kTilesY = 8;
+    static constexpr uint32_t kSlices = 24;
+    static constexpr uint32_t kClusterCount = kTilesX * kTilesY * kSlices;
+
+    LightClusters();
+
+    /// Recomputes the cluster bounds, only if projection or depth range changed.
+    void setProjection( const simd::float4x4& projectionMatrix, float near, float far );
+
+    /// Assigns view space light spheres, center in xyz and radius in w, to the clusters.
+    void build( const simd::float4* pLightSpheres, size_t lightCount );
+
+    const LightClusterGrid& grid() const { return _grid; }
+    const std::vector<LightCluster>& clusters() const { return _clusters; }
+    const std::vector<uint32_t>& lightIndices() const { return _lightIndices; }
+
+    /// Tile y counts from the top of the screen, like the framebuffer rows.
+    static uint32_t clusterIndex( uint32_t tileX, uint32_t tileY, uint32_t slice )
+    {
+        return ( slice * kTilesY + tileY ) * kTilesX + tileX;
+    }
+
+private:
+    struct Bounds
+    {
+        simd::float3 boundsMin;
+        simd::float3 boundsMax;
+    };
+
+    /// Per slice scratch, lights overlapping the slice depth range in SoA lanes of eight
+    struct Slice
+    {
+        std::vector<uint32_t>     candidates;
+        std::vector<simd::float8> centerX;
+        std::vector<simd::float8> centerY;
+        std::vector<simd::float8> centerZ;
+        std::vector<simd::float8> radius;
+        std::vector<uint32_t>     indices;
+    };
+
+    void buildSlice( uint32_t slice, const simd::float4* pLightSpheres, size_t lightCount );
+
+    simd::float4x4 _projectionMatrix;
+    float _near;
+    float _far;
+    float _sliceDepth[kSlices + 1];
+
+    LightClusterGrid _grid;
+    std::vector<Bounds> _clusterBounds;
+    std::vector<LightCluster> _clusters;
+    std::vector<uint32_t> _lightIndices;
+    std::vector<Slice> _slices;
+};
+
+#endif /* AAPLLightClusters_h */
@@ -0,0 +1,250 @@
+///
+///  AAPLLightCuts.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 20.04.24.
+///
+
+#include "AAPLLightCuts.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+namespace
+{
+    /// Rec. 709 luminance of the light color
+    const simd::float3 kLuminance = { 0.2126f, 0.7152f, 0.0722f };
+
+    inline simd::float3 chromaticity( simd::float3 color )
+    {
+        const float sum = color.x + color.y + color.z;
+        return sum > 0.f ? color / sum : (simd::float3){ 1.f / 3.f, 1.f / 3.f, 1.f / 3.f };
+    }
+}
+
+LightCuts::LightCuts()
+: _errorRatio(0.05f)
+, _colorWeight(1.f)
+{
+}
+
+void LightCuts::setLights( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    _spheres.assign( pSpheres, pSpheres + count );
+    _colors.resize( count );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        _colors[i] = simd_max( pLights[i].pointLightColor, (simd::float3){ 0.f, 0.f, 0.f } );
+    }
+}
+
+void LightCuts::setLeaf( Node& node ) const
+{
+    const uint32_t light = _order[node.leftFirst];
+    node.center       = _spheres[light].xyz;
+    node.color        = _colors[light];
+    node.chroma       = chromaticity( _colors[light] );
+    node.intensity    = simd_dot( _colors[light], kLuminance );
+    node.spread       = 0.f;
+    node.chromaSpread = 0.f;
+    node.radius       = _spheres[light].w;
+}
+
+void LightCuts::setInner( Node& node ) const
+{
+    const Node& a = _nodes[node.leftFirst];
+    const Node& b = _nodes[node.leftFirst + 1];
+
+    /// Brighter children pull the representative towards them, dark ones weigh equally
+    const float intensity = a.intensity + b.intensity;
+    const float weight = intensity > 0.f ? b.intensity / intensity : 0.5f;
+
+    node.center    = simd_mix( a.center, b.center, (simd::float3){ weight, weight, weight } );
+    node.chroma    = simd_mix( a.chroma, b.chroma, (simd::float3){ weight, weight, weight } );
+    node.color     = a.color + b.color;
+    node.intensity = intensity;
+
+    /// Bounds over the children bound the lights below, they only grow by refitting
+    const float distanceA = simd_length( a.center - node.center );
+    const float distanceB = simd_length( b.center - node.center );
+    node.spread       = std::max( distanceA + a.spread, distanceB + b.spread );
+    node.radius       = std::max( distanceA + a.radius, distanceB + b.radius );
+    node.chromaSpread = std::max( simd_length( a.chroma - node.chroma ) + a.chromaSpread,
+                                  simd_length( b.chroma - node.chroma ) + b.chromaSpread );
+}
+
+float LightCuts::nodeError( const Node& node ) const
+{
+    /// Chromaticity differences count as a shift of the light in the size of its reach
+    return node.spread + _colorWeight * node.chromaSpread * node.radius;
+}
+
+void LightCuts::build( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    setLights( pLights, pSpheres, count );
+    _order.resize( count );
+    _nodes.clear();
+    _nodes.reserve( count ? 2 * count - 1 : 0 );
+    ++_rebuildCount;
+
+    if ( count == 0 )
+    {
+        _builtLooseness = 0.f;
+        return;
+    }
+
+    for ( uint32_t i = 0; i < count; ++i )
+        _order[i] = i;
+
+    struct Range
+    {
+        uint32_t node;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    /// Children are always appended behind their parent, the bottom up passes rely on that order
+    _nodes.push_back( Node{} );
+    std::vector<Range> stack = { { 0, 0, uint32_t( count ) } };
+    while ( !stack.empty() )
+    {
+        const Range range = stack.back();
+        stack.pop_back();
+
+        if ( range.count == 1 )
+        {
+            _nodes[range.node].leftFirst = range.first;
+            _nodes[range.node].count     = 1;
+            continue;
+        }
+
+        /// Split at the median of the widest of position and chromaticity, the chromaticity
+        /// scaled to the spatial extent so both compete at every level
+        simd::float3 positionMin = FLT_MAX, positionMax = -FLT_MAX;
+        simd::float3 chromaMin   = FLT_MAX, chromaMax   = -FLT_MAX;
+        for ( uint32_t i = range.first; i < range.first + range.count; ++i )
+        {
+            const uint32_t light = _order[i];
+            positionMin = simd_min( positionMin, _spheres[light].xyz );
+            positionMax = simd_max( positionMax, _spheres[light].xyz );
+            chromaMin   = simd_min( chromaMin, chromaticity( _colors[light] ) );
+            chromaMax   = simd_max( chromaMax, chromaticity( _colors[light] ) );
+        }
+        const simd::float3 positionExtent = positionMax - positionMin;
+        const float spatialExtent = std::max( std::max( positionExtent.x, positionExtent.y ), positionExtent.z );
+        const simd::float3 chromaExtent = ( chromaMax - chromaMin ) * ( _colorWeight * spatialExtent );
+
+        int axis = 0;
+        float widest = -1.f;
+        for ( int dimension = 0; dimension < 6; ++dimension )
+        {
+            const float extent = dimension < 3 ? positionExtent[dimension] : chromaExtent[dimension - 3];
+            if ( extent > widest )
+            {
+                widest = extent;
+                axis = dimension;
+            }
+        }
+
+        auto key = [&]( uint32_t light )
+        {
+            return axis < 3 ? _spheres[light][axis] : chromaticity( _colors[light] )[axis - 3];
+        };
+
+        const uint32_t half = range.count / 2;
+        std::nth_element( &_order[range.first], &_order[range.first + half], &_order[range.first] + range.count,
+                          [&]( uint32_t a, uint32_t b ) { return key( a ) < key( b ); } );
+
+        const uint32_t leftIndex = uint32_t( _nodes.size() );
+        _nodes.push_back( Node{} );
+        _nodes.push_back( Node{} );
+        _nodes[range.node].leftFirst = leftIndex;
+        _nodes[range.node].count     = 0;
+
+        stack.push_back( { leftIndex + 1, range.first + half, range.count - half } );
+        stack.push_back( { leftIndex, range.first, half } );
+    }
+
+    for ( size_t nodeIndex = _nodes.size(); nodeIndex-- > 0; )
+    {
+        Node& node = _nodes[nodeIndex];
+        if ( node.isLeaf() )
+            setLeaf( node );
+        else
+            setInner( node );
+    }
+
+    _builtLooseness = treeLooseness();
+}
+
+float LightCuts::treeLooseness() const
+{
+    /// Summed spread of all representatives relative to the light count
+    float spread = 0.f;
+    for ( const Node& node : _nodes )
+        spread += node.spread;
+    return spread / float( _order.size() );
+}
+
+bool LightCuts::refit( const PointLightData* pLights, const simd::float4* pSpheres )
+{
+    if ( _nodes.empty() )
+        return true;
+
+    setLights( pLights, pSpheres, _order.size() );
+
+    /// Children follow their parents, so one reverse sweep sees every child before its parent
+    for ( size_t nodeIndex = _nodes.size(); nodeIndex-- > 0; )
+    {
+        Node& node = _nodes[nodeIndex];
+        if ( node.isLeaf() )
+            setLeaf( node );
+        else
+            setInner( node );
+    }
+
+    return treeLooseness() <= kRebuildRatio * _builtLooseness;
+}
+
+bool LightCuts::update( const PointLightData* pLights, const simd::float4* pSpheres, size_t count )
+{
+    if ( count != _order.size() || ( count && _nodes.empty() ) || !refit( pLights, pSpheres ) )
+    {
+        build( pLights, pSpheres, count );
+        return true;
+    }
+    return false;
+}
+
+void LightCuts::selectCut( float near )
+{
+    _cutLights.clear();
+    _cutSpheres.clear();
+    if ( _nodes.empty() )
+        return;
+
+    /// Top down, a node is taken as soon as its error is small against the distance of its
+    /// nearest light, the camera sits at the view space origin
+    std::vector<uint32_t> stack = { 0 };
+    while ( !stack.empty() )
+    {
+        const Node& node = _nodes[stack.back()];
+        stack.pop_back();
+
+        const float distance = std::max( simd_length( node.center ) - node.spread, near );
+        if ( !node.isLeaf() && nodeError( node ) > _errorRatio * distance )
+        {
+            stack.push_back( node.leftFirst + 1 );
+            stack.push_back( node.leftFirst );
+            continue;
+        }
+
+        PointLightData light;
+        light.pointLightColor = node.color;
+        light.light_radius    = node.radius;
+        light.light_speed     = 0.f;
+        _cutLights.push_back( light );
+        _cutSpheres.push_back( (simd::float4){ node.center.x, node.center.y, node.center.z, node.radius } );
+    }
+}
@@ -0,0 +1,102 @@
+///
+///  AAPLLightCuts.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 20.04.24.
+///
+/// Abstract:
+/// Light level of detail in the spirit of lightcuts. The point lights are merged into a
+/// binary tree by proximity and color, every node is a representative light with the summed
+/// color, placed at the intensity weighted center and with a radius covering all of its
+/// lights. The tree is built top down with median splits over position and chromaticity,
+/// refit every frame and rebuilt once it got too loose. A cut through the tree is chosen per
+/// frame, a node stands in for its lights when its position and color error is small against
+/// its distance to the camera. Near lights stay single, distant groups collapse, so the
+/// number of lights to draw grows roughly with the logarithm of the light count.
+
+#pragma once
+#ifndef AAPLLightCuts_h
+#define AAPLLightCuts_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "AAPLShaderTypes.h"
+
+class LightCuts
+{
+public:
+    LightCuts();
+
+    /// Builds the tree over count view space lights, positions in xyz and the light radius in w.
+    void build( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+
+    /// Refits the representatives to the new positions and colors of the same lights.
+    /// Returns false if the refit tree became much worse than the built one and should be rebuilt.
+    bool refit( const PointLightData* pLights, const simd::float4* pSpheres );
+
+    /// Refits, or rebuilds for a new light count or a loose tree. Returns true after a rebuild.
+    bool update( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+
+    /// Largest error of a representative relative to its distance from the camera at the origin,
+    /// and the weight of the chromaticity difference against the position error.
+    void setErrorRatio( float ratio ) { _errorRatio = ratio; }
+    void setColorWeight( float weight ) { _colorWeight = weight; }
+    float errorRatio() const { return _errorRatio; }
+
+    /// Chooses the cut, distances below near count as near.
+    void selectCut( float near );
+
+    /// Representative lights of the cut, the spheres hold the view space center and the radius.
+    const std::vector<PointLightData>& cutLights() const { return _cutLights; }
+    const std::vector<simd::float4>& cutSpheres() const { return _cutSpheres; }
+
+    size_t lightCount() const { return _order.size(); }
+    size_t nodeCount() const { return _nodes.size(); }
+    size_t cutSize() const { return _cutSpheres.size(); }
+    size_t rebuildCount() const { return _rebuildCount; }
+
+private:
+    static constexpr float kRebuildRatio = 1.6f;
+
+    /// Leaves have count 1 and leftFirst indexes _order, inner nodes have their two children
+    /// at leftFirst and leftFirst + 1.
+    struct Node
+    {
+        simd::float3 center;        /// intensity weighted mean of the light positions
+        simd::float3 color;         /// summed light colors
+        simd::float3 chroma;        /// mean chromaticity
+        float        intensity;     /// summed luminance
+        float        spread;        /// largest distance of a light from the center
+        float        chromaSpread;  /// largest chromaticity distance of a light from the mean
+        float        radius;        /// reaches as far as the farthest light does
+        uint32_t     leftFirst;
+        uint32_t     count;
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    void setLights( const PointLightData* pLights, const simd::float4* pSpheres, size_t count );
+    void setLeaf( Node& node ) const;
+    void setInner( Node& node ) const;
+    float nodeError( const Node& node ) const;
+    float treeLooseness() const;
+
+    float _errorRatio;
+    float _colorWeight;
+
+    std::vector<Node>         _nodes;
+    std::vector<uint32_t>     _order;
+    std::vector<simd::float4> _spheres;
+    std::vector<simd::float3> _colors;
+    float  _builtLooseness = 0.f;
+    size_t _rebuildCount = 0;
+
+    std::vector<PointLightData> _cutLights;
+    std::vector<simd::float4>   _cutSpheres;
+};
+
+#endif /* AAPLLightCuts_h */
@@ -0,0 +1,243 @@
+///
+///  AAPLLightProxies.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 11.04.24.
+///
+
+#include "AAPLLightProxies.h"
+#include "AAPLUtilities.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iterator>
+#include <unordered_map>
+
+namespace
+{
+    /// Costs relative to one fragment of deferred_point_lighting_fragment_traditional.
+    /// Every proxy is drawn twice, by the stencil mask pass and by the lighting pass.
+    constexpr float kTriangleCost   = 0.5f;   /// vertex work and setup per triangle and pass
+    constexpr float kMaskPixelCost  = 0.1f;   /// stencil only fragment of the mask pass
+    constexpr float kLightPixelCost = 1.f;
+
+    constexpr float kPi = 3.14159265358979f;
+
+    /// Circumradius of the icosahedron makeIcosahedronMesh built for the light volumes,
+    /// its vertices are ( 0, +-Z, +-Z / golden ratio ) with the radius passed as Z.
+    float legacyCircumradius()
+    {
+        const float Z = 1.f / ( std::sqrt( 3.f ) / 12.f * ( 3.f + std::sqrt( 5.f ) ) );
+        const float X = Z * 2.f / ( 1.f + std::sqrt( 5.f ) );
+        return std::sqrt( X * X + Z * Z );
+    }
+
+    using Triangle = std::array<uint16_t, 3>;
+}
+
+LightProxies::LightProxies()
+: _legacyCircumradius(0.f)
+, _legacyAreaFactor(0.f)
+, _stats{}
+{
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        _levels[level] = { 0, 0, 0.f, 0.f };
+        _buckets[level] = { 0, 0 };
+    }
+}
+
+void LightProxies::buildIcospheres( std::vector<simd::float4>& vertices, std::vector<uint16_t>& indices )
+{
+    /// Unit icosahedron, same vertex order and outward facing winding as makeIcosahedronMesh
+    const float phi = ( 1.f + std::sqrt( 5.f ) ) * 0.5f;
+    const float Z = 1.f / std::sqrt( 1.f + 1.f / ( phi * phi ) );
+    const float X = Z / phi;
+    const simd::float3 icosahedron[] =
+    {
+        {  -X, 0.f,   Z }, {   X, 0.f,   Z }, {  -X, 0.f,  -Z }, {   X, 0.f,  -Z },
+        { 0.f,   Z,   X }, { 0.f,   Z,  -X }, { 0.f,  -Z,   X }, { 0.f,  -Z,  -X },
+        {   Z,   X, 0.f }, {  -Z,   X, 0.f }, {   Z,  -X, 0.f }, {  -Z,  -X, 0.f }
+    };
+    std::vector<simd::float3> points( std::begin( icosahedron ), std::end( icosahedron ) );
+    std::vector<Triangle> triangles =
+    {
+        {  0,  1,  4 }, {  0,  4,  9 }, {  9,  4,  5 }, {  4,  8,  5 }, {  4,  1,  8 },
+        {  8,  1, 10 }, {  8, 10,  3 }, {  5,  8,  3 }, {  5,  3,  2 }, {  2,  3,  7 },
+        {  7,  3, 10 }, {  7, 10,  6 }, {  7,  6, 11 }, { 11,  6,  0 }, {  0,  6,  1 },
+        {  6, 10,  1 }, {  9, 11,  0 }, {  9,  2, 11 }, {  9,  5,  2 }, {  7, 11,  2 }
+    };
+
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        if ( level > 0 )
+        {
+            /// Split every triangle into four, edge midpoints are shared and pushed onto the sphere
+            std::unordered_map<uint32_t, uint16_t> midpoints;
+            auto midpoint = [&]( uint16_t a, uint16_t b ) -> uint16_t
+            {
+                const uint32_t key = uint32_t( std::min( a, b ) ) << 16 | std::max( a, b );
+                auto found = midpoints.find( key );
+                if ( found != midpoints.end() )
+                    return found->second;
+
+                const uint16_t index = uint16_t( points.size() );
+                points.push_back( simd_normalize( points[a] + points[b] ) );
+                midpoints.emplace( key, index );
+                return index;
+            };
+
+            std::vector<Triangle> subdivided;
+            subdivided.reserve( triangles.size() * 4 );
+            for ( const Triangle& t : triangles )
+            {
+                const uint16_t ab = midpoint( t[0], t[1] );
+                const uint16_t bc = midpoint( t[1], t[2] );
+                const uint16_t ca = midpoint( t[2], t[0] );
+                subdivided.push_back( { t[0], ab, ca } );
+                subdivided.push_back( { t[1], bc, ab } );
+                subdivided.push_back( { t[2], ca, bc } );
+                subdivided.push_back( { ab, bc, ca } );
+            }
+            triangles.swap( subdivided );
+        }
+
+        /// The closest face plane sets the scale at which the proxy encloses the unit sphere,
+        /// the surface area gives the mean projected area over all view directions (Cauchy)
+        float inradius = 1.f;
+        float area = 0.f;
+        for ( const Triangle& t : triangles )
+        {
+            const simd::float3 normal = simd_cross( points[t[1]] - points[t[0]], points[t[2]] - points[t[0]] );
+            inradius = std::min( inradius, simd_dot( simd_normalize( normal ), points[t[0]] ) );
+            area += 0.5f * simd_length( normal );
+        }
+        AAPL_ASSERT( inradius > 0.f, "LightProxies: icosphere faces must point outwards" );
+
+        const float scale = 1.f / inradius;
+        const uint16_t baseVertex = uint16_t( vertices.size() );
+        AAPL_ASSERT( vertices.size() + points.size() <= UINT16_MAX, "LightProxies: too many vertices for 16 bit indices" );
+
+        for ( const simd::float3& point : points )
+        {
+            vertices.push_back( (simd::float4){ point.x * scale, point.y * scale, point.z * scale, 1.f } );
+        }
+
+        Level& proxy = _levels[level];
+        proxy.indexOffset  = indices.size() * sizeof( uint16_t );
+        proxy.indexCount   = triangles.size() * 3;
+        proxy.circumradius = scale;
+        proxy.areaFactor   = area * scale * scale / ( 4.f * kPi );
+
+        for ( const Triangle& t : triangles )
+        {
+            indices.push_back( baseVertex + t[0] );
+            indices.push_back( baseVertex + t[1] );
+            indices.push_back( baseVertex + t[2] );
+        }
+
+        if ( level == 0 )
+        {
+            /// Same shape as level 0, only scaled from the unit circumradius
+            _legacyCircumradius = legacyCircumradius();
+            _legacyAreaFactor = area * _legacyCircumradius * _legacyCircumradius / ( 4.f * kPi );
+        }
+    }
+}
+
+float LightProxies::proxyPixels( float areaFactor, float circumradius, const simd::float4& sphere,
+                                 float pixelScale, float near, float screenPixels )
+{
+    /// The view looks down -z
+    const float depth  = -sphere.z;
+    const float extent = circumradius * sphere.w;
+
+    if ( depth + extent <= near )
+        return 0.f;
+
+    /// Clipped by the near plane, the back faces of the mask pass cover the whole screen
+    if ( depth - extent <= near )
+        return screenPixels;
+
+    const float pixelRadius = sphere.w * pixelScale / depth;
+    return std::min( areaFactor * kPi * pixelRadius * pixelRadius, screenPixels );
+}
+
+float LightProxies::levelCost( size_t level, float pixels ) const
+{
+    return 2.f * kTriangleCost * ( _levels[level].indexCount / 3 ) + ( kMaskPixelCost + kLightPixelCost ) * pixels;
+}
+
+float LightProxies::legacyCost( float pixels ) const
+{
+    /// Same triangles as level 0
+    return levelCost( 0, pixels );
+}
+
+uint8_t LightProxies::cheapestLevel( const simd::float4& sphere, float pixelScale, float near, float screenPixels,
+                                     float& pixels, float& cost ) const
+{
+    uint8_t best = 0;
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        const float levelPixels = proxyPixels( _levels[level].areaFactor, _levels[level].circumradius,
+                                               sphere, pixelScale, near, screenPixels );
+        const float estimate = levelCost( level, levelPixels );
+        if ( level == 0 || estimate < cost )
+        {
+            best = uint8_t( level );
+            pixels = levelPixels;
+            cost = estimate;
+        }
+    }
+    return best;
+}
+
+void LightProxies::select( const simd::float4* pViewSpheres, size_t lightCount,
+                           float pixelScale, float near, float screenPixels )
+{
+    _selected.resize( lightCount );
+    _stats = {};
+
+    NS::UInteger counts[kLevelCount] = { 0 };
+
+    for ( size_t light = 0; light < lightCount; ++light )
+    {
+        const simd::float4& sphere = pViewSpheres[light];
+
+        /// The proxies only differ in fit, any level gives the same image, no hysteresis needed
+        float bestPixels, bestCost;
+        const uint8_t best = cheapestLevel( sphere, pixelScale, near, screenPixels, bestPixels, bestCost );
+
+        const float legacyPixels = proxyPixels( _legacyAreaFactor, _legacyCircumradius,
+                                                sphere, pixelScale, near, screenPixels );
+
+        _stats.spherePixels   += proxyPixels( 1.f, 1.f, sphere, pixelScale, near, screenPixels );
+        _stats.legacyPixels   += legacyPixels;
+        _stats.selectedPixels += bestPixels;
+        _stats.legacyCost     += legacyCost( legacyPixels );
+        _stats.selectedCost   += bestCost;
+
+        _selected[light] = best;
+        ++counts[best];
+    }
+
+    NS::UInteger first = 0;
+    for ( size_t level = 0; level < kLevelCount; ++level )
+    {
+        _buckets[level] = { first, counts[level] };
+        first += counts[level];
+    }
+
+    /// Counting sort by level, stable so each bucket stays in light order
+    NS::UInteger cursor[kLevelCount];
+    for ( size_t level = 0; level < kLevelCount; ++level )
+        cursor[level] = _buckets[level].firstInstance;
+
+    _ordered.resize( lightCount );
+    for ( uint32_t light = 0; light < lightCount; ++light )
+    {
+        _ordered[ cursor[ _selected[light] ]++ ] = light;
+    }
+}
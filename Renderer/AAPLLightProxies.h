@@ -0,0 +1,92 @@
+///
+///  AAPLLightProxies.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 11.04.24.
+///
+/// Abstract:
+/// Proxy geometry for the point light volumes. Icospheres of several subdivision levels
+/// share one vertex and one index buffer, each scaled so its faces just touch the unit
+/// sphere. A CPU estimate of the projected proxy area per light picks the level with the
+/// lowest vertex plus fragment cost, coarse proxies for small or distant lights, finer
+/// ones where a light covers a large part of the screen. Lights are grouped per level so
+/// every level is drawn with one instanced draw call.
+
+#pragma once
+#ifndef AAPLLightProxies_h
+#define AAPLLightProxies_h
+
+#include <simd/simd.h>
+#include <Metal/Metal.hpp>
+
+#include <vector>
+#include <cstdint>
+
+class LightProxies
+{
+public:
+    static constexpr size_t kLevelCount = 4;
+
+    /// Level n is the icosahedron subdivided n times.
+    struct Level
+    {
+        NS::UInteger indexOffset;   /// in bytes
+        NS::UInteger indexCount;
+        float        circumradius;  /// for a unit light radius
+        float        areaFactor;    /// mean projected area relative to the sphere silhouette
+    };
+
+    /// Light range of one level inside orderedLights().
+    struct Bucket
+    {
+        NS::UInteger firstInstance;
+        NS::UInteger instanceCount;
+    };
+
+    /// Estimated covered pixels and cost of the last select(), the legacy proxy is the single
+    /// inflated icosahedron the light volumes were drawn with before.
+    struct Stats
+    {
+        double spherePixels;
+        double legacyPixels;
+        double selectedPixels;
+        double legacyCost;
+        double selectedCost;
+    };
+
+    LightProxies();
+
+    /// Appends all levels as triangle lists with absolute indices, positions have w = 1.
+    void buildIcospheres( std::vector<simd::float4>& vertices, std::vector<uint16_t>& indices );
+    const Level& level( size_t level ) const { return _levels[level]; }
+
+    /// Picks the cheapest level for every view space light sphere, radius in w.
+    /// pixelScale converts a radius at depth 1 into pixels, (projection[1][1] * viewport height / 2).
+    void select( const simd::float4* pViewSpheres, size_t lightCount,
+                 float pixelScale, float near, float screenPixels );
+
+    /// Light indices ordered by level, the proxy draws map their instance id through it.
+    const std::vector<uint32_t>& orderedLights() const { return _ordered; }
+    const Bucket& bucket( size_t level ) const { return _buckets[level]; }
+    const Stats& stats() const { return _stats; }
+
+private:
+    /// Covered pixels of a proxy with the given area factor.
+    static float proxyPixels( float areaFactor, float circumradius, const simd::float4& sphere,
+                              float pixelScale, float near, float screenPixels );
+    float levelCost( size_t level, float pixels ) const;
+    float legacyCost( float pixels ) const;
+    uint8_t cheapestLevel( const simd::float4& sphere, float pixelScale, float near, float screenPixels,
+                           float& pixels, float& cost ) const;
+
+    Level _levels[kLevelCount];
+    float _legacyCircumradius;
+    float _legacyAreaFactor;
+
+    std::vector<uint8_t> _selected;
+    std::vector<uint32_t> _ordered;
+    Bucket _buckets[kLevelCount];
+    Stats _stats;
+};
+
+#endif /* AAPLLightProxies_h */
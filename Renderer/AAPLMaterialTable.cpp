@@ -0,0 +1,179 @@
+///
+///  AAPLMaterialTable.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 28.04.24.
+///
+
+#include "AAPLMaterialTable.h"
+#include "AAPLMesh.h"
+
+#include <cstring>
+#include <functional>
+
+MaterialData Material::defaultData()
+{
+    return MaterialData{ { 1.f, 1.f, 1.f, 1.f }, 1.f, 1.f, 1.f, 0.f };
+}
+
+size_t MaterialTable::Hash::operator()( const Material& material ) const
+{
+    /// FNV-1a over the texture pointers and the bits of the factors
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash]( const void* pData, size_t size )
+    {
+        const uint8_t* pBytes = static_cast<const uint8_t*>( pData );
+        for ( size_t i = 0; i < size; ++i )
+            hash = ( hash ^ pBytes[i] ) * 1099511628211ull;
+    };
+    mix( material.pTextures, sizeof( material.pTextures ) );
+    mix( &material.data, sizeof( material.data ) );
+    return size_t( hash );
+}
+
+bool MaterialTable::Equal::operator()( const Material& a, const Material& b ) const
+{
+    return std::memcmp( a.pTextures, b.pTextures, sizeof( a.pTextures ) ) == 0
+        && std::memcmp( &a.data, &b.data, sizeof( a.data ) ) == 0;
+}
+
+MaterialTable::~MaterialTable()
+{
+    clear();
+}
+
+uint32_t MaterialTable::intern( const Material& material )
+{
+    Material key = material;
+    key.data.padding = 0.f;
+
+    const auto found = _indices.find( key );
+    if ( found != _indices.end() )
+        return found->second;
+
+    for ( MTL::Texture* pTexture : key.pTextures )
+    {
+        if ( pTexture )
+            pTexture->retain();
+    }
+    const uint32_t index = uint32_t( _materials.size() );
+    _materials.push_back( key );
+    _indices.emplace( key, index );
+    return index;
+}
+
+void MaterialTable::bind( MTL::RenderCommandEncoder* pEncoder, uint32_t index ) const
+{
+    const Material& material = _materials[index];
+    for ( uint32_t slot = 0; slot < kMaterialTextureCount; ++slot )
+    {
+        if ( material.pTextures[slot] )
+            pEncoder->setFragmentTexture( material.pTextures[slot], TextureIndexBaseColor + slot );
+    }
+    pEncoder->setFragmentBytes( &material.data, sizeof( MaterialData ), BufferIndexMaterialData );
+}
+
+void MaterialTable::replaceTexture( MTL::Texture* pOld, MTL::Texture* pNew )
+{
+    bool replaced = false;
+    for ( Material& material : _materials )
+    {
+        for ( MTL::Texture*& pTexture : material.pTextures )
+        {
+            if ( pTexture != pOld )
+                continue;
+            pNew->retain();
+            pOld->release();
+            pTexture = pNew;
+            replaced = true;
+        }
+    }
+    if ( !replaced )
+        return;
+
+    /// The pointers are part of the key, the indices stay the same
+    _indices.clear();
+    for ( uint32_t index = 0; index < _materials.size(); ++index )
+        _indices.emplace( _materials[index], index );
+}
+
+void MaterialTable::clear()
+{
+    for ( Material& material : _materials )
+    {
+        for ( MTL::Texture* pTexture : material.pTextures )
+        {
+            if ( pTexture )
+                pTexture->release();
+        }
+    }
+    _materials.clear();
+    _indices.clear();
+}
+
+void MaterialDrawList::clear()
+{
+    _draws.clear();
+    _meshes.clear();
+}
+
+void MaterialDrawList::add( const Mesh& mesh, NS::UInteger instanceCount, NS::UInteger baseInstance )
+{
+    _meshes.push_back( &mesh );
+    for ( const Submesh& submesh : mesh.submeshes() )
+        _draws.push_back( Draw{ &mesh, &submesh, instanceCount, baseInstance } );
+}
+
+void MaterialDrawList::encode( MTL::RenderCommandEncoder* pEncoder, const MaterialTable& materials )
+{
+    _statistics = { 0, 0, 0 };
+    if ( _draws.empty() )
+        return;
+
+    /// Material above the mesh in the key, kNoMaterial wraps around to the front
+    _keys.resize( _draws.size() );
+    _order.resize( _draws.size() );
+    uint32_t meshIndex = 0;
+    for ( size_t i = 0; i < _draws.size(); ++i )
+    {
+        while ( _meshes[meshIndex] != _draws[i].pMesh )
+            ++meshIndex;
+        const uint32_t material = _draws[i].pSubmesh->material() + 1;
+        _keys[i]  = ( uint64_t( material ) << 32 ) | meshIndex;
+        _order[i] = uint32_t( i );
+    }
+    _drawOrder.sort( _keys, _order );
+
+    uint32_t    boundMaterial = MaterialTable::kNoMaterial;
+    const Mesh* pBoundMesh    = nullptr;
+    for ( uint32_t index : _order )
+    {
+        const Draw& draw = _draws[index];
+        const Submesh& submesh = *draw.pSubmesh;
+        if ( submesh.material() != MaterialTable::kNoMaterial && submesh.material() != boundMaterial )
+        {
+            materials.bind( pEncoder, submesh.material() );
+            boundMaterial = submesh.material();
+            ++_statistics.materialBindCount;
+        }
+        if ( draw.pMesh != pBoundMesh )
+        {
+            for ( const MeshBuffer& meshBuffer : draw.pMesh->vertexBuffers() )
+            {
+                pEncoder->setVertexBuffer( meshBuffer.buffer(), meshBuffer.offset(), meshBuffer.argumentIndex() );
+                ++_statistics.vertexBufferBindCount;
+            }
+            pBoundMesh = draw.pMesh;
+        }
+
+        pEncoder->drawIndexedPrimitives( submesh.primitiveType(),
+                                         submesh.indexCount(),
+                                         submesh.indexType(),
+                                         submesh.indexBuffer().buffer(),
+                                         submesh.indexBuffer().offset(),
+                                         draw.instanceCount,
+                                         0,
+                                         draw.baseInstance );
+        ++_statistics.drawCount;
+    }
+}
@@ -0,0 +1,126 @@
+///
+///  AAPLMaterialTable.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 28.04.24.
+///
+/// Abstract:
+/// Materials interned into one table and referred to by index. A material is the texture set
+/// of the PBR fragment shader and its MaterialData factors, two submeshes with the same set and
+/// the same factors share one entry, however many meshes a scene loads. The draw list collects
+/// submesh draws and encodes them grouped by material and mesh, so textures and factors are
+/// bound once per group and vertex buffers once per mesh within it.
+
+#pragma once
+#ifndef AAPLMaterialTable_h
+#define AAPLMaterialTable_h
+
+#include <Metal/Metal.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "AAPLShaderTypes.h"
+#include "AAPLDrawOrder.h"
+
+/// Base color, normal and ORM, the textures bound at TextureIndexBaseColor to TextureIndexORM.
+static constexpr uint32_t kMaterialTextureCount = 3;
+
+struct Material
+{
+    MTL::Texture* pTextures[kMaterialTextureCount];   /// indexed by TextureIndex, nullptr leaves the slot as it is
+    MaterialData  data;
+
+    /// Factors that leave the textures as they are.
+    static MaterialData defaultData();
+};
+
+class MaterialTable
+{
+public:
+    static constexpr uint32_t kNoMaterial = UINT32_MAX;
+
+    MaterialTable() = default;
+
+    /// Releases the textures of every material.
+    ~MaterialTable();
+
+    MaterialTable( const MaterialTable& ) = delete;
+    MaterialTable& operator=( const MaterialTable& ) = delete;
+
+    /// Index of the material, added and its textures retained when the table has no material
+    /// with the same textures and bit for bit the same factors yet.
+    uint32_t intern( const Material& material );
+
+    const Material& material( uint32_t index ) const { return _materials[index]; }
+    uint32_t size() const { return uint32_t( _materials.size() ); }
+
+    /// Binds the textures and the factors of a material for the fragment stage.
+    void bind( MTL::RenderCommandEncoder* pEncoder, uint32_t index ) const;
+
+    /// Points every slot that samples pOld at pNew instead, retaining pNew and releasing pOld once
+    /// per slot. For textures the residency manager reloaded with other mips.
+    void replaceTexture( MTL::Texture* pOld, MTL::Texture* pNew );
+
+    void clear();
+
+private:
+    struct Hash
+    {
+        size_t operator()( const Material& material ) const;
+    };
+
+    struct Equal
+    {
+        bool operator()( const Material& a, const Material& b ) const;
+    };
+
+    std::vector<Material> _materials;
+    std::unordered_map<Material, uint32_t, Hash, Equal> _indices;
+};
+
+struct Mesh;
+struct Submesh;
+
+/// Submesh draws of a pass, encoded grouped by material.
+class MaterialDrawList
+{
+public:
+    /// Binds and draws of the last encode.
+    struct Statistics
+    {
+        uint32_t drawCount;
+        uint32_t materialBindCount;
+        uint32_t vertexBufferBindCount;
+    };
+
+    void clear();
+
+    /// Adds every submesh of the mesh, the mesh has to outlive the next encode.
+    void add( const Mesh& mesh, NS::UInteger instanceCount = 1, NS::UInteger baseInstance = 0 );
+
+    /// Sorts the draws by material and mesh, keeping the order within a group, and encodes them.
+    /// Submeshes without a material are drawn first with whatever is bound.
+    void encode( MTL::RenderCommandEncoder* pEncoder, const MaterialTable& materials );
+
+    const Statistics& statistics() const { return _statistics; }
+
+private:
+    struct Draw
+    {
+        const Mesh*    pMesh;
+        const Submesh* pSubmesh;
+        NS::UInteger   instanceCount;
+        NS::UInteger   baseInstance;
+    };
+
+    std::vector<Draw>     _draws;
+    std::vector<const Mesh*> _meshes;
+    std::vector<uint64_t> _keys;
+    std::vector<uint32_t> _order;
+    DrawOrder  _drawOrder;
+    Statistics _statistics = { 0, 0, 0 };
+};
+
+#endif /* AAPLMaterialTable_h */
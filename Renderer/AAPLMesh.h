@@ -10,12 +10,11 @@ Header for mesh and submesh objects used for managing models.
 #include <unordered_map>
 
 #include "AAPLShaderTypes.h"
+#include "AAPLAssetPack.h"
+#include "AAPLMaterialTable.h"
 #include <vector>
 #include <array>
 
-constexpr uint8_t kSubmeshTextureCount = 3;
-using SubmeshTextureArray = std::array< MTL::Texture*, kSubmeshTextureCount >;
-
 struct MeshVertex
 {
     vector_float3 position;
@@ -72,16 +71,12 @@ public:
 
     Submesh();
     
+    /// material indexes the MaterialTable the mesh was loaded with.
     Submesh(MTL::PrimitiveType  primitiveType,
             MTL::IndexType      indexType,
             NS::UInteger        indexCount,
             const MeshBuffer&   indexBuffer,
-            const SubmeshTextureArray& pTextures);
-
-    Submesh(MTL::PrimitiveType  primitiveType,
-            MTL::IndexType      indexType,
-            NS::UInteger        indexCount,
-            const MeshBuffer&   indexBuffer);
+            uint32_t            material = MaterialTable::kNoMaterial);
 
     Submesh(const Submesh& rhs);
     Submesh& operator=(Submesh& rhs);
@@ -95,7 +90,7 @@ public:
     MTL::IndexType      indexType() const;
     NS::UInteger        indexCount() const;
     const MeshBuffer&   indexBuffer() const;
-    const SubmeshTextureArray& textures() const;
+    uint32_t            material() const;
 
 private:
 
@@ -107,7 +102,7 @@ private:
 
     MeshBuffer m_indexBuffer;
 
-    SubmeshTextureArray m_pTextures;
+    uint32_t m_material;
 };
 
 struct Mesh
@@ -141,9 +136,11 @@ private:
     std::vector<MeshBuffer> m_vertexBuffers;
 };
 
+/// The textures of the submesh materials are interned into materials.
 std::vector<Mesh> newMeshesFromBundlePath(const char* bundlePath,
                                           MTL::Device* pDevice,
                                           const MTL::VertexDescriptor& vertexDescriptor,
+                                          MaterialTable& materials,
                                           NS::Error **pError);
 
 
@@ -157,6 +154,10 @@ Mesh makeIcosahedronMesh(MTL::Device* pDevice,
 
 MTL::Texture* newTextureFromCatalog( MTL::Device* pDevice, const char* name, MTL::StorageMode storageMode, MTL::TextureUsage usage );
 
+/// Mesh of a mapped asset pack, its vertex and index buffers are one no copy buffer over the
+/// blob, so the pack has to stay open as long as the mesh is drawn.
+Mesh newMeshFromPack( MTL::Device* pDevice, const AssetPack& pack, const char* name );
+
 #pragma mark - MeshBuffer inline implementations
 
 inline MTL::Buffer* MeshBuffer::buffer() const
@@ -201,13 +202,13 @@ inline const MeshBuffer& Submesh::indexBuffer() const
     return m_indexBuffer;
 }
 
-#pragma mark - Mesh inline implementations
-
-inline const SubmeshTextureArray& Submesh::textures() const
+inline uint32_t Submesh::material() const
 {
-    return m_pTextures;
+    return m_material;
 }
 
+#pragma mark - Mesh inline implementations
+
 inline const std::vector<Submesh>& Mesh::submeshes() const
 {
     return m_submeshes;
@@ -7,6 +7,7 @@ Implementation for mesh and submesh objects.
 #include <MetalKit/MetalKit.h>
 #include <ModelIO/ModelIO.h>
 #include <set>
+#include <string>
 #include <unordered_map>
 
 #include "AAPLMesh.h"
@@ -93,41 +94,23 @@ Submesh::Submesh()
 , m_indexType( MTL::IndexTypeUInt16 )
 , m_indexCount( 0 )
 , m_indexBuffer( MeshBuffer().buffer() , (NS::UInteger)0, (NS::UInteger)0)
+, m_material( MaterialTable::kNoMaterial )
 {
     
 }
 
 Submesh::Submesh(MTL::PrimitiveType primitiveType,
-                        MTL::IndexType indexType,
-                        NS::UInteger indexCount,
-                        const MeshBuffer& indexBuffer,
-                        const SubmeshTextureArray& pTextures)
+                 MTL::IndexType indexType,
+                 NS::UInteger indexCount,
+                 const MeshBuffer& indexBuffer,
+                 uint32_t material)
 : m_primitiveType(primitiveType)
 , m_indexType(indexType)
 , m_indexCount(indexCount)
 , m_indexBuffer(indexBuffer)
-, m_pTextures( pTextures )
+, m_material(material)
 {
-    for ( auto&& pTexture : m_pTextures )
-    {
-        pTexture->retain();
-    }
-}
 
-// Initialize a submesh without textures
-inline Submesh::Submesh(MTL::PrimitiveType primitiveType,
-                        MTL::IndexType indexType,
-                        NS::UInteger indexCount,
-                        const MeshBuffer& indexBuffer)
-: m_primitiveType(primitiveType)
-, m_indexType(indexType)
-, m_indexCount(indexCount)
-, m_indexBuffer(indexBuffer)
-{
-    for ( size_t i = 0; i < 3; ++i )
-    {
-        m_pTextures[i] = nullptr;
-    }
 }
 
 Submesh::Submesh(const Submesh& rhs)
@@ -135,12 +118,9 @@ Submesh::Submesh(const Submesh& rhs)
 , m_indexType( rhs.m_indexType )
 , m_indexCount( rhs.m_indexCount )
 , m_indexBuffer( rhs.m_indexBuffer )
-, m_pTextures( rhs.m_pTextures )
+, m_material( rhs.m_material )
 {
-    for ( size_t i = 0; i < 3; ++i )
-    {
-        m_pTextures[i]->retain();
-    }
+
 }
 
 Submesh& Submesh::operator=(Submesh& rhs)
@@ -149,13 +129,8 @@ Submesh& Submesh::operator=(Submesh& rhs)
     m_indexType = rhs.m_indexType;
     m_indexCount = rhs.m_indexCount;
     m_indexBuffer = rhs.m_indexBuffer;
-    m_pTextures = rhs.m_pTextures;
-    
-    for ( size_t i = 0; i < 3; ++i )
-    {
-        m_pTextures[i]->retain();
-    }
-    
+    m_material = rhs.m_material;
+
     return *this;
 }
 
@@ -164,14 +139,9 @@ Submesh::Submesh(Submesh&& rhs)
 , m_indexType( rhs.m_indexType )
 , m_indexCount( rhs.m_indexCount )
 , m_indexBuffer( rhs.m_indexBuffer )
-, m_pTextures( rhs.m_pTextures )
+, m_material( rhs.m_material )
 {
-    for ( size_t i = 0; i < 3; ++i )
-    {
-        m_pTextures[i]->retain();
-        rhs.m_pTextures[i]->release();
-        rhs.m_pTextures[i] = nullptr;
-    }
+
 }
 
 Submesh& Submesh::operator=(Submesh&& rhs)
@@ -180,25 +150,15 @@ Submesh& Submesh::operator=(Submesh&& rhs)
     m_indexType = rhs.m_indexType;
     m_indexCount = rhs.m_indexCount;
     m_indexBuffer = rhs.m_indexBuffer;
-    m_pTextures = rhs.m_pTextures;
-    
-    for ( size_t i = 0; i < 3; ++i )
-    {
-        m_pTextures[i]->retain();
-        rhs.m_pTextures[i]->release();
-        rhs.m_pTextures[i] = nullptr;
-    }
-    
+    m_material = rhs.m_material;
+
     return *this;
 
 }
 
 Submesh::~Submesh()
 {
-    for ( auto&& pTexture : m_pTextures )
-    {
-        pTexture->release();
-    }
+
 }
 
 #pragma mark - Mesh Implementation
@@ -257,9 +217,15 @@ Mesh::~Mesh()
 {
 }
 
+/// Textures of one model by the catalog name or file URL they were loaded from, holding one
+/// reference each. Submeshes naming the same source get the same texture, so the material table
+/// sees the same pointers and interns them into one material.
+using TextureSourceCache = std::unordered_map<std::string, MTL::Texture*>;
+
 static MTL::Texture* createTextureFromMaterial(MDLMaterial * material,
                                          MDLMaterialSemantic materialSemantic,
-                                         MTKTextureLoader* textureLoader)
+                                         MTKTextureLoader* textureLoader,
+                                         TextureSourceCache& textureCache)
 {
     NSArray<MDLMaterialProperty *> *propertiesWithSemantic =
         [material propertiesWithSemantic:materialSemantic];
@@ -269,6 +235,16 @@ static MTL::Texture* createTextureFromMaterial(MDLMaterial * material,
         if(property.type == MDLMaterialPropertyTypeString ||
            property.type == MDLMaterialPropertyTypeURL)
         {
+            NSString* source = property.type == MDLMaterialPropertyTypeURL ? property.URLValue.absoluteString
+                                                                           : property.stringValue;
+            const std::string sourceKey = source ? source.UTF8String : "";
+            const auto cached = textureCache.find( sourceKey );
+            if ( cached != textureCache.end() )
+            {
+                cached->second->retain();
+                return cached->second;
+            }
+
             // Load the textures with shader read using private storage
             NSDictionary<MTKTextureLoaderOption, id>* options = @{
                     MTKTextureLoaderOptionTextureStorageMode : @(MTLStorageModePrivate),
@@ -293,7 +269,9 @@ static MTL::Texture* createTextureFromMaterial(MDLMaterial * material,
             // If the texture has been found for a material using the string as a file path name...
             if(pTexture)
             {
-                // ...return it
+                // ...remember it and return it
+                pTexture->retain();
+                textureCache.emplace( sourceKey, pTexture );
                 return pTexture;
             }
 
@@ -309,6 +287,8 @@ static MTL::Texture* createTextureFromMaterial(MDLMaterial * material,
             // If a texture is found by interpreting the URL as an asset catalog name return it.
             if( pTexture )
             {
+                pTexture->retain();
+                textureCache.emplace( sourceKey, pTexture );
                 return pTexture;
             }
 
@@ -336,29 +316,38 @@ static MTL::Texture* createTextureFromMaterial(MDLMaterial * material,
 static Submesh createSubmesh(MDLSubmesh *modelIOSubmesh,
                              MTKSubmesh *metalKitSubmesh,
                              MTL::Device* pDevice,
-                             MTKTextureLoader* textureLoader)
+                             MTKTextureLoader* textureLoader,
+                             TextureSourceCache& textureCache,
+                             MaterialTable& materials)
 {
 
-    // Set each index in the array with the appropriate material semantic specified in the
+    // Set each texture of the material with the appropriate material semantic specified in the
     //   submesh's material property
 
-    // Create an array with three null textures that will be immediately replaced.
-    SubmeshTextureArray textures;
+    Material material = {};
+    material.data = Material::defaultData();
 
-    // Now that createSubmesh has added dummy elements, it can replace indices in the vector
-    // with real textures.
+    material.pTextures[TextureIndexBaseColor] = createTextureFromMaterial(modelIOSubmesh.material,
+                                                                          MDLMaterialSemanticBaseColor,
+                                                                          textureLoader,
+                                                                          textureCache);
 
-    textures[TextureIndexBaseColor] = createTextureFromMaterial(modelIOSubmesh.material,
-                                                                MDLMaterialSemanticBaseColor,
-                                                                textureLoader);
+    material.pTextures[TextureIndexORM]       = createTextureFromMaterial(modelIOSubmesh.material,
+                                                                          MDLMaterialSemanticSpecular,
+                                                                          textureLoader,
+                                                                          textureCache);
 
-    textures[TextureIndexRoughness]  = createTextureFromMaterial(modelIOSubmesh.material,
-                                                               MDLMaterialSemanticSpecular,
-                                                               textureLoader);
+    material.pTextures[TextureIndexNormal]    = createTextureFromMaterial(modelIOSubmesh.material,
+                                                                          MDLMaterialSemanticTangentSpaceNormal,
+                                                                          textureLoader,
+                                                                          textureCache);
 
-    textures[TextureIndexNormal]    = createTextureFromMaterial(modelIOSubmesh.material,
-                                                                MDLMaterialSemanticTangentSpaceNormal,
-                                                                textureLoader);
+    // The table keeps its own reference, submeshes sharing a texture set share the material
+    const uint32_t materialIndex = materials.intern( material );
+    for ( MTL::Texture* pTexture : material.pTextures )
+    {
+        pTexture->release();
+    }
 
     MTL::Buffer* pMetalIndexBuffer = ( MTL::Buffer*)(metalKitSubmesh.indexBuffer.buffer);
 
@@ -368,7 +357,7 @@ static Submesh createSubmesh(MDLSubmesh *modelIOSubmesh,
                     (MTL::IndexType) metalKitSubmesh.indexType,
                     metalKitSubmesh.indexCount,
                     indexBuffer,
-                    textures);
+                    materialIndex);
 
     return submesh;
 }
@@ -377,7 +366,9 @@ static Submesh createSubmesh(MDLSubmesh *modelIOSubmesh,
 Mesh createMeshFromModelIOMesh(MDLMesh *modelIOMesh,
                                MDLVertexDescriptor *vertexDescriptor,
                                MTKTextureLoader* textureLoader,
+                               TextureSourceCache& textureCache,
                                MTL::Device* pDevice,
+                               MaterialTable& materials,
                                NS::Error** pError)
 {
 
@@ -444,7 +435,9 @@ Mesh createMeshFromModelIOMesh(MDLMesh *modelIOMesh,
         auto submesh = createSubmesh(modelIOMesh.submeshes[index],
                                      metalKitMesh.submeshes[index],
                                      pDevice,
-                                     textureLoader);
+                                     textureLoader,
+                                     textureCache,
+                                     materials);
         
         submeshes.push_back( submesh );
     }
@@ -458,7 +451,9 @@ Mesh createMeshFromModelIOMesh(MDLMesh *modelIOMesh,
 static std::vector<Mesh> createMeshesFromModelIOObject(MDLObject* object,
                                                        MDLVertexDescriptor * vertexDescriptor,
                                                        MTKTextureLoader* textureLoader,
+                                                       TextureSourceCache& textureCache,
                                                        MTL::Device* pDevice,
+                                                       MaterialTable& materials,
                                                        NS::Error** pError)
 {
     std::vector<Mesh> newMeshes;
@@ -472,7 +467,9 @@ static std::vector<Mesh> createMeshesFromModelIOObject(MDLObject* object,
         auto mesh = createMeshFromModelIOMesh(modelIOMesh,
                                                vertexDescriptor,
                                                textureLoader,
+                                               textureCache,
                                                pDevice,
+                                               materials,
                                                pError);
 
         newMeshes.push_back( mesh );
@@ -484,7 +481,7 @@ static std::vector<Mesh> createMeshesFromModelIOObject(MDLObject* object,
     {
         std::vector<Mesh> childMeshes;
 
-        childMeshes = createMeshesFromModelIOObject(child, vertexDescriptor, textureLoader, pDevice, pError);
+        childMeshes = createMeshesFromModelIOObject(child, vertexDescriptor, textureLoader, textureCache, pDevice, materials, pError);
 
         newMeshes.insert(newMeshes.end(), childMeshes.begin(), childMeshes.end());
     }
@@ -495,6 +492,7 @@ static std::vector<Mesh> createMeshesFromModelIOObject(MDLObject* object,
 std::vector<Mesh> newMeshesFromBundlePath(const char* bundlePath,
                                           MTL::Device* pDevice,
                                           const MTL::VertexDescriptor& vertexDescriptor,
+                                          MaterialTable& materials,
                                           NS::Error** pError)
 {
     // Create a ModelIO vertexDescriptor so that the format/layout of the ModelIO mesh vertices
@@ -532,6 +530,7 @@ std::vector<Mesh> newMeshesFromBundlePath(const char* bundlePath,
     // Create a MetalKit texture loader to load material textures from files or the asset catalog
     //   into Metal textures.
     MTKTextureLoader* textureLoader = [[MTKTextureLoader alloc] initWithDevice:(__bridge id<MTLDevice>)pDevice];
+    TextureSourceCache textureCache;
 
     std::vector<Mesh> newMeshes;
 
@@ -544,12 +543,20 @@ std::vector<Mesh> newMeshesFromBundlePath(const char* bundlePath,
         const std::vector<Mesh>& assetMeshes = createMeshesFromModelIOObject(object,
                                                                              modelIOVertexDescriptor,
                                                                              textureLoader,
+                                                                             textureCache,
                                                                              pDevice,
+                                                                             materials,
                                                                              &pInternalError);
         
         newMeshes.insert(newMeshes.end(), assetMeshes.begin(), assetMeshes.end());
     }
 
+    // The material table holds its own references to the textures it interned
+    for ( const auto& entry : textureCache )
+    {
+        entry.second->release();
+    }
+
     AAPL_ASSERT_NULL_ERROR( pInternalError, "Error loading model:" );
     if(pInternalError && pError)
     {
@@ -950,8 +957,44 @@ MTL::Texture* newTextureFromCatalog( MTL::Device* pDevice, const char* name, MTL
                                                           bundle:nil
                                                          options:options
                                                            error:&err];
+    [textureLoader release];
 
     AAPL_ASSERT( !err, "Error loading texture:", name );
     
     return ( MTL::Texture*)texture;
 }
+
+Mesh newMeshFromPack( MTL::Device* pDevice, const AssetPack& pack, const char* name )
+{
+    static_assert( sizeof( VertexData ) == sizeof( AssetPackVertex ), "The asset pack vertex layout has to match VertexData" );
+
+    const AssetPackEntry* pEntry = pack.find( name );
+    AAPL_ASSERT( pEntry && pEntry->type == AssetPackEntry::TypeMesh, "No mesh in the asset pack:", name );
+
+    /// Vertices, indices and the submesh table share the pages of the blob, nothing is copied
+    const AssetPackEntry& entry = *pEntry;
+    pack.prefetch( entry );
+    MTL::Buffer* pBuffer = pDevice->newBuffer( const_cast<uint8_t*>( pack.data( entry ) ), pack.pageLength( entry ),
+                                               MTL::ResourceStorageModeShared, nullptr );
+    pBuffer->setLabel( NS::String::string( name, NS::UTF8StringEncoding ) );
+
+    const MTL::IndexType indexType = entry.format == AssetPackEntry::FormatUInt16 ? MTL::IndexTypeUInt16 : MTL::IndexTypeUInt32;
+    const NS::UInteger indexSize = indexType == MTL::IndexTypeUInt16 ? sizeof( uint16_t ) : sizeof( uint32_t );
+
+    std::vector<MeshBuffer> vertexBuffers;
+    vertexBuffers.emplace_back( pBuffer, 0, NS::UInteger( entry.vertexCount ) * sizeof( VertexData ), BufferIndexVertexData );
+
+    std::vector<Submesh> submeshes;
+    const AssetPackSubmesh* pSubmeshes = pack.submeshes( entry );
+    for ( uint32_t i = 0; i < entry.submeshCount; ++i )
+    {
+        const AssetPackSubmesh& range = pSubmeshes[i];
+        const MeshBuffer indexBuffer( pBuffer, entry.indexOffset + range.indexStart * indexSize, range.indexCount * indexSize );
+        submeshes.emplace_back( range.primitive == AssetPackSubmesh::PrimitiveTriangleStrip ? MTL::PrimitiveTypeTriangleStrip
+                                                                                             : MTL::PrimitiveTypeTriangle,
+                                indexType, range.indexCount, indexBuffer );
+    }
+    pBuffer->release();
+
+    return Mesh( submeshes, vertexBuffers );
+}
@@ -0,0 +1,255 @@
+///
+///  AAPLMipGenerator.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 24.04.24.
+///
+
+#include "AAPLMipGenerator.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    float sRGBToLinear( float value )
+    {
+        return value <= 0.04045f ? value / 12.92f : std::pow( ( value + 0.055f ) / 1.055f, 2.4f );
+    }
+
+    float linearToSRGB( float value )
+    {
+        return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow( value, 1.f / 2.4f ) - 0.055f;
+    }
+
+    /// Modified Bessel function of the first kind of order zero, power series
+    double besselI0( double x )
+    {
+        double sum = 1.0, term = 1.0;
+        const double quarter = x * x / 4.0;
+        for ( int k = 1; k < 50 && term > sum * 1e-12; ++k )
+        {
+            term *= quarter / ( double( k ) * k );
+            sum += term;
+        }
+        return sum;
+    }
+
+    float sinc( float x )
+    {
+        if ( std::fabs( x ) < 1e-5f )
+            return 1.f;
+        const float px = float( M_PI ) * x;
+        return std::sin( px ) / px;
+    }
+
+    uint32_t address( int64_t index, uint32_t size, MipGenerator::Addressing addressing )
+    {
+        if ( addressing == MipGenerator::AddressRepeat )
+            return uint32_t( ( ( index % size ) + size ) % size );
+        return uint32_t( std::clamp< int64_t >( index, 0, size - 1 ) );
+    }
+
+    /// One row tile of one level, the unit of parallel work
+    struct Job
+    {
+        uint32_t level;
+        uint32_t firstRow;
+        uint32_t endRow;
+    };
+}
+
+MipGenerator::MipGenerator( const Settings& settings )
+: _settings( settings )
+{
+}
+
+uint32_t MipGenerator::levelCount( uint32_t width, uint32_t height )
+{
+    uint32_t levels = 1;
+    for ( uint32_t size = std::max( width, height ); size > 1; size >>= 1 )
+        ++levels;
+    return levels;
+}
+
+float MipGenerator::kaiser( float t ) const
+{
+    const float x = t / _settings.kaiserWidth;
+    if ( std::fabs( x ) >= 1.f )
+        return 0.f;
+    const double window = besselI0( _settings.kaiserAlpha * std::sqrt( 1.0 - double( x ) * x ) ) / besselI0( _settings.kaiserAlpha );
+    return sinc( t ) * float( window );
+}
+
+MipGenerator::Contributions MipGenerator::contributions( uint32_t sourceSize, uint32_t destinationSize ) const
+{
+    Contributions taps;
+    taps.first.reserve( destinationSize + 1 );
+    const double scale = double( sourceSize ) / double( destinationSize );
+
+    for ( uint32_t i = 0; i < destinationSize; ++i )
+    {
+        taps.first.push_back( uint32_t( taps.index.size() ) );
+        const size_t begin = taps.weight.size();
+        const double center = ( i + 0.5 ) * scale;
+
+        if ( _settings.filter == FilterBox || scale <= 1.0 )
+        {
+            /// Coverage of the footprint [ i, i + 1 ) * scale, a copy where the axis did not shrink
+            const double low = i * scale, high = low + scale;
+            for ( int64_t j = int64_t( std::floor( low ) ); j < int64_t( std::ceil( high ) ); ++j )
+            {
+                const double overlap = std::min( high, double( j + 1 ) ) - std::max( low, double( j ) );
+                if ( overlap > 0.0 )
+                {
+                    taps.index.push_back( address( j, sourceSize, _settings.addressing ) );
+                    taps.weight.push_back( float( overlap ) );
+                }
+            }
+        }
+        else
+        {
+            /// Kernel stretched by the scale, its radius counted in destination texels
+            const double radius = _settings.kaiserWidth * scale;
+            for ( int64_t j = int64_t( std::floor( center - radius ) ); j <= int64_t( std::ceil( center + radius ) ); ++j )
+            {
+                const float weight = kaiser( float( ( j + 0.5 - center ) / scale ) );
+                if ( weight != 0.f )
+                {
+                    taps.index.push_back( address( j, sourceSize, _settings.addressing ) );
+                    taps.weight.push_back( weight );
+                }
+            }
+        }
+
+        float sum = 0.f;
+        for ( size_t k = begin; k < taps.weight.size(); ++k )
+            sum += taps.weight[k];
+        for ( size_t k = begin; k < taps.weight.size(); ++k )
+            taps.weight[k] /= sum;
+    }
+    taps.first.push_back( uint32_t( taps.index.size() ) );
+    return taps;
+}
+
+Image MipGenerator::decode( const Image& base ) const
+{
+    Image linear = base;
+    if ( _settings.content == ContentLinear )
+        return linear;
+
+    parallelFor( linear.height, kTileRows, [&]( size_t begin, size_t end )
+    {
+        for ( size_t y = begin; y < end; ++y )
+        {
+            simd::float4* pRow = &linear.at( 0, uint32_t( y ) );
+            for ( uint32_t x = 0; x < linear.width; ++x )
+            {
+                simd::float4& texel = pRow[x];
+                if ( _settings.content == ContentColor )
+                    texel = (simd::float4){ sRGBToLinear( texel.x ), sRGBToLinear( texel.y ), sRGBToLinear( texel.z ), texel.w };
+                else
+                    texel = (simd::float4){ texel.x * 2.f - 1.f, texel.y * 2.f - 1.f, texel.z * 2.f - 1.f, texel.w };
+            }
+        }
+    });
+    return linear;
+}
+
+void MipGenerator::encodeRow( simd::float4* pRow, uint32_t width ) const
+{
+    for ( uint32_t x = 0; x < width; ++x )
+    {
+        simd::float4 texel = pRow[x];
+        if ( _settings.content == ContentNormal )
+        {
+            /// Opposing normals can cancel out, a flat normal is the only sensible answer then
+            const float length = simd_length( texel.xyz );
+            const simd::float3 normal = length > 1e-6f ? texel.xyz / length : (simd::float3){ 0.f, 0.f, 1.f };
+            texel = (simd::float4){ normal.x * 0.5f + 0.5f, normal.y * 0.5f + 0.5f, normal.z * 0.5f + 0.5f, texel.w };
+        }
+        texel = simd_clamp( texel, simd::float4( 0.f ), simd::float4( 1.f ) );
+        if ( _settings.content == ContentColor )
+            texel = (simd::float4){ linearToSRGB( texel.x ), linearToSRGB( texel.y ), linearToSRGB( texel.z ), texel.w };
+        pRow[x] = texel;
+    }
+}
+
+std::vector<Image> MipGenerator::generate( const Image& base ) const
+{
+    const uint32_t levelTotal = levelCount( base.width, base.height );
+    std::vector<Image> levels( levelTotal );
+    levels[0] = base;
+    if ( levelTotal == 1 )
+        return levels;
+
+    const Image source = decode( base );
+
+    /// Horizontal pass into width of the level by height of the base, then the vertical pass
+    std::vector<Image> horizontal( levelTotal );
+    std::vector<Contributions> columns( levelTotal ), rows( levelTotal );
+    std::vector<Job> horizontalJobs, verticalJobs;
+    for ( uint32_t level = 1; level < levelTotal; ++level )
+    {
+        const uint32_t width  = std::max( 1u, base.width >> level );
+        const uint32_t height = std::max( 1u, base.height >> level );
+        columns[level] = contributions( base.width, width );
+        rows[level]    = contributions( base.height, height );
+        horizontal[level] = Image( width, base.height );
+        levels[level]     = Image( width, height );
+
+        for ( uint32_t row = 0; row < base.height; row += kTileRows )
+            horizontalJobs.push_back( { level, row, std::min( row + kTileRows, base.height ) } );
+        for ( uint32_t row = 0; row < height; row += kTileRows )
+            verticalJobs.push_back( { level, row, std::min( row + kTileRows, height ) } );
+    }
+
+    parallelFor( horizontalJobs.size(), 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+        {
+            const Job& job = horizontalJobs[i];
+            const Contributions& taps = columns[job.level];
+            Image& out = horizontal[job.level];
+            for ( uint32_t y = job.firstRow; y < job.endRow; ++y )
+            {
+                const simd::float4* pSource = &source.at( 0, y );
+                simd::float4* pOut = &out.at( 0, y );
+                for ( uint32_t x = 0; x < out.width; ++x )
+                {
+                    simd::float4 sum = 0.f;
+                    for ( uint32_t k = taps.first[x]; k < taps.first[x + 1]; ++k )
+                        sum += taps.weight[k] * pSource[taps.index[k]];
+                    pOut[x] = sum;
+                }
+            }
+        }
+    });
+
+    parallelFor( verticalJobs.size(), 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t i = begin; i < end; ++i )
+        {
+            const Job& job = verticalJobs[i];
+            const Contributions& taps = rows[job.level];
+            const Image& in = horizontal[job.level];
+            Image& out = levels[job.level];
+            for ( uint32_t y = job.firstRow; y < job.endRow; ++y )
+            {
+                /// Whole rows scaled and accumulated, contiguous for the vector units
+                simd::float4* pOut = &out.at( 0, y );
+                std::fill( pOut, pOut + out.width, simd::float4( 0.f ) );
+                for ( uint32_t k = taps.first[y]; k < taps.first[y + 1]; ++k )
+                {
+                    const simd::float4* pIn = &in.at( 0, taps.index[k] );
+                    const float weight = taps.weight[k];
+                    for ( uint32_t x = 0; x < out.width; ++x )
+                        pOut[x] += weight * pIn[x];
+                }
+                encodeRow( pOut, out.width );
+            }
+        }
+    });
+    return levels;
+}
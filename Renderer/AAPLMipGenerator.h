@@ -0,0 +1,86 @@
+///
+///  AAPLMipGenerator.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 24.04.24.
+///
+/// Abstract:
+/// CPU mip chain generation for the asset pipeline. Every level is resampled straight from
+/// the base with a separable box or Kaiser windowed sinc filter, so the levels do not wait
+/// on each other and all levels and row tiles run on the cores at once, four channels per
+/// SIMD operation. Colors are filtered in linear space and encoded to sRGB again, normal
+/// maps are filtered as vectors and renormalized per texel. The chain runs down to 1x1 in
+/// the sizes Metal expects, odd sizes included.
+
+#pragma once
+#ifndef AAPLMipGenerator_h
+#define AAPLMipGenerator_h
+
+#include <simd/simd.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "AAPLImage.h"
+
+class MipGenerator
+{
+public:
+    enum Filter
+    {
+        FilterBox,              /// area average, exact for power of two sizes
+        FilterKaiser            /// Kaiser windowed sinc, sharper, keeps more of the detail
+    };
+
+    enum Content
+    {
+        ContentColor,           /// sRGB encoded color, alpha linear
+        ContentLinear,          /// data such as roughness, metallic or occlusion
+        ContentNormal           /// tangent space normal in rgb, scaled and biased to [0, 1]
+    };
+
+    enum Addressing
+    {
+        AddressRepeat,          /// tiling textures, the filter wraps around the edges
+        AddressClamp
+    };
+
+    struct Settings
+    {
+        Filter     filter     = FilterKaiser;
+        Content    content    = ContentColor;
+        Addressing addressing = AddressRepeat;
+        float      kaiserWidth = 3.f;   /// kernel radius in texels of the level
+        float      kaiserAlpha = 4.f;   /// window shape, larger is smoother
+    };
+
+    explicit MipGenerator( const Settings& settings );
+
+    /// Levels of a full chain down to 1x1.
+    static uint32_t levelCount( uint32_t width, uint32_t height );
+
+    /// Full chain, level 0 is a copy of base. The levels keep the encoding of base.
+    std::vector<Image> generate( const Image& base ) const;
+
+private:
+    /// Rows per tile of parallel work.
+    static constexpr uint32_t kTileRows = 16;
+
+    /// Source texels and weights of each destination texel along one axis
+    struct Contributions
+    {
+        std::vector<uint32_t> first;    /// first tap of each destination texel, one extra at the end
+        std::vector<uint32_t> index;
+        std::vector<float>    weight;
+    };
+
+    Contributions contributions( uint32_t sourceSize, uint32_t destinationSize ) const;
+    float kaiser( float t ) const;
+
+    Image decode( const Image& base ) const;
+    void encodeRow( simd::float4* pRow, uint32_t width ) const;
+
+    Settings _settings;
+};
+
+#endif /* AAPLMipGenerator_h */
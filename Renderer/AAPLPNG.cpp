@@ -0,0 +1,441 @@
+///
+///  AAPLPNG.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+
+#include "AAPLPNG.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+    const uint8_t kSignature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+    enum ColorType : uint8_t
+    {
+        ColorGray      = 0,
+        ColorRGB       = 2,
+        ColorPalette   = 3,
+        ColorGrayAlpha = 4,
+        ColorRGBA      = 6
+    };
+
+    uint32_t readU32( const uint8_t* p )
+    {
+        return ( uint32_t( p[0] ) << 24 ) | ( uint32_t( p[1] ) << 16 ) | ( uint32_t( p[2] ) << 8 ) | uint32_t( p[3] );
+    }
+
+    void writeU32( std::vector<uint8_t>& out, uint32_t value )
+    {
+        out.push_back( uint8_t( value >> 24 ) );
+        out.push_back( uint8_t( value >> 16 ) );
+        out.push_back( uint8_t( value >> 8 ) );
+        out.push_back( uint8_t( value ) );
+    }
+
+    uint32_t channelCount( uint8_t colorType )
+    {
+        switch ( colorType )
+        {
+            case ColorGray:      return 1;
+            case ColorRGB:       return 3;
+            case ColorPalette:   return 1;
+            case ColorGrayAlpha: return 2;
+            case ColorRGBA:      return 4;
+        }
+        return 0;
+    }
+
+    bool validDepth( uint8_t colorType, uint8_t depth )
+    {
+        switch ( colorType )
+        {
+            case ColorGray:    return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+            case ColorPalette: return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+            default:           return depth == 8 || depth == 16;
+        }
+    }
+
+    uint8_t paeth( int a, int b, int c )
+    {
+        const int p  = a + b - c;
+        const int pa = std::abs( p - a );
+        const int pb = std::abs( p - b );
+        const int pc = std::abs( p - c );
+        if ( pa <= pb && pa <= pc )
+            return uint8_t( a );
+        return uint8_t( pb <= pc ? b : c );
+    }
+
+    /// Reverses the filter of one row in place, previous is the already unfiltered row above or null
+    bool unfilterRow( uint8_t filter, uint8_t* row, const uint8_t* previous, size_t rowBytes, size_t bpp )
+    {
+        for ( size_t i = 0; i < rowBytes; ++i )
+        {
+            const int a = i >= bpp ? row[i - bpp] : 0;
+            const int b = previous ? previous[i] : 0;
+            const int c = previous && i >= bpp ? previous[i - bpp] : 0;
+            switch ( filter )
+            {
+                case 0:                                       break;
+                case 1: row[i] = uint8_t( row[i] + a );       break;
+                case 2: row[i] = uint8_t( row[i] + b );       break;
+                case 3: row[i] = uint8_t( row[i] + ( ( a + b ) >> 1 ) ); break;
+                case 4: row[i] = uint8_t( row[i] + paeth( a, b, c ) );   break;
+                default: return false;
+            }
+        }
+        return true;
+    }
+
+    /// Filters one row with the given type into out
+    void filterRow( uint8_t filter, const uint8_t* row, const uint8_t* previous, size_t rowBytes, size_t bpp, uint8_t* out )
+    {
+        for ( size_t i = 0; i < rowBytes; ++i )
+        {
+            const int a = i >= bpp ? row[i - bpp] : 0;
+            const int b = previous ? previous[i] : 0;
+            const int c = previous && i >= bpp ? previous[i - bpp] : 0;
+            switch ( filter )
+            {
+                case 0: out[i] = row[i];                                     break;
+                case 1: out[i] = uint8_t( row[i] - a );                      break;
+                case 2: out[i] = uint8_t( row[i] - b );                      break;
+                case 3: out[i] = uint8_t( row[i] - ( ( a + b ) >> 1 ) );     break;
+                case 4: out[i] = uint8_t( row[i] - paeth( a, b, c ) );       break;
+            }
+        }
+    }
+
+    /// Sample of the channel at index in a row, bit depths below 8 are packed from the high bit
+    uint32_t readSample( const uint8_t* row, size_t index, uint8_t depth )
+    {
+        if ( depth == 16 )
+            return ( uint32_t( row[2 * index] ) << 8 ) | row[2 * index + 1];
+        if ( depth == 8 )
+            return row[index];
+
+        const size_t bit = index * depth;
+        const uint32_t shift = 8 - depth - uint32_t( bit & 7 );
+        return ( row[bit >> 3] >> shift ) & ( ( 1u << depth ) - 1 );
+    }
+
+    float linearToSRGB( float value )
+    {
+        return value <= 0.0031308f ? value * 12.92f : 1.055f * std::pow( value, 1.f / 2.4f ) - 0.055f;
+    }
+
+    void appendChunk( std::vector<uint8_t>& out, const char* type, const uint8_t* pData, size_t size )
+    {
+        writeU32( out, uint32_t( size ) );
+        const size_t typeOffset = out.size();
+        out.insert( out.end(), type, type + 4 );
+        if ( size )
+            out.insert( out.end(), pData, pData + size );
+        writeU32( out, uint32_t( crc32( 0, &out[typeOffset], uInt( size + 4 ) ) ) );
+    }
+    /// File contents after inflating and unfiltering, rows of rowBytes without the filter byte
+    struct DecodedPNG
+    {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint8_t  depth = 0;
+        uint8_t  colorType = 0;
+        uint32_t channels = 0;
+        size_t   rowBytes = 0;
+        std::vector<uint8_t> raw;
+        std::vector<uint8_t> palette;      /// RGBA per entry
+
+        const uint8_t* row( uint32_t y ) const { return &raw[y * ( rowBytes + 1 ) + 1]; }
+    };
+
+    bool decodePNG( const std::string& path, DecodedPNG& png, std::string& error )
+    {
+        FILE* pFile = std::fopen( path.c_str(), "rb" );
+        if ( !pFile )
+        {
+            error = "can not open " + path;
+            return false;
+        }
+        std::vector<uint8_t> file;
+        uint8_t buffer[65536];
+        size_t read;
+        while ( ( read = std::fread( buffer, 1, sizeof( buffer ), pFile ) ) > 0 )
+            file.insert( file.end(), buffer, buffer + read );
+        std::fclose( pFile );
+
+        if ( file.size() < 8 || std::memcmp( file.data(), kSignature, 8 ) != 0 )
+        {
+            error = path + " is not a PNG file";
+            return false;
+        }
+
+        uint8_t interlace = 0;
+        std::vector<uint8_t> compressed;
+        bool header = false, end = false;
+
+        size_t offset = 8;
+        while ( !end && offset + 12 <= file.size() )
+        {
+            const uint32_t length = readU32( &file[offset] );
+            if ( length > file.size() - offset - 12 )
+                break;
+
+            const uint8_t* pType = &file[offset + 4];
+            const uint8_t* pData = &file[offset + 8];
+            if ( crc32( 0, pType, length + 4 ) != readU32( pData + length ) )
+            {
+                error = path + " has a corrupt chunk";
+                return false;
+            }
+
+            if ( std::memcmp( pType, "IHDR", 4 ) == 0 && length >= 13 )
+            {
+                png.width     = readU32( pData );
+                png.height    = readU32( pData + 4 );
+                png.depth     = pData[8];
+                png.colorType = pData[9];
+                interlace     = pData[12];
+                header        = true;
+            }
+            else if ( std::memcmp( pType, "PLTE", 4 ) == 0 )
+            {
+                png.palette.clear();
+                for ( uint32_t i = 0; i + 2 < length; i += 3 )
+                    png.palette.insert( png.palette.end(), { pData[i], pData[i + 1], pData[i + 2], 255 } );
+            }
+            else if ( std::memcmp( pType, "tRNS", 4 ) == 0 && png.colorType == ColorPalette )
+            {
+                for ( uint32_t i = 0; i < length && 4 * i < png.palette.size(); ++i )
+                    png.palette[4 * i + 3] = pData[i];
+            }
+            else if ( std::memcmp( pType, "IDAT", 4 ) == 0 )
+            {
+                compressed.insert( compressed.end(), pData, pData + length );
+            }
+            else if ( std::memcmp( pType, "IEND", 4 ) == 0 )
+            {
+                end = true;
+            }
+            offset += size_t( length ) + 12;
+        }
+
+        if ( !header || png.width == 0 || png.height == 0 || channelCount( png.colorType ) == 0 || !validDepth( png.colorType, png.depth ) )
+        {
+            error = path + " has an unsupported header";
+            return false;
+        }
+        if ( interlace != 0 )
+        {
+            error = path + " is interlaced, which is not supported";
+            return false;
+        }
+        if ( png.colorType == ColorPalette && png.palette.empty() )
+        {
+            error = path + " has no palette";
+            return false;
+        }
+
+        png.channels = channelCount( png.colorType );
+        png.rowBytes = ( size_t( png.width ) * png.channels * png.depth + 7 ) / 8;
+        const size_t bpp = std::max< size_t >( 1, png.channels * png.depth / 8 );
+
+        png.raw.resize( ( png.rowBytes + 1 ) * png.height );
+        uLongf rawSize = uLongf( png.raw.size() );
+        if ( uncompress( png.raw.data(), &rawSize, compressed.data(), uLong( compressed.size() ) ) != Z_OK || rawSize != png.raw.size() )
+        {
+            error = path + " has corrupt image data";
+            return false;
+        }
+
+        for ( uint32_t y = 0; y < png.height; ++y )
+        {
+            uint8_t* row = &png.raw[y * ( png.rowBytes + 1 ) + 1];
+            const uint8_t* previous = y > 0 ? row - ( png.rowBytes + 1 ) : nullptr;
+            if ( !unfilterRow( row[-1], row, previous, png.rowBytes, bpp ) )
+            {
+                error = path + " uses an unknown filter";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Channels of the pixel at x, y expanded to RGBA, returns the value that stands for 1
+    uint32_t readPixel( const DecodedPNG& png, uint32_t x, uint32_t y, uint32_t rgba[4] )
+    {
+        const uint8_t* row = png.row( y );
+        const size_t first = size_t( x ) * png.channels;
+        const uint32_t maximum = ( 1u << png.depth ) - 1;
+        switch ( png.colorType )
+        {
+            case ColorGray:
+            case ColorGrayAlpha:
+                rgba[0] = rgba[1] = rgba[2] = readSample( row, first, png.depth );
+                rgba[3] = png.colorType == ColorGrayAlpha ? readSample( row, first + 1, png.depth ) : maximum;
+                return maximum;
+            case ColorPalette:
+            {
+                const uint32_t index = readSample( row, first, png.depth );
+                for ( uint32_t c = 0; c < 4; ++c )
+                    rgba[c] = 4 * index < png.palette.size() ? png.palette[4 * index + c] : ( c == 3 ? 255 : 0 );
+                return 255;
+            }
+            default:
+                for ( uint32_t c = 0; c < 3; ++c )
+                    rgba[c] = readSample( row, first + c, png.depth );
+                rgba[3] = png.colorType == ColorRGBA ? readSample( row, first + 3, png.depth ) : maximum;
+                return maximum;
+        }
+    }
+}
+
+bool loadPNG( const std::string& path, Image8& image, std::string& error )
+{
+    DecodedPNG png;
+    if ( !decodePNG( path, png, error ) )
+        return false;
+
+    image = Image8( png.width, png.height );
+    for ( uint32_t y = 0; y < png.height; ++y )
+    {
+        uint8_t* pOut = &image.pixels[size_t( y ) * png.width * 4];
+        for ( uint32_t x = 0; x < png.width; ++x, pOut += 4 )
+        {
+            uint32_t rgba[4];
+            const uint32_t maximum = readPixel( png, x, y, rgba );
+            for ( uint32_t c = 0; c < 4; ++c )
+                pOut[c] = maximum == 255 ? uint8_t( rgba[c] ) : uint8_t( ( rgba[c] * 255 + maximum / 2 ) / maximum );
+        }
+    }
+    return true;
+}
+
+bool loadPNG( const std::string& path, uint32_t& width, uint32_t& height, std::vector<float>& rgba, std::string& error )
+{
+    DecodedPNG png;
+    if ( !decodePNG( path, png, error ) )
+        return false;
+
+    width = png.width;
+    height = png.height;
+    rgba.resize( size_t( png.width ) * png.height * 4 );
+    for ( uint32_t y = 0; y < png.height; ++y )
+    {
+        float* pOut = &rgba[size_t( y ) * png.width * 4];
+        for ( uint32_t x = 0; x < png.width; ++x, pOut += 4 )
+        {
+            uint32_t samples[4];
+            const float scale = 1.f / float( readPixel( png, x, y, samples ) );
+            for ( uint32_t c = 0; c < 4; ++c )
+                pOut[c] = samples[c] * scale;
+        }
+    }
+    return true;
+}
+
+bool savePNG( const std::string& path, uint32_t width, uint32_t height, const float* pRGBA, uint32_t bitDepth, bool sRGB, std::string& error )
+{
+    if ( width == 0 || height == 0 || ( bitDepth != 8 && bitDepth != 16 ) )
+    {
+        error = "can not encode " + path + ", empty image or bit depth other than 8 and 16";
+        return false;
+    }
+
+    const size_t bpp = 4 * bitDepth / 8;
+    const size_t rowBytes = size_t( width ) * bpp;
+    const float maximum = float( ( 1u << bitDepth ) - 1 );
+
+    std::vector<uint8_t> rows( rowBytes * height );
+    for ( uint32_t y = 0; y < height; ++y )
+    {
+        uint8_t* row = &rows[y * rowBytes];
+        for ( uint32_t x = 0; x < width; ++x )
+        {
+            const float* pixel = &pRGBA[( size_t( y ) * width + x ) * 4];
+            for ( uint32_t c = 0; c < 4; ++c )
+            {
+                float value = std::clamp( pixel[c], 0.f, 1.f );
+                if ( sRGB && c < 3 )
+                    value = linearToSRGB( value );
+                const uint32_t quantized = uint32_t( std::lrint( value * maximum ) );
+                if ( bitDepth == 16 )
+                {
+                    row[x * bpp + 2 * c]     = uint8_t( quantized >> 8 );
+                    row[x * bpp + 2 * c + 1] = uint8_t( quantized );
+                }
+                else
+                {
+                    row[x * bpp + c] = uint8_t( quantized );
+                }
+            }
+        }
+    }
+
+    /// Per row the filter with the smallest sum of absolute residuals, the usual heuristic
+    std::vector<uint8_t> filtered( ( rowBytes + 1 ) * height );
+    std::vector<uint8_t> candidate( rowBytes );
+    for ( uint32_t y = 0; y < height; ++y )
+    {
+        const uint8_t* row = &rows[y * rowBytes];
+        const uint8_t* previous = y > 0 ? row - rowBytes : nullptr;
+        uint8_t* out = &filtered[y * ( rowBytes + 1 )];
+
+        uint64_t bestCost = UINT64_MAX;
+        for ( uint8_t filter = 0; filter < 5; ++filter )
+        {
+            filterRow( filter, row, previous, rowBytes, bpp, candidate.data() );
+            uint64_t cost = 0;
+            for ( size_t i = 0; i < rowBytes; ++i )
+                cost += uint64_t( std::abs( int( int8_t( candidate[i] ) ) ) );
+            if ( cost < bestCost )
+            {
+                bestCost = cost;
+                out[0] = filter;
+                std::memcpy( out + 1, candidate.data(), rowBytes );
+            }
+        }
+    }
+
+    uLongf compressedSize = compressBound( uLong( filtered.size() ) );
+    std::vector<uint8_t> compressed( compressedSize );
+    if ( compress2( compressed.data(), &compressedSize, filtered.data(), uLong( filtered.size() ), Z_BEST_COMPRESSION ) != Z_OK )
+    {
+        error = "can not compress " + path;
+        return false;
+    }
+
+    std::vector<uint8_t> header;
+    writeU32( header, width );
+    writeU32( header, height );
+    header.push_back( uint8_t( bitDepth ) );
+    header.push_back( ColorRGBA );
+    header.push_back( 0 );
+    header.push_back( 0 );
+    header.push_back( 0 );
+
+    std::vector<uint8_t> file( kSignature, kSignature + 8 );
+    appendChunk( file, "IHDR", header.data(), header.size() );
+    appendChunk( file, "IDAT", compressed.data(), compressedSize );
+    appendChunk( file, "IEND", nullptr, 0 );
+
+    FILE* pFile = std::fopen( path.c_str(), "wb" );
+    if ( !pFile )
+    {
+        error = "can not write " + path;
+        return false;
+    }
+    const bool written = std::fwrite( file.data(), 1, file.size(), pFile ) == file.size();
+    std::fclose( pFile );
+    if ( !written )
+        error = "can not write " + path;
+    return written;
+}
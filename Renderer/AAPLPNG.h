@@ -0,0 +1,48 @@
+///
+///  AAPLPNG.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Minimal PNG reader and writer on top of zlib, for tools that have to produce or consume
+/// the images of the asset catalog without ImageIO. Reads gray, gray alpha, palette, RGB and
+/// RGBA images at 8 and 16 bit without interlacing, writes RGBA at 8 or 16 bit. Pixels are
+/// handed out as 8 bit RGBA for images that only go to the GPU, or as packed float RGBA in
+/// [0, 1], rows top down as they are stored in the file. Encoding is deterministic, the same
+/// pixels always give the same bytes. Plain C++, the simd Image of AAPLImage.h builds on it.
+
+#pragma once
+#ifndef AAPLPNG_h
+#define AAPLPNG_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Four 8 bit channels per pixel in RGBA order, the upload format of color textures.
+struct Image8
+{
+    uint32_t width  = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels;
+
+    Image8() = default;
+    Image8( uint32_t w, uint32_t h ) : width( w ), height( h ), pixels( size_t( w ) * h * 4, 0 ) {}
+
+    size_t bytesPerRow() const { return size_t( width ) * 4; }
+};
+
+/// Decodes a PNG file to 8 bits per channel, 16 bit samples are rounded.
+/// Returns false and fills error if the file can not be read.
+bool loadPNG( const std::string& path, Image8& image, std::string& error );
+
+/// Decodes a PNG file to four floats per pixel.
+bool loadPNG( const std::string& path, uint32_t& width, uint32_t& height, std::vector<float>& rgba, std::string& error );
+
+/// Encodes four floats per pixel as RGBA with 8 or 16 bits per channel, values are clamped to
+/// [0, 1]. With sRGB the linear values are encoded with the sRGB transfer function.
+bool savePNG( const std::string& path, uint32_t width, uint32_t height, const float* pRGBA,
+              uint32_t bitDepth, bool sRGB, std::string& error );
+
+#endif /* AAPLPNG_h */
@@ -0,0 +1,49 @@
+///
+///  AAPLParallel.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.03.24.
+///
+/// Abstract:
+/// Small helper to spread CPU side per frame work over libdispatch worker threads.
+
+#pragma once
+#ifndef AAPLParallel_h
+#define AAPLParallel_h
+
+#include <dispatch/dispatch.h>
+#include <algorithm>
+#include <cstddef>
+
+/// Calls body( begin, end ) for consecutive chunks of [0, count), each at most grain elements,
+/// concurrently on the global queue. Returns after all chunks finished.
+/// Small counts run inline on the calling thread.
+template< typename Body >
+void parallelFor( size_t count, size_t grain, const Body& body )
+{
+    grain = std::max< size_t >( grain, 1 );
+    if ( count <= grain )
+    {
+        if ( count > 0 )
+            body( size_t( 0 ), count );
+        return;
+    }
+
+    struct Context
+    {
+        const Body* pBody;
+        size_t      count;
+        size_t      grain;
+    } context { &body, count, grain };
+
+    dispatch_apply_f( ( count + grain - 1 ) / grain, DISPATCH_APPLY_AUTO, &context,
+                      []( void* pContext, size_t chunk )
+                      {
+                          const Context* pCtx = static_cast< const Context* >( pContext );
+                          const size_t begin = chunk * pCtx->grain;
+                          const size_t end = std::min( begin + pCtx->grain, pCtx->count );
+                          ( *pCtx->pBody )( begin, end );
+                      } );
+}
+
+#endif /* AAPLParallel_h */
@@ -24,14 +24,18 @@ vertex LightMaskOut
 light_mask_vertex(const device float4 * vertices               [[ buffer(BufferIndexVertexData) ]],
                   const device PointLightData* light_data      [[ buffer(BufferIndexLightData) ]],
                   const device vector_float4 * light_positions [[ buffer(BufferIndexLightsPosition) ]],
+                  const device uint          * light_order     [[ buffer(BufferIndexLightProxyOrder) ]],
                   constant FrameData         & frameData       [[ buffer(BufferIndexFrameData) ]],
                   uint                         iid             [[ instance_id ]],
                   uint                         vid             [[ vertex_id ]])
 {
     LightMaskOut out;
 
+    // Lights are grouped by proxy level, the instance id indexes the grouped order
+    uint light = light_order[iid];
+
     // Transform light to position relative to the temple
-    float4 vertex_eye_position = float4(vertices[vid].xyz * light_data[iid].light_radius + light_positions[iid].xyz, 1);
+    float4 vertex_eye_position = float4(vertices[vid].xyz * light_data[light].light_radius + light_positions[light].xyz, 1);
     out.position = frameData.perspectiveTransform * vertex_eye_position;
 
     return out;
@@ -48,76 +52,88 @@ vertex LightInOut
 deferred_point_lighting_vertex(const device float4        * vertices        [[ buffer(BufferIndexVertexData) ]],
                                const device PointLightData * light_data     [[ buffer(BufferIndexLightData) ]],
                                const device vector_float4 * light_positions [[ buffer(BufferIndexLightsPosition) ]],
+                               const device uint          * light_order     [[ buffer(BufferIndexLightProxyOrder) ]],
                                constant FrameData         & frameData       [[ buffer(BufferIndexFrameData) ]],
                                uint                         iid             [[ instance_id ]],
                                uint                         vid             [[ vertex_id ]])
 {
     LightInOut out;
 
+    uint light = light_order[iid];
+
     // Transform light to position relative to the temple
-    float3 vertex_eye_position = vertices[vid].xyz * light_data[iid].light_radius + light_positions[iid].xyz;
+    float3 vertex_eye_position = vertices[vid].xyz * light_data[light].light_radius + light_positions[light].xyz;
 
     out.position = frameData.perspectiveTransform * float4(vertex_eye_position, 1);
 
     // Sending light position in view space to next stage
     out.eye_position = vertex_eye_position.xyz;
 
-    out.iid = iid;
+    out.iid = light;
 
     return out;
 }
 
 
 half4
-deferred_point_lighting_fragment_common(LightInOut             in,
-                                        device PointLightData * light_data,
-                                        device vector_float4 * light_positions,
-                                        constant FrameData   & frameData,
-                                        half4                  lighting,
-                                        float                  depth,
-                                        half4                  normal_shadow,
-                                        half4                  albedo_specular)
+point_light_contribution(float3                 eye_space_fragment_pos,
+                         float3                 light_eye_position,
+                         device PointLightData & light,
+                         constant FrameData    & frameData,
+                         half4                  normal_shadow,
+                         half4                  albedo_specular)
 {
-    // Used eye_space depth to determine the position of the fragment in eye_space
-    float3 eye_space_fragment_pos = in.eye_position * (depth / in.eye_position.z);
-
-    float3 light_eye_position = light_positions[in.iid].xyz;
-    
     float light_distance = length(light_eye_position - eye_space_fragment_pos);
-    
-    float light_radius = light_data[in.iid].light_radius;
 
+    float light_radius = light.light_radius;
 
-    if (light_distance < light_radius)
+    if (light_distance >= light_radius)
     {
-        float4 eye_space_light_pos = float4(light_eye_position,1);
+        return half4(0);
+    }
 
-        float3 eye_space_fragment_to_light = eye_space_light_pos.xyz - eye_space_fragment_pos;
+    float3 eye_space_fragment_to_light = light_eye_position - eye_space_fragment_pos;
 
-        float3 light_direction = normalize(eye_space_fragment_to_light);
+    float3 light_direction = normalize(eye_space_fragment_to_light);
 
-        half3 light_color = half3(light_data[in.iid].pointLightColor);
+    half3 light_color = half3(light.pointLightColor);
 
-        // Diffuse contribution
-        half4 diffuse_contribution = half4(float4(albedo_specular)*max(dot(float3(normal_shadow.xyz), light_direction),0.0f))*half4(light_color,1);
+    // Diffuse contribution
+    half4 diffuse_contribution = half4(float4(albedo_specular)*max(dot(float3(normal_shadow.xyz), light_direction),0.0f))*half4(light_color,1);
 
-        // Specular Contribution
-        float3 halfway_vector = normalize(eye_space_fragment_to_light - eye_space_fragment_pos);
+    // Specular Contribution
+    float3 halfway_vector = normalize(eye_space_fragment_to_light - eye_space_fragment_pos);
 
-        half specular_intensity = half(frameData.point_specular_intensity);
+    half specular_intensity = half(frameData.point_specular_intensity);
 
-        half specular_shininess = normal_shadow.w * half(frameData.shininess_factor);
+    half specular_shininess = normal_shadow.w * half(frameData.shininess_factor);
 
-        half specular_factor = powr(max(dot(half3(normal_shadow.xyz),half3(halfway_vector)),0.0h), specular_intensity);
+    half specular_factor = powr(max(dot(half3(normal_shadow.xyz),half3(halfway_vector)),0.0h), specular_intensity);
 
-        half3 specular_contribution = specular_factor * half3(albedo_specular.xyz) * specular_shininess * light_color;
+    half3 specular_contribution = specular_factor * half3(albedo_specular.xyz) * specular_shininess * light_color;
 
-        // Light falloff
-        float attenuation = 1.0 - (light_distance / light_radius);
-        attenuation *= attenuation;
+    // Light falloff
+    float attenuation = 1.0 - (light_distance / light_radius);
+    attenuation *= attenuation;
 
-        lighting += (diffuse_contribution + half4(specular_contribution, 0)) * attenuation;
-    }
+    return (diffuse_contribution + half4(specular_contribution, 0)) * attenuation;
+}
+
+half4
+deferred_point_lighting_fragment_common(LightInOut             in,
+                                        device PointLightData * light_data,
+                                        device vector_float4 * light_positions,
+                                        constant FrameData   & frameData,
+                                        half4                  lighting,
+                                        float                  depth,
+                                        half4                  normal_shadow,
+                                        half4                  albedo_specular)
+{
+    // Used eye_space depth to determine the position of the fragment in eye_space
+    float3 eye_space_fragment_pos = in.eye_position * (depth / in.eye_position.z);
+
+    lighting += point_light_contribution(eye_space_fragment_pos, light_positions[in.iid].xyz, light_data[in.iid],
+                                         frameData, normal_shadow, albedo_specular);
 
     return lighting;
 }
@@ -145,3 +161,41 @@ fragment half4  deferred_point_lighting_fragment_traditional(
 }
 
 
+// All point lights in one full screen pass, every fragment only walks the light list of its cluster
+fragment half4 deferred_clustered_point_lighting_fragment(
+    QuadInOut                 in                      [[ stage_in ]],
+    device PointLightData   * light_data              [[ buffer(BufferIndexLightData) ]],
+    device vector_float4    * light_positions         [[ buffer(BufferIndexLightsPosition) ]],
+    const device LightCluster * clusters              [[ buffer(BufferIndexLightClusters) ]],
+    const device uint       * light_indices           [[ buffer(BufferIndexLightIndices) ]],
+    constant LightClusterGrid & grid                  [[ buffer(BufferIndexLightClusterGrid) ]],
+    constant FrameData      & frameData               [[ buffer(BufferIndexFrameData) ]],
+    texture2d<half>           albedo_specular_GBuffer [[ texture(RenderTargetAlbedo) ]],
+    texture2d<half>           normal_shadow_GBuffer   [[ texture(RenderTargetNormal) ]],
+    texture2d<float>          depth_GBuffer           [[ texture(RenderTargetDepth) ]])
+{
+    uint2 position = uint2(in.position.xy);
+    float depth = depth_GBuffer.read(position.xy).x;
+    half4 normal_shadow = normal_shadow_GBuffer.read(position.xy);
+    half4 albedo_specular = albedo_specular_GBuffer.read(position.xy);
+
+    // Same reconstruction as the light volumes, in.eye_position lies on the near plane
+    float3 eye_space_fragment_pos = in.eye_position * (depth / in.eye_position.z);
+
+    uint tile_x = min(position.x * grid.tilesX / frameData.framebuffer_width,  grid.tilesX - 1);
+    uint tile_y = min(position.y * grid.tilesY / frameData.framebuffer_height, grid.tilesY - 1);
+    float view_depth = max(-eye_space_fragment_pos.z, 1e-4f);
+    uint slice = uint(clamp(int(log(view_depth) * grid.sliceScale + grid.sliceBias), 0, int(grid.slices) - 1));
+
+    LightCluster cluster = clusters[(slice * grid.tilesY + tile_y) * grid.tilesX + tile_x];
+
+    half4 lighting = half4(0);
+    for (uint i = 0; i < cluster.count; ++i)
+    {
+        uint light = light_indices[cluster.offset + i];
+        lighting += point_light_contribution(eye_space_fragment_pos, light_positions[light].xyz, light_data[light],
+                                             frameData, normal_shadow, albedo_specular);
+    }
+
+    return lighting;
+}
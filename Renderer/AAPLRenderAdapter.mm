@@ -22,6 +22,9 @@
 
 @implementation AAPLRenderAdapter
 
+@synthesize cursorPosition = _cursorPosition;
+@synthesize mouseButtonMask = _mouseButtonMask;
+
 - (instancetype)initWithMTKView:(MTKView*)pMTKView
 {
     self = [super init];
@@ -97,6 +100,17 @@
     return _mouseButtonMask;
 }
 
+/// Forward input right away, so a click reaches the renderer in the frame it happened
+- ( void ) setCursorPosition:( const simd::float2 ) cursorPosition {
+    _cursorPosition = cursorPosition;
+    _pRenderer->setCursorPosition( _cursorPosition );
+}
+
+- ( void ) setMouseButtonMask:( const NSUInteger ) mouseButtonMask {
+    _mouseButtonMask = mouseButtonMask;
+    _pRenderer->setMouseButtonMask( static_cast<NS::UInteger>(_mouseButtonMask) );
+}
+
 - (const MTLPixelFormat) colorPixelFormat {
     _pRenderer->setColorTargetPixelFormat((__bridge MTL::PixelFormat)_colorPixelFormat);
     return _colorPixelFormat;
@@ -4,6 +4,7 @@
 //
 //  Created by Guido Schneider on 11.08.22.
 
+#pragma once
 
 #import "AAPLMathUtilities.h"
 
@@ -99,6 +100,10 @@ struct FrustumCuller
     float         dist_Near;
     float         dist_Far;
 
+    // clip planes in world space : xyz is the inward facing normal, w the plane distance.
+    // Order is left, right, bottom, top, near, far. Filled by Reset_ViewProjection.
+    vector_float4 planes[6];
+
     // Initializes data so we can call Intersection predicates.
     // Made for a left-handed coordinate system.
     void Reset_LH ( const matrix_float4x4 viewMatrix,
@@ -146,6 +151,38 @@ struct FrustumCuller
         Reset_LH (cachedViewMatrix, camera.position, 1.f, M_PI_4, camera.distanceNear, camera.distanceFar);
     }
 
+    // Extracts the six clip planes from a combined projection * view matrix (Gribb/Hartmann).
+    // Works for perspective and orthographic projections of either handedness, as long as the
+    // projection maps depth to Metal's [0, 1] clip range.
+    void Reset_ViewProjection (const matrix_float4x4 viewProjectionMatrix)
+    {
+        // the columns of the transpose are the rows of the view projection matrix
+        const matrix_float4x4 rows = simd_transpose (viewProjectionMatrix);
+
+        planes[0] = rows.columns[3] + rows.columns[0];
+        planes[1] = rows.columns[3] - rows.columns[0];
+        planes[2] = rows.columns[3] + rows.columns[1];
+        planes[3] = rows.columns[3] - rows.columns[1];
+        planes[4] = rows.columns[2];
+        planes[5] = rows.columns[3] - rows.columns[2];
+
+        for (vector_float4 & plane : planes)
+        {
+            plane /= vector_length (plane.xyz);
+        }
+    }
+
+    // Sphere test against the planes filled by Reset_ViewProjection.
+    // bSphere is in world space, position in xyz and radius in w.
+    bool IntersectsPlanes (const vector_float4 bSphere) const
+    {
+        for (const vector_float4 & plane : planes)
+        {
+            if (vector_dot (plane.xyz, bSphere.xyz) + plane.w < -bSphere.w) { return false; }
+        }
+        return true;
+    }
+
     // To test the intersection between a frustum and a sphere, we "inflate" the frustum by
     // the bounding sphere radius ; then test if the sphere center is inside this extended frustum.
     bool Intersects (const vector_float3 actorPosition, vector_float4 bSphere) const
@@ -181,55 +218,6 @@ enum EPassFlags : uint8_t
     ALL_PASS = (uint8_t) ~(uint8_t(0))
 };
 
-//----------------------------------------------------------------------------------------
-// Data describing each 'object' the world will contain.
-class AAPLActorData : NS::Object
-{
-    
-public:
-// Metal pipeline used to render this actor
-   MTL::RenderPipelineState gpuProg;
-    
-// pointer to meshes used by this actor
-//    std::vector <Mesh*> meshes;
-    
-// bounding sphere. position is stored in xyz, radius is stored in w.
-    vector_float4               bSphere;
-    
-// multiplier used in shading to color actors using the same mesh differently
-    vector_float3               diffuseMultiplier;
-    
-// translation away from rotation point
-    vector_float3               translation;
-    
-// Position around which we rotate the object
-    vector_float3               rotationPoint;
-    
-// current rotation angle (in radians) around rotationAxis at rotationPoint
-    float                       rotationAmount;
-    
-// per-actor multiplier for rotation
-    float                       rotationSpeed;
-    
-// per-actor axis for rotation
-    vector_float3               rotationAxis;
-    
-// actor's position in the scene
-    vector_float4               modelPosition;
-    
-// passes this actor must be rendered to
-    EPassFlags                  passFlags;
-    
-// number of instances with which we must draw this actor in the reflection pass
-    uint8_t                     instanceCountInReflection;
-    
-// Whether this actor is visible in the final pass
-    bool                       visibleInFinal;
-private:
-    
-};
-
-
 //----------------------------------------------------------------------------------------
 
 // Utility function to align a memory address
@@ -0,0 +1,118 @@
+///
+///  AAPLResidencyManager.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 29.04.24.
+///
+
+#include "AAPLResidencyManager.h"
+#include "AAPLTextureLoader.h"
+#include "AAPLUtilities.h"
+
+#include <chrono>
+
+ResidencyManager::ResidencyManager( MTL::Device* pDevice, uint64_t budgetBytes )
+: _pDevice( pDevice )
+, _pQueue( pDevice->newCommandQueue() )
+, _residency( budgetBytes )
+, _worker( 1 )
+{
+    _pQueue->setLabel( AAPLSTR( "Texture Residency Queue" ) );
+}
+
+ResidencyManager::~ResidencyManager()
+{
+    for ( Texture& texture : _textures )
+    {
+        if ( texture.pending.valid() )
+            texture.pending.get()->release();
+        if ( texture.pTexture )
+            texture.pTexture->release();
+    }
+    for ( const Swap& swap : _swaps )
+        swap.pOld->release();
+    _pQueue->release();
+}
+
+ResidencyManager::Handle ResidencyManager::track( MTL::Texture* pTexture )
+{
+    const char* pLabel = pTexture->label() ? pTexture->label()->utf8String() : "Texture";
+    _textures.push_back( Texture{ nullptr, nullptr, nullptr, 0, 0, {} } );
+    return _residency.add( pLabel, std::vector<uint64_t>( 1, pTexture->allocatedSize() ), true );
+}
+
+ResidencyManager::Handle ResidencyManager::manage( MTL::Texture* pTexture, const AssetPack& pack, const AssetPackEntry& entry )
+{
+    std::vector<uint64_t> levelSizes( entry.levelCount );
+    for ( uint32_t level = 0; level < entry.levelCount; ++level )
+        levelSizes[level] = AssetPack::levelSize( entry, level );
+
+    pTexture->retain();
+    _textures.push_back( Texture{ pTexture, &pack, &entry, 0, 0, {} } );
+    return _residency.add( entry.name, levelSizes );
+}
+
+void ResidencyManager::use( Handle handle, uint64_t frame, uint32_t requiredLevel )
+{
+    _residency.use( handle, frame, requiredLevel );
+}
+
+void ResidencyManager::reload( Handle handle, uint32_t firstLevel )
+{
+    Texture& texture = _textures[handle];
+    texture.pPack->prefetch( *texture.pEntry );
+    texture.pendingLevel = firstLevel;
+
+    MTL::Device* pDevice = _pDevice;
+    MTL::CommandQueue* pQueue = _pQueue;
+    const AssetPack* pPack = texture.pPack;
+    const AssetPackEntry* pEntry = texture.pEntry;
+    const MTL::StorageMode storageMode = texture.pTexture->storageMode();
+    const MTL::TextureUsage usage = texture.pTexture->usage();
+    texture.pending = _worker.enqueue( [pDevice, pQueue, pPack, pEntry, firstLevel, storageMode, usage]() -> MTL::Texture*
+    {
+        return TextureLoader::newTextureFromPack( pDevice, pQueue, *pPack, *pEntry, firstLevel, storageMode, usage );
+    });
+}
+
+const std::vector<ResidencyManager::Swap>& ResidencyManager::update()
+{
+    for ( const Swap& swap : _swaps )
+        swap.pOld->release();
+    _swaps.clear();
+    _stale.clear();
+
+    /// A reload the policy changed its mind about meanwhile is thrown away and queued again
+    for ( Handle handle = 0; handle < _textures.size(); ++handle )
+    {
+        Texture& texture = _textures[handle];
+        if ( !texture.pending.valid() || texture.pending.wait_for( std::chrono::seconds( 0 ) ) != std::future_status::ready )
+            continue;
+
+        MTL::Texture* pTexture = texture.pending.get();
+        if ( texture.pendingLevel != _residency.residentLevel( handle ) )
+        {
+            pTexture->release();
+            _stale.push_back( handle );
+            continue;
+        }
+        _swaps.push_back( Swap{ texture.pTexture, pTexture } );
+        texture.pTexture = pTexture;
+        texture.loadedLevel = texture.pendingLevel;
+    }
+
+    /// Only one reload per texture is in flight, a change that comes meanwhile waits for it
+    for ( const TextureResidency::Change& change : _residency.update() )
+    {
+        const Texture& texture = _textures[change.handle];
+        if ( texture.pTexture && !texture.pending.valid() && texture.loadedLevel != change.toLevel )
+            reload( change.handle, change.toLevel );
+    }
+    for ( Handle handle : _stale )
+    {
+        const Texture& texture = _textures[handle];
+        if ( !texture.pending.valid() && texture.loadedLevel != _residency.residentLevel( handle ) )
+            reload( handle, _residency.residentLevel( handle ) );
+    }
+    return _swaps;
+}
@@ -0,0 +1,92 @@
+///
+///  AAPLResidencyManager.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 29.04.24.
+///
+/// Abstract:
+/// Keeps the textures of the renderer within a memory budget. Every texture is accounted by
+/// its label, textures of the mapped asset pack can lose and regain their finest mips as the
+/// TextureResidency policy decides, everything else is only counted against the budget. A
+/// change of levels is carried out by rebuilding the texture from the pack on a background
+/// worker, the renderer polls once per frame and swaps the finished textures into its
+/// materials. The old texture is released after the swap, command buffers still in flight
+/// keep their own reference until they completed.
+
+#pragma once
+#ifndef AAPLResidencyManager_h
+#define AAPLResidencyManager_h
+
+#include <Metal/Metal.hpp>
+
+#include <cstdint>
+#include <future>
+#include <vector>
+
+#include "AAPLAssetPack.h"
+#include "AAPLDecoderPool.h"
+#include "AAPLTextureResidency.h"
+
+class ResidencyManager
+{
+public:
+    using Handle = TextureResidency::Handle;
+
+    /// A texture that was rebuilt with other levels, pOld is released by the next update.
+    struct Swap
+    {
+        MTL::Texture* pOld;
+        MTL::Texture* pNew;
+    };
+
+    ResidencyManager( MTL::Device* pDevice, uint64_t budgetBytes );
+
+    /// Waits for the reload in flight and releases the textures it holds.
+    ~ResidencyManager();
+
+    ResidencyManager( const ResidencyManager& ) = delete;
+    ResidencyManager& operator=( const ResidencyManager& ) = delete;
+
+    /// Accounts a texture that always stays whole, by its allocated size.
+    Handle track( MTL::Texture* pTexture );
+
+    /// Takes a reference to a texture loaded whole from the pack, its finest levels may be dropped
+    /// and reloaded from there. The pack has to stay open as long as the manager lives.
+    Handle manage( MTL::Texture* pTexture, const AssetPack& pack, const AssetPackEntry& entry );
+
+    /// Marks a texture sampled in frame, requiredLevel is the finest mip that frame needs.
+    void use( Handle handle, uint64_t frame, uint32_t requiredLevel );
+
+    /// Releases the textures replaced by the last update, picks up finished reloads, runs the
+    /// policy and queues the reloads it asks for. Returns the textures to swap this frame.
+    const std::vector<Swap>& update();
+
+    /// Current texture of a managed handle, nullptr for tracked ones.
+    MTL::Texture* texture( Handle handle ) const { return _textures[handle].pTexture; }
+
+    const TextureResidency& residency() const { return _residency; }
+    const TextureResidency::Statistics& statistics() const { return _residency.statistics(); }
+
+private:
+    struct Texture
+    {
+        MTL::Texture*         pTexture;         /// nullptr for tracked textures
+        const AssetPack*      pPack;
+        const AssetPackEntry* pEntry;
+        uint32_t              loadedLevel;      /// first level of pTexture in the pack
+        uint32_t              pendingLevel;
+        std::future<MTL::Texture*> pending;
+    };
+
+    void reload( Handle handle, uint32_t firstLevel );
+
+    MTL::Device*       _pDevice;
+    MTL::CommandQueue* _pQueue;
+    TextureResidency   _residency;
+    std::vector<Texture> _textures;
+    std::vector<Handle>  _stale;        /// reloads that finished with the wrong level
+    std::vector<Swap>    _swaps;
+    DecoderPool          _worker;       /// last member, joined before the textures go away
+};
+
+#endif /* AAPLResidencyManager_h */
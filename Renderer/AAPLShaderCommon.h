@@ -21,10 +21,51 @@ struct GBufferData
     float depth           [[ color(RenderTargetDepth),    raster_order_group(GBufferROG) ]];
 };
 
+// Full screen quad with the eye space position on the near plane
+struct QuadInOut
+{
+    float4 position [[position]];
+    float3 eye_position;
+};
+
 // Final buffer outputs using Raster Order Groups
 struct AccumLightBuffer
 {
     half4 lighting [[ color(RenderTargetLighting), raster_order_group(LightingROG) ]];
 };
 
+// Sun shadow cascades, slices of one depth texture array
+constexpr sampler cascadeShadowSampler(coord::normalized,
+                                       filter::linear,
+                                       mip_filter::none,
+                                       address::clamp_to_edge,
+                                       compare_func::less);
+
+// First cascade whose far split lies beyond the view depth, ShadowCascadeCount past the last one
+static inline uint shadow_cascade_index(float4 cascade_splits, float view_depth)
+{
+    return uint(dot(select(float4(0), float4(1), cascade_splits < view_depth), float4(1)));
+}
+
+// 7x7 percentage closer filter in one cascade, fragments past the last cascade are lit
+static inline half shadow_cascade_pcf(depth2d_array<float> shadowMap, float3 shadow_coord, uint cascade)
+{
+    if (cascade >= ShadowCascadeCount)
+    {
+        return 1.h;
+    }
+
+    const int neighborWidth = 3;
+    const float neighbors = (neighborWidth * 2.0 + 1.0) *
+                            (neighborWidth * 2.0 + 1.0);
+    float texelSize = 1.0 / shadowMap.get_width();
+    float total = 0.f;
+    for (int x = -neighborWidth; x <= neighborWidth; x++) {
+      for (int y = -neighborWidth; y <= neighborWidth; y++) {
+          total += shadowMap.sample_compare(cascadeShadowSampler, shadow_coord.xy + float2(x,y) * texelSize, cascade, shadow_coord.z);
+        }
+      }
+    return half(total / neighbors);
+}
+
 #endif /* AAPLShaderCommon_h */
@@ -39,6 +39,12 @@ enum BufferIndex : int32_t
     BufferIndexPointVertexData  = 13,
     BufferIndexMeshPositions    = 14,
     BufferIndexMeshGenerics     = 15,
+    BufferIndexLightClusters    = 16,
+    BufferIndexLightIndices     = 17,
+    BufferIndexLightClusterGrid = 18,
+    BufferIndexLightProxyOrder  = 19,
+    BufferIndexShadowCascade    = 20,
+    BufferIndexMaterialData     = 21,
 };
 
 typedef enum VertexAttributes
@@ -57,9 +63,7 @@ enum TextureIndex : int32_t
 {
     TextureIndexBaseColor        =  0,
     TextureIndexNormal           =  1,
-    TextureIndexMetallic         =  2,
-    TextureIndexRoughness        =  3,
-    TextureIndexAmbientOcclusion =  4,
+    TextureIndexORM              =  2,    /// occlusion, roughness and metallic in r, g and b
     TextureIndexIrradianceMap    =  5,
     TextureIndexPreFilterMap     =  6,
     TextureIndexBDRF             =  7,
@@ -72,6 +76,20 @@ enum TextureIndex : int32_t
     TextureIndexAlpha            = 14,
 };
 
+/// Number of sun shadow cascades, slices of the shadow map texture array. The shadow vertex
+/// shader takes ShadowStaticLayer as cascade to draw into the cached static layer.
+enum ShadowCascadeLimits : int32_t
+{
+    ShadowCascadeCount = 4,
+    ShadowStaticLayer  = ShadowCascadeCount
+};
+
+/// Spherical harmonic coefficients of the diffuse irradiance, bands 0 to 2
+enum IrradianceSHLimits : int32_t
+{
+    IrradianceSHCoefficientCount = 9
+};
+
 enum RenderTargetIndex : int32_t
 {
     RenderTargetLighting  = 0,
@@ -101,6 +119,24 @@ struct PointLightData
     float light_speed;
 };
 
+/// Range of one cluster inside the compacted light index list
+struct LightCluster
+{
+    uint offset;
+    uint count;
+};
+
+/// Cluster grid over the view frustum, screen tiles in x and y, exponential depth slices in z.
+/// slice = log(view depth) * sliceScale + sliceBias
+struct LightClusterGrid
+{
+    uint  tilesX;
+    uint  tilesY;
+    uint  slices;
+    float sliceScale;
+    float sliceBias;
+};
+
 struct FrameData
 {
     ///Per Frame Data
@@ -134,6 +170,9 @@ struct FrameData
     simd::float4x4 shadow_view_matrix;
     simd::float4x4 shadow_projections_matrix;
     simd::float4x4 shadow_xform_matrix;
+    simd::float4x4 shadow_cascade_matrix[ShadowCascadeCount];
+    simd::float4   shadow_cascade_splits;
+    simd::float4x4 shadow_static_matrix;
     
     /// Per Texture Transform
     float textureScale;
@@ -141,6 +180,32 @@ struct FrameData
     float metallnessBias;
     float roughnessBias;
     float mipLevel;
+    
+    /// Diffuse irradiance over pi as SH9, rgb in xyz, replaces the irradiance map once valid
+    simd::float4 irradianceSH[IrradianceSHCoefficientCount];
+    uint irradianceSHValid;
+};
+
+/// Factors of a material applied to its textures, 1 leaves them as they are
+struct MaterialData
+{
+    simd::float4 baseColorFactor;
+    float roughnessFactor;
+    float metalnessFactor;
+    float occlusionStrength;
+    float padding;
+};
+
+/// Reprojects the static shadow layer into a cascade slice. Both projections are
+/// orthographic in the same light view, so clip space maps affinely between them.
+struct ShadowCompositeData
+{
+    simd::float4x4 cascadeToStatic;
+    simd::float4x4 staticToCascade;
+    simd::float2   cascadeSize;     /// texels of the cascade slice
+    float          depthBias;       /// caster depth bias in cascade depth, as setDepthBias applies it
+    float          slopeScale;
+    float          biasClamp;
 };
 
 struct Particle
@@ -30,9 +30,7 @@ struct v1f
     float3 normal;
     float3 worldPos;
     half3  color;
-    float4 shadowPosition;
-    float2 shadow_uv;
-    half   shadow_depth;
+    float  view_depth;
     float  metallnessBias;
     float  colorMixBias;
     float  roughnessBias;
@@ -67,11 +65,6 @@ constexpr sampler linearSampler (min_filter::linear, mag_filter::linear, mip_fil
 constexpr sampler irradiatedSampler (s_address::clamp_to_edge,t_address::clamp_to_edge,r_address::clamp_to_edge , min_filter::linear, mag_filter::linear);
 constexpr sampler preFilterSampler (s_address::clamp_to_edge,t_address::clamp_to_edge,r_address::clamp_to_edge , min_filter::linear, mag_filter::linear, mip_filter::linear, lod_clamp(0.f, 4.f));
 constexpr sampler bdrfSampler ( s_address::clamp_to_edge, t_address::clamp_to_edge , min_filter::linear, mag_filter::linear );
-constexpr sampler shadowSampler(coord::normalized,
-                                filter::linear,
-                                mip_filter::none,
-                                address::clamp_to_edge,
-                                compare_func::less);
 
 constant float kMaxHDRValue  = float(500.0f);
 //constant float3 kRec709Luma = float3(0.2126f, 0.7152f, 0.0722f);
@@ -218,13 +211,29 @@ inline float4 computeSpecular(PBRParameter parameters){
 
 }
 
+/// Irradiance over pi from the nine SH coefficients the CPU projected from the irradiance map
+inline float3 irradianceFromSH(device const FrameData &frameData, float3 n)
+{
+    device const float4* sh = frameData.irradianceSH;
+    
+    float3 irradiance = sh[0].xyz * 0.282095f;
+    irradiance += sh[1].xyz * (0.488603f * n.y);
+    irradiance += sh[2].xyz * (0.488603f * n.z);
+    irradiance += sh[3].xyz * (0.488603f * n.x);
+    irradiance += sh[4].xyz * (1.092548f * n.x * n.y);
+    irradiance += sh[5].xyz * (1.092548f * n.y * n.z);
+    irradiance += sh[6].xyz * (0.315392f * (3.f * n.z * n.z - 1.f));
+    irradiance += sh[7].xyz * (1.092548f * n.x * n.z);
+    irradiance += sh[8].xyz * (0.546274f * (n.x * n.x - n.y * n.y));
+    return max(irradiance, 0.f);
+}
+
 PBRParameter calculateParameters(v1f in,
                                  device const FrameData &frameData        [[ buffer(BufferIndexFrameData) ]],
+                                 constant MaterialData &material          [[ buffer(BufferIndexMaterialData) ]],
                                  texture2d<float>   baseColorMap          [[ texture(TextureIndexBaseColor) ]],
                                  texture2d<float>   normalMap             [[ texture(TextureIndexNormal) ]],
-                                 texture2d<float>   metallicMap           [[ texture(TextureIndexMetallic) ]],
-                                 texture2d<float>   roughnessMap          [[ texture(TextureIndexRoughness) ]],
-                                 texture2d<float>   ambientOcclusionMap   [[ texture(TextureIndexAmbientOcclusion) ]],
+                                 texture2d<float>   ormMap                [[ texture(TextureIndexORM) ]],
                                  texturecube<float> irradianceMap         [[ texture(TextureIndexIrradianceMap) ]],
                                  texturecube<float> prefilterMap          [[ texture(TextureIndexPreFilterMap)]],
                                  texture2d<float>   brdfMap               [[ texture(TextureIndexBDRF) ]],
@@ -244,17 +253,20 @@ PBRParameter calculateParameters(v1f in,
     
     float3 computedColor = computedMap.sample(repeatSampler, in.texcoord).xyz;
     
-    parameters.baseColor = pow(mix( baseColor , computedColor, in.colorMixBias), float3(2.0f));
+    parameters.baseColor = pow(mix( baseColor , computedColor, in.colorMixBias), float3(2.0f)) * material.baseColorFactor.rgb;
     
-    parameters.roughness = max(roughnessMap.sample(repeatSampler, in.texcoord.xy).x, 0.001f);
+    float3 orm = ormMap.sample(repeatSampler, in.texcoord.xy).xyz;
+
+    parameters.roughness = max(orm.g * material.roughnessFactor, 0.001f);
     parameters.roughness += in.roughnessBias;
 
-    parameters.metalness = max(metallicMap.sample(repeatSampler, in.texcoord.xy).x, 0.1);
+    parameters.metalness = max(orm.b * material.metalnessFactor, 0.1);
     parameters.metalness *= in.metallnessBias;
     
-    parameters.ambientOcclusion = ambientOcclusionMap.sample(repeatSampler, in.texcoord.xy).x;
+    parameters.ambientOcclusion = mix(1.f, orm.r, material.occlusionStrength);
 
-    float3 c = irradianceMap.sample(irradiatedSampler, parameters.normal).xyz ;
+    float3 c = frameData.irradianceSHValid ? irradianceFromSH(frameData, parameters.normal)
+                                           : irradianceMap.sample(irradiatedSampler, parameters.normal).xyz;
     parameters.irradiatedColor = clamp(c, 0.f, kMaxHDRValue);
     
     uint8_t mipLevel =  parameters.roughness * prefilterMap.get_num_mip_levels();
@@ -300,12 +312,8 @@ vertex v1f vertexMain ( device const VertexData* vertexData       [[buffer(Buffe
     float3 normal = instanceData[ instanceId ].instanceNormalTransform * vd.normal;
     out.normal = normalize(frameData.worldNormalTransform * normal);
 
-    float4 modelPos = float4( vd.position, 1.0);
-    modelPos =  instanceData[ instanceId ].instanceTransform * modelPos;
-    float3 shadow_coord =(frameData.shadow_xform_matrix * frameData.shadow_projections_matrix * frameData.shadow_view_matrix * modelPos).xyz;
-    
-    out.shadow_uv = shadow_coord.xy;
-    out.shadow_depth = half(shadow_coord.z);
+    /// The shadow cascade is picked per fragment from the view depth, the view looks down -z
+    out.view_depth = -(frameData.worldTransform * pos).z;
     
 /// -- color
     half3 color = half3( instanceData[ instanceId ].instanceColor.rgb);
@@ -320,26 +328,24 @@ vertex v1f vertexMain ( device const VertexData* vertexData       [[buffer(Buffe
 ///--fragment function for calculation textures light with reflecting effects-----------------------------
 fragment GBufferData fragmentMain(v1f in [[stage_in]],
                              device const FrameData &frameData        [[ buffer(BufferIndexFrameData) ]],
+                             constant MaterialData &material          [[ buffer(BufferIndexMaterialData) ]],
                              texture2d<float>   baseColorMap          [[ texture(TextureIndexBaseColor) ]],
                              texture2d<float>   normalMap             [[ texture(TextureIndexNormal) ]],
-                             texture2d<float>   metallicMap           [[ texture(TextureIndexMetallic) ]],
-                             texture2d<float>   roughnessMap          [[ texture(TextureIndexRoughness) ]],
-                             texture2d<float>   ambientOcclusionMap   [[ texture(TextureIndexAmbientOcclusion) ]],
+                             texture2d<float>   ormMap                [[ texture(TextureIndexORM) ]],
                              texturecube<float> irradianceMap         [[ texture(TextureIndexIrradianceMap) ]],
                              texturecube<float> prefilterMap          [[ texture(TextureIndexPreFilterMap) ]],
                              texture2d<float>   brdfMap               [[ texture(TextureIndexBDRF) ]],
                              texture2d<float , access::sample> computeMap   [[ texture(TextureIndexWriteMap) ]],
-                             depth2d<float>     shadowMap             [[ texture(TextureIndexShadowMap) ]])
+                             depth2d_array<float> shadowMap           [[ texture(TextureIndexShadowMap) ]])
 {
     GBufferData gBuffer;
     
     PBRParameter parameters = calculateParameters(in ,
                                                   frameData,
+                                                  material,
                                                   baseColorMap,
                                                   normalMap,
-                                                  metallicMap,
-                                                  roughnessMap,
-                                                  ambientOcclusionMap,
+                                                  ormMap,
                                                   irradianceMap,
                                                   prefilterMap,
                                                   brdfMap,
@@ -347,19 +353,9 @@ fragment GBufferData fragmentMain(v1f in [[stage_in]],
 
     half3 eye_normal = normalize(half3(parameters.normal));
     
-    const int neighborWidth = 3;
-    const float neighbors = (neighborWidth * 2.0 + 1.0) *
-                            (neighborWidth * 2.0 + 1.0);
-    float mapSize = 2048;
-    float texelSize = 1.0 / mapSize;
-    float total = 0.f;
-    for (int x = -neighborWidth; x <= neighborWidth; x++) {
-      for (int y = -neighborWidth; y <= neighborWidth; y++) {
-          total += shadowMap.sample_compare(shadowSampler, in.shadow_uv + float2(x,y) * texelSize, in.shadow_depth);
-        }
-      }
-    total /= neighbors;
-    half shadow_sample = (half)total;
+    uint cascade = shadow_cascade_index(frameData.shadow_cascade_splits, in.view_depth);
+    float3 shadow_coord = (frameData.shadow_xform_matrix * frameData.shadow_cascade_matrix[min(cascade, uint(ShadowCascadeCount - 1))] * float4(in.worldPos, 1)).xyz;
+    half shadow_sample = shadow_cascade_pcf(shadowMap, shadow_coord, cascade);
     
     half4 albedo_specular = half4(computeSpecular(parameters));
     gBuffer.albedo_specular = half4(albedo_specular.rgb, albedo_specular.w );
@@ -18,6 +18,7 @@ struct ShadowOutput
 vertex ShadowOutput shadow_vertex( const device VertexData *vertexData    [[buffer(BufferIndexVertexData) ]],
                                    const device InstanceData *instanceData[[buffer(BufferIndexInstanceData)]],
                                    constant  FrameData & frameData        [[buffer(BufferIndexFrameData)]],
+                                   constant  uint & cascade               [[buffer(BufferIndexShadowCascade)]],
                                    uint vertexID                          [[vertex_id]],
                                    uint instanceId                        [[instance_id]])
 {
@@ -26,9 +27,54 @@ vertex ShadowOutput shadow_vertex( const device VertexData *vertexData    [[buff
     device const VertexData & vd = vertexData[ vertexID ];
     float4 pos = float4( vd.position, 1.0 );
     pos = instanceData[instanceId].instanceTransform * pos;
-    out.position = frameData.shadow_projections_matrix * frameData.shadow_view_matrix * pos;
+    out.position = ( cascade == ShadowStaticLayer ? frameData.shadow_static_matrix : frameData.shadow_cascade_matrix[cascade] ) * pos;
     
     out.texcoord = vd.texCoord;
     
     return out;
 }
+
+/// Full screen triangle on the far plane, clears the scissored regions of the static shadow layer
+/// and covers a cascade slice for the composite
+vertex float4 shadow_clear_vertex( uint vertexID [[vertex_id]] )
+{
+    const float2 uv = float2( ( vertexID << 1 ) & 2, vertexID & 2 );
+    return float4( uv * 2.0 - 1.0, 1.0, 1.0 );
+}
+
+struct ShadowCompositeOutput
+{
+    float depth [[depth(any)]];
+};
+
+/// Starts a cascade slice from the static layer. The texel center is taken to the layer and
+/// its depth back to the cascade range, texels the layer has no caster in stay on the far
+/// plane. The layer is drawn without bias, the bias of the dynamic casters is added here in
+/// cascade depth, so static and dynamic casters are offset by the same world distance.
+fragment ShadowCompositeOutput shadow_composite_fragment( float4 position                        [[position]],
+                                                          constant ShadowCompositeData & composite [[buffer(BufferIndexShadowCascade)]],
+                                                          depth2d<float> staticLayer               [[texture(TextureIndexShadowMap)]] )
+{
+    constexpr sampler nearestSampler( coord::normalized, filter::nearest, address::clamp_to_edge );
+    
+    ShadowCompositeOutput out;
+    out.depth = 1.0;
+    
+    const float2 cascadeClip = float2( position.x / composite.cascadeSize.x * 2.0 - 1.0,
+                                       1.0 - position.y / composite.cascadeSize.y * 2.0 );
+    const float4 staticClip = composite.cascadeToStatic * float4( cascadeClip, 0.0, 1.0 );
+    const float2 uv = float2( staticClip.x * 0.5 + 0.5, 0.5 - staticClip.y * 0.5 );
+    const bool inside = all( uv >= 0.0 ) && all( uv <= 1.0 );
+    
+    const float staticDepth = staticLayer.sample( nearestSampler, uv );
+    const float cascadeDepth = ( composite.staticToCascade * float4( staticClip.xy, staticDepth, 1.0 ) ).z;
+    
+    /// Slope of the depth across the slice, every lane computes it so the derivatives hold
+    const float slope = max( abs( dfdx( cascadeDepth ) ), abs( dfdy( cascadeDepth ) ) );
+    /// The constant part counts steps of the 16 bit shadow map
+    const float bias = min( composite.slopeScale * slope + composite.depthBias / 65536.0, composite.biasClamp );
+    
+    if ( inside && staticDepth < 1.0 )
+        out.depth = saturate( cascadeDepth + bias );
+    return out;
+}
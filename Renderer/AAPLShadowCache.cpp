@@ -0,0 +1,272 @@
+///
+///  AAPLShadowCache.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 16.04.24.
+///
+
+#include "AAPLShadowCache.h"
+#include "AAPLMathUtilities.h"
+#include "AAPLUtilities.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+    /// Margin around the static casters, in parts of the layer extent, so a caster that
+    /// settles next to the others rarely asks for a new fit.
+    constexpr float kFitMargin = 1.f / 8.f;
+
+    /// Smallest half extent of the layer in world units.
+    constexpr float kMinHalfExtent = 1.f / 16.f;
+
+    simd::float3 transformPoint( const simd::float4x4& matrix, const simd::float3& point )
+    {
+        const simd::float4 transformed = simd_mul( matrix, (simd::float4){ point.x, point.y, point.z, 1.f } );
+        return (simd::float3){ transformed.x, transformed.y, transformed.z };
+    }
+}
+
+ShadowCache::ShadowCache()
+: _resolution(0)
+, _staticCount(0)
+, _lightViewMatrix(matrix_identity_float4x4)
+, _layerMin((simd::float3){ 0.f, 0.f, 0.f })
+, _layerMax((simd::float3){ 0.f, 0.f, 0.f })
+, _viewProjection(matrix_identity_float4x4)
+, _texelSize(0.f)
+, _fitCount(0)
+, _fullRedraw(false)
+, _redrawnTiles(0)
+{
+    invalidate();
+}
+
+void ShadowCache::resize( size_t instanceCount, uint32_t resolution )
+{
+    _resolution = resolution;
+    _staticCount = 0;
+    _settledFrames.assign( instanceCount, 0 );
+    _static.assign( instanceCount, 0 );
+    _footprints.assign( instanceCount, TileRect{ 0, 0, 0, 0 } );
+    invalidate();
+}
+
+void ShadowCache::invalidate()
+{
+    _invalid = true;
+    _fitted = false;
+    std::memset( _dirty, 0, sizeof( _dirty ) );
+}
+
+bool ShadowCache::fits( const simd::float3& lightMin, const simd::float3& lightMax ) const
+{
+    if ( simd_any( lightMin < _layerMin ) || simd_any( lightMax > _layerMax ) )
+        return false;
+
+    const simd::float3 extent = lightMax - lightMin;
+    const float halfExtent = 0.5f * ( _layerMax.x - _layerMin.x );
+    return 0.5f * std::max( extent.x, extent.y ) * ( 1.f + kFitMargin ) > 0.25f * halfExtent;
+}
+
+void ShadowCache::fit( const simd::float3& lightMin, const simd::float3& lightMax )
+{
+    /// A power of two extent keeps the size while the casters grow or shrink a little, the
+    /// snapped center keeps the texel grid of the layer where it was in light space
+    const simd::float3 extent = lightMax - lightMin;
+    const float needed = std::max( 0.5f * std::max( extent.x, extent.y ) * ( 1.f + kFitMargin ), kMinHalfExtent );
+    const float halfExtent = std::exp2( std::ceil( std::log2( needed ) ) );
+    _texelSize = 2.f * halfExtent / float( _resolution );
+
+    simd::float3 center = 0.5f * ( lightMin + lightMax );
+    center.x = std::floor( center.x / _texelSize + 0.5f ) * _texelSize;
+    center.y = std::floor( center.y / _texelSize + 0.5f ) * _texelSize;
+
+    /// The light view looks down +z, the depth range keeps the same margin
+    const float depthMargin = std::max( kFitMargin * extent.z, kMinHalfExtent );
+    _layerMin = (simd::float3){ center.x - halfExtent, center.y - halfExtent, lightMin.z - depthMargin };
+    _layerMax = (simd::float3){ center.x + halfExtent, center.y + halfExtent, lightMax.z + depthMargin };
+
+    const simd::float4x4 projection = matrix_ortho_left_hand( _layerMin.x, _layerMax.x, _layerMin.y, _layerMax.y,
+                                                              _layerMin.z, _layerMax.z );
+    _viewProjection = matrix_multiply( projection, _lightViewMatrix );
+    _fitted = true;
+    ++_fitCount;
+}
+
+ShadowCache::TileRect ShadowCache::footprint( const simd::float3& rowLength, const simd::float4& sphere ) const
+{
+    /// The layer projection is orthographic, w stays 1
+    const simd::float4 clip = simd_mul( _viewProjection, (simd::float4){ sphere.x, sphere.y, sphere.z, 1.f } );
+    const float radiusX = sphere.w * rowLength.x;
+    const float radiusY = sphere.w * rowLength.y;
+    const float radiusZ = sphere.w * rowLength.z;
+
+    if ( clip.z + radiusZ < 0.f || clip.z - radiusZ > 1.f )
+        return TileRect{ 0, 0, 0, 0 };
+
+    /// Texture y runs down, clip y up
+    const float u0 = ( clip.x - radiusX + 1.f ) * 0.5f;
+    const float u1 = ( clip.x + radiusX + 1.f ) * 0.5f;
+    const float v0 = ( 1.f - clip.y - radiusY ) * 0.5f;
+    const float v1 = ( 1.f - clip.y + radiusY ) * 0.5f;
+
+    if ( u1 < 0.f || u0 > 1.f || v1 < 0.f || v0 > 1.f )
+        return TileRect{ 0, 0, 0, 0 };
+
+    auto tile = [&]( float coordinate, float bias ) -> uint8_t
+    {
+        return uint8_t( std::clamp( std::floor( coordinate * kTileCount ) + bias, 0.f, float( kTileCount ) ) );
+    };
+    return TileRect{ tile( u0, 0.f ), tile( v0, 0.f ), tile( u1, 1.f ), tile( v1, 1.f ) };
+}
+
+void ShadowCache::markDirty( const TileRect& rect )
+{
+    for ( uint32_t y = rect.y0; y < rect.y1; ++y )
+    {
+        for ( uint32_t x = rect.x0; x < rect.x1; ++x )
+        {
+            _dirty[y * kTileCount + x] = 1;
+        }
+    }
+}
+
+void ShadowCache::update( const simd::float4x4& lightViewMatrix, const InstanceCuller& culler, const uint8_t* pMoved )
+{
+    const size_t instanceCount = _static.size();
+    AAPL_ASSERT( culler.instanceCount() == instanceCount, "ShadowCache: resize() before update()" );
+
+    /// Classify the casters and take the light space box around the static ones
+    simd::float3 lightMin = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+    simd::float3 lightMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    _staticCount = 0;
+    for ( size_t i = 0; i < instanceCount; ++i )
+    {
+        _settledFrames[i] = pMoved[i] ? 0 : std::min< uint8_t >( _settledFrames[i] + 1, kSettleFrames );
+        _static[i] = _settledFrames[i] >= kSettleFrames;
+        _staticCount += _static[i];
+
+        if ( _static[i] )
+        {
+            const simd::float4 sphere = culler.bounds( i );
+            const simd::float3 center = transformPoint( lightViewMatrix, sphere.xyz );
+            lightMin = simd_min( lightMin, center - sphere.w );
+            lightMax = simd_max( lightMax, center + sphere.w );
+        }
+    }
+
+    /// Without static casters the layer is not drawn or read, the next static caster starts
+    /// it over with a new fit and a full redraw
+    if ( _staticCount == 0 )
+    {
+        _footprints.assign( instanceCount, TileRect{ 0, 0, 0, 0 } );
+        _regions.clear();
+        _fullRedraw = false;
+        _redrawnTiles = 0;
+        invalidate();
+        return;
+    }
+
+    /// A new sun direction turns the whole layer, a new fit moves every texel of it. The
+    /// camera does not take part, the layer stays while it moves.
+    bool fullRedraw = _invalid;
+    _invalid = false;
+    if ( std::memcmp( &lightViewMatrix, &_lightViewMatrix, sizeof( simd::float4x4 ) ) != 0 )
+    {
+        _lightViewMatrix = lightViewMatrix;
+        _fitted = false;
+    }
+    if ( !_fitted || !fits( lightMin, lightMax ) )
+    {
+        fit( lightMin, lightMax );
+        fullRedraw = true;
+    }
+
+    const simd::float3 rowLength =
+    {
+        simd_length( (simd::float3){ _viewProjection.columns[0].x, _viewProjection.columns[1].x, _viewProjection.columns[2].x } ),
+        simd_length( (simd::float3){ _viewProjection.columns[0].y, _viewProjection.columns[1].y, _viewProjection.columns[2].y } ),
+        simd_length( (simd::float3){ _viewProjection.columns[0].z, _viewProjection.columns[1].z, _viewProjection.columns[2].z } )
+    };
+
+    /// Static casters that appeared or left dirty their old and new tiles. A caster that
+    /// moves is dynamic, so a footprint only changes with the static set.
+    for ( size_t i = 0; i < instanceCount; ++i )
+    {
+        const TileRect rect = _static[i] ? footprint( rowLength, culler.bounds( i ) ) : TileRect{ 0, 0, 0, 0 };
+        if ( !fullRedraw && !( rect == _footprints[i] ) )
+        {
+            markDirty( _footprints[i] );
+            markDirty( rect );
+        }
+        _footprints[i] = rect;
+    }
+
+    _fullRedraw = fullRedraw;
+    buildRegions();
+}
+
+void ShadowCache::buildRegions()
+{
+    std::vector<Region>& regions = _regions;
+    uint8_t* pDirty = _dirty;
+    regions.clear();
+
+    uint32_t dirtyCount = 0;
+    for ( uint32_t tile = 0; tile < kTileCount * kTileCount; ++tile )
+        dirtyCount += pDirty[tile];
+
+    /// Past half of the layer one cleared pass is cheaper than many scissored ones
+    if ( _fullRedraw || dirtyCount * 2 > kTileCount * kTileCount )
+    {
+        _fullRedraw = true;
+        _redrawnTiles = kTileCount * kTileCount;
+        regions.push_back( { 0, 0, _resolution, _resolution } );
+        std::memset( pDirty, 0, kTileCount * kTileCount );
+        return;
+    }
+
+    /// Tile rectangles, x0 x1 y0 y1
+    struct Span { uint32_t x0, x1, y0, y1; };
+    std::vector<Span> spans;
+    for ( uint32_t y = 0; y < kTileCount; ++y )
+    {
+        for ( uint32_t x = 0; x < kTileCount; )
+        {
+            if ( !pDirty[y * kTileCount + x] )
+            {
+                ++x;
+                continue;
+            }
+            const uint32_t x0 = x;
+            while ( x < kTileCount && pDirty[y * kTileCount + x] )
+                ++x;
+
+            auto above = std::find_if( spans.begin(), spans.end(), [&]( const Span& span )
+            {
+                return span.x0 == x0 && span.x1 == x && span.y1 == y;
+            });
+            if ( above != spans.end() )
+                above->y1 = y + 1;
+            else
+                spans.push_back( { x0, x, y, y + 1 } );
+        }
+    }
+
+    const uint32_t tileSize = _resolution / kTileCount;
+    for ( const Span& span : spans )
+    {
+        const uint32_t x = span.x0 * tileSize;
+        const uint32_t y = span.y0 * tileSize;
+        const uint32_t right  = span.x1 == kTileCount ? _resolution : span.x1 * tileSize;
+        const uint32_t bottom = span.y1 == kTileCount ? _resolution : span.y1 * tileSize;
+        regions.push_back( { x, y, right - x, bottom - y } );
+    }
+
+    _redrawnTiles = dirtyCount;
+    std::memset( pDirty, 0, kTileCount * kTileCount );
+}
@@ -0,0 +1,132 @@
+///
+///  AAPLShadowCache.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 16.04.24.
+///
+/// Abstract:
+/// Static shadow caching for the sun cascades. Casters that have not moved for a few frames
+/// are static, they live in a separate depth layer that is only re-rendered where it changed.
+/// The layer does not follow the camera, it has its own orthographic projection in light
+/// space fitted around the static casters, with a power of two extent and its center snapped
+/// to whole texels. The fit only changes with the sun direction or when the static casters
+/// leave it or shrink to a fraction of it, and that change redraws the whole layer. Otherwise
+/// the layer is divided into light space tiles. A tile turns dirty when a static caster
+/// enters, leaves or moves inside it, and only the dirty tiles are cleared and redrawn,
+/// merged into a few scissor rectangles. Every frame a cascade whose texels are as large as
+/// the layer texels or larger starts from the layer reprojected into its projection, finer
+/// cascades draw the static casters themselves, the dynamic casters go on top of both.
+
+#pragma once
+#ifndef AAPLShadowCache_h
+#define AAPLShadowCache_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+
+#include "AAPLInstanceCuller.h"
+
+class ShadowCache
+{
+public:
+    /// Tiles per side of the static layer.
+    static constexpr uint32_t kTileCount = 32;
+
+    /// Frames a caster has to stay put before it moves into the static layer.
+    static constexpr uint8_t kSettleFrames = 8;
+
+    /// Texel rectangle of the static layer to clear and redraw.
+    struct Region
+    {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    ShadowCache();
+
+    /// Resets the static state and forces a full redraw of the layer.
+    void resize( size_t instanceCount, uint32_t resolution );
+    void invalidate();
+
+    /// Classifies the casters, refits the layer projection if the sun or the static casters
+    /// ask for it and collects the dirty tiles. pMoved flags the instances whose transform
+    /// changed this frame, the bounds come from the culler.
+    void update( const simd::float4x4& lightViewMatrix, const InstanceCuller& culler, const uint8_t* pMoved );
+
+    /// 1 for instances drawn into the static layer, 0 for the dynamic ones.
+    const std::vector<uint8_t>& staticFlags() const { return _static; }
+
+    /// Light view followed by the orthographic projection of the layer.
+    const simd::float4x4& viewProjection() const { return _viewProjection; }
+
+    /// World units per texel of the layer.
+    float texelSize() const { return _texelSize; }
+
+    /// The renderer clears and redraws these regions of the static layer this frame, none while
+    /// there are no static casters.
+    bool fullRedraw() const { return _fullRedraw; }
+    const std::vector<Region>& redrawRegions() const { return _regions; }
+
+    /// Tiles redrawn this frame, kTileCount * kTileCount for a full redraw.
+    uint32_t redrawnTiles() const { return _redrawnTiles; }
+    size_t staticCount() const { return _staticCount; }
+
+    /// Times the projection was fitted, a new sun direction or static footprint each.
+    uint32_t fitCount() const { return _fitCount; }
+
+private:
+    /// Tile range [x0, x1) x [y0, y1), empty when x0 >= x1.
+    struct TileRect
+    {
+        uint8_t x0, y0, x1, y1;
+
+        bool empty() const { return x0 >= x1; }
+        bool operator==( const TileRect& other ) const
+        {
+            return x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1;
+        }
+    };
+
+    /// True while the light space box of the static casters lies inside the fitted layer
+    /// and still takes more than a quarter of its extent.
+    bool fits( const simd::float3& lightMin, const simd::float3& lightMax ) const;
+
+    /// Fits the layer projection around the light space box of the static casters.
+    void fit( const simd::float3& lightMin, const simd::float3& lightMax );
+
+    /// Tiles covered by the layer footprint of a world space sphere.
+    TileRect footprint( const simd::float3& rowLength, const simd::float4& sphere ) const;
+    void markDirty( const TileRect& rect );
+
+    /// Merges the dirty tiles into rectangles, row spans first, then equal spans of
+    /// neighbouring rows.
+    void buildRegions();
+
+    uint32_t _resolution;
+    size_t _staticCount;
+
+    std::vector<uint8_t> _settledFrames;
+    std::vector<uint8_t> _static;
+
+    /// Light view the layer was fitted in, its light space box and projection
+    simd::float4x4 _lightViewMatrix;
+    simd::float3 _layerMin;
+    simd::float3 _layerMax;
+    simd::float4x4 _viewProjection;
+    float _texelSize;
+    uint32_t _fitCount;
+
+    bool _invalid;
+    bool _fitted;
+    bool _fullRedraw;
+    std::vector<TileRect> _footprints;
+    uint8_t _dirty[kTileCount * kTileCount];
+    std::vector<Region> _regions;
+    uint32_t _redrawnTiles;
+};
+
+#endif /* AAPLShadowCache_h */
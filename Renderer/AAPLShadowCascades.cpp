@@ -0,0 +1,241 @@
+///
+///  AAPLShadowCascades.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 14.04.24.
+///
+
+#include "AAPLShadowCascades.h"
+#include "AAPLMathUtilities.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+static_assert( ShadowCascades::kCascadeCount == 4, "splitFarDepths packs the cascades into a float4" );
+
+namespace
+{
+    /// Bounding sphere radii are rounded up to this step, so float noise in the corners
+    /// never changes the projection size.
+    constexpr float kRadiusStep = 1.f / 16.f;
+
+    simd::float3 transformPoint( const simd::float4x4& matrix, const simd::float3& point )
+    {
+        const simd::float4 transformed = simd_mul( matrix, (simd::float4){ point.x, point.y, point.z, 1.f } );
+        return (simd::float3){ transformed.x, transformed.y, transformed.z };
+    }
+}
+
+ShadowCascades::ShadowCascades()
+: _splitLambda(0.75f)
+, _shadowDistance(0.f)
+, _cameraViewMatrix(matrix_identity_float4x4)
+, _lightViewMatrix(matrix_identity_float4x4)
+{
+    for ( uint32_t index = 0; index < kCascadeCount; ++index )
+    {
+        Cascade& cascade = _cascades[index];
+        cascade.viewProjection = matrix_identity_float4x4;
+        cascade.splitNear = 0.f;
+        cascade.splitFar  = 0.f;
+        cascade.texelSize = 0.f;
+        cascade.bounds    = (simd::float4){ 0.f, 0.f, 0.f, 0.f };
+
+        _sliceMin[index] = _sliceMax[index] = (simd::float3){ 0.f, 0.f, 0.f };
+        _sliceLightMin[index] = _sliceLightMax[index] = (simd::float3){ 0.f, 0.f, 0.f };
+        _casterNear[index] = 0.f;
+        setCasterVolume( index, _sliceLightMin[index], _sliceLightMax[index] );
+    }
+}
+
+void ShadowCascades::splitDistances( float near, float far, float* pSplits ) const
+{
+    for ( uint32_t split = 0; split <= kCascadeCount; ++split )
+    {
+        const float fraction = float( split ) / kCascadeCount;
+        const float logarithmic = near * std::pow( far / near, fraction );
+        const float uniform = near + ( far - near ) * fraction;
+        pSplits[split] = _splitLambda * logarithmic + ( 1.f - _splitLambda ) * uniform;
+    }
+    pSplits[0] = near;
+    pSplits[kCascadeCount] = far;
+}
+
+FrustumPoints ShadowCascades::planePoints( const simd::float4x4& cameraViewMatrix,
+                                          const simd::float4x4& projectionMatrix, float depth )
+{
+    /// Right handed projections look down -z, left handed ones down +z, the sign sits in the w row
+    const float z = depth * projectionMatrix.columns[2].w;
+    const float halfWidth  = depth / projectionMatrix.columns[0][0];
+    const float halfHeight = depth / projectionMatrix.columns[1][1];
+
+    const simd::float4x4 worldFromView = matrix_invert( cameraViewMatrix );
+    auto corner = [&]( float x, float y ) -> simd::float3
+    {
+        const simd::float4 world = simd_mul( worldFromView, (simd::float4){ x, y, z, 1.f } );
+        return (simd::float3){ world.x, world.y, world.z };
+    };
+
+    FrustumPoints points;
+    points.viewMatrix = cameraViewMatrix;
+    points.upperLeft  = corner( -halfWidth,  halfHeight );
+    points.upperRight = corner(  halfWidth,  halfHeight );
+    points.lowerRight = corner(  halfWidth, -halfHeight );
+    points.lowerLeft  = corner( -halfWidth, -halfHeight );
+    return points;
+}
+
+void ShadowCascades::update( const CameraData& camera, const simd::float4x4& projectionMatrix,
+                             const simd::float4x4& lightViewMatrix, const simd::float4& sceneBounds,
+                             uint32_t resolution )
+{
+    _cameraViewMatrix = camera.viewMatrix;
+    _lightViewMatrix  = lightViewMatrix;
+
+    const float near = camera.near;
+    const float far  = _shadowDistance > near ? std::min( camera.far, _shadowDistance ) : camera.far;
+
+    float splits[kCascadeCount + 1];
+    splitDistances( near, far, splits );
+
+    FrustumPoints planes[kCascadeCount + 1];
+    for ( uint32_t split = 0; split <= kCascadeCount; ++split )
+    {
+        planes[split] = planePoints( camera.viewMatrix, projectionMatrix, splits[split] );
+    }
+
+    /// Light space depth of the nearest caster, the light view looks down +z
+    const simd::float4 sceneCenter = simd_mul( lightViewMatrix, (simd::float4){ sceneBounds.x, sceneBounds.y, sceneBounds.z, 1.f } );
+    const float casterNear = sceneCenter.z - sceneBounds.w;
+
+    for ( uint32_t index = 0; index < kCascadeCount; ++index )
+    {
+        const simd::float3 corners[8] =
+        {
+            planes[index].upperLeft,     planes[index].upperRight,
+            planes[index].lowerRight,    planes[index].lowerLeft,
+            planes[index + 1].upperLeft, planes[index + 1].upperRight,
+            planes[index + 1].lowerRight, planes[index + 1].lowerLeft
+        };
+
+        simd::float3 center = corners[0];
+        for ( uint32_t i = 1; i < 8; ++i )
+            center += corners[i];
+        center /= 8.f;
+
+        float radius = 0.f;
+        for ( const simd::float3& corner : corners )
+            radius = std::max( radius, simd_length( corner - center ) );
+        radius = std::ceil( radius / kRadiusStep ) * kRadiusStep;
+
+        /// One texel of margin on each side, snapping the center moves it by less than a texel
+        const float texelSize = 2.f * radius / float( resolution - 2 );
+        const float halfExtent = 0.5f * texelSize * resolution;
+
+        simd::float4 lightCenter = simd_mul( lightViewMatrix, (simd::float4){ center.x, center.y, center.z, 1.f } );
+        lightCenter.x = std::floor( lightCenter.x / texelSize ) * texelSize;
+        lightCenter.y = std::floor( lightCenter.y / texelSize ) * texelSize;
+
+        const float zNear = std::min( lightCenter.z - radius, casterNear );
+        const float zFar  = lightCenter.z + radius;
+
+        const simd::float4x4 projection = matrix_ortho_left_hand( lightCenter.x - halfExtent, lightCenter.x + halfExtent,
+                                                                  lightCenter.y - halfExtent, lightCenter.y + halfExtent,
+                                                                  zNear, zFar );
+
+        Cascade& cascade = _cascades[index];
+        cascade.viewProjection = matrix_multiply( projection, lightViewMatrix );
+        cascade.splitNear = splits[index];
+        cascade.splitFar  = splits[index + 1];
+        cascade.texelSize = texelSize;
+        cascade.bounds    = (simd::float4){ center.x, center.y, center.z, radius };
+
+        /// Until receivers are known every caster in front of the whole slice counts
+        _sliceMin[index] = _sliceMax[index] = corners[0];
+        _sliceLightMin[index] = _sliceLightMax[index] = transformPoint( lightViewMatrix, corners[0] );
+        for ( const simd::float3& corner : corners )
+        {
+            const simd::float3 lightCorner = transformPoint( lightViewMatrix, corner );
+            _sliceMin[index] = simd_min( _sliceMin[index], corner );
+            _sliceMax[index] = simd_max( _sliceMax[index], corner );
+            _sliceLightMin[index] = simd_min( _sliceLightMin[index], lightCorner );
+            _sliceLightMax[index] = simd_max( _sliceLightMax[index], lightCorner );
+        }
+        _casterNear[index] = zNear;
+        setCasterVolume( index, _sliceLightMin[index], _sliceLightMax[index] );
+    }
+}
+
+void ShadowCascades::fitCasterVolumes( const simd::float4* pReceivers, size_t receiverCount,
+                                       const simd::float3& groundMin, const simd::float3& groundMax )
+{
+    for ( uint32_t index = 0; index < kCascadeCount; ++index )
+    {
+        const Cascade& cascade = _cascades[index];
+        simd::float3 receiverMin = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+        simd::float3 receiverMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+        /// The part of the ground inside the world bounds of the slice
+        const simd::float3 clippedMin = simd_max( groundMin, _sliceMin[index] );
+        const simd::float3 clippedMax = simd_min( groundMax, _sliceMax[index] );
+        if ( simd_all( clippedMin <= clippedMax ) )
+        {
+            for ( uint32_t corner = 0; corner < 8; ++corner )
+            {
+                const simd::float3 point = { ( corner & 1 ) ? clippedMax.x : clippedMin.x,
+                                             ( corner & 2 ) ? clippedMax.y : clippedMin.y,
+                                             ( corner & 4 ) ? clippedMax.z : clippedMin.z };
+                const simd::float3 lightPoint = transformPoint( _lightViewMatrix, point );
+                receiverMin = simd_min( receiverMin, lightPoint );
+                receiverMax = simd_max( receiverMax, lightPoint );
+            }
+        }
+
+        /// Visible instances overlapping the depth range of the slice, the camera looks down -z
+        for ( size_t i = 0; i < receiverCount; ++i )
+        {
+            const simd::float4& sphere = pReceivers[i];
+            const simd::float3 center = { sphere.x, sphere.y, sphere.z };
+            const float depth = -transformPoint( _cameraViewMatrix, center ).z;
+            if ( depth + sphere.w < cascade.splitNear || depth - sphere.w > cascade.splitFar )
+                continue;
+
+            const simd::float3 lightCenter = transformPoint( _lightViewMatrix, center );
+            receiverMin = simd_min( receiverMin, lightCenter - sphere.w );
+            receiverMax = simd_max( receiverMax, lightCenter + sphere.w );
+        }
+
+        /// Nothing to receive outside the slice, an empty box culls every caster
+        setCasterVolume( index, simd_max( receiverMin, _sliceLightMin[index] ),
+                                simd_min( receiverMax, _sliceLightMax[index] ) );
+    }
+}
+
+void ShadowCascades::setCasterVolume( uint32_t index, const simd::float3& lightMin, const simd::float3& lightMax )
+{
+    /// Inward facing light space planes, the near plane of the cascade instead of lightMin.z
+    /// keeps every caster between the light and the receivers
+    const simd::float4 lightPlanes[6] =
+    {
+        {  1.f,  0.f,  0.f, -lightMin.x },
+        { -1.f,  0.f,  0.f,  lightMax.x },
+        {  0.f,  1.f,  0.f, -lightMin.y },
+        {  0.f, -1.f,  0.f,  lightMax.y },
+        {  0.f,  0.f,  1.f, -_casterNear[index] },
+        {  0.f,  0.f, -1.f,  lightMax.z }
+    };
+
+    /// A light space plane p becomes p * lightView in world space, the light view is rigid so
+    /// the normals stay unit length
+    const simd::float4x4 lightViewTransposed = simd_transpose( _lightViewMatrix );
+    for ( uint32_t plane = 0; plane < 6; ++plane )
+    {
+        _cascades[index].casterPlanes[plane] = simd_mul( lightViewTransposed, lightPlanes[plane] );
+    }
+}
+
+simd::float4 ShadowCascades::splitFarDepths() const
+{
+    return (simd::float4){ _cascades[0].splitFar, _cascades[1].splitFar, _cascades[2].splitFar, _cascades[3].splitFar };
+}
@@ -0,0 +1,96 @@
+///
+///  AAPLShadowCascades.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 14.04.24.
+///
+/// Abstract:
+/// Cascaded shadow maps for the sun. The camera frustum is split at practical split
+/// distances, a blend of logarithmic and uniform splits. Every cascade gets an orthographic
+/// projection in light space fitted around the bounding sphere of its frustum slice. The
+/// sphere size does not change when the camera turns, and its center is snapped to whole
+/// shadow map texels, so shadow edges do not shimmer while the camera moves. Casters are
+/// culled against a light space box around the receivers of a slice, extruded towards the
+/// light, so only instances whose shadow can land on something visible are drawn. Only simd
+/// and the camera types are used, so the fit can be exercised without a Metal device.
+
+#pragma once
+#ifndef AAPLShadowCascades_h
+#define AAPLShadowCascades_h
+
+#include <simd/simd.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "AAPLShaderTypes.h"
+#include "AAPLCamera3DTypes.h"
+
+class ShadowCascades
+{
+public:
+    static constexpr uint32_t kCascadeCount = ShadowCascadeCount;
+
+    struct Cascade
+    {
+        simd::float4x4 viewProjection;  /// light view followed by the fitted orthographic projection
+        float          splitNear;       /// camera view depth range covered by the cascade
+        float          splitFar;
+        float          texelSize;       /// world units per shadow map texel
+        simd::float4   bounds;          /// world space bounding sphere of the frustum slice
+        simd::float4   casterPlanes[6]; /// world space caster volume, FrustumCuller plane order
+    };
+
+    ShadowCascades();
+
+    /// Blend between uniform (0) and logarithmic (1) split distances.
+    void setSplitLambda( float lambda ) { _splitLambda = lambda; }
+
+    /// Limits the shadowed camera depth, shadows past it are not drawn.
+    void setShadowDistance( float distance ) { _shadowDistance = distance; }
+
+    /// Writes kCascadeCount + 1 split depths, near first and the last one at far.
+    void splitDistances( float near, float far, float* pSplits ) const;
+
+    /// World space corners of the camera frustum cross section at the given view depth.
+    static FrustumPoints planePoints( const simd::float4x4& cameraViewMatrix,
+                                      const simd::float4x4& projectionMatrix, float depth );
+
+    /// Splits the camera frustum and fits one light space projection per cascade.
+    /// sceneBounds is a world space sphere around all casters, the projections reach back
+    /// to it so casters between the light and a cascade still land in its depth range.
+    void update( const CameraData& camera, const simd::float4x4& projectionMatrix,
+                 const simd::float4x4& lightViewMatrix, const simd::float4& sceneBounds,
+                 uint32_t resolution );
+
+    /// Shrinks the caster volumes of the last update() to the receivers inside each slice.
+    /// pReceivers are the world space spheres of the instances the camera sees, groundMin and
+    /// groundMax a world space box around the ground plane.
+    void fitCasterVolumes( const simd::float4* pReceivers, size_t receiverCount,
+                           const simd::float3& groundMin, const simd::float3& groundMax );
+
+    const Cascade& cascade( uint32_t index ) const { return _cascades[index]; }
+
+    /// Far split depths of all cascades, the receivers pick the first cascade whose split
+    /// lies beyond their view depth.
+    simd::float4 splitFarDepths() const;
+
+private:
+    /// Planes of the light space box [minXY, maxXY] from the cascade near plane to maxZ.
+    void setCasterVolume( uint32_t index, const simd::float3& lightMin, const simd::float3& lightMax );
+
+    float _splitLambda;
+    float _shadowDistance;
+    Cascade _cascades[kCascadeCount];
+
+    /// Frustum slice bounds of the last update(), world space and light space
+    simd::float4x4 _cameraViewMatrix;
+    simd::float4x4 _lightViewMatrix;
+    simd::float3 _sliceMin[kCascadeCount];
+    simd::float3 _sliceMax[kCascadeCount];
+    simd::float3 _sliceLightMin[kCascadeCount];
+    simd::float3 _sliceLightMax[kCascadeCount];
+    float _casterNear[kCascadeCount];
+};
+
+#endif /* AAPLShadowCascades_h */
@@ -0,0 +1,151 @@
+///
+///  AAPLTextureLoader.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 23.04.24.
+///
+/// Abstract:
+/// Start up texture loading through one MTKTextureLoader shared by all requests. Catalog
+/// textures are collected until flush and then handed to the loader as one asynchronous
+/// batch per storage mode and usage, a name asked for twice in a batch is loaded once.
+/// Catalog sets whose PNG files the bundle carries under a catalog index skip the loader,
+/// their mip chains are decoded on the decoder pool and uploaded by the worker that decoded
+/// them. BC7 files cooked by the TextureCooker are read on the pool as well and uploaded as
+/// they are, private ones through a blit, and textures of a mapped asset pack go to Metal
+/// without being copied first. Every request returns a future, so the renderer can issue all
+/// of its textures up front and wait once instead of loading them one after the other.
+
+#pragma once
+#ifndef AAPLTextureLoader_h
+#define AAPLTextureLoader_h
+
+#include <Metal/Metal.hpp>
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "AAPLDecoderPool.h"
+#include "AAPLAssetPack.h"
+#include "AAPLCatalogIndex.h"
+
+class TextureLoader
+{
+public:
+    /// Texture with a +1 reference for the caller, available once the request completed.
+    using Future = std::shared_future<MTL::Texture*>;
+
+    /// Counts since the loader was created, time from the first request to the end of the last wait.
+    struct Statistics
+    {
+        uint32_t requestCount;
+        uint32_t batchCount;
+        uint32_t fileCount;
+        double   milliseconds;
+    };
+
+    /// The same catalog textures loaded one by one the old way and as one batch.
+    struct Timings
+    {
+        size_t textureCount;
+        double serialMilliseconds;
+        double batchedMilliseconds;
+    };
+
+    /// decoderThreads workers decode loose files, 0 takes one per hardware thread.
+    explicit TextureLoader( MTL::Device* pDevice, uint32_t decoderThreads = 0 );
+
+    /// Waits for the outstanding requests.
+    ~TextureLoader();
+
+    TextureLoader( const TextureLoader& ) = delete;
+    TextureLoader& operator=( const TextureLoader& ) = delete;
+
+    /// Decodes the PNG files of a 2D set of the catalog index on the pool, queues any other
+    /// texture of the asset catalog, it is loaded with the next flush.
+    Future loadFromCatalog( const char* name, MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+    /// Decodes the PNG files of a mip chain, level 0 first, on the pool into an RGBA8Unorm or
+    /// RGBA8Unorm_sRGB texture. Images stored bottom row first are flipped, private textures
+    /// are filled by a blit from a shared staging buffer.
+    Future loadFromFiles( const std::vector<std::string>& levelPaths, MTL::PixelFormat pixelFormat,
+                          MTL::StorageMode storageMode, MTL::TextureUsage usage, bool bottomLeftOrigin = false );
+
+    /// Reads a BC7 KTX file with its mips on the pool. Private textures are filled by a blit from
+    /// a shared staging buffer, textures of the other storage modes with replaceRegion.
+    Future loadFromKTX( const std::string& path, MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+    /// Uploads a texture of a mapped asset pack straight from its pages, the pack has to stay
+    /// open until the request completed. Private textures are blitted from a no copy buffer
+    /// over the blob, the others are filled with replaceRegion from the mapping.
+    Future loadFromPack( const AssetPack& pack, const AssetPackEntry& entry, MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+    /// Creates the texture of a pack entry from firstLevel down to its smallest mip and uploads it
+    /// on the calling thread, pQueue blits private textures. The residency manager reloads with it.
+    static MTL::Texture* newTextureFromPack( MTL::Device* pDevice, MTL::CommandQueue* pQueue, const AssetPack& pack,
+                                             const AssetPackEntry& entry, uint32_t firstLevel,
+                                             MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+    /// Asset pack loadCooked looks in first, nullptr for none.
+    void usePack( const AssetPack* pPack ) { _pPack = pPack; }
+
+    /// Index of the loose catalog files loadFromCatalog decodes itself, nullptr for none.
+    void useCatalogIndex( const CatalogIndex* pIndex ) { _pCatalogIndex = pIndex; }
+
+    /// Entry of the asset pack loadCooked takes the texture from, nullptr when it loads it elsewhere.
+    const AssetPackEntry* cookedPackEntry( const char* name ) const;
+
+    /// The texture of the asset pack, else the cooked <name>.ktx of the main bundle, as long as
+    /// the device samples its format, the catalog texture otherwise.
+    Future loadCooked( const char* name, MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+    /// Hands the queued catalog requests to the texture loader.
+    void flush();
+
+    /// Flushes and returns once every request issued so far completed.
+    void wait();
+
+    const Statistics& statistics() const { return _statistics; }
+
+    /// Loads the names with newTextureFromCatalog one after the other, then as one batch, and
+    /// releases the textures again.
+    static Timings benchmark( MTL::Device* pDevice, const std::vector<const char*>& names,
+                              MTL::StorageMode storageMode, MTL::TextureUsage usage );
+
+private:
+    struct CatalogRequest
+    {
+        std::string name;
+        size_t      nameIndex;          /// index of the name in the batch, shared by duplicates
+        std::promise<MTL::Texture*> promise;
+    };
+
+    struct CatalogBatch
+    {
+        MTL::StorageMode storageMode;
+        MTL::TextureUsage usage;
+        std::vector<std::string>    names;
+        std::vector<CatalogRequest> requests;
+    };
+
+    void startTiming();
+
+    /// Creates the queue that blits private textures the first time one is asked for.
+    void prepareUpload( MTL::StorageMode storageMode );
+
+    MTL::Device* _pDevice;
+    NS::Object*  _pTextureLoader;       /// MTKTextureLoader
+    MTL::CommandQueue* _pUploadQueue = nullptr;   /// blits private compressed textures, created on first use
+    const AssetPack*   _pPack = nullptr;
+    const CatalogIndex* _pCatalogIndex = nullptr;
+    DecoderPool  _decoders;
+
+    std::vector<CatalogBatch> _batches;
+    std::vector<Future>       _outstanding;
+    Statistics _statistics = { 0, 0, 0, 0.0 };
+    std::chrono::steady_clock::time_point _start;
+    bool _timing = false;
+};
+
+#endif /* AAPLTextureLoader_h */
@@ -0,0 +1,448 @@
+///
+///  AAPLTextureLoader.mm
+///  MetalCCP
+///
+///  Created by Guido Schneider on 23.04.24.
+///
+
+#include <MetalKit/MetalKit.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "AAPLTextureLoader.h"
+#include "AAPLCompressedTexture.h"
+#include "AAPLMesh.h"
+#include "AAPLUtilities.h"
+
+#include <Metal/Metal.hpp>
+
+namespace
+{
+    /// Reverses the rows of an image stored bottom row first, Metal wants the top row first.
+    void flipRows( Image8& image )
+    {
+        const size_t bytesPerRow = image.bytesPerRow();
+        for ( uint32_t top = 0, bottom = image.height - 1; top < bottom; ++top, --bottom )
+        {
+            uint8_t* pTop = image.pixels.data() + top * bytesPerRow;
+            std::swap_ranges( pTop, pTop + bytesPerRow, image.pixels.data() + bottom * bytesPerRow );
+        }
+    }
+}
+
+TextureLoader::TextureLoader( MTL::Device* pDevice, uint32_t decoderThreads )
+: _pDevice( pDevice->retain() )
+, _pTextureLoader( ( __bridge NS::Object* )[[MTKTextureLoader alloc] initWithDevice:( __bridge id<MTLDevice> )pDevice] )
+, _decoders( decoderThreads )
+{
+}
+
+TextureLoader::~TextureLoader()
+{
+    wait();
+    if ( _pUploadQueue )
+        _pUploadQueue->release();
+    _pTextureLoader->release();
+    _pDevice->release();
+}
+
+void TextureLoader::startTiming()
+{
+    if ( !_timing )
+    {
+        _start = std::chrono::steady_clock::now();
+        _timing = true;
+    }
+}
+
+void TextureLoader::prepareUpload( MTL::StorageMode storageMode )
+{
+    if ( storageMode == MTL::StorageModePrivate && !_pUploadQueue )
+    {
+        _pUploadQueue = _pDevice->newCommandQueue();
+        _pUploadQueue->setLabel( AAPLSTR( "Texture Upload Queue" ) );
+    }
+}
+
+TextureLoader::Future TextureLoader::loadFromCatalog( const char* name, MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    /// Cube sets and images other than PNG stay with MTKTextureLoader
+    const CatalogIndex::Entry* pEntry = _pCatalogIndex ? _pCatalogIndex->find( name ) : nullptr;
+    if ( pEntry && pEntry->type == CatalogIndex::Entry::TypeTexture )
+    {
+        /// The chain ends at the first level the set leaves out
+        std::vector<std::string> levelPaths;
+        bool png = true;
+        for ( uint32_t level = 0; level < pEntry->levelCount; ++level )
+        {
+            const std::filesystem::path path = _pCatalogIndex->imagePath( *pEntry, 0, level );
+            if ( path.empty() )
+                break;
+            png = png && path.extension() == ".png";
+            levelPaths.push_back( path.string() );
+        }
+        if ( png )
+        {
+            const MTL::PixelFormat pixelFormat = pEntry->flags & CatalogIndex::Entry::FlagData ? MTL::PixelFormatRGBA8Unorm
+                                                                                               : MTL::PixelFormatRGBA8Unorm_sRGB;
+            return loadFromFiles( levelPaths, pixelFormat, storageMode, usage,
+                                  pEntry->flags & CatalogIndex::Entry::FlagBottomLeftOrigin );
+        }
+    }
+
+    startTiming();
+    ++_statistics.requestCount;
+
+    auto batch = std::find_if( _batches.begin(), _batches.end(), [&]( const CatalogBatch& candidate )
+    {
+        return candidate.storageMode == storageMode && candidate.usage == usage;
+    });
+    if ( batch == _batches.end() )
+    {
+        _batches.push_back( CatalogBatch{ storageMode, usage, {}, {} } );
+        batch = _batches.end() - 1;
+    }
+
+    const auto known = std::find( batch->names.begin(), batch->names.end(), name );
+    const size_t nameIndex = size_t( known - batch->names.begin() );
+    if ( known == batch->names.end() )
+        batch->names.push_back( name );
+
+    batch->requests.push_back( CatalogRequest{ name, nameIndex, {} } );
+    Future future = batch->requests.back().promise.get_future().share();
+    _outstanding.push_back( future );
+    return future;
+}
+
+TextureLoader::Future TextureLoader::loadFromFiles( const std::vector<std::string>& levelPaths, MTL::PixelFormat pixelFormat,
+                                                   MTL::StorageMode storageMode, MTL::TextureUsage usage, bool bottomLeftOrigin )
+{
+    AAPL_ASSERT( !levelPaths.empty(), "No files for the texture" );
+    AAPL_ASSERT( pixelFormat == MTL::PixelFormatRGBA8Unorm || pixelFormat == MTL::PixelFormatRGBA8Unorm_sRGB,
+                 "Decoded files are uploaded as 8 bit RGBA:", levelPaths.front() );
+    startTiming();
+    ++_statistics.requestCount;
+    _statistics.fileCount += uint32_t( levelPaths.size() );
+    prepareUpload( storageMode );
+
+    /// Creating and filling textures is thread safe, the worker uploads what it decoded
+    MTL::Device* pDevice = _pDevice;
+    MTL::CommandQueue* pQueue = _pUploadQueue;
+    Future future = _decoders.enqueue( [pDevice, pQueue, levelPaths, pixelFormat, storageMode, usage, bottomLeftOrigin]() -> MTL::Texture*
+    {
+        @autoreleasepool
+        {
+            std::vector<Image8> levels;
+            levels.reserve( levelPaths.size() );
+            for ( const std::string& path : levelPaths )
+            {
+                DecodedImage decoded = DecoderPool::decodeFile( path );
+                AAPL_ASSERT( decoded.valid(), "Error loading texture:", decoded.error );
+                const uint32_t level = uint32_t( levels.size() );
+                AAPL_ASSERT( level == 0 || ( decoded.image.width == std::max( levels.front().width >> level, 1u )
+                                             && decoded.image.height == std::max( levels.front().height >> level, 1u ) ),
+                             "Mip level does not fit the chain:", path );
+                if ( bottomLeftOrigin )
+                    flipRows( decoded.image );
+                levels.push_back( std::move( decoded.image ) );
+            }
+
+            MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( pixelFormat, levels.front().width,
+                                                                                                levels.front().height, false );
+            pTextureDesc->setMipmapLevelCount( levels.size() );
+            pTextureDesc->setStorageMode( storageMode );
+            pTextureDesc->setUsage( usage );
+            MTL::Texture* pTexture = pDevice->newTexture( pTextureDesc );
+            pTexture->setLabel( NS::String::string( levelPaths.front().c_str(), NS::UTF8StringEncoding ) );
+
+            if ( storageMode != MTL::StorageModePrivate )
+            {
+                for ( uint32_t level = 0; level < levels.size(); ++level )
+                    pTexture->replaceRegion( MTL::Region( 0, 0, levels[level].width, levels[level].height ), level,
+                                             levels[level].pixels.data(), levels[level].bytesPerRow() );
+                return pTexture;
+            }
+
+            /// All levels go through one staging buffer and one blit, the worker waits for it
+            size_t byteCount = 0;
+            for ( const Image8& level : levels )
+                byteCount += level.pixels.size();
+            MTL::Buffer* pStaging = pDevice->newBuffer( byteCount, MTL::ResourceStorageModeShared );
+
+            MTL::CommandBuffer* pCommandBuffer = pQueue->commandBuffer();
+            MTL::BlitCommandEncoder* pBlitEncoder = pCommandBuffer->blitCommandEncoder();
+            size_t offset = 0;
+            for ( uint32_t level = 0; level < levels.size(); ++level )
+            {
+                const Image8& image = levels[level];
+                std::memcpy( static_cast<uint8_t*>( pStaging->contents() ) + offset, image.pixels.data(), image.pixels.size() );
+                pBlitEncoder->copyFromBuffer( pStaging, offset, image.bytesPerRow(), image.pixels.size(),
+                                              MTL::Size( image.width, image.height, 1 ), pTexture, 0, level, MTL::Origin( 0, 0, 0 ) );
+                offset += image.pixels.size();
+            }
+            pBlitEncoder->endEncoding();
+            pCommandBuffer->commit();
+            pCommandBuffer->waitUntilCompleted();
+            pStaging->release();
+            return pTexture;
+        }
+    }).share();
+    _outstanding.push_back( future );
+    return future;
+}
+
+TextureLoader::Future TextureLoader::loadFromKTX( const std::string& path, MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    startTiming();
+    ++_statistics.requestCount;
+    ++_statistics.fileCount;
+
+    prepareUpload( storageMode );
+
+    MTL::Device* pDevice = _pDevice;
+    MTL::CommandQueue* pQueue = _pUploadQueue;
+    Future future = _decoders.enqueue( [pDevice, pQueue, path, storageMode, usage]() -> MTL::Texture*
+    {
+        @autoreleasepool
+        {
+            CompressedTexture compressed;
+            std::string error;
+            const bool loaded = loadKTX( path, compressed, error );
+            AAPL_ASSERT( loaded, "Error loading texture:", error );
+
+            const MTL::PixelFormat pixelFormat = compressed.format == CompressedTexture::FormatBC7_sRGB ? MTL::PixelFormatBC7_RGBAUnorm_sRGB
+                                                                                                        : MTL::PixelFormatBC7_RGBAUnorm;
+            MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( pixelFormat, compressed.width,
+                                                                                                compressed.height, false );
+            pTextureDesc->setMipmapLevelCount( compressed.levels.size() );
+            pTextureDesc->setStorageMode( storageMode );
+            pTextureDesc->setUsage( usage );
+            MTL::Texture* pTexture = pDevice->newTexture( pTextureDesc );
+            pTexture->setLabel( NS::String::string( path.c_str(), NS::UTF8StringEncoding ) );
+
+            if ( storageMode != MTL::StorageModePrivate )
+            {
+                for ( uint32_t level = 0; level < compressed.levels.size(); ++level )
+                    pTexture->replaceRegion( MTL::Region( 0, 0, compressed.levelWidth( level ), compressed.levelHeight( level ) ), level,
+                                             compressed.levels[level].data(), compressed.bytesPerRow( level ) );
+                return pTexture;
+            }
+
+            /// All levels go through one staging buffer and one blit, the worker waits for it
+            size_t byteCount = 0;
+            for ( const std::vector<uint8_t>& level : compressed.levels )
+                byteCount += level.size();
+            MTL::Buffer* pStaging = pDevice->newBuffer( byteCount, MTL::ResourceStorageModeShared );
+
+            MTL::CommandBuffer* pCommandBuffer = pQueue->commandBuffer();
+            MTL::BlitCommandEncoder* pBlitEncoder = pCommandBuffer->blitCommandEncoder();
+            size_t offset = 0;
+            for ( uint32_t level = 0; level < compressed.levels.size(); ++level )
+            {
+                const std::vector<uint8_t>& bytes = compressed.levels[level];
+                std::memcpy( static_cast<uint8_t*>( pStaging->contents() ) + offset, bytes.data(), bytes.size() );
+                pBlitEncoder->copyFromBuffer( pStaging, offset, compressed.bytesPerRow( level ), bytes.size(),
+                                              MTL::Size( compressed.levelWidth( level ), compressed.levelHeight( level ), 1 ),
+                                              pTexture, 0, level, MTL::Origin( 0, 0, 0 ) );
+                offset += bytes.size();
+            }
+            pBlitEncoder->endEncoding();
+            pCommandBuffer->commit();
+            pCommandBuffer->waitUntilCompleted();
+            pStaging->release();
+            return pTexture;
+        }
+    }).share();
+    _outstanding.push_back( future );
+    return future;
+}
+
+TextureLoader::Future TextureLoader::loadFromPack( const AssetPack& pack, const AssetPackEntry& entry,
+                                                  MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    AAPL_ASSERT( entry.type == AssetPackEntry::TypeTexture, "Not a texture of the asset pack:", entry.name );
+    startTiming();
+    ++_statistics.requestCount;
+    ++_statistics.fileCount;
+
+    prepareUpload( storageMode );
+
+    /// The kernel reads the blob ahead while the request waits for a worker
+    pack.prefetch( entry );
+
+    MTL::Device* pDevice = _pDevice;
+    MTL::CommandQueue* pQueue = _pUploadQueue;
+    const AssetPack* pPack = &pack;
+    const AssetPackEntry* pEntry = &entry;
+    Future future = _decoders.enqueue( [pDevice, pQueue, pPack, pEntry, storageMode, usage]() -> MTL::Texture*
+    {
+        return newTextureFromPack( pDevice, pQueue, *pPack, *pEntry, 0, storageMode, usage );
+    }).share();
+    _outstanding.push_back( future );
+    return future;
+}
+
+MTL::Texture* TextureLoader::newTextureFromPack( MTL::Device* pDevice, MTL::CommandQueue* pQueue, const AssetPack& pack,
+                                                 const AssetPackEntry& entry, uint32_t firstLevel,
+                                                 MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    @autoreleasepool
+    {
+        MTL::PixelFormat pixelFormat = MTL::PixelFormatBC7_RGBAUnorm;
+        switch ( entry.format )
+        {
+            case AssetPackEntry::FormatBC7_sRGB:   pixelFormat = MTL::PixelFormatBC7_RGBAUnorm_sRGB; break;
+            case AssetPackEntry::FormatRGBA8:      pixelFormat = MTL::PixelFormatRGBA8Unorm;         break;
+            case AssetPackEntry::FormatRGBA8_sRGB: pixelFormat = MTL::PixelFormatRGBA8Unorm_sRGB;    break;
+            default: break;
+        }
+        firstLevel = std::min( firstLevel, entry.levelCount - 1 );
+        const uint32_t levelCount = entry.levelCount - firstLevel;
+        MTL::TextureDescriptor* pTextureDesc = MTL::TextureDescriptor::texture2DDescriptor( pixelFormat,
+                                                                                            AssetPack::levelWidth( entry, firstLevel ),
+                                                                                            AssetPack::levelHeight( entry, firstLevel ), false );
+        pTextureDesc->setMipmapLevelCount( levelCount );
+        pTextureDesc->setStorageMode( storageMode );
+        pTextureDesc->setUsage( usage );
+        MTL::Texture* pTexture = pDevice->newTexture( pTextureDesc );
+        pTexture->setLabel( NS::String::string( entry.name, NS::UTF8StringEncoding ) );
+
+        /// Level i of the texture is level firstLevel + i of the blob
+        const uint8_t* pBlob = pack.data( entry );
+        if ( storageMode != MTL::StorageModePrivate )
+        {
+            for ( uint32_t level = 0; level < levelCount; ++level )
+            {
+                const uint32_t source = firstLevel + level;
+                pTexture->replaceRegion( MTL::Region( 0, 0, AssetPack::levelWidth( entry, source ), AssetPack::levelHeight( entry, source ) ),
+                                         level, pBlob + AssetPack::levelOffset( entry, source ), AssetPack::bytesPerRow( entry, source ) );
+            }
+            return pTexture;
+        }
+
+        /// The blob starts on a page and owns whole pages, Metal blits from the mapping itself
+        MTL::Buffer* pSource = pDevice->newBuffer( const_cast<uint8_t*>( pBlob ), pack.pageLength( entry ),
+                                                   MTL::ResourceStorageModeShared, nullptr );
+        MTL::CommandBuffer* pCommandBuffer = pQueue->commandBuffer();
+        MTL::BlitCommandEncoder* pBlitEncoder = pCommandBuffer->blitCommandEncoder();
+        for ( uint32_t level = 0; level < levelCount; ++level )
+        {
+            const uint32_t source = firstLevel + level;
+            pBlitEncoder->copyFromBuffer( pSource, AssetPack::levelOffset( entry, source ), AssetPack::bytesPerRow( entry, source ),
+                                          AssetPack::levelSize( entry, source ),
+                                          MTL::Size( AssetPack::levelWidth( entry, source ), AssetPack::levelHeight( entry, source ), 1 ),
+                                          pTexture, 0, level, MTL::Origin( 0, 0, 0 ) );
+        }
+        pBlitEncoder->endEncoding();
+        pCommandBuffer->commit();
+        pCommandBuffer->waitUntilCompleted();
+        pSource->release();
+        return pTexture;
+    }
+}
+
+const AssetPackEntry* TextureLoader::cookedPackEntry( const char* name ) const
+{
+    const AssetPackEntry* pEntry = _pPack ? _pPack->find( name ) : nullptr;
+    if ( !pEntry || pEntry->type != AssetPackEntry::TypeTexture )
+        return nullptr;
+    const bool compressed = pEntry->format == AssetPackEntry::FormatBC7 || pEntry->format == AssetPackEntry::FormatBC7_sRGB;
+    return !compressed || _pDevice->supportsBCTextureCompression() ? pEntry : nullptr;
+}
+
+TextureLoader::Future TextureLoader::loadCooked( const char* name, MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    if ( const AssetPackEntry* pEntry = cookedPackEntry( name ) )
+        return loadFromPack( *_pPack, *pEntry, storageMode, usage );
+
+    NSString* path = [[NSBundle mainBundle] pathForResource:[NSString stringWithUTF8String:name] ofType:@"ktx"];
+    if ( path && _pDevice->supportsBCTextureCompression() )
+        return loadFromKTX( path.UTF8String, storageMode, usage );
+    return loadFromCatalog( name, storageMode, usage );
+}
+
+void TextureLoader::flush()
+{
+    MTKTextureLoader* textureLoader = ( __bridge MTKTextureLoader* )_pTextureLoader;
+    for ( CatalogBatch& batch : _batches )
+    {
+        if ( batch.requests.empty() )
+            continue;
+
+        NSMutableArray<NSString*>* names = [NSMutableArray arrayWithCapacity:batch.names.size()];
+        for ( const std::string& name : batch.names )
+            [names addObject:[NSString stringWithUTF8String:name.c_str()]];
+
+        NSDictionary<MTKTextureLoaderOption, id>* options = @{
+            MTKTextureLoaderOptionTextureStorageMode : @( (MTLStorageMode)batch.storageMode ),
+            MTKTextureLoaderOptionTextureUsage : @( (MTLTextureUsage)batch.usage )
+        };
+
+        /// The block outlives this call, it owns the promises of the batch
+        auto pRequests = std::make_shared< std::vector<CatalogRequest> >( std::move( batch.requests ) );
+        batch.requests.clear();
+        batch.names.clear();
+        ++_statistics.batchCount;
+
+        [textureLoader newTexturesWithNames:names
+                                scaleFactor:1
+                                     bundle:nil
+                                    options:options
+                          completionHandler:^( NSArray<id<MTLTexture>>* textures, NSError* error )
+        {
+            for ( CatalogRequest& request : *pRequests )
+            {
+                /// A texture that failed to load is NSNull in the array
+                id texture = request.nameIndex < textures.count ? textures[request.nameIndex] : nil;
+                if ( texture == [NSNull null] )
+                    texture = nil;
+
+                AAPL_ASSERT( texture != nil, "Error loading texture:", request.name,
+                             error ? error.localizedDescription.UTF8String : "" );
+                request.promise.set_value( ( MTL::Texture* )[texture retain] );
+            }
+        }];
+    }
+}
+
+void TextureLoader::wait()
+{
+    flush();
+    for ( Future& future : _outstanding )
+        future.wait();
+    _outstanding.clear();
+
+    if ( _timing )
+    {
+        _statistics.milliseconds += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - _start ).count();
+        _timing = false;
+    }
+}
+
+TextureLoader::Timings TextureLoader::benchmark( MTL::Device* pDevice, const std::vector<const char*>& names,
+                                                 MTL::StorageMode storageMode, MTL::TextureUsage usage )
+{
+    using Clock = std::chrono::steady_clock;
+    Timings timings = { names.size(), 0.0, 0.0 };
+
+    auto start = Clock::now();
+    for ( const char* name : names )
+        newTextureFromCatalog( pDevice, name, storageMode, usage )->release();
+    timings.serialMilliseconds = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+
+    /// Loader creation counts, the serial path pays it for every texture
+    start = Clock::now();
+    {
+        TextureLoader loader( pDevice );
+        std::vector<Future> futures;
+        for ( const char* name : names )
+            futures.push_back( loader.loadFromCatalog( name, storageMode, usage ) );
+        loader.wait();
+        for ( Future& future : futures )
+            future.get()->release();
+    }
+    timings.batchedMilliseconds = std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    return timings;
+}
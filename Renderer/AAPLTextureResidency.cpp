@@ -0,0 +1,128 @@
+///
+///  AAPLTextureResidency.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 29.04.24.
+///
+
+#include "AAPLTextureResidency.h"
+
+#include <algorithm>
+#include <chrono>
+
+TextureResidency::TextureResidency( uint64_t budgetBytes )
+: _statistics{ budgetBytes, 0, 0, 0, 0, 0, 0, 0.0 }
+{
+}
+
+void TextureResidency::setBudget( uint64_t budgetBytes )
+{
+    _statistics.budgetBytes = budgetBytes;
+}
+
+TextureResidency::Handle TextureResidency::add( const std::string& label, const std::vector<uint64_t>& levelSizes, bool pinned )
+{
+    Texture texture = { label, std::vector<uint64_t>( std::max<size_t>( levelSizes.size(), 1 ), 0 ), pinned, 0, 0, 0 };
+    for ( size_t level = levelSizes.size(); level-- > 0; )
+        texture.tailBytes[level] = levelSizes[level] + ( level + 1 < levelSizes.size() ? texture.tailBytes[level + 1] : 0 );
+
+    _statistics.fullBytes     += texture.tailBytes[0];
+    _statistics.residentBytes += texture.tailBytes[0];
+    ++_statistics.textureCount;
+    _textures.push_back( std::move( texture ) );
+    return Handle( _textures.size() - 1 );
+}
+
+std::vector<uint64_t> TextureResidency::levelSizes( uint32_t width, uint32_t height, uint32_t levelCount,
+                                                    uint32_t blockSize, uint32_t bytesPerBlock )
+{
+    std::vector<uint64_t> sizes( levelCount );
+    for ( uint32_t level = 0; level < levelCount; ++level )
+    {
+        const uint64_t columns = ( std::max( width >> level, 1u ) + blockSize - 1 ) / blockSize;
+        const uint64_t rows    = ( std::max( height >> level, 1u ) + blockSize - 1 ) / blockSize;
+        sizes[level] = columns * rows * bytesPerBlock;
+    }
+    return sizes;
+}
+
+void TextureResidency::use( Handle handle, uint64_t frame, uint32_t requiredLevel )
+{
+    Texture& texture = _textures[handle];
+    requiredLevel = std::min( requiredLevel, uint32_t( texture.tailBytes.size() - 1 ) );
+    texture.requiredLevel = texture.lastUse == frame ? std::min( texture.requiredLevel, requiredLevel ) : requiredLevel;
+    texture.lastUse = frame;
+}
+
+void TextureResidency::drop( uint64_t& total, bool belowRequired )
+{
+    for ( Handle handle : _lru )
+    {
+        if ( total <= _statistics.budgetBytes )
+            return;
+
+        const Texture& texture = _textures[handle];
+        const uint32_t limit = belowRequired ? uint32_t( texture.tailBytes.size() - 1 ) : texture.requiredLevel;
+        uint32_t& target = _targets[handle];
+        while ( target < limit && total > _statistics.budgetBytes )
+        {
+            total -= texture.tailBytes[target] - texture.tailBytes[target + 1];
+            ++target;
+        }
+    }
+}
+
+const std::vector<TextureResidency::Change>& TextureResidency::update()
+{
+    const auto start = std::chrono::steady_clock::now();
+    _changes.clear();
+
+    /// Everything used gets what it needed, and keeps what it has beyond that as long as it fits
+    uint64_t total = 0;
+    _targets.resize( _textures.size() );
+    for ( size_t i = 0; i < _textures.size(); ++i )
+    {
+        const Texture& texture = _textures[i];
+        _targets[i] = texture.pinned ? 0 : std::min( texture.residentLevel, texture.requiredLevel );
+        total += texture.tailBytes[_targets[i]];
+    }
+
+    if ( total > _statistics.budgetBytes )
+    {
+        /// Least recently used first, the order of adding breaks ties so the result is repeatable
+        _lru.clear();
+        for ( Handle handle = 0; handle < _textures.size(); ++handle )
+        {
+            if ( !_textures[handle].pinned )
+                _lru.push_back( handle );
+        }
+        std::sort( _lru.begin(), _lru.end(), [this]( Handle a, Handle b )
+        {
+            return _textures[a].lastUse != _textures[b].lastUse ? _textures[a].lastUse < _textures[b].lastUse : a < b;
+        });
+
+        drop( total, false );
+        drop( total, true );
+        if ( total > _statistics.budgetBytes )
+            ++_statistics.overBudgetUpdates;
+    }
+
+    for ( Handle handle = 0; handle < _textures.size(); ++handle )
+    {
+        Texture& texture = _textures[handle];
+        const uint32_t target = _targets[handle];
+        if ( target == texture.residentLevel )
+            continue;
+
+        _changes.push_back( Change{ handle, texture.residentLevel, target } );
+        if ( target > texture.residentLevel )
+            _statistics.droppedLevels += target - texture.residentLevel;
+        else
+            _statistics.restoredLevels += texture.residentLevel - target;
+        texture.residentLevel = target;
+    }
+
+    _statistics.residentBytes = total;
+    _statistics.microseconds = std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+    return _changes;
+}
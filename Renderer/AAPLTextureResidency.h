@@ -0,0 +1,99 @@
+///
+///  AAPLTextureResidency.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 29.04.24.
+///
+/// Abstract:
+/// Residency policy of the texture mips under a global memory budget. Every texture is known
+/// by its label and the size of each mip level, and is resident from some first level down to
+/// its smallest mip. Each frame the renderer reports which textures it used and the finest
+/// level it needed. When everything needed does not fit, levels are dropped from the least
+/// recently used textures first: first the levels finer than what they need, then the needed
+/// ones, never the smallest mip. When memory is free again, dropped levels come back. The
+/// policy only does the bookkeeping and hands out the changes, who moves the texels is up to
+/// the caller, so it runs and can be measured without a GPU.
+
+#pragma once
+#ifndef AAPLTextureResidency_h
+#define AAPLTextureResidency_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TextureResidency
+{
+public:
+    using Handle = uint32_t;
+
+    /// First resident level of a texture before and after an update. A larger level drops mips,
+    /// a smaller one restores them.
+    struct Change
+    {
+        Handle   handle;
+        uint32_t fromLevel;
+        uint32_t toLevel;
+    };
+
+    struct Statistics
+    {
+        uint64_t budgetBytes;
+        uint64_t residentBytes;         /// after the last update
+        uint64_t fullBytes;             /// every level of every texture
+        uint32_t textureCount;
+        uint64_t droppedLevels;         /// summed over all updates
+        uint64_t restoredLevels;
+        uint64_t overBudgetUpdates;     /// updates that could not get under the budget
+        double   microseconds;          /// time of the last update
+    };
+
+    explicit TextureResidency( uint64_t budgetBytes );
+
+    void setBudget( uint64_t budgetBytes );
+
+    /// Adds a fully resident texture, level 0 first. Pinned textures are only accounted.
+    Handle add( const std::string& label, const std::vector<uint64_t>& levelSizes, bool pinned = false );
+
+    /// Bytes of each level of a 2D texture, blockSize x blockSize texels of bytesPerBlock each,
+    /// 4 and 16 for BC7, 1 and 4 for RGBA8.
+    static std::vector<uint64_t> levelSizes( uint32_t width, uint32_t height, uint32_t levelCount,
+                                             uint32_t blockSize, uint32_t bytesPerBlock );
+
+    /// Marks the texture used in frame, the finest of the levels reported in one frame counts.
+    void use( Handle handle, uint64_t frame, uint32_t requiredLevel );
+
+    /// Moves the resident levels towards what was used within the budget and returns what changed.
+    const std::vector<Change>& update();
+
+    uint32_t levelCount( Handle handle ) const { return uint32_t( _textures[handle].tailBytes.size() ); }
+    uint32_t residentLevel( Handle handle ) const { return _textures[handle].residentLevel; }
+    uint64_t residentBytes( Handle handle ) const { return _textures[handle].tailBytes[_textures[handle].residentLevel]; }
+    uint64_t lastUse( Handle handle ) const { return _textures[handle].lastUse; }
+    const std::string& label( Handle handle ) const { return _textures[handle].label; }
+    uint32_t size() const { return uint32_t( _textures.size() ); }
+
+    const Statistics& statistics() const { return _statistics; }
+
+private:
+    struct Texture
+    {
+        std::string label;
+        std::vector<uint64_t> tailBytes;    /// bytes from a level down to the smallest mip
+        bool     pinned;
+        uint32_t residentLevel;
+        uint32_t requiredLevel;
+        uint64_t lastUse;
+    };
+
+    /// Raises the targets of the textures in LRU order until the total fits, none past limit.
+    void drop( uint64_t& total, bool belowRequired );
+
+    std::vector<Texture>  _textures;
+    std::vector<uint32_t> _targets;
+    std::vector<Handle>   _lru;
+    std::vector<Change>   _changes;
+    Statistics _statistics;
+};
+
+#endif /* AAPLTextureResidency_h */
@@ -0,0 +1,203 @@
+///
+///  AAPLTransformHierarchy.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.03.24.
+///
+
+#include "AAPLTransformHierarchy.h"
+#include "AAPLParallel.h"
+#include "AAPLUtilities.h"
+
+#include <cstring>
+
+TransformHierarchy::TransformHierarchy()
+: _layoutDirty(false)
+{
+}
+
+void TransformHierarchy::clear()
+{
+    _parentNode.clear();
+    _slotOfNode.clear();
+    _parentSlot.clear();
+    _subtreeEnd.clear();
+    _local.clear();
+    _world.clear();
+    _localDirty.clear();
+    _worldChanged.clear();
+    _serialSlots.clear();
+    _ranges.clear();
+    _layoutDirty = false;
+}
+
+TransformHierarchy::Node TransformHierarchy::addNode( Node parent, const simd::float4x4& local )
+{
+    AAPL_ASSERT( parent == kNoParent || parent < nodeCount(), "TransformHierarchy: parent node does not exist" );
+
+    const Node node = Node( nodeCount() );
+    const uint32_t slot = uint32_t( _local.size() );
+
+    _parentNode.push_back( parent );
+    _slotOfNode.push_back( slot );
+
+    /// Appended at the end for now, relayout() moves it behind its parent's subtree
+    _parentSlot.push_back( parent == kNoParent ? kNoSlot : _slotOfNode[parent] );
+    _subtreeEnd.push_back( slot + 1 );
+    _local.push_back( local );
+    _world.push_back( local );
+    _localDirty.push_back( 1 );
+    _worldChanged.push_back( 1 );
+
+    _layoutDirty = true;
+    return node;
+}
+
+void TransformHierarchy::setLocal( Node node, const simd::float4x4& local )
+{
+    const uint32_t slot = _slotOfNode[node];
+    if ( std::memcmp( &_local[slot], &local, sizeof( simd::float4x4 ) ) == 0 )
+        return;
+
+    _local[slot] = local;
+    _localDirty[slot] = 1;
+}
+
+void TransformHierarchy::relayout()
+{
+    const uint32_t count = uint32_t( nodeCount() );
+
+    /// Child lists in insertion order
+    std::vector<Node> firstChild( count, kNoParent );
+    std::vector<Node> nextSibling( count, kNoParent );
+    std::vector<Node> roots;
+    for ( Node node = count; node-- > 0; )
+    {
+        const Node parent = _parentNode[node];
+        if ( parent == kNoParent )
+        {
+            roots.push_back( node );
+        }
+        else
+        {
+            nextSibling[node] = firstChild[parent];
+            firstChild[parent] = node;
+        }
+    }
+
+    /// Depth first pre-order, roots are collected back to front so popping keeps their order
+    std::vector<Node> order;
+    order.reserve( count );
+    std::vector<Node> stack( roots.begin(), roots.end() );
+    std::vector<Node> children;
+    while ( !stack.empty() )
+    {
+        const Node node = stack.back();
+        stack.pop_back();
+        order.push_back( node );
+
+        children.clear();
+        for ( Node child = firstChild[node]; child != kNoParent; child = nextSibling[child] )
+            children.push_back( child );
+        stack.insert( stack.end(), children.rbegin(), children.rend() );
+    }
+
+    std::vector<uint32_t> slotOfNode( count );
+    for ( uint32_t slot = 0; slot < count; ++slot )
+        slotOfNode[ order[slot] ] = slot;
+
+    std::vector<simd::float4x4> local( count );
+    for ( uint32_t slot = 0; slot < count; ++slot )
+    {
+        const Node node = order[slot];
+        local[slot] = _local[ _slotOfNode[node] ];
+        _parentSlot[slot] = _parentNode[node] == kNoParent ? kNoSlot : slotOfNode[ _parentNode[node] ];
+        _subtreeEnd[slot] = slot + 1;
+    }
+
+    /// Children follow their parent in pre-order, so walking backwards closes every subtree
+    for ( uint32_t slot = count; slot-- > 0; )
+    {
+        const uint32_t parent = _parentSlot[slot];
+        if ( parent != kNoSlot && _subtreeEnd[parent] < _subtreeEnd[slot] )
+            _subtreeEnd[parent] = _subtreeEnd[slot];
+    }
+
+    _slotOfNode.swap( slotOfNode );
+    _local.swap( local );
+
+    /// Slots moved, so every world matrix is recomputed once
+    _localDirty.assign( count, 1 );
+    _worldChanged.assign( count, 1 );
+
+    buildTasks();
+    _layoutDirty = false;
+}
+
+void TransformHierarchy::buildTasks()
+{
+    _serialSlots.clear();
+    _ranges.clear();
+    splitSiblings( 0, uint32_t( _local.size() ) );
+}
+
+void TransformHierarchy::splitSiblings( uint32_t begin, uint32_t end )
+{
+    /// [begin, end) is a sequence of sibling subtrees. Small neighbours are merged into one task,
+    /// large subtrees get their root updated serially and are split further below it.
+    uint32_t rangeBegin = begin;
+    for ( uint32_t slot = begin; slot < end; slot = _subtreeEnd[slot] )
+    {
+        const uint32_t subtreeEnd = _subtreeEnd[slot];
+        if ( subtreeEnd - slot > kTaskGrain )
+        {
+            if ( rangeBegin < slot )
+                _ranges.push_back( { rangeBegin, slot } );
+
+            _serialSlots.push_back( slot );
+            splitSiblings( slot + 1, subtreeEnd );
+            rangeBegin = subtreeEnd;
+        }
+        else if ( subtreeEnd - rangeBegin >= kTaskGrain )
+        {
+            _ranges.push_back( { rangeBegin, subtreeEnd } );
+            rangeBegin = subtreeEnd;
+        }
+    }
+
+    if ( rangeBegin < end )
+        _ranges.push_back( { rangeBegin, end } );
+}
+
+inline void TransformHierarchy::updateSlot( uint32_t slot )
+{
+    const uint32_t parent = _parentSlot[slot];
+    const bool parentChanged = parent != kNoSlot && _worldChanged[parent];
+    const bool changed = _localDirty[slot] || parentChanged;
+
+    if ( changed )
+        _world[slot] = parent != kNoSlot ? matrix_multiply( _world[parent], _local[slot] ) : _local[slot];
+
+    _worldChanged[slot] = changed;
+    _localDirty[slot] = 0;
+}
+
+void TransformHierarchy::update()
+{
+    if ( _layoutDirty )
+        relayout();
+
+    /// Ancestors of split subtrees first, in slot order so parents precede children
+    for ( uint32_t slot : _serialSlots )
+        updateSlot( slot );
+
+    /// Every range only depends on itself and on already updated serial slots
+    parallelFor( _ranges.size(), 1, [this]( size_t begin, size_t end )
+    {
+        for ( size_t r = begin; r < end; ++r )
+        {
+            for ( uint32_t slot = _ranges[r].begin; slot < _ranges[r].end; ++slot )
+                updateSlot( slot );
+        }
+    });
+}
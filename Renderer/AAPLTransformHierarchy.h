@@ -0,0 +1,87 @@
+///
+///  AAPLTransformHierarchy.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.03.24.
+///
+/// Abstract:
+/// Transform hierarchy with cached world matrices. Local and world transforms live in
+/// flat arrays laid out depth first, so every parent comes before its children and every
+/// subtree is one contiguous range. update() recomputes world matrices only for nodes
+/// whose local transform or any ancestor changed, in one linear pass that is split into
+/// independent subtree ranges and processed in parallel.
+
+#pragma once
+#ifndef AAPLTransformHierarchy_h
+#define AAPLTransformHierarchy_h
+
+#include <simd/simd.h>
+
+#include <vector>
+#include <cstdint>
+
+class TransformHierarchy
+{
+public:
+    /// Stable handle of a node, stays valid when the storage is re-laid out.
+    using Node = uint32_t;
+    static constexpr Node kNoParent = UINT32_MAX;
+
+    TransformHierarchy();
+
+    /// Adds a node below parent (or a new root). The parent has to exist already.
+    Node addNode( Node parent = kNoParent, const simd::float4x4& local = matrix_identity_float4x4 );
+    void clear();
+    size_t nodeCount() const { return _parentNode.size(); }
+    Node parent( Node node ) const { return _parentNode[node]; }
+
+    /// Marks the node dirty only if the matrix differs, so worldChanged() stays false for
+    /// nodes that are set to the same transform every frame.
+    void setLocal( Node node, const simd::float4x4& local );
+    const simd::float4x4& local( Node node ) const { return _local[ _slotOfNode[node] ]; }
+
+    /// World matrix as of the last update().
+    const simd::float4x4& world( Node node ) const { return _world[ _slotOfNode[node] ]; }
+
+    /// True if the world matrix was recomputed by the last update().
+    bool worldChanged( Node node ) const { return _worldChanged[ _slotOfNode[node] ]; }
+
+    /// Propagates dirty local transforms down their subtrees.
+    void update();
+
+private:
+    static constexpr uint32_t kNoSlot = UINT32_MAX;
+
+    /// Subtrees up to this many nodes are updated as one task.
+    static constexpr uint32_t kTaskGrain = 512;
+
+    struct Range
+    {
+        uint32_t begin;
+        uint32_t end;
+    };
+
+    void relayout();
+    void buildTasks();
+    void splitSiblings( uint32_t begin, uint32_t end );
+    void updateSlot( uint32_t slot );
+
+    /// Per node handle
+    std::vector<Node>     _parentNode;
+    std::vector<uint32_t> _slotOfNode;
+
+    /// Per storage slot, depth first order
+    std::vector<uint32_t>       _parentSlot;
+    std::vector<uint32_t>       _subtreeEnd;
+    std::vector<simd::float4x4> _local;
+    std::vector<simd::float4x4> _world;
+    std::vector<uint8_t>        _localDirty;
+    std::vector<uint8_t>        _worldChanged;
+
+    /// Update schedule, ancestors of split subtrees run serially, ranges run in parallel
+    std::vector<uint32_t> _serialSlots;
+    std::vector<Range>    _ranges;
+    bool _layoutDirty;
+};
+
+#endif /* AAPLTransformHierarchy_h */
@@ -15,11 +15,11 @@
 #define COLUMNS 1
 #define DEPTH   1
 
-#define TRANSFORMATION_SPEED 0.0007
-#define ROTATION_SPEED 0.004
-
 #import <stdlib.h>
 #import <cassert>
+#import <cfloat>
+#import <cmath>
+#import <unistd.h>
 
 #define NS_PRIVATE_IMPLEMENTATION
 #define MTL_PRIVATE_IMPLEMENTATION
@@ -50,9 +50,9 @@ Renderer::Renderer(MTK::View &pView )
 , _albedo_specular_GBufferFormat(MTL::PixelFormatBGRA8Unorm_sRGB)
 , _normal_shadow_GBufferFormat(MTL::PixelFormatRGBA8Snorm)
 , _depth_GBufferFormat(MTL::PixelFormatR32Float)
+, _residencyManager( _pDevice, kTextureBudgetBytes )
 , _sampleCount(pView.sampleCount())
 , _aspect (1.f)
-, _angle (0.f)
 , _frame (0)
 , _frameNumber(0)
 , _mouseButtonMask(0)
@@ -60,7 +60,6 @@ Renderer::Renderer(MTK::View &pView )
 , _animationIndex(0)
 , _instanceArray { size_t( ROWS ), size_t( COLUMNS ), size_t( DEPTH ) }
 , _kNumInstances(numberOfInstances())
-, _indexCount (0)
 , _instSize(1.f)
 , _objScale(1.f)
 , _textureScale(1.f)
@@ -85,6 +84,7 @@ Renderer::Renderer(MTK::View &pView )
     buildDirectionalLightPipeline();
     buildPointLightMaskPipeline();
     buildPointLightPipeline();
+    buildClusteredPointLightPipeline();
     buildSkyPipeline();
     buildPointsPipeline();
     buildDepthStencilStates();
@@ -125,8 +125,29 @@ void Renderer::buildShadowPipeline()
     pRenderPipelineDescriptor->setSampleCount(NS::UInteger(sampleCount()/sampleCount()));
     _pShadowPipelineState = _pDevice->newRenderPipelineState( pRenderPipelineDescriptor, &pError );
     AAPL_ASSERT_NULL_ERROR( pError, "Failed to create  shadow map render pipeline state for Objects:");
+    
+    /// Clears scissored regions of the static shadow layer
+    MTL::Function* pShadowClearVertexFn = _pShaderLibrary->newFunction( AAPLSTR( "shadow_clear_vertex" ) );
+    AAPL_ASSERT( pShadowClearVertexFn, "Failed to load shadow clear vertex");
+    
+    pRenderPipelineDescriptor->setLabel( AAPLSTR( "Shadow Clear Pipeline" ));
+    pRenderPipelineDescriptor->setVertexFunction( pShadowClearVertexFn );
+    _pShadowClearPipelineState = _pDevice->newRenderPipelineState( pRenderPipelineDescriptor, &pError );
+    AAPL_ASSERT_NULL_ERROR( pError, "Failed to create shadow clear render pipeline state:");
+    
+    /// Reprojects the static shadow layer into a cascade slice
+    MTL::Function* pShadowCompositeFragmentFn = _pShaderLibrary->newFunction( AAPLSTR( "shadow_composite_fragment" ) );
+    AAPL_ASSERT( pShadowCompositeFragmentFn, "Failed to load shadow composite fragment");
+    
+    pRenderPipelineDescriptor->setLabel( AAPLSTR( "Shadow Composite Pipeline" ));
+    pRenderPipelineDescriptor->setFragmentFunction( pShadowCompositeFragmentFn );
+    _pShadowCompositePipelineState = _pDevice->newRenderPipelineState( pRenderPipelineDescriptor, &pError );
+    AAPL_ASSERT_NULL_ERROR( pError, "Failed to create shadow composite render pipeline state:");
+    
     pRenderPipelineDescriptor->release();
     pShadowVertexFn->release();
+    pShadowClearVertexFn->release();
+    pShadowCompositeFragmentFn->release();
    }
 
 void Renderer::buildGBufferPipeline()
@@ -353,6 +374,46 @@ void Renderer::buildPointLightPipeline(){
     pRenderPipelineDescriptor->release();
 }
 
+void Renderer::buildClusteredPointLightPipeline()
+{
+    NS::Error* pError = nullptr;
+    
+    MTL::RenderPipelineDescriptor* pRenderPipelineDescriptor = MTL::RenderPipelineDescriptor::alloc()->init();
+    pRenderPipelineDescriptor->setLabel( AAPLSTR( "Clustered Point Lights" ) );
+    pRenderPipelineDescriptor->setVertexDescriptor( nullptr );
+    
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setPixelFormat( colorTargetPixelFormat() );
+    
+    // Enable additive blending on top of the directional light
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setBlendingEnabled( true );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setRgbBlendOperation( MTL::BlendOperationAdd );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setAlphaBlendOperation( MTL::BlendOperationAdd );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setDestinationRGBBlendFactor( MTL::BlendFactorOne );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setDestinationAlphaBlendFactor( MTL::BlendFactorOne );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setSourceRGBBlendFactor( MTL::BlendFactorOne );
+    pRenderPipelineDescriptor->colorAttachments()->object(RenderTargetLighting)->setSourceAlphaBlendFactor( MTL::BlendFactorOne );
+    
+    pRenderPipelineDescriptor->setDepthAttachmentPixelFormat( depthStencilTargetPixelFormat() );
+    pRenderPipelineDescriptor->setStencilAttachmentPixelFormat( depthStencilTargetPixelFormat() );
+    
+    MTL::Function* pVertexFunction = _pShaderLibrary->newFunction( AAPLSTR( "lighting_vertex" ) );
+    MTL::Function* pFragmentFunction = _pShaderLibrary->newFunction( AAPLSTR( "deferred_clustered_point_lighting_fragment" ) );
+    
+    AAPL_ASSERT( pVertexFunction, "Failed to load lighting_vertex" );
+    AAPL_ASSERT( pFragmentFunction, "Failed to load deferred_clustered_point_lighting_fragment" );
+    
+    pRenderPipelineDescriptor->setVertexFunction( pVertexFunction );
+    pRenderPipelineDescriptor->setFragmentFunction( pFragmentFunction );
+    
+    _pClusteredLightPipelineState = _pDevice->newRenderPipelineState( pRenderPipelineDescriptor, &pError );
+    
+    AAPL_ASSERT_NULL_ERROR( pError, "Failed to create clustered lighting render pipeline state" );
+    
+    pVertexFunction->release();
+    pFragmentFunction->release();
+    pRenderPipelineDescriptor->release();
+}
+
 void Renderer::buildPointsPipeline()
 {
     NS::Error * pError = nullptr;
@@ -459,6 +520,13 @@ void Renderer::buildDepthStencilStates()
     _pShadowDepthStencilState = _pDevice->newDepthStencilState( pDepthStencilDesc );
     pDepthStencilDesc->release();
     
+    pDepthStencilDesc = MTL::DepthStencilDescriptor::alloc()->init();
+    pDepthStencilDesc->setLabel( AAPLSTR( "Shadow Clear Depth Stencil" ) );
+    pDepthStencilDesc->setDepthCompareFunction( MTL::CompareFunctionAlways );
+    pDepthStencilDesc->setDepthWriteEnabled( true );
+    _pShadowClearDepthStencilState = _pDevice->newDepthStencilState( pDepthStencilDesc );
+    pDepthStencilDesc->release();
+    
     ///GBuffer depth state setup
     MTL::StencilDescriptor* pStencilStateDesc = MTL::StencilDescriptor::alloc()->init();
     pStencilStateDesc->setStencilCompareFunction( MTL::CompareFunctionAlways );
@@ -559,56 +627,90 @@ void Renderer::buildTextures()
     _pTexture->setLabel(AAPLSTR( "Computed Texture" ));
     pTextureDesc->release();
 
-    _pMaterialTexture[0] = newTextureFromCatalog(_pDevice, "BaseColorMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pMaterialTexture[0]->allowGPUOptimizedContents();
-    _pMaterialTexture[0]->newTextureView(MTL::PixelFormatRGBA16Float);
-
-
-    _pMaterialTexture[1] = newTextureFromCatalog(_pDevice, "NormalMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pMaterialTexture[1]->allowGPUOptimizedContents();
-    _pMaterialTexture[1]->newTextureView(MTL::PixelFormatRGBA16Float);
-
-
-    _pMaterialTexture[2] = newTextureFromCatalog(_pDevice, "MetallicMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pMaterialTexture[2]->allowGPUOptimizedContents();
-    _pMaterialTexture[2]->newTextureView(MTL::PixelFormatRGBA16Float);
-
-
-    _pMaterialTexture[3] = newTextureFromCatalog(_pDevice, "RoughnessMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pMaterialTexture[3]->allowGPUOptimizedContents();
-    _pMaterialTexture[3]->newTextureView(MTL::PixelFormatRGBA16Float);
-
-
-    _pMaterialTexture[4] = newTextureFromCatalog(_pDevice, "AOMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pMaterialTexture[4]->allowGPUOptimizedContents();
-    _pMaterialTexture[4]->newTextureView(MTL::PixelFormatRGBA16Float);
+    /// Every catalog texture is requested up front and loaded in batches on one shared loader,
+    /// the sphere mesh is built meanwhile. Material maps cooked to BC7 are taken instead of the
+    /// half float catalog textures when the bundle has them, from the mapped asset pack first.
+    /// The PNG backed sets the build copied into the bundle with their catalog index are decoded
+    /// on the loader's pool, only the cube maps still go through MTKTextureLoader.
+    /// Occlusion, roughness and metallic come packed in one texture
+    const MTL::StorageMode storage = MTL::StorageModePrivate;
+    const MTL::TextureUsage usage = MTL::TextureUsageShaderRead;
+    const char* materialNames[kMaterialTextureCount] = { "BaseColorMap", "NormalMap", "ORMMap" };
+
+    const std::string resourcePath = NS::Bundle::mainBundle()->resourcePath()->utf8String();
+    const std::string packPath = resourcePath + "/Assets.pack";
+    std::string packError;
+    if ( access( packPath.c_str(), F_OK ) == 0 && !_assetPack.open( packPath, packError ) )
+        AAPL_PRINT( "Asset pack not used:", packError );
+
+    const std::string catalogIndexPath = resourcePath + "/Catalog.index";
+    CatalogIndex catalogIndex;
+    std::string catalogError;
+    const bool catalogIndexed = access( catalogIndexPath.c_str(), F_OK ) == 0
+                             && catalogIndex.load( resourcePath + "/Catalog", catalogIndexPath, catalogError );
+    if ( !catalogError.empty() )
+        AAPL_PRINT( "Catalog index not used:", catalogError );
+
+    TextureLoader textureLoader( _pDevice );
+    textureLoader.usePack( _assetPack.isOpen() ? &_assetPack : nullptr );
+    textureLoader.useCatalogIndex( catalogIndexed ? &catalogIndex : nullptr );
+    TextureLoader::Future materialTextures[kMaterialTextureCount];
+    for ( size_t i = 0; i < kMaterialTextureCount; ++i )
+        materialTextures[i] = textureLoader.loadCooked( materialNames[i], storage, usage );
+    TextureLoader::Future preFilterMap  = textureLoader.loadFromCatalog( "PreFilterMap", storage, usage );
+    TextureLoader::Future bdrfMap       = textureLoader.loadFromCatalog( "BDRFMap", storage, usage );
+    TextureLoader::Future pointMap      = textureLoader.loadFromCatalog( "PointMap", storage, usage );
+    TextureLoader::Future skyMap        = textureLoader.loadFromCatalog( "IrradianceMap", storage, usage );
+
+    /// Managed copy of the irradiance map for the CPU, released once its texels are copied. The
+    /// sky draws the same map, the shaders sample its copy as the diffuse fallback until the SH
+    /// are projected and fit the map closely enough.
+    TextureLoader::Future irradianceSHSource = textureLoader.loadFromCatalog( "IrradianceMap", MTL::StorageModeManaged, usage );
+    textureLoader.flush();
 
+    _skyMesh = makeSphereMesh(_pDevice, *_pSkyVertexDescriptor, 60, 60, 150.f );
 
-    _pIrradianceMap = newTextureFromCatalog( _pDevice, "IrradianceMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead );
-    _pIrradianceMap->allowGPUOptimizedContents();
-    _pIrradianceMap->newTextureView(MTL::PixelFormatRGBA16Float);
-
-
-    _pPreFilterMap = newTextureFromCatalog(_pDevice, "PreFilterMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead );
-    _pPreFilterMap->allowGPUOptimizedContents();
-    _pPreFilterMap->newTextureView(MTL::PixelFormatRGBA16Float);
-
+    textureLoader.wait();
+    Material sphereMaterial = {};
+    sphereMaterial.data = Material::defaultData();
+    for ( size_t i = 0; i < kMaterialTextureCount; ++i )
+        sphereMaterial.pTextures[TextureIndexBaseColor + i] = materialTextures[i].get();
+    _sphereMaterial = _materialTable.intern( sphereMaterial );
 
-    _pBDRFMap = newTextureFromCatalog(_pDevice, "BDRFMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead );
-    _pBDRFMap->allowGPUOptimizedContents();
-    _pBDRFMap->newTextureView(MTL::PixelFormatRG16Float);
-    
-    _pPointMap = newTextureFromCatalog(_pDevice, "PointMap", MTL::StorageModePrivate,MTL::TextureUsageShaderRead);
-    _pPointMap->allowGPUOptimizedContents();
-    
-    _skyMesh = makeSphereMesh(_pDevice, *_pSkyVertexDescriptor, 60, 60, 150.f );
-    
-    _pSkyMap = newTextureFromCatalog( _pDevice , "IrradianceMap", MTL::StorageModePrivate, MTL::TextureUsageShaderRead);
-    _pSkyMap->allowGPUOptimizedContents();
-    _pSkyMap->newTextureView(MTL::PixelFormatRGBA16Float);
+    /// Material maps that came from the pack can drop their finest mips under the texture budget
+    for ( size_t i = 0; i < kMaterialTextureCount; ++i )
+    {
+        MTL::Texture* pTexture = sphereMaterial.pTextures[TextureIndexBaseColor + i];
+        _sphereTextureWidths[i] = uint32_t( pTexture->width() );
+        const AssetPackEntry* pEntry = textureLoader.cookedPackEntry( materialNames[i] );
+        _sphereTextures[i] = pEntry ? _residencyManager.manage( pTexture, _assetPack, *pEntry )
+                                    : _residencyManager.track( pTexture );
+    }
+    for ( MTL::Texture* pTexture : sphereMaterial.pTextures )
+        pTexture->release();
+    _pPreFilterMap  = preFilterMap.get();
+    _pBDRFMap       = bdrfMap.get();
+    _pPointMap      = pointMap.get();
+    _pSkyMap        = skyMap.get();
+    buildIrradianceSH( irradianceSHSource.get() );
+
+    if ( kBenchmarkTextureLoading )
+    {
+        const TextureLoader::Statistics& statistics = textureLoader.statistics();
+        AAPL_PRINT( "Loaded", statistics.requestCount, "textures in", statistics.batchCount, "batches and from", statistics.fileCount, "files,",
+                    statistics.milliseconds, "ms" );
+
+        const std::vector<const char*> names = { "BaseColorMap", "NormalMap", "ORMMap",
+                                                 "IrradianceMap", "PreFilterMap", "BDRFMap", "PointMap" };
+        const TextureLoader::Timings timings = TextureLoader::benchmark( _pDevice, names, storage, usage );
+        AAPL_PRINT( "Texture loading,", timings.textureCount, "textures: serial", timings.serialMilliseconds,
+                    "ms, batched", timings.batchedMilliseconds, "ms" );
+    }
     
 /// Shadow map setup
     MTL::TextureDescriptor* pShadowTextureDesc = MTL::TextureDescriptor::alloc()->init();
+    pShadowTextureDesc->setTextureType( MTL::TextureType2DArray );
+    pShadowTextureDesc->setArrayLength( ShadowCascadeCount );
     pShadowTextureDesc->setPixelFormat( shadowMapPixelFormat );
     pShadowTextureDesc->setWidth( 2048 );
     pShadowTextureDesc->setHeight( 2048 );
@@ -619,8 +721,22 @@ void Renderer::buildTextures()
     _pShadowMap = _pDevice->newTexture( pShadowTextureDesc );
     _pShadowMap->setLabel( AAPLSTR( "shadow Map" ) );
     _pShadowMap->allowGPUOptimizedContents();
+    
+    /// The static layer is a single light space map over the static casters, not per cascade
+    pShadowTextureDesc->setTextureType( MTL::TextureType2D );
+    pShadowTextureDesc->setArrayLength( 1 );
+    pShadowTextureDesc->setWidth( kShadowStaticResolution );
+    pShadowTextureDesc->setHeight( kShadowStaticResolution );
+    _pShadowStaticMap = _pDevice->newTexture( pShadowTextureDesc );
+    _pShadowStaticMap->setLabel( AAPLSTR( "static shadow Map" ) );
+    _pShadowStaticMap->allowGPUOptimizedContents();
     pShadowTextureDesc->release();
 
+    /// The other textures of the scene count against the budget as they are
+    for ( MTL::Texture* pTexture : { _pTexture, _pPreFilterMap, _pBDRFMap, _pPointMap, _pSkyMap,
+                                     _pShadowMap, _pShadowStaticMap } )
+        _residencyManager.track( pTexture );
+
     MTL::TextureDescriptor* _pGBufferTextureDesc = MTL::TextureDescriptor::alloc()->init();
     _pGBufferTextureDesc->allowGPUOptimizedContents();
     _pGBufferTextureDesc->setMipmapLevelCount( 1 );
@@ -654,9 +770,18 @@ void Renderer::buildRenderPasses()
     _pShadowRenderPassDescriptor->depthAttachment()->setClearDepth( 1.0 );
     _pShadowRenderPassDescriptor->colorAttachments()->object(0)->clearColor();
     _pShadowRenderPassDescriptor->depthAttachment()->setTexture( _pShadowMap );
+    /// Slices are cleared or written whole by the static layer composite, see drawShadow
     _pShadowRenderPassDescriptor->depthAttachment()->setLoadAction( MTL::LoadActionClear );
     _pShadowRenderPassDescriptor->depthAttachment()->setStoreAction( MTL::StoreActionStore );
     
+    /// The static layer keeps its content between frames, only a full redraw clears it
+    _pShadowStaticRenderPassDescriptor = MTL::RenderPassDescriptor::alloc()->init();
+    _pShadowStaticRenderPassDescriptor->setRenderTargetWidth(NS::UInteger(_pShadowStaticMap->width()));
+    _pShadowStaticRenderPassDescriptor->setRenderTargetHeight(NS::UInteger(_pShadowStaticMap->height()));
+    _pShadowStaticRenderPassDescriptor->depthAttachment()->setClearDepth( 1.0 );
+    _pShadowStaticRenderPassDescriptor->depthAttachment()->setTexture( _pShadowStaticMap );
+    _pShadowStaticRenderPassDescriptor->depthAttachment()->setStoreAction( MTL::StoreActionStore );
+    
     /// Create a render pass descriptor to create an encoder for rendering to the GBuffers.
     /// The encoder stores rendered data of each attachment when encoding ends.
 
@@ -723,17 +848,17 @@ void Renderer::buildBuffers()
 
     static const GroundVertex groundVertices[] =
     {
-        vector_float4 { -250.0f, -250.0f,  0.0f,  1.0f },      // 1
+        vector_float4 { -kGroundHalfSize, -kGroundHalfSize,  0.0f,  1.0f },      // 1
         vector_float3 {   -1.0f,   -1.0f,  0.0f } ,
-        vector_float4 { -250.0f,  250.0f,  0.0f,  1.0f },      // 2
+        vector_float4 { -kGroundHalfSize,  kGroundHalfSize,  0.0f,  1.0f },      // 2
         vector_float3 {   -1.0f,    1.0f,  0.0f },
-        vector_float4 {  250.0f, -250.0f,  0.0f,  1.0f },      // 3
+        vector_float4 {  kGroundHalfSize, -kGroundHalfSize,  0.0f,  1.0f },      // 3
         vector_float3 {    1.0f,   -1.0f,  0.0f } ,
-        vector_float4 {  250.0f, -250.0f,  0.0f,  1.0f },      // 4
+        vector_float4 {  kGroundHalfSize, -kGroundHalfSize,  0.0f,  1.0f },      // 4
         vector_float3 {    1.0f,   -1.0f,  0.0f } ,
-        vector_float4 { -250.0f,  250.0f,  0.0f,  1.0f },      // 5
+        vector_float4 { -kGroundHalfSize,  kGroundHalfSize,  0.0f,  1.0f },      // 5
         vector_float3 {   -1.0f,    1.0f,  0.0f } ,
-        vector_float4 {  250.0f,  250.0f,  0.0f,  1.0f },      // 6
+        vector_float4 {  kGroundHalfSize,  kGroundHalfSize,  0.0f,  1.0f },      // 6
         vector_float3 {    1.0f,    1.0f,  0.0f }
     };
     
@@ -758,86 +883,23 @@ void Renderer::buildBuffers()
     AAPL_ASSERT( _pPointVertexBuffer->length() != pointDataSize * sizeof(SimpleVertex), pError);
     _pPointVertexBuffer->setLabel( AAPLSTR( "Point Vertices" ) );
 
-    // Create an icosahedron mesh for fairy light volumes
+    /// Icosphere proxies for the fairy light volumes, all levels in one vertex and one index buffer
+    std::vector <simd::float4> proxyVertices;
+    std::vector <uint16_t> proxyIndices;
+    _lightProxies.buildIcospheres( proxyVertices, proxyIndices );
     
-    // Create vertex descriptor with layout for icoshedron
-    MTL::VertexDescriptor * icosahedronVertexDescriptor = MTL::VertexDescriptor::alloc()->init();
-    icosahedronVertexDescriptor->attributes()->object(VertexAttributePosition)->setFormat( MTL::VertexFormatFloat4);
-    icosahedronVertexDescriptor->attributes()->object(VertexAttributePosition)->setBufferIndex( BufferIndexVertexData );
-    icosahedronVertexDescriptor->attributes()->object(VertexAttributePosition)->setOffset( 0 );
-    icosahedronVertexDescriptor->layouts()->object(BufferIndexVertexData)->setStride(sizeof(simd::float4));
+    _pLightProxyVertexBuffer = _pDevice->newBuffer( proxyVertices.data(), proxyVertices.size() * sizeof( simd::float4 ), MTL::ResourceStorageModeShared );
+    _pLightProxyVertexBuffer->setLabel( AAPLSTR( "Light Proxy Vertices" ) );
+    _pLightProxyIndexBuffer = _pDevice->newBuffer( proxyIndices.data(), proxyIndices.size() * sizeof( uint16_t ), MTL::ResourceStorageModeShared );
+    _pLightProxyIndexBuffer->setLabel( AAPLSTR( "Light Proxy Indices" ) );
     
-    float icoshedronRadius = 1.0 / (sqrtf(3.0) / 12.0 * (3.0 + sqrtf(5.0)));
-    _icosahedronMesh = makeIcosahedronMesh( _pDevice, *icosahedronVertexDescriptor, icoshedronRadius);
-   
-    icosahedronVertexDescriptor->release();
-    
-    std::vector <float3> _positions;
-    std::vector <float2> _uv;
-    std::vector <float3> _normals;
-    std::vector <int16_t>_indices;
-
-    const int16_t X_SEGMENTS = 69;
-    const int16_t Y_SEGMENTS = 69;
-
-    for (int16_t x = 0; x <= X_SEGMENTS; ++x)
-    {
-        for (int16_t y = 0; y <= Y_SEGMENTS; ++y)
-        {
-            float xSegment = (float)x / (float)X_SEGMENTS;
-            float ySegment = (float)y / (float)Y_SEGMENTS;
-            float xPos = std::cos(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
-            float yPos = std::cos(ySegment * PI);
-            float zPos = std::sin(xSegment * 2.0f * PI) * std::sin(ySegment * PI);
-
-            _positions.push_back( float3 { xPos, yPos, zPos});
-            _uv.push_back( float2 {xSegment, ySegment});
-            _normals.push_back( float3 {xPos, yPos, zPos});
-        }
-    }
+    /// Sphere tessellations for all LOD levels, sharing one vertex and one index buffer
+    std::vector <VertexData> verts;
+    std::vector <uint16_t> indices;
+    _instanceLOD.buildSphereLevels( verts, indices );
 
-    VertexData verts[_positions.size()];
-
-    for (int16_t j = 0; j < _positions.size(); ++j)
-    {
-        verts[j] = { vector_float3 { _positions[j].x, _positions[j].y, _positions[j].z },
-                     vector_float2 { _uv[j].x, _uv[j].y },
-                     vector_float3 { _normals[j].x, _normals[j].y, _normals[j].z }};
-    }
-
-    bool oddRow = false;
-    for ( int16_t y = 0; y < Y_SEGMENTS; ++y)
-    {
-        if (!oddRow)
-        {
-            for (unsigned int x = 0; x <= X_SEGMENTS; ++x)
-            {
-                _indices.push_back(y * (X_SEGMENTS + 1) + x);
-                _indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
-            }
-        }
-        else
-        {
-            for (int x = X_SEGMENTS; x >= 0; --x)
-            {
-                _indices.push_back((y + 1) * (X_SEGMENTS + 1) + x);
-                _indices.push_back(y * (X_SEGMENTS + 1) + x);
-            }
-        }
-        oddRow = !oddRow;
-    }
-
-    int16_t indices[_indices.size()];
-
-    for(int16_t i = 0 ; i < _indices.size() ; ++i)
-    {
-        indices[i] = _indices[i];
-    }
-
-    _indexCount =  _indices.size();
-
-    const size_t vertexDataSize = sizeof( verts );
-    const size_t indexDataSize  = sizeof( indices);
+    const size_t vertexDataSize = verts.size() * sizeof( VertexData );
+    const size_t indexDataSize  = indices.size() * sizeof( uint16_t );
 
     MTL::Buffer* pVertexBuffer = _pDevice->newBuffer( vertexDataSize, MTL::ResourceStorageModeShared );
     MTL::Buffer* pIndexBuffer  = _pDevice->newBuffer( indexDataSize, MTL::ResourceStorageModeShared );
@@ -847,10 +909,11 @@ void Renderer::buildBuffers()
     _pIndexBuffer = pIndexBuffer;
     _pIndexBuffer->setLabel(AAPLSTR( "Index Buffer" ));
     
-    memcpy( _pVertexDataBuffer->contents(), verts, vertexDataSize );
-    memcpy( _pIndexBuffer->contents(), indices, indexDataSize );
+    memcpy( _pVertexDataBuffer->contents(), verts.data(), vertexDataSize );
+    memcpy( _pIndexBuffer->contents(), indices.data(), indexDataSize );
 
-    const size_t instanceDataSize = kMaxFramesInFlight * numberOfInstances() * sizeof( InstanceData );
+    /// One region per culled view, each holding the compacted visible instances of that view
+    const size_t instanceDataSize = InstanceCuller::ViewCount * numberOfInstances() * sizeof( InstanceData );
     for ( size_t i = 0; i < kMaxFramesInFlight; ++i )
     {
         _pInstanceDataBuffer[ i ] = _pDevice->newBuffer( instanceDataSize, MTL::ResourceStorageModeShared);
@@ -920,15 +983,29 @@ void Renderer::buildLightsBuffer() {
     
     PointLightData *light_data = reinterpret_cast<PointLightData*>(_pLightsDataBuffer->contents());
 
-    _original_light_positions = new float4[ NumLights ];
-
-    const size_t lightPositionSize = kMaxFramesInFlight * sizeof( _original_light_positions );
+    const size_t lightPositionSize = NumLights * sizeof( float4 );
     for ( size_t i = 0; i < kMaxFramesInFlight; ++i ){
         _pLightPositionsBuffer[i] = _pDevice->newBuffer(lightPositionSize, MTL::ResourceStorageModeShared);
         _pLightPositionsBuffer[i]->setLabel(AAPLSTR("LightPositionBuffer"));
+        
+        /// A cut never holds more representatives than there are lights
+        _pLightCutDataBuffer[i] = _pDevice->newBuffer(sizeof(PointLightData) * NumLights, MTL::ResourceStorageModeShared);
+        _pLightCutDataBuffer[i]->setLabel(AAPLSTR("LightCutDataBuffer"));
+        _pLightCutPositionsBuffer[i] = _pDevice->newBuffer(lightPositionSize, MTL::ResourceStorageModeShared);
+        _pLightCutPositionsBuffer[i]->setLabel(AAPLSTR("LightCutPositionBuffer"));
+        
+        _pLightClusterBuffer[i] = _pDevice->newBuffer(sizeof(LightCluster) * LightClusters::kClusterCount, MTL::ResourceStorageModeShared);
+        _pLightClusterBuffer[i]->setLabel(AAPLSTR("LightClusterBuffer"));
+        
+        /// Grows in updateLights when the cluster lists need more room
+        _pLightIndexBuffer[i] = _pDevice->newBuffer(sizeof(uint32_t) * NumLights * 16, MTL::ResourceStorageModeShared);
+        _pLightIndexBuffer[i]->setLabel(AAPLSTR("LightIndexBuffer"));
+        
+        _pLightProxyOrderBuffer[i] = _pDevice->newBuffer(sizeof(uint32_t) * NumLights, MTL::ResourceStorageModeShared);
+        _pLightProxyOrderBuffer[i]->setLabel(AAPLSTR("LightProxyOrderBuffer"));
     }
     
-    float4 *light_position = _original_light_positions;
+    _lightAnimation.clear();
     
     for(uint32_t lightId = 0; lightId < NumLights; lightId++){
         
@@ -939,47 +1016,217 @@ void Renderer::buildLightsBuffer() {
         speed *= (random()%2)*2-1;
         
         speed *= .5;
-        *light_position = {(vector_float4){distance*sinf(angle), height, distance*cosf(angle), 1.f}};
         light_data->light_radius = 36 / 10.0;
         light_data->light_speed  = speed;
         light_data->pointLightColor = (float3){ 0.9f,  0.8f,  0.4f};
+        _lightAnimation.addLight( (float3){ distance*sinf(angle), height, distance*cosf(angle) }, speed, light_data->light_radius );
         light_data++;
-        light_position++;
     }
-    
-    
 }
 
-void Renderer::updateLights(const simd::float4x4 & modelViewMatrix) {
+void Renderer::buildSceneHierarchy()
+{
+    /// Object group and its instances, the ground on its own
+    _sceneHierarchy.clear();
+    _pickedInstance = InstanceBVH::kInvalid;
+    _groundNode = _sceneHierarchy.addNode();
+    _objectGroupNode = _sceneHierarchy.addNode();
+    
+    _instanceNodes.resize( numberOfInstances() );
+    for ( auto& node : _instanceNodes )
+    {
+        node = _sceneHierarchy.addNode( _objectGroupNode );
+    }
+}
+
+void Renderer::buildAnimations()
+{
+    using simd::float3;
     using simd::float4;
     
-    PointLightData *light_Data = reinterpret_cast<PointLightData*>(_pLightsDataBuffer->contents());
+    _animation.clear();
+    _animatedInstanceSize = instancesSize();
+    _animatedGroupScale = getGroupScale();
     
-    float4 *currentBuffer =
-    reinterpret_cast<float4*>(_pLightPositionsBuffer[_frame]->contents());
-
-    float4 *originalLightPositions =  (float4 *)_original_light_positions;
+    const size_t kInstanceRows    = instances()[0];
+    const size_t kInstanceColumns = instances()[1];
+    const size_t kInstanceDepth   = instances()[2];
     
-    for(uint32_t i = 0; i < NumLights; i++)
+    const float scl = _animatedInstanceSize;
+    const float obscl = _animatedGroupScale;
+    const float instanceRowCount = pow( numberOfInstances(), 1.f / 3 );
+    const float3 objectPosition = { 0.f,  4.f + float(instanceRowCount)/2 , -1.f -float(instanceRowCount * 1.5f) };
+    
+    const float3 xAxis = { 1.f, 0.f, 0.f };
+    const float3 yAxis = { 0.f, 1.f, 0.f };
+    const float3 zAxis = { 0.f, 0.f, 1.f };
+    
+    /// The object group tumbles around objectPosition, -a around y and -a around x with
+    /// a = 0.01 per frame, keyed over one period of 2 pi
+    constexpr float kGroupSpeed = 0.01f;
+    constexpr size_t kGroupKeyCount = 65;
+    float groupTimes[kGroupKeyCount];
+    float4 groupRotations[kGroupKeyCount];
+    for ( size_t key = 0; key < kGroupKeyCount; ++key )
     {
-        float4 currentPosition;
-        
-        float rotationRadians = light_Data[i].light_speed * _frameNumber;
-        
-        simd::float4x4 rotation = matrix4x4_rotation(rotationRadians, 0, 1, 0);
+        const float angle = 2.f * PI * key / ( kGroupKeyCount - 1 );
+        groupTimes[key] = angle / kGroupSpeed;
+        groupRotations[key] = quaternion_multiply( quaternion_from_axis_angle( yAxis, -angle ),
+                                                   quaternion_from_axis_angle( xAxis, -angle ) );
+    }
+    const AnimationSystem::Track groupRotation = _animation.addQuaternionTrack( groupTimes, groupRotations, kGroupKeyCount, AnimationSystem::WrapLoop );
+    _animation.bindTransform( _objectGroupNode, AnimationSystem::kNoTrack, groupRotation, AnimationSystem::kNoTrack,
+                              objectPosition, quaternion_identity(), (float3){ 1.f, 1.f, 1.f } );
+    
+    /// Instances sit on a grid relative to the group, tilted around y by cos( row ) and
+    /// spinning around z by 2 a sin( column ), keyed every quarter turn
+    size_t ix = 0;
+    size_t iy = 0;
+    size_t iz = 0;
+    
+    for ( size_t i = 0; i < numberOfInstances(); ++i )
+    {
+        if ( ix == kInstanceRows )
+        {
+            ix = 0;
+            iy += 1;
+        }
+        if ( iy == kInstanceRows )
+        {
+            iy = 0;
+            iz += 1;
+        }
         
-        currentPosition = rotation * originalLightPositions[i];
+        float x = ((float)ix - (float)kInstanceRows   /2.5f) * (2.5f * obscl) + obscl;
+        float y = ((float)iy - (float)kInstanceColumns/2.5f) * (2.5f * obscl) + obscl;
+        float z = ((float)iz - (float)kInstanceDepth  /2.5f) * (2.5f * obscl) + obscl;
         
-        currentPosition = modelViewMatrix * currentPosition;
+        const float4 tilt = quaternion_from_axis_angle( yAxis, cosf( (float)iy ) );
+        const float spinSpeed = 2.f * kGroupSpeed * sinf( (float)ix );
         
-        currentBuffer[i] = currentPosition;
+        float spinTimes[5];
+        float4 spinRotations[5];
+        size_t spinKeyCount = 1;
+        spinTimes[0] = 0.f;
+        spinRotations[0] = tilt;
+        if ( fabsf( spinSpeed ) > 1e-6f )
+        {
+            spinKeyCount = 5;
+            for ( size_t key = 1; key < spinKeyCount; ++key )
+            {
+                const float angle = 0.5f * PI * key;
+                spinTimes[key] = angle / fabsf( spinSpeed );
+                spinRotations[key] = quaternion_multiply( tilt, quaternion_from_axis_angle( zAxis, spinSpeed > 0.f ? -angle : angle ) );
+            }
+        }
+        const AnimationSystem::Track spin = _animation.addQuaternionTrack( spinTimes, spinRotations, spinKeyCount, AnimationSystem::WrapLoop );
+        _animation.bindTransform( _instanceNodes[ i ], AnimationSystem::kNoTrack, spin, AnimationSystem::kNoTrack,
+                                  (float3){ x, y, z }, quaternion_identity(), (float3){ scl, scl, scl } );
+        ix += 1;
     }
     
+    /// The point lights circle the group with their own speeds, driven by one time parameter
+    const float lightTimes[] = { 0.f, 1.f };
+    const float lightValues[] = { 0.f, 1.f };
+    _animation.bindFloat( _animation.addFloatTrack( lightTimes, lightValues, 2, AnimationSystem::WrapExtrapolate ), &_lightTime );
 }
-void Renderer::step_animation()
+
+void Renderer::buildIrradianceSH( MTL::Texture* pIrradianceMap )
 {
-    t_transformation = fmod(1.0 + t_transformation + dir * TRANSFORMATION_SPEED, 1.0);
-    t_rotation = fmod(1.0 + t_rotation + dir * ROTATION_SPEED, 1.0);
+    const uint32_t size = uint32_t( pIrradianceMap->width() );
+    const size_t faceTexels = size_t( size ) * size;
+    const MTL::PixelFormat format = pIrradianceMap->pixelFormat();
+    const MTL::Region region( 0, 0, size, size );
+    
+    std::vector<simd::float4> texels( 6 * faceTexels );
+    for ( uint32_t face = 0; face < 6; ++face )
+    {
+        simd::float4* pFace = &texels[face * faceTexels];
+        if ( format == MTL::PixelFormatRGBA32Float )
+        {
+            pIrradianceMap->getBytes( pFace, size * sizeof( simd::float4 ), faceTexels * sizeof( simd::float4 ), region, 0, face );
+        }
+        else if ( format == MTL::PixelFormatRGBA16Float )
+        {
+            std::vector<uint16_t> halfs( 4 * faceTexels );
+            pIrradianceMap->getBytes( halfs.data(), size * 4 * sizeof( uint16_t ), faceTexels * 4 * sizeof( uint16_t ), region, 0, face );
+            for ( size_t i = 0; i < faceTexels; ++i )
+            {
+                pFace[i] = (simd::float4){ float32_from_float16( halfs[4 * i] ),     float32_from_float16( halfs[4 * i + 1] ),
+                                           float32_from_float16( halfs[4 * i + 2] ), float32_from_float16( halfs[4 * i + 3] ) };
+            }
+        }
+        else
+        {
+            AAPL_ASSERT( format == MTL::PixelFormatRGBA8Unorm || format == MTL::PixelFormatBGRA8Unorm,
+                         "Irradiance map format can not be read for the SH projection:", format );
+            const size_t red  = format == MTL::PixelFormatBGRA8Unorm ? 2 : 0;
+            const size_t blue = 2 - red;
+            std::vector<uint8_t> bytes( 4 * faceTexels );
+            pIrradianceMap->getBytes( bytes.data(), size * 4, faceTexels * 4, region, 0, face );
+            for ( size_t i = 0; i < faceTexels; ++i )
+            {
+                pFace[i] = (simd::float4){ bytes[4 * i + red] / 255.f, bytes[4 * i + 1] / 255.f,
+                                           bytes[4 * i + blue] / 255.f, bytes[4 * i + 3] / 255.f };
+            }
+        }
+    }
+    pIrradianceMap->release();
+    
+    _irradianceSH.beginProjection( texels.data(), size, IrradianceSH::SourceIrradiance );
+}
+
+void Renderer::updateLights(const simd::float4x4 & viewMatrix) {
+    using simd::float4;
+    
+    float4 *currentBuffer =
+    reinterpret_cast<float4*>(_pLightPositionsBuffer[_frame]->contents());
+    
+    /// Lights circle the y axis of the object group, the shaders want them in view space
+    const simd::float4x4 viewFromGroup = viewMatrix * _sceneHierarchy.world( _objectGroupNode );
+    _viewLightSpheres.resize( _lightAnimation.lightCount() );
+    _lightAnimation.update( _lightTime, viewFromGroup, currentBuffer, _viewLightSpheres.data() );
+    
+    /// Refit the light tree to the moved lights, Tools/LightBench measures its selection
+    const PointLightData* pLightData = reinterpret_cast<const PointLightData*>( _pLightsDataBuffer->contents() );
+    _lightBVH.update( pLightData, _viewLightSpheres.data(), _viewLightSpheres.size() );
+    
+    /// Cut the light tree for this camera, only the representatives are shaded
+    _lightCuts.update( pLightData, _viewLightSpheres.data(), _viewLightSpheres.size() );
+    _lightCuts.selectCut( cameraData().near );
+    const std::vector<float4>& cutSpheres = _lightCuts.cutSpheres();
+    float4* pCutPositions = reinterpret_cast<float4*>( _pLightCutPositionsBuffer[_frame]->contents() );
+    for ( size_t i = 0; i < cutSpheres.size(); ++i )
+    {
+        pCutPositions[i] = (float4){ cutSpheres[i].x, cutSpheres[i].y, cutSpheres[i].z, 1.f };
+    }
+    memcpy( _pLightCutDataBuffer[_frame]->contents(), _lightCuts.cutLights().data(), sizeof(PointLightData) * cutSpheres.size() );
+    
+    /// Assign the view space light spheres to the clusters of the camera frustum
+    _lightClusters.setProjection( _projectionMatrix, cameraData().near, cameraData().far );
+    _lightClusters.build( cutSpheres.data(), cutSpheres.size() );
+    
+    memcpy( _pLightClusterBuffer[_frame]->contents(), _lightClusters.clusters().data(), sizeof(LightCluster) * LightClusters::kClusterCount );
+    
+    /// The buffer of this frame slot is no longer used by the GPU, it can be replaced right away
+    const size_t indexSize = _lightClusters.lightIndices().size() * sizeof(uint32_t);
+    const size_t indexCapacity = _pLightIndexBuffer[_frame]->length();
+    if ( indexSize > indexCapacity )
+    {
+        _pLightIndexBuffer[_frame]->release();
+        _pLightIndexBuffer[_frame] = _pDevice->newBuffer( std::max( indexSize, 2 * indexCapacity ), MTL::ResourceStorageModeShared );
+        _pLightIndexBuffer[_frame]->setLabel(AAPLSTR("LightIndexBuffer"));
+    }
+    if ( indexSize )
+    {
+        memcpy( _pLightIndexBuffer[_frame]->contents(), _lightClusters.lightIndices().data(), indexSize );
+    }
+    
+    /// Pick the cheapest proxy per light for the light volume path, the GBuffer has the drawable size
+    const float pixelScale = _projectionMatrix.columns[1][1] * 0.5f * _depth_GBuffer->height();
+    const float screenPixels = float( _depth_GBuffer->width() * _depth_GBuffer->height() );
+    _lightProxies.select( cutSpheres.data(), cutSpheres.size(), pixelScale, cameraData().near, screenPixels );
+    memcpy( _pLightProxyOrderBuffer[_frame]->contents(), _lightProxies.orderedLights().data(), sizeof(uint32_t) * cutSpheres.size() );
 }
 
 void Renderer::generateComputedTexture( MTL::CommandBuffer* pCommandBuffer, MTL::Buffer* pUniformsBuffer )
@@ -1083,85 +1330,195 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
             }
         */
     
-    step_animation();
-    
     _frame = (_frame + 1) % kMaxFramesInFlight;
     _frameRate = ( _frameRate + 1) % kFrameRate;
     
     _frameNumber=( _frameNumber + 1);
     
-    _angle += 0.01;
-    
     using simd::float3;
     using simd::float4;
     using simd::float4x4;
     using simd::float3x3;
     
-    const size_t kInstanceRows    = instances()[0];
-    const size_t kInstanceColumns = instances()[1];
-    const size_t kInstanceDepth   = instances()[2];
-    
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
     
     MTL::Buffer* pInstanceDataBuffer = _pInstanceDataBuffer[_frame];
     InstanceData* pInstanceData = reinterpret_cast< InstanceData *>( pInstanceDataBuffer->contents());
     
-    float xRotate = 360.f * ease_circular_in_out(t_transformation);
-    // float yRotate = 360.f * ease_circular_in_out(xRotate);
-    
     const float scl = instancesSize();
-    const float obscl = getGroupScale();
-    const float instanceRowCount = pow( numberOfInstances(), 1.f / 3 );
     
-    float3 objectPosition = { 0.f,  4.f + float(instanceRowCount)/2 , -1.f -float(instanceRowCount * 1.5f) };
+    if ( _instanceNodes.size() != numberOfInstances() )
+    {
+        buildSceneHierarchy();
+        buildAnimations();
+    }
+    else if ( scl != _animatedInstanceSize || getGroupScale() != _animatedGroupScale )
+    {
+        buildAnimations();
+    }
+    
+    _instanceScratch.resize( numberOfInstances() );
+    _instanceCuller.resize( numberOfInstances() );
+    _instanceLOD.resize( numberOfInstances() );
+    _instanceMoved.resize( numberOfInstances() );
+    if ( _shadowCache.staticFlags().size() != numberOfInstances() )
+    {
+        _shadowCache.resize( numberOfInstances(), uint32_t( _pShadowStaticMap->width() ) );
+    }
     
-    float4x4 rt = makeTranslate((float3){ objectPosition.x , objectPosition.y , objectPosition.z});
-    float4x4 rr1 = makeYRotate( -_angle);
-    float4x4 rr0 = makeXRotate(  _angle);
-    float4x4 rtInv = makeTranslate( (float3){ -objectPosition.x, -objectPosition.y , -objectPosition.z });
-    _lightModelMatrix = rt  * rr1 * rr0;
-    _modelMatrix = rt  * rr1 * rr0  * rtInv ;
+    /// All animated nodes and parameters follow their tracks, the time runs in frames
+    _animation.evaluate( float( _frameNumber ) );
+    _animation.apply( _sceneHierarchy );
     
-    size_t ix = 0;
-    size_t iy = 0;
-    size_t iz = 0;
+    _sceneHierarchy.update();
+    
+    float3 casterMin = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+    float3 casterMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
     
     for ( size_t i = 0; i < numberOfInstances(); ++i )
     {
+        const float4x4& instanceTransform = _sceneHierarchy.world( _instanceNodes[ i ] );
+        _instanceScratch[ i ].instanceTransform = instanceTransform;
+        _instanceScratch[ i ].instanceNormalTransform = matrix3x3_upper_left( instanceTransform );
         
-        if ( ix == kInstanceRows )
+        /// The sphere mesh has radius 1, the group transform is rigid, so only the instance scale remains
+        const float3 center = instanceTransform.columns[3].xyz;
+        _instanceCuller.setBounds( i, center, scl );
+        _instanceMoved[ i ] = _sceneHierarchy.worldChanged( _instanceNodes[ i ] );
+        casterMin = simd_min( casterMin, center - scl );
+        casterMax = simd_max( casterMax, center + scl );
+    }
+    
+    /// Fit the shadow cascades to the camera frustum, their depth range reaches back to all casters
+    const float3 casterCenter = 0.5f * ( casterMin + casterMax );
+    const float4 casterBounds = { casterCenter.x, casterCenter.y, casterCenter.z, 0.5f * simd_length( casterMax - casterMin ) };
+    _shadowCascades.update( cameraData(), _projectionMatrix, shadowCameraData().viewMatrix, casterBounds, uint32_t( _pShadowMap->width() ) );
+    
+    /// Pick on the press of the left mouse button
+    if ( ( _mouseButtonMask & 1 ) && !( _previousMouseButtonMask & 1 ) )
+    {
+        pickInstance( pView->currentDrawable()->texture()->width(), pView->currentDrawable()->texture()->height() );
+    }
+    _previousMouseButtonMask = _mouseButtonMask;
+    
+    /// Colored after the pick, so a click highlights its instance in the same frame
+    for ( size_t i = 0; i < numberOfInstances(); ++i )
+    {
+        float iDivNumInstances = i / (float) numberOfInstances();
+        float r = sinf(iDivNumInstances);
+        float g = cosf(iDivNumInstances);
+        float b = sinf( PI * 2.0f * iDivNumInstances );
+        _instanceScratch[ i ].instanceColor = ( i == _pickedInstance ) ? (float4){ 1.0, 1.0, 1.0, 1.0 } : (float4){ r, g, b, 1.0 };
+    }
+    
+    /// Cull against the camera and every shadow cascade, pick a LOD per visible instance and
+    /// upload them compacted and grouped by LOD, the camera view at the start of the instance
+    /// buffer, the cascades behind it. The LOD scale is the projected radius in pixels of the
+    /// drawable for the camera and in texels of the shadow map for the cascades.
+    float4x4 viewProjection[InstanceCuller::ViewCount];
+    float pixelScale[InstanceCuller::ViewCount];
+    
+    viewProjection[InstanceCuller::ViewMain] = matrix_multiply( _projectionMatrix, cameraData().viewMatrix );
+    pixelScale[InstanceCuller::ViewMain] = _projectionMatrix.columns[1][1] * 0.5f * pView->currentDrawable()->texture()->height();
+    
+    for ( uint32_t cascade = 0; cascade < ShadowCascades::kCascadeCount; ++cascade )
+    {
+        viewProjection[InstanceCuller::ViewShadow + cascade] = _shadowCascades.cascade( cascade ).viewProjection;
+        pixelScale[InstanceCuller::ViewShadow + cascade] = _shadowCascades.cascade( cascade ).viewProjection.columns[1][1] * 0.5f * _pShadowMap->height();
+    }
+    
+    /// Split the casters into the cached static layer and the dynamic ones, collect the dirty
+    /// tiles. The layer has its own light space projection, it does not follow the camera.
+    _shadowCache.update( shadowCameraData().viewMatrix, _instanceCuller, _instanceMoved.data() );
+    viewProjection[InstanceCuller::ViewShadowStatic] = _shadowCache.viewProjection();
+    pixelScale[InstanceCuller::ViewShadowStatic] = _shadowCache.viewProjection().columns[1][1] * 0.5f * _pShadowStaticMap->height();
+    
+    /// A cascade finer than the layer would lose resolution on the static casters, it draws
+    /// them itself like the dynamic ones
+    for ( uint32_t cascade = 0; cascade < ShadowCascades::kCascadeCount; ++cascade )
+    {
+        _shadowComposited[cascade] = _shadowCache.staticCount() > 0
+                                  && _shadowCascades.cascade( cascade ).texelSize >= _shadowCache.texelSize();
+    }
+    
+    NS::UInteger visibleInstanceOffset[InstanceCuller::ViewCount];
+    
+    /// World space box around the ground plane, it receives shadows everywhere in the slices
+    const float4x4& groundTransform = _sceneHierarchy.world( _groundNode );
+    float3 groundMin = {  FLT_MAX,  FLT_MAX,  FLT_MAX };
+    float3 groundMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for ( uint32_t corner = 0; corner < 4; ++corner )
+    {
+        const float4 local = { ( corner & 1 ) ? kGroundHalfSize : -kGroundHalfSize, 0.f,
+                               ( corner & 2 ) ? kGroundHalfSize : -kGroundHalfSize, 1.f };
+        const float3 world = simd_mul( groundTransform, local ).xyz;
+        groundMin = simd_min( groundMin, world );
+        groundMax = simd_max( groundMax, world );
+    }
+    
+    for ( uint8_t view = 0; view < InstanceCuller::ViewCount; ++view )
+    {
+        /// The camera view is culled first, its visible instances and the ground are the
+        /// receivers, the cascades only keep casters whose shadow can fall on them
+        if ( view == InstanceCuller::ViewShadow )
         {
-            ix = 0;
-            iy += 1;
+            const std::vector<uint32_t>& receivers = _instanceCuller.visibleInstances( InstanceCuller::ViewMain );
+            _shadowReceivers.resize( receivers.size() );
+            for ( size_t i = 0; i < receivers.size(); ++i )
+            {
+                _shadowReceivers[i] = _instanceCuller.bounds( receivers[i] );
+            }
+            _shadowCascades.fitCasterVolumes( _shadowReceivers.data(), _shadowReceivers.size(), groundMin, groundMax );
         }
-        if ( iy == kInstanceRows )
+        
+        /// The static layer takes every static caster, it must not depend on the receivers of a
+        /// single frame, the dynamic casters are culled against the receivers
+        _instanceCuller.setViewProjection( InstanceCuller::View( view ), viewProjection[view] );
+        if ( view >= InstanceCuller::ViewShadow && view < InstanceCuller::ViewShadowStatic )
         {
-            iy = 0;
-            iz += 1;
+            _instanceCuller.setPlanes( InstanceCuller::View( view ), _shadowCascades.cascade( view - InstanceCuller::ViewShadow ).casterPlanes );
+        }
+        _instanceCuller.cull( InstanceCuller::View( view ));
+        if ( view == InstanceCuller::ViewShadowStatic ||
+             ( view >= InstanceCuller::ViewShadow && _shadowComposited[view - InstanceCuller::ViewShadow] ) )
+        {
+            _instanceCuller.filterVisible( InstanceCuller::View( view ), _shadowCache.staticFlags(), view >= InstanceCuller::ViewShadowStatic );
         }
+        _instanceLOD.select( InstanceCuller::View( view ), _instanceCuller, viewProjection[view], pixelScale[view] );
         
-        float x = ((float)ix - (float)kInstanceRows   /2.5f) * (2.5f * obscl) + obscl;
-        float y = ((float)iy - (float)kInstanceColumns/2.5f) * (2.5f * obscl) + obscl;
-        float z = ((float)iz - (float)kInstanceDepth  /2.5f) * (2.5f * obscl) + obscl;
+        visibleInstanceOffset[view] = view * numberOfInstances() * sizeof( InstanceData );
         
-        float3 instanceObjectPosition = add( objectPosition , (float3){ x, y, z });
-        float4x4 translate = makeTranslate(instanceObjectPosition);
-        float4x4 zrot = makeZRotate(2 * _angle * sinf((float)ix) );
-        ///float4x4 yrot = makeYRotate( ((_angle *  xRotate) / xRotate ) * cosf((float)iy) );
-        float4x4 yrot = makeYRotate( ((0.01 * _angle +  xRotate) / xRotate) * cosf((float)iy) );
-        float4x4 scale = makeScale( (float3){ scl , scl , scl } );
-        float4x4 _modelTrans = _modelMatrix * translate * yrot * zrot * scale;
+        const std::vector<uint32_t>* pUploadOrder = &_instanceLOD.orderedInstances( InstanceCuller::View( view ));
         
-        pInstanceData[ i ].instanceTransform = _modelTrans;
-        pInstanceData[ i ].instanceNormalTransform = matrix3x3_upper_left(pInstanceData[ i ].instanceTransform);
+        /// Sort the camera view front to back, the LOD level sits above the depth in the key
+        /// so the buckets keep their ranges. Early depth testing then rejects hidden fragments
+        /// before the PBR fragment shader runs.
+        if ( view == InstanceCuller::ViewMain )
+        {
+            const float near = cameraData().near;
+            const float far  = cameraData().far;
+            const float4 rowW = { viewProjection[view].columns[0].w, viewProjection[view].columns[1].w,
+                                  viewProjection[view].columns[2].w, viewProjection[view].columns[3].w };
+            
+            _drawInstances.assign( pUploadOrder->begin(), pUploadOrder->end() );
+            _drawKeys.resize( _drawInstances.size() );
+            for ( size_t i = 0; i < _drawInstances.size(); ++i )
+            {
+                const uint32_t index = _drawInstances[i];
+                const float4 bounds = _instanceCuller.bounds( index );
+                const float depth = simd_dot( rowW, (float4){ bounds.x, bounds.y, bounds.z, 1.f } );
+                _drawKeys[i] = DrawOrder::makeKey( 0, 0, _instanceLOD.selectedLevel( InstanceCuller::ViewMain, index ),
+                                                   ( depth - near ) / ( far - near ));
+            }
+            _drawOrder.sort( _drawKeys, _drawInstances );
+            pUploadOrder = &_drawInstances;
+        }
         
-                
-        float iDivNumInstances = i / (float) numberOfInstances();
-        float r = sinf(iDivNumInstances);
-        float g = cosf(iDivNumInstances);
-        float b = sinf( PI * 2.0f * iDivNumInstances );
-        pInstanceData[ i ].instanceColor = (float4){ r, g, b, 1.0 };
-        ix += 1;
+        InstanceData* pVisibleData = pInstanceData + view * numberOfInstances();
+        for ( uint32_t index : *pUploadOrder )
+        {
+            *pVisibleData++ = _instanceScratch[ index ];
+        }
     }
     
     /// Update camera, view matrix, state:
@@ -1194,7 +1551,7 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     
     // matrix_float4x4 planeModelMatrix = cameraData().skyModel;
     
-    matrix_float4x4 planeModelMatrix = matrix4x4_scale_translation((vector_float3){1,1,1}, (vector_float3){0,0,0});
+    matrix_float4x4 planeModelMatrix = _sceneHierarchy.world( _groundNode );
     
     pFrameData->planeModelViewMatrix = matrix_multiply(planeModelMatrix, pFrameData->viewMatrix);
     
@@ -1223,6 +1580,19 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     float4x4 shadowTransform = matrix_multiply(shadowTranslate, shadowScale);
     pFrameData->shadow_xform_matrix = shadowTransform;
     
+    for ( uint32_t cascade = 0; cascade < ShadowCascades::kCascadeCount; ++cascade )
+    {
+        pFrameData->shadow_cascade_matrix[cascade] = _shadowCascades.cascade( cascade ).viewProjection;
+    }
+    pFrameData->shadow_cascade_splits = _shadowCascades.splitFarDepths();
+    pFrameData->shadow_static_matrix = _shadowCache.viewProjection();
+    
+    /// Diffuse IBL switches from the irradiance map to SH9 once the projection completed and
+    /// its error against the map is small enough, a poor fit keeps the map
+    _irradianceSH.step( kIrradianceSHRowsPerFrame );
+    pFrameData->irradianceSHValid = _irradianceSH.accepted( kIrradianceSHMaxError );
+    std::copy( _irradianceSH.coefficients(), _irradianceSH.coefficients() + IrradianceSHCoefficientCount, pFrameData->irradianceSH );
+    
     
     MTL::Buffer *pUniformsBuffer = _pUniformsBuffer [_frame];
     Uniforms * uniforms = reinterpret_cast<Uniforms*>(pUniformsBuffer->contents());
@@ -1237,7 +1607,7 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     uniforms->moveSpeed = stepPerFrameValue();
     uniforms->family = get_num_families();
     
-    updateLights( matrix_multiply( pFrameData->viewMatrix, _lightModelMatrix));
+    updateLights( pFrameData->viewMatrix );
     
     updateDebugOutput();
     
@@ -1247,25 +1617,49 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     
     /// BEGINN RENDERPASS
     
-    drawShadow( pCmd, pFrameDataBuffer, pInstanceDataBuffer);
+    drawShadow( pCmd, pFrameDataBuffer, pInstanceDataBuffer, visibleInstanceOffset );
     
     _pGBufferRenderPassDescriptor->depthAttachment()->setTexture( pDepthStencilTexture );
     _pGBufferRenderPassDescriptor->stencilAttachment()->setTexture( pDepthStencilTexture );
 
+    /// The material maps need the mip level whose texel density matches the largest sphere on
+    /// screen. A sphere of radius r pixels wraps the texture, textureScale times, around a
+    /// circumference of 2 pi r pixels. Reloads finished on the residency worker are swapped in
+    /// before the material is bound
+    const float4x4& mainViewProjection = viewProjection[InstanceCuller::ViewMain];
+    const float4 mainRowW = { mainViewProjection.columns[0].w, mainViewProjection.columns[1].w,
+                              mainViewProjection.columns[2].w, mainViewProjection.columns[3].w };
+    float largestPixelRadius = 0.f;
+    for ( uint32_t index : _instanceCuller.visibleInstances( InstanceCuller::ViewMain ) )
+    {
+        const float4 bounds = _instanceCuller.bounds( index );
+        const float w = std::max( simd_dot( mainRowW, (float4){ bounds.x, bounds.y, bounds.z, 1.f } ), cameraData().near );
+        largestPixelRadius = std::max( largestPixelRadius, bounds.w * pixelScale[InstanceCuller::ViewMain] / w );
+    }
+    for ( size_t i = 0; i < kMaterialTextureCount; ++i )
+    {
+        /// Without a visible sphere the coarsest level will do, use() clamps to the chain
+        uint32_t requiredLevel = UINT32_MAX;
+        if ( largestPixelRadius > 0.f )
+        {
+            const float texelsPerPixel = _sphereTextureWidths[i] * textureScale() / ( 2.f * float( PI ) * largestPixelRadius );
+            requiredLevel = uint32_t( std::max( std::floor( std::log2( texelsPerPixel ) ), 0.f ) );
+        }
+        _residencyManager.use( _sphereTextures[i], _frameNumber, requiredLevel );
+    }
+    for ( const ResidencyManager::Swap& swap : _residencyManager.update() )
+        _materialTable.replaceTexture( swap.pOld, swap.pNew );
+
     MTL::RenderCommandEncoder* pNonEnc =  pCmd->renderCommandEncoder( _pGBufferRenderPassDescriptor );
     pNonEnc->setLabel( AAPLSTR( "Draw Objects to GBuffer "));
     pNonEnc->setRenderPipelineState( _pGBufferPipelineState );
     pNonEnc->setDepthStencilState( _pGBufferDepthStencilState);
     pNonEnc->setVertexBuffer( _pVertexDataBuffer,       /* offset */  0, BufferIndexVertexData );
-    pNonEnc->setVertexBuffer(  pInstanceDataBuffer,     /* offset */  0, BufferIndexInstanceData );
+    pNonEnc->setVertexBuffer(  pInstanceDataBuffer,     visibleInstanceOffset[InstanceCuller::ViewMain], BufferIndexInstanceData );
     pNonEnc->setVertexBuffer(  pFrameDataBuffer,        /* offset */  0, BufferIndexFrameData );
     pNonEnc->setFragmentBuffer(  pFrameDataBuffer,      /* offset */  0, BufferIndexFrameData );
-    pNonEnc->setFragmentTexture( _pMaterialTexture[0], TextureIndexBaseColor );
-    pNonEnc->setFragmentTexture( _pMaterialTexture[1], TextureIndexNormal);
-    pNonEnc->setFragmentTexture( _pMaterialTexture[2], TextureIndexMetallic);
-    pNonEnc->setFragmentTexture( _pMaterialTexture[3], TextureIndexRoughness);
-    pNonEnc->setFragmentTexture( _pMaterialTexture[4], TextureIndexAmbientOcclusion);
-    pNonEnc->setFragmentTexture( _pIrradianceMap, TextureIndexIrradianceMap );
+    _materialTable.bind( pNonEnc, _sphereMaterial );
+    pNonEnc->setFragmentTexture( _pSkyMap, TextureIndexIrradianceMap );
     pNonEnc->setFragmentTexture( _pPreFilterMap, TextureIndexPreFilterMap );
     pNonEnc->setFragmentTexture( _pBDRFMap, TextureIndexBDRF );
     pNonEnc->setFragmentTexture( _pTexture, TextureIndexWriteMap );
@@ -1273,11 +1667,7 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     pNonEnc->setCullMode( MTL::CullModeBack );
     pNonEnc->setStencilReferenceValue( 128 );
     pNonEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
-    pNonEnc->drawIndexedPrimitives( primitiveType(),
-                                _indexCount, MTL::IndexType::IndexTypeUInt16,
-                                _pIndexBuffer,
-                                0,
-                                numberOfInstances());
+    drawInstanceLevels( pNonEnc, InstanceCuller::ViewMain );
     
     pNonEnc->pushDebugGroup( AAPLSTR( "Draw Ground Plane to GBuffer" ) );
     pNonEnc->setRenderPipelineState(_pGroundPipelineState);
@@ -1326,11 +1716,19 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
                              (NS::UInteger)0,
                              (NS::UInteger)_indexQuadCount);
         
-        /// Point Light Mask
-        drawPointLightMask( pEnc, pFrameDataBuffer);
-        
-        /// Point Light Rendering
-        drawPointLights( pEnc, pFrameDataBuffer);
+        if ( _clusteredPointLights )
+        {
+            /// Point Lights from the cluster light lists
+            drawClusteredPointLights( pEnc, pFrameDataBuffer );
+        }
+        else
+        {
+            /// Point Light Mask
+            drawPointLightMask( pEnc, pFrameDataBuffer);
+            
+            /// Point Light Rendering
+            drawPointLights( pEnc, pFrameDataBuffer);
+        }
         
         /// SkyBox Renderring
         pEnc->pushDebugGroup( AAPLSTR( "Draw Sky" ) );
@@ -1340,18 +1738,9 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
         pEnc->setFragmentTexture( _pSkyMap, TextureIndexSkyMap );
         pEnc->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
         
-        for (auto& meshBuffer : _skyMesh.vertexBuffers()){
-            pEnc->setVertexBuffer(meshBuffer.buffer(),
-                                  meshBuffer.offset(),
-                                  meshBuffer.argumentIndex());}
-        
-        for (auto& submesh : _skyMesh.submeshes()) {
-            pEnc->drawIndexedPrimitives(submesh.primitiveType(),
-                                        submesh.indexCount(),
-                                        submesh.indexType(),
-                                        submesh.indexBuffer().buffer(),
-                                        submesh.indexBuffer().offset());
-        }
+        _skyDraws.clear();
+        _skyDraws.add( _skyMesh );
+        _skyDraws.encode( pEnc, _materialTable );
         pEnc->popDebugGroup();
         
         drawPoints(pEnc , pFrameDataBuffer);
@@ -1372,24 +1761,106 @@ void Renderer::drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, M
     pPool->release();
 }
 
-void Renderer::drawShadow(MTL::CommandBuffer * pCommandBuffer,  MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer)
+void Renderer::drawInstanceLevels(MTL::RenderCommandEncoder * pEncoder, InstanceCuller::View view)
+{
+    /// One instanced draw per LOD, baseInstance selects the bucket inside the bound instance data
+    for ( size_t level = 0; level < InstanceLOD::kLevelCount; ++level )
+    {
+        const InstanceLOD::Bucket& bucket = _instanceLOD.bucket( view, level );
+        if ( bucket.instanceCount == 0 )
+            continue;
+        
+        const InstanceLOD::Level& lod = _instanceLOD.level( level );
+        pEncoder->drawIndexedPrimitives( primitiveType(),
+                                         lod.indexCount, MTL::IndexType::IndexTypeUInt16,
+                                         _pIndexBuffer,
+                                         lod.indexOffset,
+                                         bucket.instanceCount,
+                                         0,
+                                         bucket.firstInstance );
+    }
+}
+
+void Renderer::drawShadow(MTL::CommandBuffer * pCommandBuffer,  MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer,
+                          const NS::UInteger * pInstanceOffsets)
+{
+    /// Redraw the dirty regions of the static layer, a full redraw clears it with the load
+    /// action, partial ones clear their scissor rectangles with a far plane triangle
+    const std::vector<ShadowCache::Region>& regions = _shadowCache.redrawRegions();
+    if ( !regions.empty() )
+    {
+        const bool fullRedraw = _shadowCache.fullRedraw();
+        _pShadowStaticRenderPassDescriptor->depthAttachment()->setLoadAction( fullRedraw ? MTL::LoadActionClear : MTL::LoadActionLoad );
+        
+        MTL::RenderCommandEncoder* pEncoder = pCommandBuffer->renderCommandEncoder(_pShadowStaticRenderPassDescriptor);
+        pEncoder->setLabel( AAPLSTR( "Static Shadow Layer Drawing" ) );
+        for ( const ShadowCache::Region& region : regions )
+        {
+            pEncoder->setScissorRect( MTL::ScissorRect{ region.x, region.y, region.width, region.height } );
+            if ( !fullRedraw )
+            {
+                pEncoder->setRenderPipelineState( _pShadowClearPipelineState );
+                pEncoder->setDepthStencilState( _pShadowClearDepthStencilState );
+                pEncoder->setDepthBias( 0, 0, 0 );
+                pEncoder->drawPrimitives( MTL::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(3) );
+            }
+            drawShadowCasters( pEncoder, pFrameDataBuffer, pInstanceDataBuffer, pInstanceOffsets[InstanceCuller::ViewShadowStatic],
+                               ShadowStaticLayer, InstanceCuller::ViewShadowStatic );
+        }
+        pEncoder->endEncoding();
+    }
+    
+    /// One pass per cascade into its slice of the shadow map array. A composited slice starts
+    /// from the static layer reprojected into the cascade, which writes every texel, the others
+    /// are cleared and draw their static casters with the dynamic ones.
+    const float4x4 staticInverse = simd_inverse( _shadowCache.viewProjection() );
+    for ( uint32_t cascade = 0; cascade < ShadowCascades::kCascadeCount; ++cascade )
+    {
+        const InstanceCuller::View dynamicView = InstanceCuller::View( InstanceCuller::ViewShadow + cascade );
+        _pShadowRenderPassDescriptor->depthAttachment()->setSlice( cascade );
+        _pShadowRenderPassDescriptor->depthAttachment()->setLoadAction( _shadowComposited[cascade] ? MTL::LoadActionDontCare : MTL::LoadActionClear );
+        
+        MTL::RenderCommandEncoder* pEncoder = pCommandBuffer->renderCommandEncoder(_pShadowRenderPassDescriptor);
+        pEncoder->setLabel( AAPLSTR( "Shadow Map Drawing" ) );
+        if ( _shadowComposited[cascade] )
+        {
+            const float4x4& cascadeViewProjection = _shadowCascades.cascade( cascade ).viewProjection;
+            ShadowCompositeData composite;
+            composite.cascadeToStatic = matrix_multiply( _shadowCache.viewProjection(), simd_inverse( cascadeViewProjection ) );
+            composite.staticToCascade = matrix_multiply( cascadeViewProjection, staticInverse );
+            composite.cascadeSize = (float2){ float( _pShadowMap->width() ), float( _pShadowMap->height() ) };
+            composite.depthBias  = kShadowDepthBias;
+            composite.slopeScale = kShadowSlopeScale;
+            composite.biasClamp  = kShadowBiasClamp;
+            
+            pEncoder->setRenderPipelineState( _pShadowCompositePipelineState );
+            pEncoder->setDepthStencilState( _pShadowClearDepthStencilState );
+            pEncoder->setFragmentBytes( &composite, sizeof( ShadowCompositeData ), BufferIndexShadowCascade );
+            pEncoder->setFragmentTexture( _pShadowStaticMap, TextureIndexShadowMap );
+            pEncoder->drawPrimitives( MTL::PrimitiveTypeTriangle, NS::UInteger(0), NS::UInteger(3) );
+        }
+        drawShadowCasters( pEncoder, pFrameDataBuffer, pInstanceDataBuffer, pInstanceOffsets[dynamicView], cascade, dynamicView );
+        pEncoder->endEncoding();
+    }
+}
+
+void Renderer::drawShadowCasters(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer,
+                                 NS::UInteger instanceOffset, uint32_t cascade, InstanceCuller::View view)
 {
-    MTL::RenderCommandEncoder* pEncoder = pCommandBuffer->renderCommandEncoder(_pShadowRenderPassDescriptor);
-    pEncoder->setLabel( AAPLSTR( "Shadow Map Drawing" ) );
     pEncoder->setRenderPipelineState( _pShadowPipelineState);
     pEncoder->setDepthStencilState( _pShadowDepthStencilState );
     pEncoder->setVertexBuffer( _pVertexDataBuffer,      0, BufferIndexVertexData);
-    pEncoder->setVertexBuffer(  pInstanceDataBuffer,    0, BufferIndexInstanceData );
+    pEncoder->setVertexBuffer(  pInstanceDataBuffer,    instanceOffset, BufferIndexInstanceData );
     pEncoder->setVertexBuffer(  pFrameDataBuffer,       0, BufferIndexFrameData );
+    pEncoder->setVertexBytes( &cascade, sizeof( uint32_t ), BufferIndexShadowCascade );
     pEncoder->setFrontFacingWinding( MTL::Winding::WindingCounterClockwise );
     pEncoder->setCullMode( MTL::CullModeBack );
-    pEncoder->setDepthBias( 0.015, 7, 0.02 );
-    pEncoder->drawIndexedPrimitives( primitiveType(),
-                                    _indexCount, MTL::IndexType::IndexTypeUInt16,
-                                    _pIndexBuffer,
-                                     0,
-                                     numberOfInstances());
-    pEncoder->endEncoding();
+    /// The static layer stays unbiased, the composite biases it in cascade depth
+    if ( view == InstanceCuller::ViewShadowStatic )
+        pEncoder->setDepthBias( 0, 0, 0 );
+    else
+        pEncoder->setDepthBias( kShadowDepthBias, kShadowSlopeScale, kShadowBiasClamp );
+    drawInstanceLevels( pEncoder, view );
 }
 
 
@@ -1406,25 +1877,36 @@ void Renderer::drawPointLightMask(MTL::RenderCommandEncoder * pEncoder, MTL::Buf
     
     //pEncoder->setVertexBuffer( pFrameDataBuffer, 0, BufferIndexFrameData );
     //pEncoder->setFragmentBuffer( pFrameDataBuffer, 0, BufferIndexFrameData );
-    pEncoder->setVertexBuffer( _pLightsDataBuffer, 0, BufferIndexLightData );
-    pEncoder->setVertexBuffer( _pLightPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
+    pEncoder->setVertexBuffer( _pLightCutDataBuffer[_frame], 0, BufferIndexLightData );
+    pEncoder->setVertexBuffer( _pLightCutPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
+    pEncoder->setVertexBuffer( _pLightProxyOrderBuffer[_frame], 0, BufferIndexLightProxyOrder );
+    pEncoder->setVertexBuffer( _pLightProxyVertexBuffer, 0, BufferIndexVertexData );
     
-    for( auto& vertexBuffers : _icosahedronMesh.vertexBuffers())
-    {
-        pEncoder->setVertexBuffer( vertexBuffers.buffer(),
-                                   vertexBuffers.offset(),
-                                   vertexBuffers.argumentIndex());
-    }
+    drawLightProxies( pEncoder );
     
-    for( auto& icosahedronSubmesh : _icosahedronMesh.submeshes())
-    {
-        pEncoder->drawIndexedPrimitives(icosahedronSubmesh.primitiveType(),
-                                        icosahedronSubmesh.indexCount(),
-                                        icosahedronSubmesh.indexType(),
-                                        icosahedronSubmesh.indexBuffer().buffer(),
-                                        icosahedronSubmesh.indexBuffer().offset(),
-                                        NumLights);
-    }
+    pEncoder->popDebugGroup();
+}
+
+void Renderer::drawClusteredPointLights(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer)
+{
+    pEncoder->pushDebugGroup( AAPLSTR( "Draw Clustered Point Lights" ) );
+    
+    /// Same full screen quad and GBuffer textures as the directional light, shaded where the GBuffer wrote stencil
+    pEncoder->setRenderPipelineState( _pClusteredLightPipelineState );
+    pEncoder->setDepthStencilState( _pDirectionLightDepthStencilState );
+    pEncoder->setStencilReferenceValue( 128 );
+    pEncoder->setCullMode( MTL::CullModeBack );
+    pEncoder->setFrontFacingWinding( MTL::Winding::WindingClockwise );
+    
+    pEncoder->setFragmentBuffer( _pLightCutDataBuffer[_frame], 0, BufferIndexLightData );
+    pEncoder->setFragmentBuffer( _pLightCutPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
+    pEncoder->setFragmentBuffer( _pLightClusterBuffer[_frame], 0, BufferIndexLightClusters );
+    pEncoder->setFragmentBuffer( _pLightIndexBuffer[_frame], 0, BufferIndexLightIndices );
+    pEncoder->setFragmentBytes( &_lightClusters.grid(), sizeof( LightClusterGrid ), BufferIndexLightClusterGrid );
+    
+    pEncoder->drawPrimitives( MTL::PrimitiveTypeTriangle,
+                             (NS::UInteger)0,
+                             (NS::UInteger)_indexQuadCount);
     
     pEncoder->popDebugGroup();
 }
@@ -1457,25 +1939,30 @@ void Renderer::drawPointLightsCommon(MTL::RenderCommandEncoder * pEncoder, MTL::
     //pEncoder->setVertexBuffer( _pLightPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
     
     //pEncoder->setFragmentBuffer( pFrameDataBuffer, 0,   BufferIndexFrameData );
-    pEncoder->setFragmentBuffer( _pLightsDataBuffer, 0, BufferIndexLightData );
-    pEncoder->setFragmentBuffer( _pLightPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
+    pEncoder->setFragmentBuffer( _pLightCutDataBuffer[_frame], 0, BufferIndexLightData );
+    pEncoder->setFragmentBuffer( _pLightCutPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
     
-    /*
-    for( auto& vertexBuffers : _icosahedronMesh.vertexBuffers())
+    drawLightProxies( pEncoder );
+}
+
+void Renderer::drawLightProxies(MTL::RenderCommandEncoder * pEncoder)
+{
+    /// One instanced draw per proxy level, baseInstance selects the bucket inside the light order
+    for ( size_t level = 0; level < LightProxies::kLevelCount; ++level )
     {
-        pEncoder->setVertexBuffer( vertexBuffers.buffer(),
-                                   vertexBuffers.offset(),
-                                   vertexBuffers.argumentIndex());
-    };
-    */
-    for( auto& icosahedronSubmesh : _icosahedronMesh.submeshes()){
-        pEncoder->drawIndexedPrimitives(icosahedronSubmesh.primitiveType(),
-                                        icosahedronSubmesh.indexCount(),
-                                        icosahedronSubmesh.indexType(),
-                                        icosahedronSubmesh.indexBuffer().buffer(),
-                                        icosahedronSubmesh.indexBuffer().offset(),
-                                        NumLights);
-    };
+        const LightProxies::Bucket& bucket = _lightProxies.bucket( level );
+        if ( bucket.instanceCount == 0 )
+            continue;
+        
+        const LightProxies::Level& proxy = _lightProxies.level( level );
+        pEncoder->drawIndexedPrimitives( MTL::PrimitiveTypeTriangle,
+                                         proxy.indexCount, MTL::IndexType::IndexTypeUInt16,
+                                         _pLightProxyIndexBuffer,
+                                         proxy.indexOffset,
+                                         bucket.instanceCount,
+                                         0,
+                                         bucket.firstInstance );
+    }
 }
 
 void Renderer::drawPoints(MTL::RenderCommandEncoder* pEncoder, MTL::Buffer * pFrameDataBuffer)
@@ -1485,8 +1972,9 @@ void Renderer::drawPoints(MTL::RenderCommandEncoder* pEncoder, MTL::Buffer * pFr
    // pEncoder->setDepthStencilState( _pDontWriteDepthStencilState );
     pEncoder->setCullMode( MTL::CullModeBack );
     pEncoder->setVertexBuffer( _pPointVertexBuffer, 0, BufferIndexPointVertexData);
-   // pEncoder->setVertexBuffer( _pLightsDataBuffer, 0, BufferIndexLightData );
-   // pEncoder->setVertexBuffer( _pLightPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
+    /// Every light gets its sprite, the light passes before bound the cut at the same indices
+    pEncoder->setVertexBuffer( _pLightsDataBuffer, 0, BufferIndexLightData );
+    pEncoder->setVertexBuffer( _pLightPositionsBuffer[_frame], 0, BufferIndexLightsPosition );
    // pEncoder->setVertexBuffer( pFrameDataBuffer, 0, BufferIndexFrameData );
     pEncoder->setFragmentTexture( _pPointMap, TextureIndexAlpha );
     pEncoder->setFrontFacingWinding( MTL::Winding::WindingClockwise);
@@ -1585,6 +2073,38 @@ const size_t& Renderer::numberOfInstances() {
     return _kNumInstances;
 }
 
+void Renderer::pickInstance( float drawableWidth, float drawableHeight )
+{
+    /// The cursor is (-1, -1) outside of the view
+    if ( _cursorPosition.x < 0.f || _cursorPosition.y < 0.f )
+        return;
+    
+    /// Every instance moves each frame, so all bounds are refit, the tree is rebuilt
+    /// when the instance count changed or the refit tree got too loose
+    const size_t count = numberOfInstances();
+    _pickSpheres.resize( count );
+    for ( size_t i = 0; i < count; ++i )
+    {
+        _pickSpheres[i] = _instanceCuller.bounds( i );
+    }
+    if ( _instanceBVH.primitiveCount() != count || !_instanceBVH.refit( _pickSpheres.data() ))
+    {
+        _instanceBVH.build( _pickSpheres.data(), count );
+    }
+    
+    /// Unproject the cursor, drawable pixels with the origin top left, onto the near and far plane
+    const simd::float2 ndc = { 2.f * _cursorPosition.x / drawableWidth - 1.f,
+                               1.f - 2.f * _cursorPosition.y / drawableHeight };
+    const simd::float4x4 inverseViewProjection = matrix_invert( matrix_multiply( _projectionMatrix, cameraData().viewMatrix ));
+    simd::float4 nearPoint = matrix_multiply( inverseViewProjection, (simd::float4){ ndc.x, ndc.y, 0.f, 1.f } );
+    simd::float4 farPoint  = matrix_multiply( inverseViewProjection, (simd::float4){ ndc.x, ndc.y, 1.f, 1.f } );
+    nearPoint /= nearPoint.w;
+    farPoint  /= farPoint.w;
+    
+    float distance;
+    _pickedInstance = _instanceBVH.raycast( nearPoint.xyz, farPoint.xyz - nearPoint.xyz, distance );
+}
+
 void Renderer::setCursorPosition( const simd_float2& newPostion )
 {
     if( newPostion.x !=_cursorPosition.x)
@@ -1730,11 +2250,15 @@ void Renderer::cleanup()
     _pTrailComputePSO->release();
     _pGBufferPipelineState->release();
     _pTexture->release();
-    _pIrradianceMap->release();
     _pPreFilterMap->release();
     _pBDRFMap->release();
     _pSkyMap->release();
     _pShadowMap->release();
+    _pShadowStaticMap->release();
+    _pShadowStaticRenderPassDescriptor->release();
+    _pShadowClearPipelineState->release();
+    _pShadowCompositePipelineState->release();
+    _pShadowClearDepthStencilState->release();
     _pPointMap->release();
     _albedo_specular_GBuffer->release();
     _normal_shadow_GBuffer->release();
@@ -1742,10 +2266,6 @@ void Renderer::cleanup()
     
     _pDevice->release();
 
-    for(auto& del : _pMaterialTexture){
-        del->release();
-    }
-
     for(auto& del : _skyMesh.submeshes())
     {
         delete &del;
@@ -1757,17 +2277,8 @@ void Renderer::cleanup()
         }
     }
     
-    for(auto& del : _icosahedronMesh.submeshes())
-    {
-        delete &del;
-    }
-    
-    if(_icosahedronMesh.submeshes().empty()){
-        for (auto& del : _icosahedronMesh.vertexBuffers())
-        {
-            delete &del;
-        }
-    }
+    _pLightProxyVertexBuffer->release();
+    _pLightProxyIndexBuffer->release();
     
     for(auto& del : _pInstanceDataBuffer){
         del->release();
@@ -1781,6 +2292,26 @@ void Renderer::cleanup()
         del->release();
     }
     
+    for(auto& del : _pLightCutDataBuffer){
+        del->release();
+    }
+    
+    for(auto& del : _pLightCutPositionsBuffer){
+        del->release();
+    }
+    
+    for(auto& del : _pLightClusterBuffer){
+        del->release();
+    }
+    
+    for(auto& del : _pLightIndexBuffer){
+        del->release();
+    }
+    
+    for(auto& del : _pLightProxyOrderBuffer){
+        del->release();
+    }
+    
     for(auto& del : _pUniformsBuffer){
         del->release();
     }
@@ -1830,4 +2361,46 @@ void Renderer::updateDebugOutput() {
     std::cout <<  "s:" << "i" << "| " << shadowCameraData().projectionMatrix.columns[i].x  << " " << shadowCameraData().projectionMatrix.columns[i].y  << " " << shadowCameraData().projectionMatrix.columns[i].z << " " << shadowCameraData().projectionMatrix.columns[i].w << std::endl;
     }
     std::cout <<  "---+--------------------------------" << std::endl << std::ends;
+    
+    const LightProxies::Stats& proxyStats = _lightProxies.stats();
+    std::cout <<  "   | LightProxies pixels sphere legacy selected, cost legacy selected" << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl;
+    std::cout <<  "l:" << "0" << "| " << proxyStats.spherePixels << " " << proxyStats.legacyPixels << " " << proxyStats.selectedPixels << " " << proxyStats.legacyCost << " " << proxyStats.selectedCost << std::endl;
+    std::cout <<  "l:" << "1" << "| lights per level";
+    for ( size_t level = 0; level < LightProxies::kLevelCount; ++level ){
+        std::cout << " " << _lightProxies.bucket( level ).instanceCount;
+    }
+    std::cout << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl << std::ends;
+    
+    std::cout <<  "   | ShadowCascades split near far, texel size, drawn casters, static layer composited" << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl;
+    for ( uint32_t cascade = 0; cascade < ShadowCascades::kCascadeCount; ++cascade ){
+        const ShadowCascades::Cascade& fit = _shadowCascades.cascade( cascade );
+        std::cout <<  "k:" << cascade << "| " << fit.splitNear << " " << fit.splitFar << " " << fit.texelSize << " "
+                  << _instanceCuller.visibleInstances( InstanceCuller::View( InstanceCuller::ViewShadow + cascade ) ).size() << " "
+                  << _shadowComposited[cascade] << std::endl;
+    }
+    std::cout <<  "   | static layer casters, texel size, fits, redrawn tiles" << std::endl;
+    std::cout <<  "k:" << "s" << "| " << _shadowCache.staticCount() << " " << _shadowCache.texelSize() << " "
+              << _shadowCache.fitCount() << " " << _shadowCache.redrawnTiles() << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl << std::ends;
+    
+    std::cout <<  "   | LightCuts lights nodes cut, error ratio, rebuilds" << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl;
+    std::cout <<  "u:" << "0" << "| " << _lightCuts.lightCount() << " " << _lightCuts.nodeCount() << " " << _lightCuts.cutSize() << " " << _lightCuts.errorRatio() << " " << _lightCuts.rebuildCount() << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl << std::ends;
+    
+    std::cout <<  "   | LightBVH lights nodes" << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl;
+    std::cout <<  "b:" << "0" << "| " << _lightBVH.lightCount() << " " << _lightBVH.nodeCount() << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl << std::ends;
+    
+    std::cout <<  "   | IrradianceSH valid progress in use, texels relative RMS error max error against the map, us projection" << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl;
+    std::cout <<  "h:" << "0" << "| " << _irradianceSH.valid() << " " << _irradianceSH.progress() << " "
+              << _irradianceSH.accepted( kIrradianceSHMaxError ) << std::endl;
+    std::cout <<  "h:" << "1" << "| " << _irradianceSH.error().texelCount << " " << _irradianceSH.error().relativeRMS << " "
+              << _irradianceSH.error().maxAbsolute << " " << _irradianceSH.error().microseconds << std::endl;
+    std::cout <<  "---+--------------------------------" << std::endl << std::ends;
 }
@@ -14,6 +14,22 @@
 #include "AAPLMesh.h"
 #include "AAPLMathUtilities.h"
 #include "AAPLCamera3DTypes.h"
+#include "AAPLInstanceCuller.h"
+#include "AAPLInstanceLOD.h"
+#include "AAPLTransformHierarchy.h"
+#include "AAPLAnimationSystem.h"
+#include "AAPLDrawOrder.h"
+#include "AAPLInstanceBVH.h"
+#include "AAPLLightClusters.h"
+#include "AAPLLightAnimation.h"
+#include "AAPLLightBVH.h"
+#include "AAPLLightCuts.h"
+#include "AAPLLightProxies.h"
+#include "AAPLShadowCascades.h"
+#include "AAPLShadowCache.h"
+#include "AAPLIrradianceSH.h"
+#include "AAPLTextureLoader.h"
+#include "AAPLResidencyManager.h"
 
 using simd::float4;
 using simd::float3;
@@ -34,6 +50,15 @@ static constexpr int32_t kTextureHeight = 2048;
 static constexpr int32_t kFrameRate  = 60;
 static constexpr uint32_t NumPointVertices = 7;
 static constexpr uint32_t NumLights = 15;
+static constexpr uint32_t kIrradianceSHRowsPerFrame = 64;
+static constexpr double kIrradianceSHMaxError = 0.1;   /// relative RMS, the shipped map fits at about 0.09
+static constexpr bool kBenchmarkTextureLoading = false;
+static constexpr uint64_t kTextureBudgetBytes = 256ull << 20;
+static constexpr float kGroundHalfSize = 250.0f;
+static constexpr uint32_t kShadowStaticResolution = 4096;
+static constexpr float kShadowDepthBias = 0.015f;        /// constant, slope scaled and clamp of the caster depth bias
+static constexpr float kShadowSlopeScale = 7.f;
+static constexpr float kShadowBiasClamp = 0.02f;
 static const struct CameraData cdata = CameraData();
 
 class Renderer
@@ -47,6 +72,7 @@ public:
     void buildDirectionalLightPipeline();
     void buildPointLightMaskPipeline();
     void buildPointLightPipeline();
+    void buildClusteredPointLightPipeline();
     void buildPointsPipeline();
     void buildGroundPipeline();
     void buildSkyPipeline();
@@ -60,18 +86,27 @@ public:
     void buildBuffers();
     void buildParticleBuffer();
     void buildLightsBuffer();
+    void buildSceneHierarchy();
+    void buildAnimations();
+    void buildIrradianceSH( MTL::Texture* pIrradianceMap );
     
-    void updateLights(const simd::float4x4 & modelViewMatrix);
+    void updateLights(const simd::float4x4 & viewMatrix);
+    void pickInstance(float drawableWidth, float drawableHeight);
     
-    void drawShadow(MTL::CommandBuffer * pCommandBuffer, MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer);
+    void drawShadow(MTL::CommandBuffer * pCommandBuffer, MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer,
+                    const NS::UInteger * pInstanceOffsets);
+    void drawShadowCasters(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer, MTL::Buffer * pInstanceDataBuffer,
+                           NS::UInteger instanceOffset, uint32_t cascade, InstanceCuller::View view);
+    void drawInstanceLevels(MTL::RenderCommandEncoder * pEncoder, InstanceCuller::View view);
     void drawPointLights(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer);
     void drawPointLightsCommon(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer);
     void drawPointLightMask(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer);
+    void drawLightProxies(MTL::RenderCommandEncoder * pEncoder);
+    void drawClusteredPointLights(MTL::RenderCommandEncoder * pEncoder, MTL::Buffer * pFrameDataBuffer);
     void drawPoints(MTL::RenderCommandEncoder* pRenderEncoder,  MTL::Buffer * pFrameDataBuffer);
     void drawInView( MTK::View * pView, MTL::Drawable* pCurrentDrawable, MTL::Texture* pDepthStencilTexture );
     void drawableSizeWillChange( const MTL::Size & size);
     auto currentDrawableTexture( MTL::Drawable* pCurrentDrawable ) -> MTL::Texture *;
-    void step_animation();
     
     void updateDebugOutput();
     auto device() -> MTL::Device *;
@@ -94,6 +129,7 @@ public:
     void setMouseButtonMask( const NS::UInteger& newButtonMask );
     void setTextureScale ( const float& scale );
     const float& textureScale() {return  _textureScale; }
+    void setClusteredPointLights( bool enabled ) { _clusteredPointLights = enabled; }
     
     void setCameraData ( const struct CameraData & newCameraData);
     inline auto cameraData() -> const struct CameraData &;
@@ -145,11 +181,14 @@ private:
     MTL::RenderPipelineState* _pGBufferPipelineState;
     MTL::RenderPipelineState* _pSkyboxPipelineState;
     MTL::RenderPipelineState* _pShadowPipelineState;
+    MTL::RenderPipelineState* _pShadowClearPipelineState;
+    MTL::RenderPipelineState* _pShadowCompositePipelineState;
     MTL::RenderPipelineState* _pGroundShadowPipelineState;
     MTL::RenderPipelineState* _pDirectLightPipelineState;
     MTL::RenderPipelineState* _pGroundPipelineState;
     MTL::RenderPipelineState* _pLightPipelineState;
     MTL::RenderPipelineState* _pLightMaskPipelineState;
+    MTL::RenderPipelineState* _pClusteredLightPipelineState;
     MTL::RenderPipelineState* _pPointPipelineState;
     
     /// Compute pipeline states
@@ -167,26 +206,39 @@ private:
     MTL::DepthStencilState* _pGBufferDepthStencilState;
     MTL::DepthStencilState* _pDontWriteDepthStencilState;
     MTL::DepthStencilState* _pShadowDepthStencilState;
+    MTL::DepthStencilState* _pShadowClearDepthStencilState;
     MTL::DepthStencilState* _pDirectionLightDepthStencilState;
     MTL::DepthStencilState* _pLightMaskDepthStencilState;
     MTL::DepthStencilState* _pPointLightDepthStencilState;
     
     /// Render pass descriptors
     MTL::RenderPassDescriptor* _pShadowRenderPassDescriptor;
+    MTL::RenderPassDescriptor* _pShadowStaticRenderPassDescriptor;
     MTL::RenderPassDescriptor* _pGBufferRenderPassDescriptor;
     MTL::RenderPassDescriptor* _pFinalRenderPassDescriptor;
     
     /// Mesh Objects
     Mesh _skyMesh;
-    Mesh _icosahedronMesh;
+    MaterialDrawList _skyDraws;
+
+    /// Materials of every loaded mesh, the instanced spheres use _sphereMaterial
+    MaterialTable _materialTable;
+    uint32_t      _sphereMaterial = MaterialTable::kNoMaterial;
+
+    /// Cooked Assets.pack of the bundle, mapped for as long as the renderer lives
+    AssetPack _assetPack;
+
+    /// Texture memory within kTextureBudgetBytes, declared after the pack it reloads from
+    ResidencyManager _residencyManager;
+    ResidencyManager::Handle _sphereTextures[kMaterialTextureCount];
+    uint32_t _sphereTextureWidths[kMaterialTextureCount];   /// level 0 width, the textures load whole
     
     MTL::Texture* _pTexture;
-    MTL::Texture* _pMaterialTexture[5];
     MTL::Texture* _pSkyMap;
-    MTL::Texture* _pIrradianceMap;
     MTL::Texture* _pPreFilterMap;
     MTL::Texture* _pBDRFMap;
     MTL::Texture* _pShadowMap;
+    MTL::Texture* _pShadowStaticMap;
     MTL::Texture*  pDrawableTexture;
     MTL::Texture* _pPointMap;
     
@@ -203,6 +255,13 @@ private:
     MTL::Buffer* _pUniformsBuffer[kMaxFramesInFlight];
     MTL::Buffer* _pLightsDataBuffer;
     MTL::Buffer* _pLightPositionsBuffer[kMaxFramesInFlight];
+    MTL::Buffer* _pLightCutDataBuffer[kMaxFramesInFlight];
+    MTL::Buffer* _pLightCutPositionsBuffer[kMaxFramesInFlight];
+    MTL::Buffer* _pLightClusterBuffer[kMaxFramesInFlight];
+    MTL::Buffer* _pLightIndexBuffer[kMaxFramesInFlight];
+    MTL::Buffer* _pLightProxyVertexBuffer;
+    MTL::Buffer* _pLightProxyIndexBuffer;
+    MTL::Buffer* _pLightProxyOrderBuffer[kMaxFramesInFlight];
     MTL::Buffer* _pTimeBuffer;
     MTL::Buffer* _pInterActionBuffer;
     MTL::Buffer* _pQuadVertexBuffer;
@@ -210,9 +269,7 @@ private:
     MTL::Buffer* _pShadowBuffer;
     MTL::Buffer* _pPointVertexBuffer;
     
-    float4* _original_light_positions;
     float   _aspect;
-    float   _angle;
     size_t  _frame;
     size_t  _frameRate;
     size_t _frameNumber;
@@ -235,9 +292,6 @@ private:
     float _senseOffsetValue;
     float _evaporationValue;
     float _trailWeightValue;
-    float t_transformation {0.0f};
-    float t_rotation {0.0f};
-    int   dir = 1;
     bool  initCompute = false;
     
     NS::UInteger _mouseButtonMask;
@@ -248,16 +302,76 @@ private:
     
     CGSize _viewSize;
     size_t _kNumInstances;
-    size_t _indexCount;
     size_t _indexQuadCount;
     size_t _indexGroundCount;
     
     std::array <size_t, 3> _instanceArray;
+    
+    /// Culling and LOD, per instance data is built here and uploaded compacted per view
+    InstanceCuller _instanceCuller;
+    InstanceLOD _instanceLOD;
+    std::vector<InstanceData> _instanceScratch;
+    
+    /// Front to back ordering of the camera view instances
+    DrawOrder _drawOrder;
+    std::vector<uint64_t> _drawKeys;
+    std::vector<uint32_t> _drawInstances;
+    
+    /// Scene transforms, the instances hang below the rotating object group
+    TransformHierarchy _sceneHierarchy;
+    TransformHierarchy::Node _objectGroupNode;
+    TransformHierarchy::Node _groundNode;
+    std::vector<TransformHierarchy::Node> _instanceNodes;
+    
+    /// Keyframe tracks of the object group, the instances and the light time, evaluated once per frame
+    AnimationSystem _animation;
+    float _lightTime {0.f};
+    float _animatedInstanceSize {0.f};
+    float _animatedGroupScale {0.f};
+    
+    /// Point lights circling the object group, animated in view space in SoA batches
+    LightAnimation _lightAnimation;
+    
+    /// Cursor picking, the BVH is refit from the culler bounds when the left button goes down
+    InstanceBVH _instanceBVH;
+    std::vector<simd::float4> _pickSpheres;
+    NS::UInteger _previousMouseButtonMask {0};
+    uint32_t _pickedInstance {InstanceBVH::kInvalid};
+    
+    /// Point lights are shaded in one full screen pass over per cluster light lists,
+    /// the light volume path stays available for comparison
+    LightClusters _lightClusters;
+    std::vector<simd::float4> _viewLightSpheres;
+    
+    /// Light tree over the view space light spheres for importance based selection, refit after
+    /// the lights moved.
+    LightBVH _lightBVH;
+    
+    /// Light LOD, distant lights merge into representatives. The clusters and the light volumes
+    /// only see the cut of the frame, the fairy sprites still draw every light.
+    LightCuts _lightCuts;
+    
+    /// World space spheres of the instances the camera sees, the receivers the shadow casters are culled for
+    std::vector<simd::float4> _shadowReceivers;
+    bool _clusteredPointLights {true};
+    
+    /// Light volume proxies, every light is drawn with the icosphere level of the lowest estimated cost
+    LightProxies _lightProxies;
+    
+    /// Sun shadow cascades, refitted to the camera frustum every frame
+    ShadowCascades _shadowCascades;
+    
+    /// Static casters are kept in their own shadow layer and only redrawn in dirty tiles
+    ShadowCache _shadowCache;
+    bool _shadowComposited[ShadowCascadeCount];   /// cascade starts from the static layer, else draws its static casters
+    std::vector<uint8_t> _instanceMoved;
+    
+    /// Diffuse IBL as SH9, projected from a CPU copy of the irradiance map a few rows per frame
+    IrradianceSH _irradianceSH;
+    
     simd::float4x4 _projectionMatrix;
     simd::float4x4 _shadowProjectionMatrix;
     simd::float4x4 _shadowViewMatrix;
-    simd::float4x4 _modelMatrix;
-    simd::float4x4 _lightModelMatrix;
     simd::float4x4 _cameraViewMatrix;
     simd::float4x4 _skyModel;
     
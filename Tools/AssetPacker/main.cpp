@@ -0,0 +1,328 @@
+///
+///  main.cpp
+///  AssetPacker
+///
+///  Created by Guido Schneider on 27.04.24.
+///
+/// Abstract:
+/// Writes and checks the asset packs the renderer maps at start up. Textures come from the
+/// KTX files of the TextureCooker, meshes from Wavefront OBJ files, which are triangulated,
+/// indexed and converted to the vertex layout of the shaders here so the renderer never
+/// touches them again. Only plain C++, POSIX and zlib, it builds on Linux build machines.
+
+#include "AAPLAssetPack.h"
+#include "AAPLCompressedTexture.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+namespace
+{
+    void printUsage()
+    {
+        std::printf( "usage: AssetPacker pack <out.pack> <name>=<file.ktx|file.obj>...\n"
+                     "       AssetPacker validate <file.pack>...\n"
+                     "  pack       writes the textures and meshes under the given names, every blob\n"
+                     "             page aligned, textures keep their mips and block format\n"
+                     "  validate   checks the header, the table of contents and the checksum and layout\n"
+                     "             of every blob, then lists the contents\n" );
+    }
+
+    bool hasSuffix( const std::string& text, const char* pSuffix )
+    {
+        const size_t length = std::strlen( pSuffix );
+        return text.size() >= length && text.compare( text.size() - length, length, pSuffix ) == 0;
+    }
+
+    bool addTexture( AssetPackWriter& writer, const std::string& name, const std::string& path, std::string& error )
+    {
+        CompressedTexture texture;
+        if ( !loadKTX( path, texture, error ) )
+            return false;
+
+        const AssetPackEntry::Format format = texture.format == CompressedTexture::FormatBC7_sRGB ? AssetPackEntry::FormatBC7_sRGB
+                                                                                                 : AssetPackEntry::FormatBC7;
+        return writer.addTexture( name, format, texture.width, texture.height, texture.levels, error );
+    }
+
+    /// OBJ index of a corner, 1 based, negative counts back from the end, 0 when missing
+    int resolveIndex( long index, size_t count )
+    {
+        return index < 0 ? int( long( count ) + index ) : int( index - 1 );
+    }
+
+    bool addMesh( AssetPackWriter& writer, const std::string& name, const std::string& path, std::string& error )
+    {
+        std::ifstream file( path );
+        if ( !file )
+        {
+            error = "can not open " + path;
+            return false;
+        }
+
+        std::vector< std::array<float, 3> > positions, normals;
+        std::vector< std::array<float, 2> > texCoords;
+        std::vector<AssetPackVertex>  vertices;
+        std::vector<uint32_t>         indices;
+        std::vector<AssetPackSubmesh> submeshes;
+        std::map< std::tuple<int, int, int>, uint32_t > corners;
+        bool missingNormals = false;
+
+        /// Every usemtl, o and g starts a new submesh, empty ones are dropped at the end
+        auto beginSubmesh = [&]()
+        {
+            if ( submeshes.empty() || submeshes.back().indexCount > 0 )
+                submeshes.push_back( { AssetPackSubmesh::PrimitiveTriangle, uint32_t( indices.size() ), 0, 0 } );
+        };
+        beginSubmesh();
+
+        std::string line;
+        for ( uint32_t lineNumber = 1; std::getline( file, line ); ++lineNumber )
+        {
+            std::istringstream stream( line );
+            std::string keyword;
+            stream >> keyword;
+            if ( keyword == "v" || keyword == "vn" )
+            {
+                std::array<float, 3> value = {};
+                stream >> value[0] >> value[1] >> value[2];
+                ( keyword == "v" ? positions : normals ).push_back( value );
+            }
+            else if ( keyword == "vt" )
+            {
+                std::array<float, 2> value = {};
+                stream >> value[0] >> value[1];
+                texCoords.push_back( value );
+            }
+            else if ( keyword == "usemtl" || keyword == "o" || keyword == "g" )
+            {
+                beginSubmesh();
+            }
+            else if ( keyword == "f" )
+            {
+                std::vector<uint32_t> polygon;
+                std::string corner;
+                while ( stream >> corner )
+                {
+                    long v = 0, vt = 0, vn = 0;
+                    const char* pText = corner.c_str();
+                    char* pEnd = nullptr;
+                    v = std::strtol( pText, &pEnd, 10 );
+                    if ( *pEnd == '/' )
+                    {
+                        pText = pEnd + 1;
+                        vt = std::strtol( pText, &pEnd, 10 );
+                        if ( *pEnd == '/' )
+                            vn = std::strtol( pEnd + 1, &pEnd, 10 );
+                    }
+
+                    const std::tuple<int, int, int> key( resolveIndex( v, positions.size() ),
+                                                         vt ? resolveIndex( vt, texCoords.size() ) : -1,
+                                                         vn ? resolveIndex( vn, normals.size() ) : -1 );
+                    if ( v == 0 || std::get<0>( key ) < 0 || std::get<0>( key ) >= int( positions.size() )
+                      || std::get<1>( key ) >= int( texCoords.size() ) || std::get<2>( key ) >= int( normals.size() ) )
+                    {
+                        error = path + ":" + std::to_string( lineNumber ) + ": face refers to a missing vertex";
+                        return false;
+                    }
+
+                    auto found = corners.find( key );
+                    if ( found == corners.end() )
+                    {
+                        AssetPackVertex vertex = {};
+                        const std::array<float, 3>& position = positions[std::get<0>( key )];
+                        std::copy( position.begin(), position.end(), vertex.position );
+                        if ( std::get<1>( key ) >= 0 )
+                        {
+                            /// OBJ puts v = 0 at the bottom, Metal samples the first row at 0
+                            vertex.texCoord[0] = texCoords[std::get<1>( key )][0];
+                            vertex.texCoord[1] = 1.f - texCoords[std::get<1>( key )][1];
+                        }
+                        if ( std::get<2>( key ) >= 0 )
+                        {
+                            const std::array<float, 3>& normal = normals[std::get<2>( key )];
+                            std::copy( normal.begin(), normal.end(), vertex.normal );
+                        }
+                        else
+                        {
+                            missingNormals = true;
+                        }
+                        found = corners.emplace( key, uint32_t( vertices.size() ) ).first;
+                        vertices.push_back( vertex );
+                    }
+                    polygon.push_back( found->second );
+                }
+
+                if ( polygon.size() < 3 )
+                {
+                    error = path + ":" + std::to_string( lineNumber ) + ": face with less than three corners";
+                    return false;
+                }
+                for ( size_t i = 2; i < polygon.size(); ++i )
+                {
+                    indices.insert( indices.end(), { polygon[0], polygon[i - 1], polygon[i] } );
+                    submeshes.back().indexCount += 3;
+                }
+            }
+        }
+
+        if ( submeshes.back().indexCount == 0 )
+            submeshes.pop_back();
+        if ( submeshes.empty() )
+        {
+            error = path + " has no faces";
+            return false;
+        }
+
+        if ( missingNormals )
+        {
+            /// Area weighted face normals for the corners the file gave none, shared corners get the sum
+            std::vector< std::array<float, 3> > sums( vertices.size(), { 0.f, 0.f, 0.f } );
+            for ( size_t i = 0; i + 2 < indices.size(); i += 3 )
+            {
+                const float* a = vertices[indices[i]].position;
+                const float* b = vertices[indices[i + 1]].position;
+                const float* c = vertices[indices[i + 2]].position;
+                const float e0[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+                const float e1[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+                const float cross[3] = { e0[1] * e1[2] - e0[2] * e1[1], e0[2] * e1[0] - e0[0] * e1[2], e0[0] * e1[1] - e0[1] * e1[0] };
+                for ( size_t corner = 0; corner < 3; ++corner )
+                {
+                    for ( size_t axis = 0; axis < 3; ++axis )
+                        sums[indices[i + corner]][axis] += cross[axis];
+                }
+            }
+            for ( const auto& corner : corners )
+            {
+                if ( std::get<2>( corner.first ) >= 0 )
+                    continue;
+                const std::array<float, 3>& sum = sums[corner.second];
+                const float length = std::sqrt( sum[0] * sum[0] + sum[1] * sum[1] + sum[2] * sum[2] );
+                for ( size_t axis = 0; axis < 3; ++axis )
+                    vertices[corner.second].normal[axis] = length > 0.f ? sum[axis] / length : ( axis == 1 ? 1.f : 0.f );
+            }
+        }
+
+        return writer.addMesh( name, vertices, indices, submeshes, error );
+    }
+
+    const char* formatName( AssetPackEntry::Format format )
+    {
+        switch ( format )
+        {
+            case AssetPackEntry::FormatBC7:        return "bc7";
+            case AssetPackEntry::FormatBC7_sRGB:   return "bc7 srgb";
+            case AssetPackEntry::FormatRGBA8:      return "rgba8";
+            case AssetPackEntry::FormatRGBA8_sRGB: return "rgba8 srgb";
+            case AssetPackEntry::FormatUInt16:     return "uint16";
+            case AssetPackEntry::FormatUInt32:     return "uint32";
+        }
+        return "unknown";
+    }
+
+    bool pack( const std::string& output, const std::vector<std::string>& assets, std::string& error )
+    {
+        AssetPackWriter writer;
+        for ( const std::string& asset : assets )
+        {
+            const size_t separator = asset.find( '=' );
+            if ( separator == std::string::npos || separator == 0 )
+            {
+                error = "expected <name>=<file> instead of " + asset;
+                return false;
+            }
+            const std::string name = asset.substr( 0, separator );
+            const std::string path = asset.substr( separator + 1 );
+
+            bool added;
+            if ( hasSuffix( path, ".ktx" ) )
+                added = addTexture( writer, name, path, error );
+            else if ( hasSuffix( path, ".obj" ) )
+                added = addMesh( writer, name, path, error );
+            else
+            {
+                error = "no KTX or OBJ file: " + path;
+                added = false;
+            }
+            if ( !added )
+                return false;
+        }
+        return writer.write( output, error );
+    }
+
+    bool validate( const std::string& path, std::string& error )
+    {
+        const auto start = std::chrono::steady_clock::now();
+        AssetPack pack;
+        if ( !pack.open( path, error ) || !pack.validate( error ) )
+            return false;
+
+        std::printf( "%s: %u entries, %llu bytes, valid in %.3f s\n", path.c_str(), pack.entryCount(),
+                     (unsigned long long)pack.fileSize(),
+                     std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+        for ( uint32_t i = 0; i < pack.entryCount(); ++i )
+        {
+            const AssetPackEntry& entry = pack.entries()[i];
+            if ( entry.type == AssetPackEntry::TypeTexture )
+            {
+                std::printf( "  texture %-24s %-10s %5u x %-5u %2u levels %10llu bytes at %llu\n", entry.name, formatName( entry.format ),
+                             entry.width, entry.height, entry.levelCount, (unsigned long long)entry.size, (unsigned long long)entry.offset );
+            }
+            else
+            {
+                std::printf( "  mesh    %-24s %-10s %7u vertices %8u indices %3u submeshes %10llu bytes at %llu\n", entry.name,
+                             formatName( entry.format ), entry.vertexCount, entry.indexCount, entry.submeshCount,
+                             (unsigned long long)entry.size, (unsigned long long)entry.offset );
+            }
+        }
+        return true;
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    if ( argc < 3 )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    const std::string command = argv[1];
+    std::string error;
+    if ( command == "pack" && argc >= 4 )
+    {
+        if ( !pack( argv[2], std::vector<std::string>( argv + 3, argv + argc ), error ) || !validate( argv[2], error ) )
+        {
+            std::fprintf( stderr, "AssetPacker: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if ( command == "validate" )
+    {
+        int result = EXIT_SUCCESS;
+        for ( int i = 2; i < argc; ++i )
+        {
+            if ( !validate( argv[i], error ) )
+            {
+                std::fprintf( stderr, "AssetPacker: %s: %s\n", argv[i], error.c_str() );
+                result = EXIT_FAILURE;
+            }
+        }
+        return result;
+    }
+
+    printUsage();
+    return EXIT_FAILURE;
+}
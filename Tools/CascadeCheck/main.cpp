@@ -0,0 +1,316 @@
+///
+///  main.cpp
+///  CascadeCheck
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Checks the cascade fit of the sun shadow without a GPU. Random cameras and sun directions
+/// around a scene like the one of the app are fitted and every cascade is checked: the
+/// splits have to follow the practical split formula, the orthographic projection has to
+/// contain all eight corners of its frustum slice, and moving the camera by less than a
+/// texel has to keep the projection size and move it by whole texels only, turning the
+/// camera may not change the size either. A failed check fails the run, the time of
+/// update() and fitCasterVolumes() is printed afterwards.
+
+#include "AAPLShadowCascades.h"
+#include "AAPLMathUtilities.h"
+
+#include <simd/simd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    constexpr float kPi = 3.14159265358979323846f;
+
+    struct Options
+    {
+        uint32_t cameraCount   = 1000;
+        uint32_t resolution    = 2048;      /// shadow map size the app allocates
+        uint32_t receiverCount = 1000;      /// spheres handed to fitCasterVolumes() when timing
+        uint32_t seed          = 1;
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: CascadeCheck [options]\n"
+                     "  --cameras N      random cameras fitted and checked, default 1000\n"
+                     "  --resolution N   shadow map size in texels, default 2048\n"
+                     "  --receivers N    receiver spheres when timing the caster volumes, default 1000\n"
+                     "  --seed N         seed of the cameras and the sun, default 1\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            if ( argument == "--cameras" )          valid = number( options.cameraCount );
+            else if ( argument == "--resolution" )  valid = number( options.resolution ) && options.resolution > 2;
+            else if ( argument == "--receivers" )   valid = number( options.receiverCount );
+            else if ( argument == "--seed" )        valid = number( options.seed );
+            else                                    valid = false;
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "CascadeCheck: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double microsecondsSince( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    /// Camera of the app, 45 degrees, 0.1 to 200 units, looking from eye along direction.
+    CameraData makeCamera( const simd::float3& eye, const simd::float3& direction, simd::float4x4& projection )
+    {
+        CameraData camera = {};
+        camera.fovyRadians    = 45.f * kPi / 180.f;
+        camera.aspect         = 16.f / 9.f;
+        camera.near           = 0.1f;
+        camera.far            = 200.f;
+        camera.cameraPosition = eye;
+        camera.viewMatrix     = matrix_look_at_right_hand( eye, eye + direction, (simd::float3){ 0.f, 1.f, 0.f } );
+        projection = makePerspective( camera.fovyRadians, camera.aspect, camera.near, camera.far );
+        return camera;
+    }
+
+    /// The sun looks at the origin from the direction the light comes from, as toShadowViewMatrix does.
+    simd::float4x4 makeLightView( const simd::float3& toSun )
+    {
+        const simd::float3 up = std::abs( toSun.y ) > 0.99f ? (simd::float3){ 0.f, 0.f, 1.f } : (simd::float3){ 0.f, 1.f, 0.f };
+        return matrix_look_at_left_hand( 100.f * toSun, (simd::float3){ 0.f, 0.f, 0.f }, up );
+    }
+
+    simd::float3 randomDirection( std::mt19937& generator, float minY )
+    {
+        std::uniform_real_distribution<float> uniform( 0.f, 1.f );
+        const float y = minY + ( 1.f - minY ) * uniform( generator );
+        const float angle = 2.f * kPi * uniform( generator );
+        const float r = std::sqrt( std::max( 0.f, 1.f - y * y ) );
+        return (simd::float3){ r * std::cos( angle ), y, r * std::sin( angle ) };
+    }
+
+    /// Split depths of the practical split scheme, written out on their own.
+    float practicalSplit( float near, float far, float lambda, uint32_t split )
+    {
+        const float fraction = float( split ) / ShadowCascades::kCascadeCount;
+        return lambda * near * std::pow( far / near, fraction ) + ( 1.f - lambda ) * ( near + ( far - near ) * fraction );
+    }
+
+    struct Failures
+    {
+        uint32_t splits      = 0;
+        uint32_t containment = 0;
+        uint32_t snapping    = 0;
+        uint32_t rotation    = 0;
+    };
+
+    void checkSplits( ShadowCascades& cascades, Failures& failures )
+    {
+        const float lambdas[] = { 0.f, 0.5f, 0.75f, 1.f };
+        const float ranges[][2] = { { 0.1f, 200.f }, { 0.01f, 1000.f }, { 1.f, 50.f } };
+        for ( float lambda : lambdas )
+        {
+            cascades.setSplitLambda( lambda );
+            for ( const auto& range : ranges )
+            {
+                float splits[ShadowCascades::kCascadeCount + 1];
+                cascades.splitDistances( range[0], range[1], splits );
+                bool valid = splits[0] == range[0] && splits[ShadowCascades::kCascadeCount] == range[1];
+                for ( uint32_t split = 1; split < ShadowCascades::kCascadeCount; ++split )
+                {
+                    const float expected = practicalSplit( range[0], range[1], lambda, split );
+                    valid = valid && std::abs( splits[split] - expected ) <= 1e-5f * expected && splits[split] > splits[split - 1];
+                }
+                if ( !valid )
+                {
+                    std::fprintf( stderr, "CascadeCheck: splits of %g to %g with lambda %g are off the practical split formula\n",
+                                  range[0], range[1], lambda );
+                    ++failures.splits;
+                }
+            }
+        }
+        cascades.setSplitLambda( 0.75f );
+    }
+
+    /// Every corner of every slice projects inside the clip volume of its cascade.
+    bool containsSlices( const ShadowCascades& cascades, const CameraData& camera, const simd::float4x4& projection )
+    {
+        constexpr float kEpsilon = 1e-4f;
+        for ( uint32_t index = 0; index < ShadowCascades::kCascadeCount; ++index )
+        {
+            const ShadowCascades::Cascade& cascade = cascades.cascade( index );
+            const FrustumPoints planes[2] = { ShadowCascades::planePoints( camera.viewMatrix, projection, cascade.splitNear ),
+                                              ShadowCascades::planePoints( camera.viewMatrix, projection, cascade.splitFar ) };
+            for ( const FrustumPoints& plane : planes )
+            {
+                for ( const simd::float3& corner : { plane.upperLeft, plane.upperRight, plane.lowerRight, plane.lowerLeft } )
+                {
+                    const simd::float4 clip = simd_mul( cascade.viewProjection, (simd::float4){ corner.x, corner.y, corner.z, 1.f } );
+                    if ( std::abs( clip.x ) > 1.f + kEpsilon || std::abs( clip.y ) > 1.f + kEpsilon
+                        || clip.z < -kEpsilon || clip.z > 1.f + kEpsilon )
+                        return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// The fit of the moved camera has the same size and lies a whole number of texels away. The
+    /// ortho width comes from the snapped center, rounding may move the map edge by far less than a texel.
+    bool snappedAlike( const ShadowCascades::Cascade& a, const ShadowCascades::Cascade& b, uint32_t resolution )
+    {
+        constexpr float kTexelTolerance = 1e-2f;
+        if ( a.texelSize != b.texelSize )
+            return false;
+
+        for ( uint32_t axis = 0; axis < 2; ++axis )
+        {
+            const float scaleA = a.viewProjection.columns[axis][axis];
+            const float scaleB = b.viewProjection.columns[axis][axis];
+            if ( std::abs( scaleA - scaleB ) / std::abs( scaleA ) * 0.5f * resolution > kTexelTolerance )
+                return false;
+        }
+
+        /// Clip space spans two units over the map, the translation difference in texels has to be whole
+        for ( uint32_t axis = 0; axis < 2; ++axis )
+        {
+            const float texels = ( a.viewProjection.columns[3][axis] - b.viewProjection.columns[3][axis] ) * 0.5f * resolution;
+            if ( std::abs( texels - std::round( texels ) ) > kTexelTolerance )
+                return false;
+        }
+        return true;
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    /// Casters of the app fit in a sphere of 60 units around the origin
+    const simd::float4 sceneBounds = { 0.f, 0.f, 0.f, 60.f };
+    ShadowCascades cascades;
+    Failures failures;
+    checkSplits( cascades, failures );
+
+    std::mt19937 generator( options.seed );
+    std::uniform_real_distribution<float> uniform( 0.f, 1.f );
+    for ( uint32_t run = 0; run < options.cameraCount; ++run )
+    {
+        const simd::float3 eye = { 40.f * ( uniform( generator ) - 0.5f ), 1.f + 10.f * uniform( generator ), 40.f * ( uniform( generator ) - 0.5f ) };
+        const simd::float3 direction = randomDirection( generator, -0.8f );
+        const simd::float4x4 lightView = makeLightView( randomDirection( generator, 0.1f ) );
+
+        simd::float4x4 projection;
+        const CameraData camera = makeCamera( eye, direction, projection );
+        cascades.update( camera, projection, lightView, sceneBounds, options.resolution );
+        ShadowCascades::Cascade fitted[ShadowCascades::kCascadeCount];
+        for ( uint32_t index = 0; index < ShadowCascades::kCascadeCount; ++index )
+            fitted[index] = cascades.cascade( index );
+
+        bool valid = true;
+        for ( uint32_t index = 0; index < ShadowCascades::kCascadeCount; ++index )
+        {
+            valid = valid && fitted[index].splitNear == ( index == 0 ? camera.near : fitted[index - 1].splitFar )
+                          && std::abs( fitted[index].splitFar - practicalSplit( camera.near, camera.far, 0.75f, index + 1 ) ) <= 1e-5f * fitted[index].splitFar;
+        }
+        failures.splits += !valid;
+        failures.containment += !containsSlices( cascades, camera, projection );
+
+        /// Less than half a texel of the finest cascade in a random direction
+        const simd::float3 step = randomDirection( generator, -1.f ) * ( 0.5f * uniform( generator ) * fitted[0].texelSize );
+        simd::float4x4 movedProjection;
+        const CameraData moved = makeCamera( eye + step, direction, movedProjection );
+        cascades.update( moved, movedProjection, lightView, sceneBounds, options.resolution );
+        for ( uint32_t index = 0; index < ShadowCascades::kCascadeCount; ++index )
+        {
+            if ( !snappedAlike( fitted[index], cascades.cascade( index ), options.resolution ) )
+            {
+                ++failures.snapping;
+                break;
+            }
+        }
+
+        /// Turning in place keeps the bounding spheres and with them the texel size
+        const simd::float3 turned = simd_normalize( direction + randomDirection( generator, -1.f ) * 0.5f );
+        simd::float4x4 turnedProjection;
+        const CameraData turnedCamera = makeCamera( eye, turned, turnedProjection );
+        cascades.update( turnedCamera, turnedProjection, lightView, sceneBounds, options.resolution );
+        for ( uint32_t index = 0; index < ShadowCascades::kCascadeCount; ++index )
+        {
+            if ( cascades.cascade( index ).texelSize != fitted[index].texelSize )
+            {
+                ++failures.rotation;
+                break;
+            }
+        }
+    }
+
+    /// Timing over one camera flying through the scene, receivers scattered on the ground
+    std::vector<simd::float4> receivers( options.receiverCount );
+    for ( simd::float4& receiver : receivers )
+        receiver = (simd::float4){ 100.f * ( uniform( generator ) - 0.5f ), 1.f, 100.f * ( uniform( generator ) - 0.5f ), 0.5f + uniform( generator ) };
+    const simd::float3 groundMin = { -50.f, -0.1f, -50.f };
+    const simd::float3 groundMax = {  50.f,  0.f,   50.f };
+    const simd::float4x4 lightView = makeLightView( simd_normalize( (simd::float3){ 0.25f, 2.f, 3.f } ) );
+
+    constexpr uint32_t kFrames = 10000;
+    double updateMicroseconds = 0.0, fitMicroseconds = 0.0;
+    for ( uint32_t frame = 0; frame < kFrames; ++frame )
+    {
+        const float angle = 2.f * kPi * frame / kFrames;
+        simd::float4x4 projection;
+        const CameraData camera = makeCamera( (simd::float3){ 20.f * std::cos( angle ), 4.f, 20.f * std::sin( angle ) },
+                                              (simd::float3){ -std::sin( angle ), -0.2f, std::cos( angle ) }, projection );
+        auto start = std::chrono::steady_clock::now();
+        cascades.update( camera, projection, lightView, sceneBounds, options.resolution );
+        updateMicroseconds += microsecondsSince( start );
+
+        start = std::chrono::steady_clock::now();
+        cascades.fitCasterVolumes( receivers.data(), receivers.size(), groundMin, groundMax );
+        fitMicroseconds += microsecondsSince( start );
+    }
+
+    std::printf( "cameras     %u with %u cascades on a %u texel map\n", options.cameraCount, ShadowCascades::kCascadeCount, options.resolution );
+    std::printf( "failed      %u splits, %u slices outside their ortho, %u unstable snaps, %u sizes changed by turning\n",
+                 failures.splits, failures.containment, failures.snapping, failures.rotation );
+    std::printf( "update      %.2f us\n", updateMicroseconds / kFrames );
+    std::printf( "casters     %.2f us for %u receivers\n", fitMicroseconds / kFrames, options.receiverCount );
+
+    if ( failures.splits + failures.containment + failures.snapping + failures.rotation > 0 )
+    {
+        std::fprintf( stderr, "CascadeCheck: the cascade fit failed its checks\n" );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
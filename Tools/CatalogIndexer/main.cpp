@@ -0,0 +1,200 @@
+///
+///  main.cpp
+///  CatalogIndexer
+///
+///  Created by Guido Schneider on 30.04.24.
+///
+/// Abstract:
+/// Builds and queries the catalog index outside the app bundle. index brings the index file of
+/// an .xcassets folder up to date, find resolves set names to their files through that file
+/// without reading the catalog again, and benchmark compares building the index, opening it
+/// against an unchanged catalog, loading it as it is and looking names up in it. Only plain
+/// C++ and zlib, it runs on Linux build machines.
+
+#include "AAPLCatalogIndex.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    void printUsage()
+    {
+        std::printf( "usage: CatalogIndexer index <Assets.xcassets> <catalog.index> [--threads N]\n"
+                     "       CatalogIndexer find <Assets.xcassets> <catalog.index> [name...]\n"
+                     "       CatalogIndexer benchmark <Assets.xcassets> [--runs N] [--threads N]\n"
+                     "  index      builds the index file, or keeps it when the catalog did not change\n"
+                     "  find       prints the files of the named sets, of every set without names\n"
+                     "  benchmark  times building, cached opening, loading and lookups\n" );
+    }
+
+    /// Value of --name N after position first, fallback if missing.
+    uint32_t option( int argc, const char* argv[], int first, const char* name, uint32_t fallback )
+    {
+        for ( int i = first; i + 1 < argc; ++i )
+        {
+            if ( std::string( argv[i] ) == name )
+                return uint32_t( std::strtoul( argv[i + 1], nullptr, 10 ) );
+        }
+        return fallback;
+    }
+
+    void printEntry( const CatalogIndex& index, const CatalogIndex::Entry& entry )
+    {
+        static const char* faces[6] = { "+X", "-X", "+Y", "-Y", "+Z", "-Z" };
+        const bool cube = entry.type == CatalogIndex::Entry::TypeCubeTexture;
+        std::printf( "%s  %s, %u levels, %s%s%s\n", index.name( entry ), cube ? "cube" : "2D", entry.levelCount,
+                     *index.pixelFormat( entry ) ? index.pixelFormat( entry ) : "format of the images",
+                     entry.flags & CatalogIndex::Entry::FlagBottomLeftOrigin ? ", bottom left origin" : "",
+                     entry.flags & CatalogIndex::Entry::FlagData ? ", data" : "" );
+        for ( uint32_t face = 0; face < entry.faceCount; ++face )
+        {
+            for ( uint32_t level = 0; level < entry.levelCount; ++level )
+            {
+                const char* pPath = index.relativePath( entry, face, level );
+                std::printf( "  %s%s%u  %s\n", cube ? faces[face] : "", cube ? " " : "", level, *pPath ? pPath : "-" );
+            }
+        }
+    }
+
+    double milliseconds( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    bool benchmark( const fs::path& catalog, uint32_t runs, uint32_t threadCount, std::string& error )
+    {
+        const fs::path indexPath = fs::temp_directory_path() / "CatalogIndexer-benchmark.index";
+        std::error_code code;
+        fs::remove( indexPath, code );
+
+        /// The first open builds and writes the file, the others find it up to date
+        double buildMilliseconds = 0.0, openMilliseconds = 0.0, loadMilliseconds = 0.0;
+        CatalogIndex index;
+        for ( uint32_t run = 0; run < runs; ++run )
+        {
+            CatalogIndex built;
+            if ( !built.build( catalog, error, threadCount ) )
+                return false;
+            buildMilliseconds += built.statistics().milliseconds;
+        }
+        if ( !index.open( catalog, indexPath, error, threadCount ) )
+            return false;
+        for ( uint32_t run = 0; run < runs; ++run )
+        {
+            CatalogIndex opened;
+            if ( !opened.open( catalog, indexPath, error, threadCount ) )
+                return false;
+            if ( !opened.statistics().cached )
+            {
+                error = "the index file was built again for an unchanged catalog";
+                return false;
+            }
+            openMilliseconds += opened.statistics().milliseconds;
+
+            CatalogIndex loaded;
+            if ( !loaded.load( catalog, indexPath, error ) )
+                return false;
+            loadMilliseconds += loaded.statistics().milliseconds;
+        }
+
+        /// Every name once per pass, plus a miss
+        const uint32_t passes = 100000;
+        size_t found = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for ( uint32_t pass = 0; pass < passes; ++pass )
+        {
+            for ( const CatalogIndex::Entry& entry : index.entries() )
+                found += index.find( index.name( entry ) ) != nullptr;
+            found += index.find( "NoSuchMap" ) != nullptr;
+        }
+        const double findMilliseconds = milliseconds( start );
+        const size_t lookups = size_t( passes ) * ( index.entries().size() + 1 );
+
+        fs::remove( indexPath, code );
+        std::printf( "sets        %u with %u images, %u images missing on disk\n", index.statistics().setCount,
+                     index.statistics().imageCount, index.statistics().missingImageCount );
+        std::printf( "build       %.3f ms\n", buildMilliseconds / runs );
+        std::printf( "open        %.3f ms with an up to date index file\n", openMilliseconds / runs );
+        std::printf( "load        %.3f ms without looking at the catalog\n", loadMilliseconds / runs );
+        std::printf( "find        %.1f ns per lookup, %zu of %zu found\n", findMilliseconds * 1e6 / double( lookups ), found, lookups );
+        return true;
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    if ( argc < 3 )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    const std::string command = argv[1];
+    const fs::path catalog = argv[2];
+    std::string error;
+    if ( command == "index" && argc >= 4 )
+    {
+        CatalogIndex index;
+        if ( !index.open( catalog, argv[3], error, option( argc, argv, 4, "--threads", 0 ) ) )
+        {
+            std::fprintf( stderr, "CatalogIndexer: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+        const CatalogIndex::Statistics& statistics = index.statistics();
+        std::printf( "%s %u sets, %u images in %.3f ms\n", statistics.cached ? "Kept" : "Indexed",
+                     statistics.setCount, statistics.imageCount, statistics.milliseconds );
+        if ( statistics.missingImageCount > 0 )
+            std::printf( "%u images listed in the catalog are missing on disk\n", statistics.missingImageCount );
+        return EXIT_SUCCESS;
+    }
+    if ( command == "find" && argc >= 4 )
+    {
+        CatalogIndex index;
+        if ( !index.load( catalog, argv[3], error ) )
+        {
+            std::fprintf( stderr, "CatalogIndexer: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+        if ( argc == 4 )
+        {
+            for ( const CatalogIndex::Entry& entry : index.entries() )
+                printEntry( index, entry );
+            return EXIT_SUCCESS;
+        }
+
+        int result = EXIT_SUCCESS;
+        for ( int i = 4; i < argc; ++i )
+        {
+            const CatalogIndex::Entry* pEntry = index.find( argv[i] );
+            if ( !pEntry )
+            {
+                std::fprintf( stderr, "CatalogIndexer: no set named %s\n", argv[i] );
+                result = EXIT_FAILURE;
+                continue;
+            }
+            printEntry( index, *pEntry );
+        }
+        return result;
+    }
+    if ( command == "benchmark" )
+    {
+        const uint32_t runs = std::max( option( argc, argv, 3, "--runs", 20 ), 1u );
+        if ( !benchmark( catalog, runs, option( argc, argv, 3, "--threads", 0 ), error ) )
+        {
+            std::fprintf( stderr, "CatalogIndexer: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    printUsage();
+    return EXIT_FAILURE;
+}
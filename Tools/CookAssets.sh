@@ -0,0 +1,46 @@
+#!/bin/sh
+##
+##  CookAssets.sh
+##  MetalCPP
+##
+##  Created by Guido Schneider on 01.05.24.
+##
+## Run Script phase of the app target. Cooks the material maps to BC7 with the TextureCooker
+## and packs them with the AssetPacker into Assets.pack in the app resources, the pack
+## Renderer::buildTextures maps at start up. The texture sets are cooked as copies in the
+## derived files, the build never writes into the asset catalog. The PNG backed 2D sets are
+## also copied loose into Catalog with their index in Catalog.index, so the texture loader
+## decodes them on its pool instead of MTKTextureLoader.
+
+set -e
+
+SETS="BaseColorMap NormalMap ORMMap"
+LOOSE_SETS="BaseColorMap NormalMap ORMMap BDRFMap PointMap"
+CATALOG="$PROJECT_DIR/Assets/Assets.xcassets"
+WORK="$DERIVED_FILE_DIR/CookedAssets"
+RESOURCES="$TARGET_BUILD_DIR/$UNLOCALIZED_RESOURCES_FOLDER_PATH"
+PACK="$RESOURCES/Assets.pack"
+
+rm -rf "$WORK"
+mkdir -p "$WORK/ktx" "$RESOURCES"
+
+set --
+for SET in $SETS; do
+    cp -R "$CATALOG/$SET.textureset" "$WORK/"
+    set -- "$@" "$WORK/$SET.textureset"
+done
+"$BUILT_PRODUCTS_DIR/TextureCooker" "$@" --bc7 "$WORK/ktx"
+
+set --
+for SET in $SETS; do
+    set -- "$@" "$SET=$WORK/ktx/$SET.ktx"
+done
+"$BUILT_PRODUCTS_DIR/AssetPacker" pack "$PACK" "$@"
+
+rm -rf "$RESOURCES/Catalog"
+mkdir -p "$RESOURCES/Catalog"
+for SET in $LOOSE_SETS; do
+    cp -R "$CATALOG/$SET.textureset" "$RESOURCES/Catalog/"
+done
+find "$RESOURCES/Catalog" -name .DS_Store -delete
+"$BUILT_PRODUCTS_DIR/CatalogIndexer" index "$RESOURCES/Catalog" "$RESOURCES/Catalog.index"
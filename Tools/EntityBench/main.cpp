@@ -0,0 +1,304 @@
+///
+///  main.cpp
+///  EntityBench
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Exercises the entity store with far more entities than the app has. Rotating and static
+/// entities in two archetypes are created, moved by updateRotationSystem, culled against a
+/// camera frustum and gathered per pass, a share of them is destroyed and created again every
+/// frame. Every step is checked against a plain loop over the live handles: rows have to
+/// follow their entities through the swap removes, destroyed handles have to stay dead after
+/// their index is reused, and the systems have to agree with the scalar reference. A failed
+/// check fails the run, the time of every step is printed afterwards.
+
+#include "AAPLEntityStore.h"
+
+#include <simd/simd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        uint32_t entityCount = 1000000;
+        uint32_t frameCount  = 20;
+        float    churn       = 0.05f;       /// share of the entities destroyed and created per frame
+        uint32_t seed        = 1;
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: EntityBench [options]\n"
+                     "  --entities N     entities in the store, default 1000000\n"
+                     "  --frames N       frames of rotation, culling, gathering and churn, default 20\n"
+                     "  --churn P        percent of the entities destroyed and created per frame, default 5\n"
+                     "  --seed N         seed of the scene, default 1\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            uint32_t percent = 0;
+            if ( argument == "--entities" )     valid = number( options.entityCount );
+            else if ( argument == "--frames" )  valid = number( options.frameCount );
+            else if ( argument == "--churn" )   valid = number( percent ) && percent <= 100;
+            else if ( argument == "--seed" )    valid = number( options.seed );
+            else                                valid = false;
+
+            if ( percent > 0 )
+                options.churn = percent / 100.f;
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "EntityBench: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double milliseconds( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    constexpr ComponentMask kRotatingMask = componentMask< TransformComponent, BoundsComponent, RotationComponent,
+                                                           AppearanceComponent, RenderPassComponent >();
+    constexpr ComponentMask kStaticMask   = componentMask< TransformComponent, BoundsComponent, RenderPassComponent >();
+
+    /// Entities of the bench, the radius of each is remembered by index to find rows that got mixed up.
+    struct Scene
+    {
+        EntityStore          store;
+        std::vector<Entity>  live;
+        std::vector<float>   radius;
+        std::vector<uint8_t> rotating;
+        std::mt19937         random;
+        std::uniform_real_distribution<float> unit { 0.f, 1.f };
+
+        explicit Scene( uint32_t seed ) : random( seed ) {}
+
+        void fill( Entity entity, bool rotates )
+        {
+            if ( radius.size() <= entity.index )
+            {
+                radius.resize( entity.index + 1 );
+                rotating.resize( entity.index + 1 );
+            }
+            radius[entity.index] = 0.5f + unit( random );
+            rotating[entity.index] = rotates;
+
+            const simd::float3 position = { 400.f * ( unit( random ) - 0.5f ), 20.f * unit( random ), 400.f * ( unit( random ) - 0.5f ) };
+            store.get< TransformComponent >( entity ).modelMatrix = matrix4x4_translation( position );
+            store.get< BoundsComponent >( entity ) = { (simd::float4){ 0.f, 0.f, 0.f, radius[entity.index] },
+                                                       (simd::float4){ position.x, position.y, position.z, radius[entity.index] } };
+
+            /// Every eighth entity also shows up in the reflection
+            RenderPassComponent& passes = store.get< RenderPassComponent >( entity );
+            passes.passFlags = EPassFlags( Final | ( ( entity.index & 7 ) == 0 ? Reflection : 0 ) );
+            passes.instanceCountInReflection = ( passes.passFlags & Reflection ) ? 6 : 0;
+            passes.visibleInFinal = false;
+
+            if ( rotates )
+            {
+                store.get< RotationComponent >( entity ) = { (simd::float3){ 2.f + 4.f * unit( random ), 0.f, 0.f }, position,
+                                                             (simd::float3){ 0.f, 1.f, 0.f }, 0.f, 2.f * unit( random ) - 1.f };
+                store.get< AppearanceComponent >( entity ).diffuseMultiplier = (simd::float3){ unit( random ), unit( random ), unit( random ) };
+            }
+        }
+
+        void create( size_t count )
+        {
+            std::vector<Entity> moving, still;
+            store.create( kRotatingMask, count - count / 4, moving );
+            store.create( kStaticMask, count / 4, still );
+            for ( Entity entity : moving )
+                fill( entity, true );
+            for ( Entity entity : still )
+                fill( entity, false );
+            live.insert( live.end(), moving.begin(), moving.end() );
+            live.insert( live.end(), still.begin(), still.end() );
+        }
+    };
+
+    struct Failures
+    {
+        uint32_t rows      = 0;
+        uint32_t handles   = 0;
+        uint32_t rotation  = 0;
+        uint32_t gathering = 0;
+    };
+
+    /// Rows still belong to their entities and every stale handle is dead.
+    void checkStore( Scene& scene, const std::vector<Entity>& destroyed, Failures& failures )
+    {
+        if ( scene.store.entityCount() != scene.live.size() )
+            ++failures.handles;
+        for ( Entity entity : scene.live )
+        {
+            if ( !scene.store.alive( entity ) )
+                ++failures.handles;
+            else if ( scene.store.get< BoundsComponent >( entity ).localSphere.w != scene.radius[entity.index] )
+                ++failures.rows;
+        }
+        for ( Entity entity : destroyed )
+            failures.handles += scene.store.alive( entity );
+    }
+
+    /// Model matrices and world spheres of a sample of the rotating entities against the rotation written out.
+    void checkRotation( Scene& scene, Failures& failures )
+    {
+        const size_t stride = std::max< size_t >( 1, scene.live.size() / 1000 );
+        for ( size_t i = 0; i < scene.live.size(); i += stride )
+        {
+            const Entity entity = scene.live[i];
+            if ( !scene.rotating[entity.index] )
+                continue;
+
+            const RotationComponent& rotation = scene.store.get< RotationComponent >( entity );
+            const simd::float4x4 expected = matrix_multiply( matrix4x4_translation( rotation.rotationPoint ),
+                                            matrix_multiply( matrix4x4_rotation( rotation.rotationAmount, rotation.rotationAxis ),
+                                                             matrix4x4_translation( rotation.translation ) ) );
+            const simd::float4 position = scene.store.get< TransformComponent >( entity ).modelMatrix.columns[3];
+            const simd::float4 sphere = scene.store.get< BoundsComponent >( entity ).worldSphere;
+            if ( simd_distance( position, expected.columns[3] ) > 1e-3f
+                || simd_distance( sphere.xyz, expected.columns[3].xyz ) > 1e-3f )
+                ++failures.rotation;
+        }
+    }
+
+    /// Gathered entities of a pass against a plain loop over the live handles.
+    void checkGather( Scene& scene, const FrustumCuller& frustum, EPassFlags pass,
+                      const std::vector<Entity>& gathered, Failures& failures )
+    {
+        size_t expected = 0;
+        for ( Entity entity : scene.live )
+        {
+            const RenderPassComponent& passes = scene.store.get< RenderPassComponent >( entity );
+            expected += ( passes.passFlags & pass )
+                     && ( pass != Final || frustum.IntersectsPlanes( scene.store.get< BoundsComponent >( entity ).worldSphere ) );
+        }
+        if ( gathered.size() != expected )
+            ++failures.gathering;
+        for ( Entity entity : gathered )
+            failures.gathering += !scene.store.alive( entity );
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    Scene scene( options.seed );
+    auto start = std::chrono::steady_clock::now();
+    scene.create( options.entityCount );
+    const double createMilliseconds = milliseconds( start );
+
+    /// A camera of the app looking over the field from its edge
+    Camera camera = { (simd::float3){ 0.f, 30.f, -220.f }, (simd::float3){ 0.f, 0.f, 0.f }, 0.f, 16.f / 9.f,
+                      22.5f * 3.14159265f / 180.f, 0.1f, 500.f };
+    FrustumCuller frustum;
+    frustum.Reset_ViewProjection( matrix_multiply( camera.GetProjectionMatrix_LH(), camera.GetViewMatrix() ) );
+
+    Failures failures;
+    std::vector<Entity> destroyed, visible, reflected;
+    double rotationMilliseconds = 0.0, cullMilliseconds = 0.0, gatherMilliseconds = 0.0, churnMilliseconds = 0.0;
+    for ( uint32_t frame = 0; frame < options.frameCount; ++frame )
+    {
+        start = std::chrono::steady_clock::now();
+        updateRotationSystem( scene.store, 1.f / 60.f );
+        rotationMilliseconds += milliseconds( start );
+
+        start = std::chrono::steady_clock::now();
+        cullSystem( scene.store, frustum );
+        cullMilliseconds += milliseconds( start );
+
+        start = std::chrono::steady_clock::now();
+        gatherPassSystem( scene.store, Final, visible );
+        gatherPassSystem( scene.store, Reflection, reflected );
+        gatherMilliseconds += milliseconds( start );
+
+        checkRotation( scene, failures );
+        checkGather( scene, frustum, Final, visible, failures );
+        checkGather( scene, frustum, Reflection, reflected, failures );
+
+        /// Random entities go, the same number comes back and reuses their indices
+        const size_t churnCount = size_t( options.churn * scene.live.size() );
+        destroyed.clear();
+        start = std::chrono::steady_clock::now();
+        for ( size_t i = 0; i < churnCount; ++i )
+        {
+            const size_t pick = size_t( scene.unit( scene.random ) * ( scene.live.size() - 1 ) );
+            destroyed.push_back( scene.live[pick] );
+            scene.store.destroy( scene.live[pick] );
+            scene.live[pick] = scene.live.back();
+            scene.live.pop_back();
+        }
+        scene.create( churnCount );
+        churnMilliseconds += milliseconds( start );
+
+        checkStore( scene, destroyed, failures );
+    }
+
+    /// Random access through the handles, the way single entities are looked up
+    std::vector<Entity> lookups( 1000000 );
+    double expectedSum = 0.0;
+    for ( Entity& entity : lookups )
+    {
+        entity = scene.live[ size_t( scene.unit( scene.random ) * ( scene.live.size() - 1 ) ) ];
+        expectedSum += scene.radius[entity.index];
+    }
+    double sum = 0.0;
+    start = std::chrono::steady_clock::now();
+    for ( Entity entity : lookups )
+        sum += scene.store.get< BoundsComponent >( entity ).localSphere.w;
+    const double getMilliseconds = milliseconds( start );
+    failures.rows += sum != expectedSum;
+
+    const uint32_t frames = options.frameCount;
+    std::printf( "entities    %zu, %zu in view, %zu in the reflection\n", scene.store.entityCount(), visible.size(), reflected.size() );
+    std::printf( "create      %.1f ms\n", createMilliseconds );
+    std::printf( "rotation    %.2f ms per frame\n", rotationMilliseconds / frames );
+    std::printf( "cull        %.2f ms per frame\n", cullMilliseconds / frames );
+    std::printf( "gather      %.2f ms per frame for both passes\n", gatherMilliseconds / frames );
+    std::printf( "churn       %.2f ms per frame for %.0f%% of the entities\n", churnMilliseconds / frames, 100.f * options.churn );
+    std::printf( "get         %.1f ns per lookup\n", getMilliseconds * 1e6 / lookups.size() );
+    std::printf( "failed      %u rows, %u handles, %u rotations, %u gathers\n",
+                 failures.rows, failures.handles, failures.rotation, failures.gathering );
+
+    if ( failures.rows + failures.handles + failures.rotation + failures.gathering > 0 )
+    {
+        std::fprintf( stderr, "EntityBench: the entity store failed its checks\n" );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,367 @@
+///
+///  AAPLIBLBaker.cpp
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.04.24.
+///
+
+#include "AAPLIBLBaker.h"
+#include "AAPLParallel.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    const float kPi = 3.14159265358979f;
+
+    /// Four consecutive source texels of the irradiance sum, direction and radiance
+    /// already weighted by the texel solid angle over pi
+    struct TexelPacket
+    {
+        simd::float4 x, y, z;
+        simd::float4 r, g, b;
+    };
+
+    /// Prefilter sample in the tangent space of the normal
+    struct SpecularSample
+    {
+        simd::float3 direction;
+        float        weight;
+        float        lod;
+    };
+
+    /// Four GGX half vectors of the BRDF integration
+    struct HalfVectorPacket
+    {
+        simd::float4 x, z;
+    };
+
+    /// Van der Corput radical inverse in base 2, second coordinate of the Hammersley set
+    float radicalInverse( uint32_t bits )
+    {
+        bits = ( bits << 16u ) | ( bits >> 16u );
+        bits = ( ( bits & 0x55555555u ) << 1u ) | ( ( bits & 0xAAAAAAAAu ) >> 1u );
+        bits = ( ( bits & 0x33333333u ) << 2u ) | ( ( bits & 0xCCCCCCCCu ) >> 2u );
+        bits = ( ( bits & 0x0F0F0F0Fu ) << 4u ) | ( ( bits & 0xF0F0F0F0u ) >> 4u );
+        bits = ( ( bits & 0x00FF00FFu ) << 8u ) | ( ( bits & 0xFF00FF00u ) >> 8u );
+        return float( bits ) * 2.3283064365386963e-10f;
+    }
+
+    /// GGX half vector around +z for the Hammersley point i of count, alpha = roughness^2
+    simd::float3 importanceSampleGGX( uint32_t i, uint32_t count, float alpha )
+    {
+        const float phi = 2.f * kPi * ( float( i ) + 0.5f ) / float( count );
+        const float xi  = radicalInverse( i );
+        const float cosTheta = std::sqrt( ( 1.f - xi ) / ( 1.f + ( alpha * alpha - 1.f ) * xi ) );
+        const float sinTheta = std::sqrt( std::max( 1.f - cosTheta * cosTheta, 0.f ) );
+        return (simd::float3){ std::cos( phi ) * sinTheta, std::sin( phi ) * sinTheta, cosTheta };
+    }
+
+    float areaElement( float x, float y )
+    {
+        return std::atan2( x * y, std::sqrt( x * x + y * y + 1.f ) );
+    }
+
+    float horizontalSum( simd::float4 value )
+    {
+        return ( value.x + value.y ) + ( value.z + value.w );
+    }
+
+    /// Bilinear fetch inside one face, clamped at its edges
+    simd::float4 sampleFace( const Image& face, uint32_t size, float u, float v )
+    {
+        const float x = std::clamp( ( u * 0.5f + 0.5f ) * float( size ) - 0.5f, 0.f, float( size - 1 ) );
+        const float y = std::clamp( ( v * 0.5f + 0.5f ) * float( size ) - 0.5f, 0.f, float( size - 1 ) );
+        const uint32_t x0 = uint32_t( x ), y0 = uint32_t( y );
+        const uint32_t x1 = std::min( x0 + 1, size - 1 ), y1 = std::min( y0 + 1, size - 1 );
+        const float fx = x - float( x0 ), fy = y - float( y0 );
+
+        const simd::float4 top    = face.at( x0, y0 ) + ( face.at( x1, y0 ) - face.at( x0, y0 ) ) * fx;
+        const simd::float4 bottom = face.at( x0, y1 ) + ( face.at( x1, y1 ) - face.at( x0, y1 ) ) * fx;
+        return top + ( bottom - top ) * fy;
+    }
+
+    /// Face and position in [-1, 1] that a direction points to, the inverse of faceDirection
+    uint32_t directionToFace( simd::float3 d, float& u, float& v )
+    {
+        const float ax = std::fabs( d.x ), ay = std::fabs( d.y ), az = std::fabs( d.z );
+        if ( ax >= ay && ax >= az )
+        {
+            u = ( d.x > 0.f ? -d.z : d.z ) / ax;
+            v = -d.y / ax;
+            return d.x > 0.f ? CubeMap::PositiveX : CubeMap::NegativeX;
+        }
+        if ( ay >= az )
+        {
+            u = d.x / ay;
+            v = ( d.y > 0.f ? d.z : -d.z ) / ay;
+            return d.y > 0.f ? CubeMap::PositiveY : CubeMap::NegativeY;
+        }
+        u = ( d.z > 0.f ? d.x : -d.x ) / az;
+        v = -d.y / az;
+        return d.z > 0.f ? CubeMap::PositiveZ : CubeMap::NegativeZ;
+    }
+
+    /// Smith geometry term with the image based lighting k = roughness^2 / 2, four lanes at once
+    simd::float4 geometrySmith( float nDotV, simd::float4 nDotL, float k )
+    {
+        const float gv = nDotV / ( nDotV * ( 1.f - k ) + k );
+        const simd::float4 gl = nDotL / ( nDotL * ( 1.f - k ) + k );
+        return gv * gl;
+    }
+}
+
+CubeMap::CubeMap( uint32_t faceSize )
+: size( faceSize )
+{
+    for ( Image& face : faces )
+        face = Image( faceSize, faceSize );
+}
+
+IBLBaker::IBLBaker( const CubeMap& source )
+{
+    _mips.push_back( source );
+    while ( _mips.back().size > 1 )
+    {
+        const CubeMap& above = _mips.back();
+        CubeMap level( std::max( above.size / 2, 1u ) );
+        for ( uint32_t face = 0; face < CubeMap::FaceCount; ++face )
+        {
+            for ( uint32_t y = 0; y < level.size; ++y )
+            {
+                for ( uint32_t x = 0; x < level.size; ++x )
+                {
+                    const uint32_t sx = std::min( 2 * x + 1, above.size - 1 );
+                    const uint32_t sy = std::min( 2 * y + 1, above.size - 1 );
+                    const Image& image = above.faces[face];
+                    level.faces[face].at( x, y ) = ( ( image.at( 2 * x, 2 * y ) + image.at( sx, 2 * y ) ) +
+                                                     ( image.at( 2 * x, sy ) + image.at( sx, sy ) ) ) * 0.25f;
+                }
+            }
+        }
+        _mips.push_back( level );
+    }
+}
+
+simd::float3 IBLBaker::faceDirection( uint32_t face, float u, float v )
+{
+    simd::float3 direction;
+    switch ( face )
+    {
+        case CubeMap::PositiveX: direction = (simd::float3){  1.f,  -v,  -u }; break;
+        case CubeMap::NegativeX: direction = (simd::float3){ -1.f,  -v,   u }; break;
+        case CubeMap::PositiveY: direction = (simd::float3){    u, 1.f,   v }; break;
+        case CubeMap::NegativeY: direction = (simd::float3){    u,-1.f,  -v }; break;
+        case CubeMap::PositiveZ: direction = (simd::float3){    u,  -v, 1.f }; break;
+        default:                 direction = (simd::float3){   -u,  -v,-1.f }; break;
+    }
+    return simd_normalize( direction );
+}
+
+float IBLBaker::texelSolidAngle( uint32_t x, uint32_t y, uint32_t size )
+{
+    const float scale = 2.f / float( size );
+    const float u0 = float( x ) * scale - 1.f, u1 = u0 + scale;
+    const float v0 = float( y ) * scale - 1.f, v1 = v0 + scale;
+    return areaElement( u0, v0 ) - areaElement( u0, v1 ) - areaElement( u1, v0 ) + areaElement( u1, v1 );
+}
+
+template< typename Body >
+void IBLBaker::forEachRow( uint32_t size, const Body& body )
+{
+    const uint32_t tilesPerFace = ( size + kTileRows - 1 ) / kTileRows;
+    parallelFor( size_t( tilesPerFace ) * CubeMap::FaceCount, 1, [&]( size_t begin, size_t end )
+    {
+        for ( size_t tile = begin; tile < end; ++tile )
+        {
+            const uint32_t face  = uint32_t( tile / tilesPerFace );
+            const uint32_t first = uint32_t( tile % tilesPerFace ) * kTileRows;
+            for ( uint32_t y = first; y < std::min( first + kTileRows, size ); ++y )
+                body( face, y );
+        }
+    });
+}
+
+simd::float4 IBLBaker::sampleLevel( simd::float3 direction, uint32_t level ) const
+{
+    float u, v;
+    const uint32_t face = directionToFace( direction, u, v );
+    const CubeMap& cube = _mips[level];
+    return sampleFace( cube.faces[face], cube.size, u, v );
+}
+
+simd::float4 IBLBaker::sampleTrilinear( simd::float3 direction, float lod ) const
+{
+    lod = std::clamp( lod, 0.f, float( _mips.size() - 1 ) );
+    const uint32_t level = uint32_t( lod );
+    const float fraction = lod - float( level );
+    const simd::float4 fine = sampleLevel( direction, level );
+    if ( fraction <= 0.f || level + 1 >= _mips.size() )
+        return fine;
+    return fine + ( sampleLevel( direction, level + 1 ) - fine ) * fraction;
+}
+
+CubeMap IBLBaker::bakeIrradiance( uint32_t size, uint32_t sourceSize ) const
+{
+    uint32_t level = 0;
+    while ( level + 1 < _mips.size() && _mips[level].size > sourceSize )
+        ++level;
+    const CubeMap& source = _mips[level];
+
+    /// Every source texel once, padded to full packets with black texels
+    const uint32_t texelCount = CubeMap::FaceCount * source.size * source.size;
+    std::vector<TexelPacket> packets( ( texelCount + 3 ) / 4 );
+    std::fill( packets.begin(), packets.end(), TexelPacket{ 0.f, 0.f, 0.f, 0.f, 0.f, 0.f } );
+    for ( uint32_t texel = 0; texel < texelCount; ++texel )
+    {
+        const uint32_t face = texel / ( source.size * source.size );
+        const uint32_t x = texel % source.size;
+        const uint32_t y = ( texel / source.size ) % source.size;
+        const float scale = 2.f / float( source.size );
+        const simd::float3 direction = faceDirection( face, ( float( x ) + 0.5f ) * scale - 1.f, ( float( y ) + 0.5f ) * scale - 1.f );
+        const simd::float4 radiance = source.faces[face].at( x, y ) * ( texelSolidAngle( x, y, source.size ) / kPi );
+
+        TexelPacket& packet = packets[texel / 4];
+        const uint32_t lane = texel % 4;
+        packet.x[lane] = direction.x;
+        packet.y[lane] = direction.y;
+        packet.z[lane] = direction.z;
+        packet.r[lane] = radiance.x;
+        packet.g[lane] = radiance.y;
+        packet.b[lane] = radiance.z;
+    }
+
+    CubeMap irradiance( size );
+    forEachRow( size, [&]( uint32_t face, uint32_t y )
+    {
+        const float scale = 2.f / float( size );
+        for ( uint32_t x = 0; x < size; ++x )
+        {
+            const simd::float3 n = faceDirection( face, ( float( x ) + 0.5f ) * scale - 1.f, ( float( y ) + 0.5f ) * scale - 1.f );
+
+            simd::float4 r = 0.f, g = 0.f, b = 0.f;
+            for ( const TexelPacket& packet : packets )
+            {
+                const simd::float4 cosine = simd_max( packet.x * n.x + packet.y * n.y + packet.z * n.z, 0.f );
+                r += packet.r * cosine;
+                g += packet.g * cosine;
+                b += packet.b * cosine;
+            }
+            irradiance.faces[face].at( x, y ) = (simd::float4){ horizontalSum( r ), horizontalSum( g ), horizontalSum( b ), 1.f };
+        }
+    });
+    return irradiance;
+}
+
+std::vector<CubeMap> IBLBaker::bakePrefiltered( uint32_t size, uint32_t mipCount, uint32_t sampleCount ) const
+{
+    const float sourceTexelAngle = 4.f * kPi / ( 6.f * float( sourceSize() ) * float( sourceSize() ) );
+
+    std::vector<CubeMap> mips;
+    for ( uint32_t mip = 0; mip < mipCount; ++mip )
+    {
+        const uint32_t mipSize = std::max( size >> mip, 1u );
+        const float roughness = mipCount > 1 ? float( mip ) / float( mipCount - 1 ) : 0.f;
+        const float alpha = roughness * roughness;
+
+        /// Nothing finer than the output texel is fetched, a mirror just resamples the source
+        const float baseLod = std::max( std::log2( float( sourceSize() ) / float( mipSize ) ), 0.f );
+
+        /// Reflection vectors for n = v, fetched from the mip whose texels cover the solid angle of
+        /// their sample, after Krivanek and Colbert, filtered importance sampling
+        std::vector<SpecularSample> samples;
+        float totalWeight = 0.f;
+        const uint32_t count = roughness > 0.f ? sampleCount : 1;
+        for ( uint32_t i = 0; i < count; ++i )
+        {
+            const simd::float3 h = importanceSampleGGX( i, count, alpha );
+            const simd::float3 l = 2.f * h.z * h - (simd::float3){ 0.f, 0.f, 1.f };
+            if ( l.z <= 0.f )
+                continue;
+
+            float lod = baseLod;
+            if ( roughness > 0.f )
+            {
+                const float alpha2 = alpha * alpha;
+                const float denominator = h.z * h.z * ( alpha2 - 1.f ) + 1.f;
+                const float pdf = alpha2 / ( kPi * denominator * denominator ) * 0.25f;
+                const float sampleAngle = 1.f / ( float( count ) * pdf + 1e-4f );
+                lod = std::max( 0.5f * std::log2( sampleAngle / sourceTexelAngle ) + 1.f, baseLod );
+            }
+            samples.push_back( { l, l.z, lod } );
+            totalWeight += l.z;
+        }
+
+        CubeMap level( mipSize );
+        forEachRow( mipSize, [&]( uint32_t face, uint32_t y )
+        {
+            const float scale = 2.f / float( mipSize );
+            for ( uint32_t x = 0; x < mipSize; ++x )
+            {
+                const simd::float3 n = faceDirection( face, ( float( x ) + 0.5f ) * scale - 1.f, ( float( y ) + 0.5f ) * scale - 1.f );
+                const simd::float3 up = std::fabs( n.z ) < 0.999f ? (simd::float3){ 0.f, 0.f, 1.f } : (simd::float3){ 1.f, 0.f, 0.f };
+                const simd::float3 tangent   = simd_normalize( simd_cross( up, n ) );
+                const simd::float3 bitangent = simd_cross( n, tangent );
+
+                simd::float4 color = 0.f;
+                for ( const SpecularSample& sample : samples )
+                {
+                    const simd::float3 l = tangent * sample.direction.x + bitangent * sample.direction.y + n * sample.direction.z;
+                    color += sampleTrilinear( l, sample.lod ) * sample.weight;
+                }
+                color /= totalWeight;
+                color.w = 1.f;
+                level.faces[face].at( x, y ) = color;
+            }
+        });
+        mips.push_back( std::move( level ) );
+    }
+    return mips;
+}
+
+Image IBLBaker::bakeBRDF( uint32_t size, uint32_t sampleCount )
+{
+    const uint32_t packetCount = std::max( ( sampleCount + 3 ) / 4, 1u );
+    const uint32_t count = packetCount * 4;
+
+    Image lut( size, size );
+    parallelFor( size, kTileRows, [&]( size_t begin, size_t end )
+    {
+        std::vector<HalfVectorPacket> halfVectors( packetCount );
+        for ( size_t y = begin; y < end; ++y )
+        {
+            const float roughness = ( float( y ) + 0.5f ) / float( size );
+            const float alpha = roughness * roughness;
+            const float k = alpha * 0.5f;
+
+            /// Isotropic, so v lies in the xz plane and the y components of h never matter
+            for ( uint32_t i = 0; i < count; ++i )
+            {
+                const simd::float3 h = importanceSampleGGX( i, count, alpha );
+                halfVectors[i / 4].x[i % 4] = h.x;
+                halfVectors[i / 4].z[i % 4] = h.z;
+            }
+
+            for ( uint32_t x = 0; x < size; ++x )
+            {
+                const float nDotV = ( float( x ) + 0.5f ) / float( size );
+                const float sinV  = std::sqrt( 1.f - nDotV * nDotV );
+
+                simd::float4 scale = 0.f, bias = 0.f;
+                for ( const HalfVectorPacket& h : halfVectors )
+                {
+                    const simd::float4 vDotH = simd_clamp( h.x * sinV + h.z * nDotV, 0.f, 1.f );
+                    const simd::float4 nDotL = simd_max( 2.f * vDotH * h.z - nDotV, 0.f );
+                    const simd::float4 visibility = geometrySmith( nDotV, nDotL, k ) * vDotH / ( h.z * nDotV );
+                    const simd::float4 oneMinus = 1.f - vDotH;
+                    const simd::float4 fresnel = ( oneMinus * oneMinus ) * ( oneMinus * oneMinus ) * oneMinus;
+                    scale += ( 1.f - fresnel ) * visibility;
+                    bias  += fresnel * visibility;
+                }
+                lut.at( x, uint32_t( y ) ) = (simd::float4){ horizontalSum( scale ) / float( count ), horizontalSum( bias ) / float( count ), 0.f, 1.f };
+            }
+        }
+    });
+    return lut;
+}
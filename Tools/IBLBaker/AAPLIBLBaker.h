@@ -0,0 +1,81 @@
+///
+///  AAPLIBLBaker.h
+///  MetalCCP
+///
+///  Created by Guido Schneider on 21.04.24.
+///
+/// Abstract:
+/// Offline precompute of the image based lighting inputs of the deferred lighting pass.
+/// From one environment cubemap it bakes the diffuse irradiance cube, the GGX prefiltered
+/// cube with one roughness per mip and the split sum BRDF lookup table, laid out the way
+/// calculateParameters in AAPLShaders.metal samples them. Work is split into tiles of rows
+/// that run on all cores, the inner loops work on four lanes at once. Every texel is summed
+/// in a fixed order independent of the thread that computes it, so the same input always
+/// gives the same output bits.
+
+#pragma once
+#ifndef AAPLIBLBaker_h
+#define AAPLIBLBaker_h
+
+#include <simd/simd.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "AAPLImage.h"
+
+/// Six square faces in the Metal order +X, -X, +Y, -Y, +Z, -Z, rows top down in texture space.
+struct CubeMap
+{
+    enum Face : uint32_t { PositiveX, NegativeX, PositiveY, NegativeY, PositiveZ, NegativeZ, FaceCount };
+
+    uint32_t size = 0;
+    Image    faces[FaceCount];
+
+    CubeMap() = default;
+    explicit CubeMap( uint32_t faceSize );
+};
+
+class IBLBaker
+{
+public:
+    /// Keeps the source and builds its box filtered mip chain.
+    explicit IBLBaker( const CubeMap& source );
+
+    /// Cosine convolution of the environment divided by pi, the shader multiplies it by the
+    /// base color only. Summed over every texel of the first source mip of at most sourceSize.
+    CubeMap bakeIrradiance( uint32_t size, uint32_t sourceSize ) const;
+
+    /// GGX prefiltered mips, mip m at roughness m / ( mipCount - 1 ) to match the
+    /// roughness * mip count lookup of the shader. Importance sampled with sampleCount
+    /// Hammersley points, each fetched from the source mip matching its solid angle.
+    std::vector<CubeMap> bakePrefiltered( uint32_t size, uint32_t mipCount, uint32_t sampleCount ) const;
+
+    /// Split sum scale and bias in red and green, n dot v along x and roughness along y,
+    /// row 0 is roughness 0. The sample count is rounded up to a multiple of four.
+    static Image bakeBRDF( uint32_t size, uint32_t sampleCount );
+
+    /// Direction through the face at u, v in [-1, 1], v pointing down the rows.
+    static simd::float3 faceDirection( uint32_t face, float u, float v );
+
+    /// Solid angle of texel x, y of a face with size texels per side.
+    static float texelSolidAngle( uint32_t x, uint32_t y, uint32_t size );
+
+    uint32_t sourceSize() const { return _mips.front().size; }
+    uint32_t sourceMipCount() const { return uint32_t( _mips.size() ); }
+
+private:
+    /// Rows per tile of parallel work.
+    static constexpr uint32_t kTileRows = 8;
+
+    /// Calls body( face, y ) for every row of a cube with size rows per face, tile by tile on all cores.
+    template< typename Body >
+    static void forEachRow( uint32_t size, const Body& body );
+
+    simd::float4 sampleLevel( simd::float3 direction, uint32_t level ) const;
+    simd::float4 sampleTrilinear( simd::float3 direction, float lod ) const;
+
+    std::vector<CubeMap> _mips;
+};
+
+#endif /* AAPLIBLBaker_h */
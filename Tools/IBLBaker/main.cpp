@@ -0,0 +1,284 @@
+///
+///  main.cpp
+///  IBLBaker
+///
+///  Created by Guido Schneider on 21.04.24.
+///
+/// Abstract:
+/// Command line front end of the IBL precompute. Reads an environment cubetextureset of the
+/// asset catalog and writes IrradianceMap, PreFilterMap and BDRFMap next to it in the layout
+/// the renderer loads, Contents.json included.
+
+#include "AAPLIBLBaker.h"
+#include "AAPLImage.h"
+#include "AAPLAssetCatalog.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace AssetCatalog;
+
+namespace
+{
+    struct Options
+    {
+        std::string source;
+        std::string output;
+        uint32_t irradianceSize       = 64;
+        uint32_t irradianceSourceSize = 32;
+        uint32_t specularSize         = 256;
+        uint32_t specularMips         = 5;
+        uint32_t specularSamples      = 128;
+        uint32_t brdfSize             = 512;
+        uint32_t brdfSamples          = 1024;
+        uint32_t bitDepth             = 8;
+        bool     sRGB                 = false;
+    };
+
+    /// Catalog names of the faces in CubeMap order and the suffixes of the existing sets
+    const char* kCubeFaces[CubeMap::FaceCount]    = { "x+", "x-", "y+", "y-", "z+", "z-" };
+    const char* kFaceFolders[CubeMap::FaceCount]  = { "+X", "-X", "+Y", "-Y", "+Z", "-Z" };
+    const char* kIrradianceFiles[CubeMap::FaceCount] = { "posx", "negx", "posy", "negy", "posz", "negz" };
+    const char* kPreFilterBase[CubeMap::FaceCount]   = { "px", "nx", "py", "ny", "pz", "nz" };
+    const char* kPreFilterMips[CubeMap::FaceCount]   = { "posX", "negX", "posY", "negY", "posZ", "negZ" };
+
+    /// Order Xcode lists the faces in Contents.json
+    const uint32_t kCatalogOrder[CubeMap::FaceCount] = { CubeMap::NegativeX, CubeMap::NegativeY, CubeMap::NegativeZ,
+                                                         CubeMap::PositiveX, CubeMap::PositiveY, CubeMap::PositiveZ };
+
+    void printUsage()
+    {
+        std::printf( "usage: IBLBaker <source.cubetextureset> <output.xcassets> [options]\n"
+                     "  --irradiance-size N      irradiance face size, default 64\n"
+                     "  --irradiance-source N    largest source mip summed for the irradiance, default 32\n"
+                     "  --specular-size N        prefiltered mip 0 face size, default 256\n"
+                     "  --mips N                 prefiltered mips, one roughness each, default 5\n"
+                     "  --samples N              GGX samples per prefiltered texel, default 128\n"
+                     "  --brdf-size N            BRDF lookup table size, default 512\n"
+                     "  --brdf-samples N         GGX samples per BRDF texel, default 1024\n"
+                     "  --16bit                  write 16 bit instead of 8 bit PNGs\n"
+                     "  --srgb                   encode colors with the sRGB transfer function\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        std::vector<std::string> positional;
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            if ( argument == "--irradiance-size" )        valid = number( options.irradianceSize );
+            else if ( argument == "--irradiance-source" ) valid = number( options.irradianceSourceSize );
+            else if ( argument == "--specular-size" )     valid = number( options.specularSize );
+            else if ( argument == "--mips" )              valid = number( options.specularMips );
+            else if ( argument == "--samples" )           valid = number( options.specularSamples );
+            else if ( argument == "--brdf-size" )         valid = number( options.brdfSize );
+            else if ( argument == "--brdf-samples" )      valid = number( options.brdfSamples );
+            else if ( argument == "--16bit" )             options.bitDepth = 16;
+            else if ( argument == "--srgb" )              options.sRGB = true;
+            else if ( argument.compare( 0, 2, "--" ) == 0 ) valid = false;
+            else                                          positional.push_back( argument );
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "IBLBaker: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+
+        if ( positional.size() != 2 )
+            return false;
+        options.source = positional[0];
+        options.output = positional[1];
+        return true;
+    }
+
+    bool loadCubeSet( const fs::path& set, CubeMap& cube, std::string& error )
+    {
+        std::string contents;
+        if ( !readText( set / "Contents.json", contents ) )
+        {
+            error = "no Contents.json in " + set.string();
+            return false;
+        }
+
+        bool found[CubeMap::FaceCount] = {};
+        for ( const std::string& object : innerObjects( contents ) )
+        {
+            const std::string faceName = stringValue( object, "cube-face" );
+            for ( uint32_t face = 0; face < CubeMap::FaceCount; ++face )
+            {
+                if ( faceName != kCubeFaces[face] )
+                    continue;
+
+                fs::path path;
+                if ( !resolveBaseImage( set, stringValue( object, "filename" ), path ) )
+                {
+                    error = "no base level for face " + faceName + " in " + set.string();
+                    return false;
+                }
+                if ( !loadPNG( path.string(), cube.faces[face], error ) )
+                    return false;
+                found[face] = true;
+            }
+        }
+
+        cube.size = cube.faces[0].width;
+        for ( uint32_t face = 0; face < CubeMap::FaceCount; ++face )
+        {
+            if ( !found[face] )
+            {
+                error = std::string( "face " ) + kCubeFaces[face] + " missing in " + set.string();
+                return false;
+            }
+            if ( cube.faces[face].width != cube.size || cube.faces[face].height != cube.size )
+            {
+                error = "faces of " + set.string() + " are not square or differ in size";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// Replaces the cubetextureset with one mipmapset per face, the catalog keeps it as half floats
+    template< typename Filename >
+    bool writeCubeSet( const fs::path& set, const std::vector<CubeMap>& mips, const Filename& filename,
+                       const Options& options, std::string& error )
+    {
+        fs::remove_all( set );
+        fs::create_directories( set );
+
+        std::ostringstream json;
+        writeSetHeader( json );
+        for ( uint32_t i = 0; i < CubeMap::FaceCount; ++i )
+        {
+            const uint32_t face = kCatalogOrder[i];
+            const std::string folder = std::string( "Universal " ) + kFaceFolders[face] + ".mipmapset";
+
+            std::vector<const Image*> levels;
+            std::vector<std::string>  filenames;
+            for ( uint32_t mip = 0; mip < mips.size(); ++mip )
+            {
+                levels.push_back( &mips[mip].faces[face] );
+                filenames.push_back( filename( face, mip ) );
+            }
+            if ( !writeMipmapSet( set / folder, levels, filenames, false, options.bitDepth, options.sRGB, error ) )
+                return false;
+
+            json << "    {\n"
+                 << "      \"cube-face\" : \"" << kCubeFaces[face] << "\",\n"
+                 << "      \"filename\" : \"" << folder << "\",\n"
+                 << "      \"idiom\" : \"universal\",\n"
+                 << "      \"pixel-format\" : \"rgba-16-float\"\n"
+                 << "    }" << ( i + 1 < CubeMap::FaceCount ? "," : "" ) << "\n";
+        }
+        json << "  ]\n"
+                "}\n";
+        return writeText( set / "Contents.json", json.str(), error );
+    }
+
+    bool writeTextureSet( const fs::path& set, const Image& image, const std::string& filename,
+                          const Options& options, std::string& error )
+    {
+        fs::remove_all( set );
+        fs::create_directories( set );
+
+        if ( !writeMipmapSet( set / "Universal.mipmapset", { &image }, { filename }, true, options.bitDepth, options.sRGB, error ) )
+            return false;
+
+        std::ostringstream json;
+        writeSetHeader( json );
+        json << "    {\n"
+                "      \"filename\" : \"Universal.mipmapset\",\n"
+                "      \"idiom\" : \"universal\",\n"
+                "      \"pixel-format\" : \"rg-16-float\"\n"
+                "    }\n"
+                "  ]\n"
+                "}\n";
+        return writeText( set / "Contents.json", json.str(), error );
+    }
+
+    double secondsSince( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    std::string error;
+    CubeMap source;
+    auto start = std::chrono::steady_clock::now();
+    if ( !loadCubeSet( options.source, source, error ) )
+    {
+        std::fprintf( stderr, "IBLBaker: %s\n", error.c_str() );
+        return EXIT_FAILURE;
+    }
+    const IBLBaker baker( source );
+    std::printf( "source      %4u^2, %u mips, %.2f s\n", baker.sourceSize(), baker.sourceMipCount(), secondsSince( start ) );
+
+    const fs::path output = options.output;
+
+    start = std::chrono::steady_clock::now();
+    const CubeMap irradiance = baker.bakeIrradiance( options.irradianceSize, options.irradianceSourceSize );
+    if ( !writeCubeSet( output / "IrradianceMap.cubetextureset", { irradiance },
+                        []( uint32_t face, uint32_t ) { return std::string( kIrradianceFiles[face] ) + ".png"; }, options, error ) )
+    {
+        std::fprintf( stderr, "IBLBaker: %s\n", error.c_str() );
+        return EXIT_FAILURE;
+    }
+    std::printf( "irradiance  %4u^2, %.2f s\n", options.irradianceSize, secondsSince( start ) );
+
+    start = std::chrono::steady_clock::now();
+    const std::vector<CubeMap> prefiltered = baker.bakePrefiltered( options.specularSize, options.specularMips, options.specularSamples );
+    if ( !writeCubeSet( output / "PreFilterMap.cubetextureset", prefiltered,
+                        []( uint32_t face, uint32_t mip )
+                        {
+                            return mip == 0 ? std::string( kPreFilterBase[face] ) + ".png"
+                                            : "specular-" + std::to_string( mip ) + "-" + kPreFilterMips[face] + ".png";
+                        }, options, error ) )
+    {
+        std::fprintf( stderr, "IBLBaker: %s\n", error.c_str() );
+        return EXIT_FAILURE;
+    }
+    std::printf( "prefiltered %4u^2, %u mips, %u samples, %.2f s\n", options.specularSize, options.specularMips,
+                 options.specularSamples, secondsSince( start ) );
+
+    start = std::chrono::steady_clock::now();
+    const Image brdf = IBLBaker::bakeBRDF( options.brdfSize, options.brdfSamples );
+    Options lutOptions = options;
+    lutOptions.sRGB = false;
+    if ( !writeTextureSet( output / "BDRFMap.textureset", brdf, "brdfImage.png", lutOptions, error ) )
+    {
+        std::fprintf( stderr, "IBLBaker: %s\n", error.c_str() );
+        return EXIT_FAILURE;
+    }
+    std::printf( "brdf        %4u^2, %u samples, %.2f s\n", options.brdfSize, options.brdfSamples, secondsSince( start ) );
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+///
+///  main.cpp
+///  LightBench
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Measures the light selection of the renderer outside the app. select builds the light BVH
+/// over random light fields above a ground plane, from a thousand lights up to the requested
+/// count, refits it after every light moved and compares the top k and the stochastic
+/// selection of a light budget per shading point against a brute force sum over all lights.
+/// The top k lights of the tree must be the k most important ones, a point where the brute
+/// force finds stronger lights fails the run. proxies prints the overdraw and the estimated
+/// cost of the icosphere proxy each projected light radius gets against the inflated
+/// icosahedron the light volumes were drawn with before, and times the selection over a
+/// field of lights seen by the app camera.
+
+#include "AAPLLightBVH.h"
+#include "AAPLLightProxies.h"
+
+#include <simd/simd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        uint32_t lightCount = 100000;       /// largest light field, the sweep goes up by ten from 1000
+        uint32_t pointCount = 64;
+        uint32_t budget     = 4;            /// lights per shading point
+        uint32_t seed       = 1;
+    };
+
+    /// Selection quality and cost per shading point.
+    struct Stats
+    {
+        double   topKCaptured;              /// share of the reference kept by the top k lights
+        double   stochasticError;           /// relative RMS error of the estimate from budget samples
+        double   nodesVisited;              /// per top k selection
+        double   referenceMicroseconds;
+        double   topKMicroseconds;
+        double   stochasticMicroseconds;
+        uint32_t topKMisses;                /// points whose top k lights were not the strongest
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: LightBench select [options]\n"
+                     "       LightBench proxies [options]\n"
+                     "  select           times and checks the light BVH selection on random light fields\n"
+                     "  proxies          prints the pixels and cost the light proxies save, times their selection\n"
+                     "  --lights N       largest light field, lights in front of the camera for proxies, default 100000\n"
+                     "  --points N       shading points per field, default 64\n"
+                     "  --budget N       lights per shading point, default 4\n"
+                     "  --seed N         seed of the fields and the samples, default 1\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], int first, Options& options )
+    {
+        for ( int i = first; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            if ( argument == "--lights" )       valid = number( options.lightCount );
+            else if ( argument == "--points" )  valid = number( options.pointCount );
+            else if ( argument == "--budget" )  valid = number( options.budget );
+            else if ( argument == "--seed" )    valid = number( options.seed );
+            else                                valid = false;
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "LightBench: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double microsecondsSince( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    /// Brute force reference over all lights against the top k and the stochastic selection of the tree.
+    Stats measure( const LightBVH& bvh, const std::vector<simd::float3>& points, const std::vector<simd::float3>& normals,
+                   uint32_t budget, uint32_t seed )
+    {
+        const size_t count = points.size();
+        Stats stats = {};
+
+        std::vector<double> reference( count, 0.0 );
+        std::vector<float> strongest( count * budget, 0.f );
+        std::vector<float> importances( bvh.lightCount() );
+        auto start = std::chrono::steady_clock::now();
+        for ( size_t p = 0; p < count; ++p )
+        {
+            for ( uint32_t light = 0; light < bvh.lightCount(); ++light )
+            {
+                importances[light] = bvh.lightImportance( light, points[p], normals[p] );
+                reference[p] += importances[light];
+            }
+            const size_t k = std::min< size_t >( budget, importances.size() );
+            std::partial_sort( importances.begin(), importances.begin() + k, importances.end(), std::greater<float>() );
+            std::copy( importances.begin(), importances.begin() + k, strongest.begin() + p * budget );
+        }
+        stats.referenceMicroseconds = microsecondsSince( start ) / count;
+
+        std::vector<uint32_t> lights( budget );
+        std::vector<float> selected( budget );
+        double topKSum = 0.0;
+        size_t visitedSum = 0;
+        start = std::chrono::steady_clock::now();
+        for ( size_t p = 0; p < count; ++p )
+        {
+            size_t visited;
+            const size_t selectedCount = bvh.selectTopK( points[p], normals[p], budget, lights.data(), selected.data(), &visited );
+            for ( size_t i = 0; i < selectedCount; ++i )
+                topKSum += selected[i];
+            visitedSum += visited;
+        }
+        stats.topKMicroseconds = microsecondsSince( start ) / count;
+
+        /// Selected again outside the timing, every importance has to match the brute force one
+        for ( size_t p = 0; p < count; ++p )
+        {
+            const size_t selectedCount = bvh.selectTopK( points[p], normals[p], budget, lights.data(), selected.data() );
+            for ( size_t i = 0; i < budget; ++i )
+            {
+                const float expected = strongest[p * budget + i];
+                const float found = i < selectedCount ? selected[i] : 0.f;
+                if ( std::abs( found - expected ) > 1e-4f * std::max( expected, 1e-6f ) )
+                {
+                    ++stats.topKMisses;
+                    break;
+                }
+            }
+        }
+
+        /// One stratified sample per budget slot, weighted by its probability
+        std::mt19937 generator( seed );
+        std::uniform_real_distribution<float> uniform( 0.f, 1.f );
+        std::vector<double> estimate( count, 0.0 );
+        start = std::chrono::steady_clock::now();
+        for ( size_t p = 0; p < count; ++p )
+        {
+            for ( uint32_t s = 0; s < budget; ++s )
+            {
+                const float u = std::min( ( s + uniform( generator ) ) / budget, 0x1.fffffep-1f );
+                const LightBVH::Sample drawn = bvh.sample( points[p], normals[p], u );
+                if ( drawn.light != LightBVH::kInvalid )
+                    estimate[p] += bvh.lightImportance( drawn.light, points[p], normals[p] ) / drawn.pdf;
+            }
+            estimate[p] /= budget;
+        }
+        stats.stochasticMicroseconds = microsecondsSince( start ) / count;
+
+        double referenceSum = 0.0;
+        double squaredError = 0.0;
+        for ( size_t p = 0; p < count; ++p )
+        {
+            referenceSum += reference[p];
+            squaredError += ( estimate[p] - reference[p] ) * ( estimate[p] - reference[p] );
+        }
+        stats.topKCaptured    = referenceSum > 0.0 ? topKSum / referenceSum : 1.0;
+        stats.stochasticError = referenceSum > 0.0 ? std::sqrt( squaredError / count ) / ( referenceSum / count ) : 0.0;
+        stats.nodesVisited    = double( visitedSum ) / count;
+        return stats;
+    }
+
+    /// Random light fields on a ground plane, returns the number of points with a wrong top k.
+    uint32_t selectBenchmark( const Options& options )
+    {
+        std::printf( "lights   build ms  refit ms  top k captured  nodes  stochastic error  us per point reference  top k  stochastic\n" );
+        std::vector<size_t> lightCounts;
+        for ( size_t lightCount = 1000; lightCount < options.lightCount; lightCount *= 10 )
+            lightCounts.push_back( lightCount );
+        lightCounts.push_back( options.lightCount );
+
+        uint32_t misses = 0;
+        for ( size_t lightCount : lightCounts )
+        {
+            /// About four lights per square unit of ground seen from every point
+            std::mt19937 generator( options.seed );
+            std::uniform_real_distribution<float> uniform( 0.f, 1.f );
+            const float side = 2.f * std::sqrt( float( lightCount ) );
+
+            std::vector<PointLightData> lights( lightCount );
+            std::vector<simd::float4> spheres( lightCount );
+            for ( size_t i = 0; i < lightCount; ++i )
+            {
+                lights[i].pointLightColor = (simd::float3){ 0.2f + 0.8f * uniform( generator ), 0.2f + 0.8f * uniform( generator ), 0.2f + 0.8f * uniform( generator ) };
+                lights[i].light_radius = 2.f + 4.f * uniform( generator );
+                lights[i].light_speed = 0.f;
+                spheres[i] = (simd::float4){ side * uniform( generator ), 0.5f + 2.5f * uniform( generator ), side * uniform( generator ), lights[i].light_radius };
+            }
+
+            std::vector<simd::float3> points( options.pointCount );
+            std::vector<simd::float3> normals( options.pointCount, (simd::float3){ 0.f, 1.f, 0.f } );
+            for ( simd::float3& point : points )
+                point = (simd::float3){ side * uniform( generator ), 0.f, side * uniform( generator ) };
+
+            LightBVH bvh;
+            auto start = std::chrono::steady_clock::now();
+            bvh.build( lights.data(), spheres.data(), lightCount );
+            const double buildMilliseconds = microsecondsSince( start ) / 1000.0;
+
+            /// Every light moves a little, as the animated lights of the app do each frame
+            for ( simd::float4& sphere : spheres )
+                sphere += (simd::float4){ uniform( generator ) - 0.5f, 0.f, uniform( generator ) - 0.5f, 0.f };
+            start = std::chrono::steady_clock::now();
+            bvh.refit( lights.data(), spheres.data() );
+            const double refitMilliseconds = microsecondsSince( start ) / 1000.0;
+
+            const Stats stats = measure( bvh, points, normals, options.budget, options.seed + 6 );
+            std::printf( "%-7zu  %8.2f  %8.2f  %13.1f%%  %5.1f  %15.1f%%  %22.2f  %5.2f  %10.2f\n", lightCount,
+                         buildMilliseconds, refitMilliseconds, 100.0 * stats.topKCaptured, stats.nodesVisited,
+                         100.0 * stats.stochasticError, stats.referenceMicroseconds, stats.topKMicroseconds,
+                         stats.stochasticMicroseconds );
+            misses += stats.topKMisses;
+        }
+        return misses;
+    }
+
+    /// Level the single light of the last select went to.
+    size_t selectedLevel( const LightProxies& proxies )
+    {
+        for ( size_t level = 0; level < LightProxies::kLevelCount; ++level )
+        {
+            if ( proxies.bucket( level ).instanceCount > 0 )
+                return level;
+        }
+        return 0;
+    }
+
+    void proxiesBenchmark( const Options& options )
+    {
+        LightProxies proxies;
+        std::vector<simd::float4> vertices;
+        std::vector<uint16_t> indices;
+        proxies.buildIcospheres( vertices, indices );
+
+        /// A unit light at depth 10, far enough from the near plane to stay unclipped
+        std::printf( "radius px  level  wasted pixels legacy   proxy  cost legacy     proxy  saved\n" );
+        for ( float pixelRadius = 2.f; pixelRadius <= 1024.f; pixelRadius *= 2.f )
+        {
+            const simd::float4 sphere = { 0.f, 0.f, -10.f, 1.f };
+            proxies.select( &sphere, 1, pixelRadius * 10.f, 0.1f, 1e12f );
+            const LightProxies::Stats& stats = proxies.stats();
+            std::printf( "%9.0f  %5zu  %20.0f  %6.0f  %11.0f  %8.0f  %4.1f%%\n", pixelRadius, selectedLevel( proxies ),
+                         stats.legacyPixels - stats.spherePixels, stats.selectedPixels - stats.spherePixels,
+                         stats.legacyCost, stats.selectedCost, 100.0 * ( 1.0 - stats.selectedCost / stats.legacyCost ) );
+        }
+
+        /// Lights around the radius of 3.6 the app gives them, inside the frustum of its 45 degree camera at 1080p
+        const float near = 0.1f;
+        const float height = 1080.f;
+        const float tanHalfFovY = std::tan( 45.f * 0.5f * 3.14159265f / 180.f );
+        const float aspect = 16.f / 9.f;
+        std::mt19937 generator( options.seed );
+        std::uniform_real_distribution<float> uniform( 0.f, 1.f );
+        std::vector<simd::float4> spheres( options.lightCount );
+        for ( simd::float4& sphere : spheres )
+        {
+            const float depth = 1.f + 199.f * uniform( generator );
+            sphere = (simd::float4){ ( 2.f * uniform( generator ) - 1.f ) * depth * tanHalfFovY * aspect,
+                                     ( 2.f * uniform( generator ) - 1.f ) * depth * tanHalfFovY,
+                                     -depth, 2.f + 3.2f * uniform( generator ) };
+        }
+
+        constexpr uint32_t kRuns = 20;
+        const auto start = std::chrono::steady_clock::now();
+        for ( uint32_t run = 0; run < kRuns; ++run )
+            proxies.select( spheres.data(), spheres.size(), 0.5f * height / tanHalfFovY, near, height * height * aspect );
+        const double selectMicroseconds = microsecondsSince( start ) / kRuns;
+
+        const LightProxies::Stats& stats = proxies.stats();
+        std::printf( "lights      %u in front of the camera, per level", options.lightCount );
+        for ( size_t level = 0; level < LightProxies::kLevelCount; ++level )
+            std::printf( " %lu", (unsigned long)proxies.bucket( level ).instanceCount );
+        std::printf( "\n" );
+        std::printf( "pixels      %.3g sphere, %.3g legacy, %.3g selected\n", stats.spherePixels, stats.legacyPixels, stats.selectedPixels );
+        std::printf( "cost        %.3g legacy, %.3g selected, %.1f%% saved\n", stats.legacyCost, stats.selectedCost,
+                     100.0 * ( 1.0 - stats.selectedCost / stats.legacyCost ) );
+        std::printf( "select      %.3f ms, %.1f ns per light\n", selectMicroseconds / 1000.0, selectMicroseconds * 1000.0 / options.lightCount );
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( argc < 2 || !parseOptions( argc, argv, 2, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    const std::string command = argv[1];
+    if ( command == "select" )
+    {
+        const uint32_t misses = selectBenchmark( options );
+        if ( misses > 0 )
+        {
+            std::fprintf( stderr, "LightBench: %u points got other top k lights than the brute force selection\n", misses );
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+    if ( command == "proxies" )
+    {
+        proxiesBenchmark( options );
+        return EXIT_SUCCESS;
+    }
+
+    printUsage();
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,207 @@
+///
+///  main.cpp
+///  PickBench
+///
+///  Created by Guido Schneider on 01.05.24.
+///
+/// Abstract:
+/// Times the instance BVH the renderer picks with on scenes far larger than the app draws.
+/// A million bounding spheres are scattered through a cube, the tree is built, refit after
+/// every sphere moved a little and cast against with rays from a camera outside the cube, the
+/// way the cursor ray enters the scene. A sample of the rays is cast against every sphere as
+/// well, a ray whose closest hit the tree missed fails the run.
+
+#include "AAPLInstanceBVH.h"
+
+#include <simd/simd.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        uint32_t instanceCount = 1000000;
+        uint32_t rayCount      = 100000;
+        uint32_t checkCount    = 200;       /// rays also cast against every sphere
+        uint32_t seed          = 1;
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: PickBench [options]\n"
+                     "  --instances N    bounding spheres in the scene, default 1000000\n"
+                     "  --rays N         rays cast per run, default 100000\n"
+                     "  --check N        rays compared against a brute force cast, default 200\n"
+                     "  --seed N         seed of the scene and the rays, default 1\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            if ( argument == "--instances" )    valid = number( options.instanceCount );
+            else if ( argument == "--rays" )    valid = number( options.rayCount );
+            else if ( argument == "--check" )   valid = number( options.checkCount );
+            else if ( argument == "--seed" )    valid = number( options.seed );
+            else                                valid = false;
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "PickBench: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double milliseconds( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    struct Ray
+    {
+        simd::float3 origin;
+        simd::float3 direction;
+    };
+
+    /// Closest sphere along the ray by testing every one, the reference for the tree.
+    uint32_t raycastAll( const std::vector<simd::float4>& spheres, const Ray& ray, float& outDistance )
+    {
+        const simd::float3 direction = simd_normalize( ray.direction );
+        uint32_t hit = InstanceBVH::kInvalid;
+        outDistance = FLT_MAX;
+        for ( uint32_t i = 0; i < spheres.size(); ++i )
+        {
+            const simd::float3 toOrigin = ray.origin - spheres[i].xyz;
+            const float b = simd_dot( toOrigin, direction );
+            const float c = simd_dot( toOrigin, toOrigin ) - spheres[i].w * spheres[i].w;
+            const float discriminant = b * b - c;
+            if ( discriminant < 0.f )
+                continue;
+            const float root = std::sqrt( discriminant );
+            const float t = ( -b - root >= 0.f ) ? -b - root : -b + root;
+            if ( t >= 0.f && t < outDistance )
+            {
+                outDistance = t;
+                hit = i;
+            }
+        }
+        return hit;
+    }
+
+    /// Hits agree when they name the same sphere or two spheres at the same distance.
+    bool sameHit( uint32_t a, float distanceA, uint32_t b, float distanceB )
+    {
+        if ( a == b )
+            return true;
+        return a != InstanceBVH::kInvalid && b != InstanceBVH::kInvalid
+            && std::abs( distanceA - distanceB ) <= 1e-4f * std::max( 1.f, distanceB );
+    }
+
+    /// Number of sampled rays the tree answered differently from the brute force cast.
+    uint32_t countMismatches( const InstanceBVH& bvh, const std::vector<simd::float4>& spheres,
+                              const std::vector<Ray>& rays, uint32_t checkCount )
+    {
+        uint32_t mismatches = 0;
+        const size_t stride = std::max< size_t >( 1, rays.size() / checkCount );
+        for ( size_t i = 0; i < rays.size(); i += stride )
+        {
+            float treeDistance, allDistance;
+            const uint32_t treeHit = bvh.raycast( rays[i].origin, rays[i].direction, treeDistance );
+            const uint32_t allHit  = raycastAll( spheres, rays[i], allDistance );
+            mismatches += !sameHit( treeHit, treeDistance, allHit, allDistance );
+        }
+        return mismatches;
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    /// The cube grows with the count, so the density and the spheres a ray passes stay alike
+    std::mt19937 random( options.seed );
+    std::uniform_real_distribution<float> unit( 0.f, 1.f );
+    const float extent = 4.f * std::cbrt( float( options.instanceCount ) );
+    std::vector<simd::float4> spheres( options.instanceCount );
+    for ( simd::float4& sphere : spheres )
+    {
+        sphere = (simd::float4){ ( unit( random ) - 0.5f ) * extent, ( unit( random ) - 0.5f ) * extent,
+                                 ( unit( random ) - 0.5f ) * extent, 0.5f + unit( random ) };
+    }
+
+    /// The camera looks at the cube from outside, every ray aims at a random point within it
+    const simd::float3 camera = { 0.f, 0.25f * extent, -1.5f * extent };
+    std::vector<Ray> rays( options.rayCount );
+    for ( Ray& ray : rays )
+    {
+        const simd::float3 target = { ( unit( random ) - 0.5f ) * extent, ( unit( random ) - 0.5f ) * extent,
+                                      ( unit( random ) - 0.5f ) * extent };
+        ray = Ray{ camera, target - camera };
+    }
+
+    InstanceBVH bvh;
+    auto start = std::chrono::steady_clock::now();
+    bvh.build( spheres.data(), spheres.size() );
+    const double buildMilliseconds = milliseconds( start );
+
+    /// Every sphere moves by up to a radius, as the animated instances of the app do each frame
+    for ( simd::float4& sphere : spheres )
+    {
+        sphere.xyz += (simd::float3){ unit( random ) - 0.5f, unit( random ) - 0.5f, unit( random ) - 0.5f };
+    }
+    start = std::chrono::steady_clock::now();
+    const bool refitted = bvh.refit( spheres.data() );
+    const double refitMilliseconds = milliseconds( start );
+
+    uint32_t hitCount = 0;
+    start = std::chrono::steady_clock::now();
+    for ( const Ray& ray : rays )
+    {
+        float distance;
+        hitCount += bvh.raycast( ray.origin, ray.direction, distance ) != InstanceBVH::kInvalid;
+    }
+    const double raycastMilliseconds = milliseconds( start );
+    const uint32_t mismatches = countMismatches( bvh, spheres, rays, options.checkCount );
+
+    std::printf( "instances   %u in a cube of %.0f units\n", options.instanceCount, extent );
+    std::printf( "build       %.1f ms\n", buildMilliseconds );
+    std::printf( "refit       %.1f ms%s\n", refitMilliseconds, refitted ? "" : ", the tree got loose and asks for a rebuild" );
+    std::printf( "raycast     %.2f us per ray, %u of %u rays hit\n", raycastMilliseconds * 1000.0 / options.rayCount, hitCount, options.rayCount );
+    std::printf( "checked     %u rays against every sphere\n", std::min( options.checkCount, options.rayCount ) );
+
+    if ( mismatches > 0 )
+    {
+        std::fprintf( stderr, "PickBench: %u rays hit another sphere than the brute force cast\n", mismatches );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+///
+///  main.cpp
+///  ResidencyBench
+///
+///  Created by Guido Schneider on 29.04.24.
+///
+/// Abstract:
+/// Runs the texture residency policy against a synthetic scene without a GPU. Textures of
+/// random size lie along a path the camera flies down, the ones near the camera are used each
+/// frame and need finer mips the closer they are. Reports how much memory stayed resident,
+/// how many levels came and went, how often a used texture lacked levels it needed and how
+/// long an update took, and fails when the accounting broke the budget while it could have kept it.
+
+#include "AAPLTextureResidency.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        uint32_t textureCount = 4000;
+        uint32_t budgetMB     = 512;
+        uint32_t frameCount   = 2000;
+        uint32_t visibleRange = 200;        /// textures on either side of the camera that are used
+        float    pinnedShare  = 0.005f;
+        uint32_t seed         = 1;
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: ResidencyBench [options]\n"
+                     "  --textures N     textures in the scene, default 4000\n"
+                     "  --budget MB      texture memory budget, default 512\n"
+                     "  --frames N       frames to simulate, default 2000\n"
+                     "  --visible N      textures on either side of the camera used per frame, default 200\n"
+                     "  --seed N         seed of the texture sizes, default 1\n" );
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto number = [&]( uint32_t& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                const long parsed = std::strtol( argv[++i], nullptr, 10 );
+                if ( parsed <= 0 )
+                    return false;
+                value = uint32_t( parsed );
+                return true;
+            };
+
+            bool valid = true;
+            if ( argument == "--textures" )     valid = number( options.textureCount );
+            else if ( argument == "--budget" )  valid = number( options.budgetMB );
+            else if ( argument == "--frames" )  valid = number( options.frameCount );
+            else if ( argument == "--visible" ) valid = number( options.visibleRange );
+            else if ( argument == "--seed" )    valid = number( options.seed );
+            else                                valid = false;
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "ResidencyBench: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double megabytes( uint64_t bytes )
+    {
+        return double( bytes ) / ( 1024.0 * 1024.0 );
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    /// BC7 textures from 256 to 4096 texels with full mip chains, a few pinned ones stand for
+    /// render targets and lookup tables
+    TextureResidency residency( uint64_t( options.budgetMB ) << 20 );
+    std::mt19937 random( options.seed );
+    std::uniform_int_distribution<uint32_t> sizeExponent( 8, 12 );
+    std::uniform_real_distribution<float> unit( 0.f, 1.f );
+    /// The least the policy can get down to, pinned textures whole and the smallest mip of the others
+    uint64_t pinnedBytes = 0, floorBytes = 0;
+    for ( uint32_t i = 0; i < options.textureCount; ++i )
+    {
+        const uint32_t size = 1u << sizeExponent( random );
+        const uint32_t levels = uint32_t( std::log2( float( size ) ) ) + 1;
+        const bool pinned = unit( random ) < options.pinnedShare;
+        const std::vector<uint64_t> sizes = TextureResidency::levelSizes( size, size, levels, 4, 16 );
+        const TextureResidency::Handle handle = residency.add( "Texture" + std::to_string( i ), sizes, pinned );
+        if ( pinned )
+        {
+            pinnedBytes += residency.residentBytes( handle );
+            floorBytes  += residency.residentBytes( handle );
+        }
+        else
+        {
+            floorBytes += sizes.back();
+        }
+    }
+
+    /// The camera moves a texture every other frame and wraps around at the end of the path
+    uint64_t residentSum = 0, residentPeak = 0, usedCount = 0, missingCount = 0, brokenBudget = 0;
+    double updateSum = 0.0, updatePeak = 0.0;
+    std::vector< std::pair<TextureResidency::Handle, uint32_t> > used;
+    for ( uint32_t frame = 1; frame <= options.frameCount; ++frame )
+    {
+        const int64_t camera = int64_t( frame / 2 ) % options.textureCount;
+        used.clear();
+        for ( int64_t offset = -int64_t( options.visibleRange ); offset <= int64_t( options.visibleRange ); ++offset )
+        {
+            const int64_t index = camera + offset;
+            if ( index < 0 || index >= int64_t( options.textureCount ) )
+                continue;
+            const uint32_t requiredLevel = uint32_t( std::log2( 1.f + float( std::abs( offset ) ) / 8.f ) );
+            residency.use( TextureResidency::Handle( index ), frame, requiredLevel );
+            used.emplace_back( TextureResidency::Handle( index ), requiredLevel );
+        }
+
+        residency.update();
+        const TextureResidency::Statistics& statistics = residency.statistics();
+        residentSum += statistics.residentBytes;
+        residentPeak = std::max( residentPeak, statistics.residentBytes );
+        updateSum += statistics.microseconds;
+        updatePeak = std::max( updatePeak, statistics.microseconds );
+
+        for ( const auto& use : used )
+        {
+            ++usedCount;
+            if ( residency.residentLevel( use.first ) > std::min( use.second, residency.levelCount( use.first ) - 1 ) )
+                ++missingCount;
+        }
+
+        /// Over the budget is only allowed when not even the smallest mips of all fit
+        if ( statistics.residentBytes > statistics.budgetBytes && floorBytes <= statistics.budgetBytes )
+            ++brokenBudget;
+    }
+
+    const TextureResidency::Statistics& statistics = residency.statistics();
+    std::printf( "textures    %u, %.1f MB with all levels, %.1f MB pinned, budget %u MB\n", statistics.textureCount,
+                 megabytes( statistics.fullBytes ), megabytes( pinnedBytes ), options.budgetMB );
+    std::printf( "resident    %.1f MB average, %.1f MB peak over %u frames\n",
+                 megabytes( residentSum / options.frameCount ), megabytes( residentPeak ), options.frameCount );
+    std::printf( "levels      %llu dropped, %llu restored\n",
+                 (unsigned long long)statistics.droppedLevels, (unsigned long long)statistics.restoredLevels );
+    std::printf( "missing     %.2f %% of the uses lacked a level they needed\n",
+                 usedCount ? 100.0 * double( missingCount ) / double( usedCount ) : 0.0 );
+    std::printf( "update      %.1f us average, %.1f us peak\n", updateSum / options.frameCount, updatePeak );
+
+    if ( brokenBudget > 0 )
+    {
+        std::fprintf( stderr, "ResidencyBench: resident memory exceeded the budget in %llu frames\n", (unsigned long long)brokenBudget );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,489 @@
+///
+///  main.cpp
+///  TextureCooker
+///
+///  Created by Guido Schneider on 24.04.24.
+///
+/// Abstract:
+/// Command line front end of the mip generator. Takes texture sets of the asset catalog and
+/// writes the full mip chain into each of their mipmapsets, next to the base image that stays
+/// as it is. Levels of an earlier run are replaced, so cooking twice gives the same set. With
+/// --bc7 the whole chain is also block compressed into a KTX file per set, the file the
+/// renderer prefers over the catalog when the device samples BC formats. With --pack-orm the
+/// occlusion, roughness and metallic maps are first packed into the red, green and blue of a
+/// new set, which is then cooked like the others, and a material description lists where each
+/// channel came from.
+
+#include "AAPLMipGenerator.h"
+#include "AAPLImage.h"
+#include "AAPLAssetCatalog.h"
+#include "AAPLBlockCompressor.h"
+#include "AAPLCompressedTexture.h"
+#include "AAPLChannelPacker.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+using namespace AssetCatalog;
+
+namespace
+{
+    /// One channel of the packed set, a set or a constant, and its remapping
+    struct PackedChannel
+    {
+        const char* property;
+        std::string source;
+        ChannelPacker::Channel channel = ChannelPacker::ChannelRed;
+        float constant;
+        float low  = 0.f;
+        float high = 1.f;
+    };
+
+    struct Options
+    {
+        std::vector<std::string> sets;
+        MipGenerator::Settings settings;
+        bool     autoContent = true;
+        uint32_t bitDepth    = 8;
+        std::string compressedFolder;
+        BC7Encoder::Quality quality = BC7Encoder::QualityNormal;
+
+        /// Packed set and its channels in ORM order, the layout calculateParameters samples
+        std::string packedSet;
+        std::string materialPath;
+        PackedChannel packed[3] = { { "occlusion", "", ChannelPacker::ChannelRed, 1.f },
+                                    { "roughness", "", ChannelPacker::ChannelRed, 0.5f },
+                                    { "metallic",  "", ChannelPacker::ChannelRed, 0.f } };
+    };
+
+    void printUsage()
+    {
+        std::printf( "usage: TextureCooker <set.textureset>... [options]\n"
+                     "       TextureCooker --pack-orm <ORMMap.textureset> --occlusion <source> --roughness <source>\n"
+                     "                     --metallic <source> [options]\n"
+                     "  --occlusion, --roughness, --metallic <source>\n"
+                     "                                       set.textureset[:r|g|b|a] or a constant for the red,\n"
+                     "                                       green and blue of the packed set, default 1, 0.5, 0\n"
+                     "  --occlusion-range, --roughness-range, --metallic-range <low>,<high>\n"
+                     "                                       maps the source from [0, 1] to [low, high], 1,0 inverts\n"
+                     "  --material <file.json>               material description, default <packed set>.json\n"
+                     "                                       next to the asset catalog\n"
+                     "  --filter box|kaiser                  downsampling filter, default kaiser\n"
+                     "  --content auto|color|linear|normal   how the texels are filtered, default auto,\n"
+                     "                                       which picks by name: normal maps, base colors, data\n"
+                     "  --clamp                              clamp at the edges instead of wrapping around\n"
+                     "  --kaiser-width N                     kernel radius in texels of the level, default 3\n"
+                     "  --kaiser-alpha N                     window shape, default 4\n"
+                     "  --16bit                              write 16 bit instead of 8 bit PNGs\n"
+                     "  --bc7 <folder>                       also write <set>.ktx with the BC7 compressed levels\n"
+                     "  --quality fast|normal|high           BC7 encoder effort, default normal\n" );
+    }
+
+    /// --<property> <source> and --<property>-range <low>,<high> of the packed channels
+    bool parsePackedOption( const std::string& argument, int& i, int argc, const char* argv[], Options& options, bool& valid )
+    {
+        for ( PackedChannel& packed : options.packed )
+        {
+            const std::string option = std::string( "--" ) + packed.property;
+            if ( argument != option && argument != option + "-range" )
+                continue;
+            if ( i + 1 >= argc )
+            {
+                valid = false;
+                return true;
+            }
+            std::string value = argv[++i];
+
+            if ( argument != option )
+            {
+                char* pEnd = nullptr;
+                packed.low = std::strtof( value.c_str(), &pEnd );
+                valid = *pEnd == ',';
+                if ( valid )
+                {
+                    packed.high = std::strtof( pEnd + 1, &pEnd );
+                    valid = *pEnd == '\0';
+                }
+                return true;
+            }
+
+            char* pEnd = nullptr;
+            const float constant = std::strtof( value.c_str(), &pEnd );
+            if ( !value.empty() && *pEnd == '\0' )
+            {
+                packed.source.clear();
+                packed.constant = constant;
+                return true;
+            }
+
+            const size_t separator = value.size() >= 2 ? value.size() - 2 : std::string::npos;
+            if ( separator != std::string::npos && value[separator] == ':' )
+            {
+                const std::string channel = value.substr( separator + 1 );
+                valid = channel == "r" || channel == "g" || channel == "b" || channel == "a";
+                packed.channel = channel == "g" ? ChannelPacker::ChannelGreen : channel == "b" ? ChannelPacker::ChannelBlue
+                               : channel == "a" ? ChannelPacker::ChannelAlpha : ChannelPacker::ChannelRed;
+                value.resize( separator );
+            }
+            packed.source = value;
+            return true;
+        }
+        return false;
+    }
+
+    bool parseOptions( int argc, const char* argv[], Options& options )
+    {
+        for ( int i = 1; i < argc; ++i )
+        {
+            const std::string argument = argv[i];
+            auto next = [&]( std::string& value )
+            {
+                if ( i + 1 >= argc )
+                    return false;
+                value = argv[++i];
+                return true;
+            };
+            auto number = [&]( float& value )
+            {
+                std::string text;
+                if ( !next( text ) )
+                    return false;
+                value = std::strtof( text.c_str(), nullptr );
+                return value > 0.f;
+            };
+
+            bool valid = true;
+            std::string value;
+            if ( argument == "--filter" )
+            {
+                valid = next( value ) && ( value == "box" || value == "kaiser" );
+                options.settings.filter = value == "box" ? MipGenerator::FilterBox : MipGenerator::FilterKaiser;
+            }
+            else if ( argument == "--content" )
+            {
+                valid = next( value ) && ( value == "auto" || value == "color" || value == "linear" || value == "normal" );
+                options.autoContent = value == "auto";
+                options.settings.content = value == "color"  ? MipGenerator::ContentColor
+                                         : value == "normal" ? MipGenerator::ContentNormal : MipGenerator::ContentLinear;
+            }
+            else if ( argument == "--quality" )
+            {
+                valid = next( value ) && ( value == "fast" || value == "normal" || value == "high" );
+                options.quality = value == "fast" ? BC7Encoder::QualityFast
+                                : value == "high" ? BC7Encoder::QualityHigh : BC7Encoder::QualityNormal;
+            }
+            else if ( argument == "--bc7" )                valid = next( options.compressedFolder );
+            else if ( argument == "--pack-orm" )           valid = next( options.packedSet );
+            else if ( argument == "--material" )           valid = next( options.materialPath );
+            else if ( parsePackedOption( argument, i, argc, argv, options, valid ) ) {}
+            else if ( argument == "--clamp" )              options.settings.addressing = MipGenerator::AddressClamp;
+            else if ( argument == "--kaiser-width" )       valid = number( options.settings.kaiserWidth );
+            else if ( argument == "--kaiser-alpha" )       valid = number( options.settings.kaiserAlpha );
+            else if ( argument == "--16bit" )              options.bitDepth = 16;
+            else if ( argument.compare( 0, 2, "--" ) == 0 ) valid = false;
+            else                                           options.sets.push_back( argument );
+
+            if ( !valid )
+            {
+                std::fprintf( stderr, "TextureCooker: invalid option %s\n", argument.c_str() );
+                return false;
+            }
+        }
+        return !options.sets.empty() || !options.packedSet.empty();
+    }
+
+    /// Content of a set by the names the catalog uses
+    MipGenerator::Content contentForName( const std::string& name )
+    {
+        if ( name.find( "Normal" ) != std::string::npos )
+            return MipGenerator::ContentNormal;
+        if ( name.find( "BaseColor" ) != std::string::npos || name.find( "Albedo" ) != std::string::npos )
+            return MipGenerator::ContentColor;
+        return MipGenerator::ContentLinear;
+    }
+
+    const char* contentName( MipGenerator::Content content )
+    {
+        switch ( content )
+        {
+            case MipGenerator::ContentColor:  return "color";
+            case MipGenerator::ContentNormal: return "normal";
+            default:                          return "linear";
+        }
+    }
+
+    /// Writes levels 1 and up next to the base of one mipmapset and lists them all
+    bool cookMipmapSet( const fs::path& folder, const MipGenerator& generator, uint32_t bitDepth,
+                        std::vector<Image>& levels, std::string& error )
+    {
+        std::string contents;
+        if ( !readText( folder / "Contents.json", contents ) )
+        {
+            error = "no Contents.json in " + folder.string();
+            return false;
+        }
+
+        std::string baseName;
+        std::vector<std::string> stale;
+        for ( const std::string& object : innerObjects( contents ) )
+        {
+            const std::string filename = stringValue( object, "filename" );
+            if ( filename.empty() )
+                continue;
+            if ( stringValue( object, "mipmap-level" ) == "base" )
+                baseName = filename;
+            else
+                stale.push_back( filename );
+        }
+        if ( baseName.empty() )
+        {
+            error = "no base level in " + folder.string();
+            return false;
+        }
+
+        Image base;
+        if ( !loadPNG( ( folder / baseName ).string(), base, error ) )
+            return false;
+
+        for ( const std::string& filename : stale )
+            fs::remove( folder / filename );
+
+        levels = generator.generate( base );
+        const std::string stem = fs::path( baseName ).stem().string();
+        std::vector<std::string> filenames( 1, baseName );
+        for ( size_t level = 1; level < levels.size(); ++level )
+        {
+            filenames.push_back( stem + "-" + std::to_string( level ) + ".png" );
+            if ( !savePNG( ( folder / filenames.back() ).string(), levels[level], bitDepth, false, error ) )
+                return false;
+        }
+        return writeMipmapContents( folder, filenames, error );
+    }
+
+    /// Compresses every level, the PNG levels hold sRGB encoded values for color content already
+    bool compressLevels( const fs::path& path, const std::vector<Image>& levels, MipGenerator::Content content,
+                         BC7Encoder::Quality quality, std::string& error )
+    {
+        const BC7Encoder encoder( quality );
+        CompressedTexture texture;
+        texture.format = content == MipGenerator::ContentColor ? CompressedTexture::FormatBC7_sRGB : CompressedTexture::FormatBC7;
+        texture.width  = levels.front().width;
+        texture.height = levels.front().height;
+
+        BC7Encoder::Statistics base {};
+        double milliseconds = 0.0;
+        for ( size_t level = 0; level < levels.size(); ++level )
+        {
+            BC7Encoder::Statistics statistics;
+            texture.levels.push_back( encoder.encode( levels[level], &statistics ) );
+            milliseconds += statistics.milliseconds;
+            if ( level == 0 )
+                base = statistics;
+        }
+        if ( !saveKTX( path.string(), texture, error ) )
+            return false;
+
+        std::printf( "%-32s bc7     %6zu blocks, %2zu%% mode 5, %.2f dB, %.2f s\n", path.filename().string().c_str(),
+                     base.blockCount, base.blockCount ? base.mode5Blocks * 100 / base.blockCount : 0, base.psnr,
+                     milliseconds / 1000.0 );
+        return true;
+    }
+
+    /// Folder of a set, also when the path ends in a separator
+    fs::path setFolder( fs::path set )
+    {
+        if ( set.filename().empty() )
+            set = set.parent_path();
+        return set;
+    }
+
+    /// Base level of the first texture of a set
+    bool loadSetBase( const fs::path& path, Image& image, std::string& error )
+    {
+        const fs::path set = setFolder( path );
+        std::string contents;
+        if ( !readText( set / "Contents.json", contents ) )
+        {
+            error = "no Contents.json in " + set.string();
+            return false;
+        }
+        for ( const std::string& object : innerObjects( contents ) )
+        {
+            const std::string filename = stringValue( object, "filename" );
+            fs::path path;
+            if ( !filename.empty() && resolveBaseImage( set, filename, path ) )
+                return loadPNG( path.string(), image, error );
+        }
+        error = "no base image in " + set.string();
+        return false;
+    }
+
+    /// Replaces the set with the packed channels at the size of the largest source and writes
+    /// the material description, which is flat enough for innerObjects to read back
+    bool packSet( const fs::path& path, const Options& options, std::string& error )
+    {
+        const fs::path set = setFolder( path );
+        Image images[3];
+        ChannelPacker::Source sources[ChannelPacker::ChannelCount];
+        for ( uint32_t i = 0; i < 3; ++i )
+        {
+            const PackedChannel& packed = options.packed[i];
+            sources[i].channel  = packed.channel;
+            sources[i].constant = packed.constant;
+            sources[i].low      = packed.low;
+            sources[i].high     = packed.high;
+            if ( packed.source.empty() )
+                continue;
+            if ( !loadSetBase( packed.source, images[i], error ) )
+                return false;
+            sources[i].pImage = &images[i];
+        }
+        sources[ChannelPacker::ChannelAlpha].constant = 1.f;
+
+        const auto start = std::chrono::steady_clock::now();
+        Image packedImage;
+        if ( !ChannelPacker::pack( sources, packedImage, error ) )
+            return false;
+
+        fs::remove_all( set );
+        fs::create_directories( set );
+        if ( !writeMipmapSet( set / "Universal.mipmapset", { &packedImage }, { "orm.png" }, false, options.bitDepth, false, error ) )
+            return false;
+
+        std::ostringstream json;
+        json << "{\n";
+        writeInfo( json );
+        json << "  \"properties\" : {\n"
+                "    \"interpretation\" : \"data\"\n"
+                "  },\n"
+                "  \"textures\" : [\n"
+                "    {\n"
+                "      \"filename\" : \"Universal.mipmapset\",\n"
+                "      \"idiom\" : \"universal\",\n"
+                "      \"pixel-format\" : \"rgba-16-float\"\n"
+                "    }\n"
+                "  ]\n"
+                "}\n";
+        if ( !writeText( set / "Contents.json", json.str(), error ) )
+            return false;
+
+        std::ostringstream material;
+        material << "{\n"
+                    "  \"texture\" : \"" << set.stem().string() << "\",\n"
+                    "  \"channels\" : [\n";
+        for ( uint32_t i = 0; i < 3; ++i )
+        {
+            const PackedChannel& packed = options.packed[i];
+            material << "    {\n"
+                     << "      \"channel\" : \"" << ChannelPacker::channelName( ChannelPacker::Channel( i ) ) << "\",\n"
+                     << "      \"property\" : \"" << packed.property << "\",\n";
+            if ( packed.source.empty() )
+                material << "      \"constant\" : \"" << packed.constant << "\"\n";
+            else
+                material << "      \"source\" : \"" << setFolder( packed.source ).stem().string() << "\",\n"
+                         << "      \"source-channel\" : \"" << ChannelPacker::channelName( packed.channel ) << "\",\n"
+                         << "      \"low\" : \"" << packed.low << "\",\n"
+                         << "      \"high\" : \"" << packed.high << "\"\n";
+            material << "    }" << ( i < 2 ? "," : "" ) << "\n";
+        }
+        material << "  ]\n"
+                    "}\n";
+
+        const fs::path materialPath = options.materialPath.empty() ? set.parent_path().parent_path() / ( set.stem().string() + ".json" )
+                                                                   : fs::path( options.materialPath );
+        if ( !writeText( materialPath, material.str(), error ) )
+            return false;
+
+        std::printf( "%-32s packed  %ux%u, %.2f s\n", set.filename().string().c_str(), packedImage.width, packedImage.height,
+                     std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+        return true;
+    }
+
+    bool cookSet( const fs::path& path, const Options& options, std::string& error )
+    {
+        const fs::path set = setFolder( path );
+        std::string contents;
+        if ( !readText( set / "Contents.json", contents ) )
+        {
+            error = "no Contents.json in " + set.string();
+            return false;
+        }
+
+        MipGenerator::Settings settings = options.settings;
+        if ( options.autoContent )
+            settings.content = contentForName( set.stem().string() );
+        const MipGenerator generator( settings );
+
+        bool cooked = false;
+        for ( const std::string& object : innerObjects( contents ) )
+        {
+            const std::string filename = stringValue( object, "filename" );
+            if ( fs::path( filename ).extension() != ".mipmapset" )
+                continue;
+
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<Image> levels;
+            if ( !cookMipmapSet( set / filename, generator, options.bitDepth, levels, error ) )
+                return false;
+            std::printf( "%-32s %-7s %2zu levels, %.2f s\n", ( set.stem().string() + "/" + filename ).c_str(),
+                         contentName( settings.content ), levels.size(),
+                         std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+
+            if ( !options.compressedFolder.empty() )
+            {
+                /// The universal set is named after the texture set, any other after both
+                std::string name = set.stem().string();
+                if ( fs::path( filename ).stem() != "Universal" )
+                    name += "-" + fs::path( filename ).stem().string();
+                fs::create_directories( options.compressedFolder );
+                if ( !compressLevels( fs::path( options.compressedFolder ) / ( name + ".ktx" ), levels,
+                                      settings.content, options.quality, error ) )
+                    return false;
+            }
+            cooked = true;
+        }
+        if ( !cooked )
+        {
+            error = "no mipmapset in " + set.string();
+            return false;
+        }
+        return true;
+    }
+}
+
+int main( int argc, const char* argv[] )
+{
+    Options options;
+    if ( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return EXIT_FAILURE;
+    }
+
+    if ( !options.packedSet.empty() )
+    {
+        std::string error;
+        if ( !packSet( options.packedSet, options, error ) || !cookSet( options.packedSet, options, error ) )
+        {
+            std::fprintf( stderr, "TextureCooker: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+    }
+
+    for ( const std::string& set : options.sets )
+    {
+        std::string error;
+        if ( !cookSet( set, options, error ) )
+        {
+            std::fprintf( stderr, "TextureCooker: %s\n", error.c_str() );
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}